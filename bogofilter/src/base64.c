@@ -43,6 +43,23 @@ uint base64_decode(word_t *word)
 	}
 	if (size < 4)
 	    break;
+	if ((base64_xlate[s[0]] | base64_xlate[s[1]] |
+	     base64_xlate[s[2]] | base64_xlate[s[3]]) < 64) {
+	    /* common case: a complete group without padding.  Like
+	     * below, a CR or LF inside the group counts as 'A'. */
+	    v = (unsigned long) base64_xlate[s[0]] << 18 |
+		(unsigned long) base64_xlate[s[1]] << 12 |
+		(unsigned long) base64_xlate[s[2]] << 6 |
+		(unsigned long) base64_xlate[s[3]];
+	    d[0] = (byte) (v >> 16);
+	    d[1] = (byte) (v >> 8);
+	    d[2] = (byte) v;
+	    s += 4;
+	    d += 3;
+	    size -= 4;
+	    count += 3;
+	    continue;
+	}
 	for (i = 0; i < 4 && (uint)i < size; i += 1) {
 	    byte c = *s++;
 	    byte t = base64_xlate[c];
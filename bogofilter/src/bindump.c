@@ -0,0 +1,164 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bindump.c -- bogoutil's binary dump format
+
+   "bogoutil -d file --binary" writes the tokens as fixed size binary
+   records rather than text lines, which is faster to write and to
+   parse and keeps the byte order of the dump independent of the host:
+
+	header:	 "\0bfdump" <version>		(8 bytes)
+	record:	 <length> <spamcount> <goodcount> <date> <token>
+
+   <version> is one byte, BINDUMP_VERSION.  The four numbers of a
+   record are unsigned 32 bit big-endian integers, <token> is <length>
+   bytes.  The dump ends with the last complete record.  No token
+   starts with a NUL byte, so "bogoutil -l" tells the formats apart by
+   the first byte of its input.
+
+   The sort runs of bulkload.c use the same records, without header.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <string.h>
+
+#include "bindump.h"
+#include "xmalloc.h"
+
+static const byte magic[] = { '\0', 'b', 'f', 'd', 'u', 'm', 'p' };
+
+#define	REC_HDR	16	/* bytes before the token */
+
+/* Function Definitions */
+
+static void put_u32(byte *p, u_int32_t v)
+{
+    p[0] = (byte) (v >> 24);
+    p[1] = (byte) (v >> 16);
+    p[2] = (byte) (v >> 8);
+    p[3] = (byte) v;
+}
+
+static u_int32_t get_u32(const byte *p)
+{
+    return ((u_int32_t) p[0] << 24) | ((u_int32_t) p[1] << 16) |
+	   ((u_int32_t) p[2] << 8) | (u_int32_t) p[3];
+}
+
+void bindump_header(FILE *fp)
+{
+    (void) fwrite(magic, 1, sizeof(magic), fp);
+    (void) putc(BINDUMP_VERSION, fp);
+}
+
+bool bindump_detect(FILE *fp)
+{
+    byte buf[sizeof(magic) + 1];
+    int c = getc(fp);
+
+    if (c == EOF)
+	return false;
+    if (c != magic[0]) {
+	(void) ungetc(c, fp);
+	return false;
+    }
+
+    buf[0] = (byte) c;
+    if (fread(buf + 1, 1, sizeof(buf) - 1, fp) != sizeof(buf) - 1 ||
+	memcmp(buf, magic, sizeof(magic)) != 0) {
+	fprintf(stderr, "%s: input is neither a text nor a binary dump.\n",
+		progname);
+	exit(EX_ERROR);
+    }
+
+    if (buf[sizeof(magic)] != BINDUMP_VERSION) {
+	fprintf(stderr, "%s: unsupported binary dump version %d.\n",
+		progname, buf[sizeof(magic)]);
+	exit(EX_ERROR);
+    }
+
+    return true;
+}
+
+int bindump_write(FILE *fp, const word_t *key, const dsv_t *val)
+{
+    byte hdr[REC_HDR];
+
+    put_u32(hdr, key->leng);
+    put_u32(hdr + 4, val->spamcount);
+    put_u32(hdr + 8, val->goodcount);
+    put_u32(hdr + 12, val->date);
+
+    if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+	fwrite(key->u.text, 1, key->leng, fp) != key->leng)
+	return EOF;
+
+    return 0;
+}
+
+/** read and drop \a leng bytes */
+static bool skip_key(FILE *fp, u_int32_t leng)
+{
+    byte buf[BUFSIZ];
+
+    while (leng > 0) {
+	size_t n = min(leng, sizeof(buf));
+	if (fread(buf, 1, n, fp) != n)
+	    return false;
+	leng -= n;
+    }
+
+    return true;
+}
+
+int bindump_read(FILE *fp, bindump_rec_t *rec, u_int32_t max_leng)
+{
+    byte hdr[REC_HDR];
+    u_int32_t leng;
+
+    for (;;) {
+	size_t n = fread(hdr, 1, sizeof(hdr), fp);
+
+	if (n == 0 && !ferror(fp))
+	    return 0;
+	if (n != sizeof(hdr))
+	    return -1;
+
+	leng = get_u32(hdr);
+	if (leng <= max_leng)
+	    break;
+
+	/* the length is checked before anything is allocated for it, so
+	 * a damaged dump ends as a truncated one */
+	if (!skip_key(fp, leng))
+	    return -1;
+    }
+
+    if (leng + D > rec->size) {
+	rec->size = leng + D;
+	rec->key.u.text = (byte *) xrealloc(rec->key.u.text, rec->size);
+    }
+    if (fread(rec->key.u.text, 1, leng, fp) != leng)
+	return -1;
+
+    Z(rec->key.u.text[leng]);
+    rec->key.leng = leng;
+    rec->val.spamcount = get_u32(hdr + 4);
+    rec->val.goodcount = get_u32(hdr + 8);
+    rec->val.date      = get_u32(hdr + 12);
+
+    return 1;
+}
+
+void bindump_rec_free(bindump_rec_t *rec)
+{
+    xfree(rec->key.u.text);
+    rec->key.u.text = NULL;
+    rec->size = 0;
+}
+
+/* End */
@@ -0,0 +1,45 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bindump.h -- bogoutil's binary dump format
+
+******************************************************************************/
+
+#ifndef	BINDUMP_H
+#define	BINDUMP_H
+
+#include "datastore.h"
+#include "word.h"
+
+/** Version of the binary dump format written by bindump_header(). */
+#define	BINDUMP_VERSION	1
+
+/** A record read by bindump_read(); the key buffer grows as needed and
+ * is released by bindump_rec_free(). */
+typedef struct {
+    word_t	key;
+    uint	size;		/* bytes allocated at key.u.text */
+    dsv_t	val;
+} bindump_rec_t;
+
+/** Write the header of a binary dump to \a fp. */
+extern void bindump_header(FILE *fp);
+
+/** Check if \a fp, positioned at its start, holds a binary dump; if it
+ * does, skip the header, otherwise leave the stream as it was.  Exits
+ * on a dump of an unknown version. */
+extern bool bindump_detect(FILE *fp);
+
+/** Write one record.  \return 0 for success, EOF on error */
+extern int bindump_write(FILE *fp, const word_t *key, const dsv_t *val);
+
+/** Read one record into \a rec, skipping records whose key is longer
+ * than \a max_leng without storing them.  \return 1 for a record, 0 at
+ * the end of the dump, -1 for a truncated record or read error */
+extern int bindump_read(FILE *fp, bindump_rec_t *rec, u_int32_t max_leng);
+
+extern void bindump_rec_free(bindump_rec_t *rec);
+
+#endif	/* BINDUMP_H */
@@ -0,0 +1,1144 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bogobench.c -- micro-benchmarks of bogofilter's hot paths
+
+   Each benchmark times one component on its own: the lexer, the
+   message wordhash, the datastore with its compiled image and Bloom
+   filter, scoring, base64 and quoted-printable decoding, and
+   passthrough output.  The results are printed as JSON (ops/sec, ns/op and allocations per op)
+   so that a script can compare the runs of two versions.
+
+   "make bench" runs all benchmarks over the corpus in tests/inputs.
+   The allocations are those made through xmalloc() and friends; the
+   datastore library's own allocations are not seen.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "getopt.h"
+
+#include "base64.h"
+#include "bogofilter.h"
+#include "bogoreader.h"
+#include "collect.h"
+#include "datastore.h"
+#include "datastore_bloom.h"
+#include "datastore_img.h"
+#include "lexer.h"
+#include "mime.h"
+#include "msgarena.h"
+#include "mxcat.h"
+#include "passthrough.h"
+#include "paths.h"
+#include "qp.h"
+#include "rstats.h"
+#include "score.h"
+#include "textblock.h"
+#include "token.h"
+#include "wordhash.h"
+#include "xmalloc.h"
+#include "xstrdup.h"
+
+const char *progname = "bogobench";
+
+#define	VOCABULARY	20000	/* distinct synthetic tokens */
+#define	STREAM		100000	/* synthetic token stream */
+#define	MSG_TOKENS	500	/* tokens per synthetic message */
+#define	SORT_TOKENS	5000	/* tokens per wordhash_sort() call */
+#define	SYNTH_MSGS	200	/* messages in the synthetic mbox */
+#define	CODED_LINES	2000	/* lines of base64 and QP text */
+
+typedef struct {
+    const char *name;
+    const char *unit;		/* what one op is */
+    bool (*setup)(void);	/* false to skip the benchmark */
+    unsigned long (*run)(void);	/* one pass, returns the ops done */
+    void (*teardown)(void);
+} bench_t;
+
+/* Local Variables */
+
+static double min_time = 1.0;	/* seconds per benchmark */
+static const char *inputs = "tests/inputs";
+static char *tempdir;
+
+static struct timeval t_start;
+static unsigned long allocs_start;
+static double timed_ns;		/* timed so far in this benchmark */
+static unsigned long timed_allocs;
+
+static u_int32_t rand_state;
+
+static word_t **vocab;		/* synthetic tokens, by rank */
+static word_t **absent;		/* tokens that aren't in the wordlist */
+static uint *stream;		/* token ranks, Zipf distributed */
+
+static char *corpus[2];	/* mboxes of tests/inputs */
+static char *synth_mbox;
+
+static bfpath *bfp;
+static void *dbe;
+static void *dsh;
+static const word_t **sorted;	/* stream chunks, sorted and unique */
+static uint *sorted_start;
+static uint sorted_chunks;
+
+static wordhash_t **msgs;	/* collected corpus messages */
+static uint msgs_count;
+
+typedef struct {
+    size_t leng;
+    char *text;
+} line_t;
+
+static line_t *lines;		/* corpus lines for passthrough */
+static uint lines_count;
+static uint *line_start;	/* first line of each message */
+static uint lines_msgs;
+static FILE *fpo_save;
+
+static char **coded;		/* base64 or QP lines */
+static char *coded_buf;
+
+/* passthrough.c needs it */
+void print_stats(FILE *fp)
+{
+    msg_print_stats(fp);
+}
+
+/* Timing */
+
+static void timer_start(void)
+{
+    allocs_start = xmalloc_count;
+    gettimeofday(&t_start, NULL);
+}
+
+static void timer_stop(void)
+{
+    struct timeval t_stop;
+
+    gettimeofday(&t_stop, NULL);
+    timed_ns += (t_stop.tv_sec - t_start.tv_sec) * 1e9 +
+		(t_stop.tv_usec - t_start.tv_usec) * 1e3;
+    timed_allocs += xmalloc_count - allocs_start;
+}
+
+/* Synthetic data */
+
+static u_int32_t rand_next(void)
+{
+    rand_state = rand_state * 1103515245u + 12345u;
+    return rand_state >> 8;
+}
+
+static double rand_unit(void)
+{
+    return (rand_next() & 0xFFFFFF) / (double) 0x1000000;
+}
+
+/** \return a rank in [0, n), roughly Zipf distributed */
+static uint rand_zipf(uint n)
+{
+    double r = floor(pow((double) n, rand_unit()));
+    return (r > 1.0 ? (uint) r : 1) - 1;
+}
+
+/** a pronounceable-ish token for \a rank, made unique by the rank */
+static word_t *make_word(uint rank)
+{
+    static const char letters[] = "etaoinshrdlucmfwypvbgkqjxz";
+    char buf[32];
+    uint h = rank * 2654435761u;
+    uint len = 2 + (h >> 28) % 9;
+    size_t n = 0;
+
+    while (n < len) {
+	buf[n++] = letters[h % 26];
+	h = h / 26 + rank;
+    }
+    n += sprintf(buf + n, "%u", rank);
+
+    return word_new((const byte *) buf, n);
+}
+
+static void vocab_init(void)
+{
+    uint i;
+
+    if (vocab != NULL)
+	return;
+
+    vocab = (word_t **) xcalloc(VOCABULARY, sizeof(word_t *));
+    absent = (word_t **) xcalloc(VOCABULARY, sizeof(word_t *));
+    for (i = 0; i < VOCABULARY; i += 1) {
+	char buf[32];
+	vocab[i] = make_word(i);
+	sprintf(buf, "absent%u", i);
+	absent[i] = word_news(buf);
+    }
+
+    rand_state = 1;
+    stream = (uint *) xcalloc(STREAM, sizeof(uint));
+    for (i = 0; i < STREAM; i += 1)
+	stream[i] = rand_zipf(VOCABULARY);
+}
+
+static void vocab_free(void)
+{
+    uint i;
+
+    if (vocab == NULL)
+	return;
+
+    for (i = 0; i < VOCABULARY; i += 1) {
+	word_free(vocab[i]);
+	word_free(absent[i]);
+    }
+    xfree(vocab);
+    xfree(absent);
+    xfree(stream);
+    vocab = NULL;
+}
+
+static void put_words(FILE *fp, uint count, uint width)
+{
+    uint col = 0;
+
+    while (count-- > 0) {
+	const word_t *w = vocab[rand_zipf(VOCABULARY)];
+	if (col + w->leng + 1 > width) {
+	    fputc('\n', fp);
+	    col = 0;
+	}
+	else if (col > 0) {
+	    fputc(' ', fp);
+	    col += 1;
+	}
+	fwrite(w->u.text, 1, w->leng, fp);
+	col += w->leng;
+    }
+    fputc('\n', fp);
+}
+
+static void put_base64(FILE *fp, uint count)
+{
+    static const char b64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint i;
+
+    for (i = 0; i < count; i += 1) {
+	fputc(b64[rand_next() & 63], fp);
+	if (i % 76 == 75)
+	    fputc('\n', fp);
+    }
+    fputc('\n', fp);
+}
+
+/** write an mbox of messages with the usual mix of parts */
+static bool synth_setup(void)
+{
+    FILE *fp;
+    uint m;
+
+    vocab_init();
+
+    synth_mbox = mxcat(tempdir, DIRSEP_S, "synthetic.mbx", NULL);
+    fp = fopen(synth_mbox, "w");
+    if (fp == NULL) {
+	fprintf(stderr, "%s: cannot create %s: %s\n",
+		progname, synth_mbox, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    rand_state = 2;
+    for (m = 0; m < SYNTH_MSGS; m += 1) {
+	fprintf(fp, "From sender%u@example.com Mon Jan  1 00:00:00 2024\n", m);
+	fprintf(fp, "Received: from mail%u.example.net (mail%u.example.net [192.0.2.%u])\n"
+		"\tby mx.example.org with ESMTP id %08X\n",
+		m, m, m % 250 + 1, rand_next());
+	fprintf(fp, "From: Sender %u <sender%u@example.com>\n", m, m);
+	fprintf(fp, "To: recipient@example.org\n");
+	fprintf(fp, "Subject: ");
+	put_words(fp, 6, 200);
+	fprintf(fp, "Date: Mon, 1 Jan 2024 00:00:00 +0000\n");
+	fprintf(fp, "Message-ID: <%08X.%u@example.com>\n", rand_next(), m);
+	fprintf(fp, "MIME-Version: 1.0\n");
+	fprintf(fp, "Content-Type: multipart/mixed; boundary=\"b%u\"\n\n", m);
+
+	fprintf(fp, "--b%u\nContent-Type: text/plain; charset=us-ascii\n\n", m);
+	put_words(fp, 150 + rand_next() % 300, 72);
+
+	fprintf(fp, "\n--b%u\nContent-Type: text/html; charset=us-ascii\n\n", m);
+	fprintf(fp, "<html><body><p>");
+	put_words(fp, 40, 72);
+	fprintf(fp, "<a href=\"http://www.example.com/%u\">", m);
+	put_words(fp, 3, 72);
+	fprintf(fp, "</a></p><font color=\"#ff0000\">");
+	put_words(fp, 20, 72);
+	fprintf(fp, "</font></body></html>\n");
+
+	if (m % 4 == 0) {
+	    fprintf(fp, "\n--b%u\nContent-Type: application/octet-stream\n"
+		    "Content-Transfer-Encoding: base64\n\n", m);
+	    put_base64(fp, 76 * 20);
+	}
+
+	fprintf(fp, "\n--b%u--\n\n", m);
+    }
+
+    if (fclose(fp) != 0) {
+	fprintf(stderr, "%s: cannot write %s: %s\n",
+		progname, synth_mbox, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    return true;
+}
+
+static void synth_teardown(void)
+{
+    unlink(synth_mbox);
+    xfree(synth_mbox);
+}
+
+/* Lexer */
+
+static unsigned long lex_files(int argc, const char * const *argv)
+{
+    unsigned long count = 0;
+
+    bogoreader_init(argc, argv);
+
+    timer_start();
+    while ((*reader_more)()) {
+	word_t token;
+	lexer_init();
+	while (get_token(&token) != NONE)
+	    count += 1;
+	msgarena_reset();
+    }
+    timer_stop();
+
+    bogoreader_fini();
+
+    return count;
+}
+
+static bool corpus_setup(void)
+{
+    corpus[0] = mxcat(inputs, DIRSEP_S, "spam.mbx", NULL);
+    corpus[1] = mxcat(inputs, DIRSEP_S, "good.mbx", NULL);
+
+    if (access(corpus[0], R_OK) != 0 || access(corpus[1], R_OK) != 0) {
+	fprintf(stderr, "%s: no corpus in %s\n", progname, inputs);
+	return false;
+    }
+
+    return true;
+}
+
+static void corpus_teardown(void)
+{
+    xfree(corpus[0]);
+    xfree(corpus[1]);
+}
+
+static unsigned long lexer_corpus(void)
+{
+    return lex_files(2, (const char * const *) corpus);
+}
+
+static unsigned long lexer_synthetic(void)
+{
+    const char *files[1];
+
+    files[0] = synth_mbox;
+    return lex_files(1, files);
+}
+
+/* Wordhash */
+
+static bool vocab_setup(void)
+{
+    vocab_init();
+    return true;
+}
+
+static wordhash_t *fill_wordhash(uint first, uint count)
+{
+    wordhash_t *wh = wordhash_new_msg();
+    uint i;
+
+    for (i = first; i < first + count; i += 1) {
+	wordprop_t *wp = (wordprop_t *)
+	    wordhash_insert(wh, vocab[stream[i]], sizeof(wordprop_t), &wordprop_init);
+	wp->freq = 1;
+    }
+
+    return wh;
+}
+
+static unsigned long wordhash_insert_run(void)
+{
+    uint i;
+
+    timer_start();
+    for (i = 0; i < STREAM; i += MSG_TOKENS) {
+	wordhash_t *wh = fill_wordhash(i, MSG_TOKENS);
+	wordhash_free(wh);
+	msgarena_reset();
+    }
+    timer_stop();
+
+    return STREAM;
+}
+
+static unsigned long wordhash_sort_run(void)
+{
+    unsigned long count = 0;
+    uint i;
+
+    for (i = 0; i < STREAM; i += SORT_TOKENS) {
+	wordhash_t *wh = fill_wordhash(i, SORT_TOKENS);
+	count += wh->count;
+	timer_start();
+	wordhash_sort(wh);
+	timer_stop();
+	wordhash_free(wh);
+	msgarena_reset();
+    }
+
+    return count;
+}
+
+/* Datastore */
+
+static int cmp_words(const void *a, const void *b)
+{
+    return word_cmp(*(const word_t * const *) a, *(const word_t * const *) b);
+}
+
+static bool datastore_setup(void)
+{
+    char *path;
+
+    vocab_init();
+
+    path = mxcat(tempdir, DIRSEP_S, WORDLIST, NULL);
+    bfp = bfpath_create(path);
+    xfree(path);
+
+    if (!bfpath_check_mode(bfp, BFP_MAY_CREATE)) {
+	fprintf(stderr, "%s: cannot create %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+
+    dbe = ds_init(bfp);
+
+    return true;
+}
+
+static void datastore_teardown(void)
+{
+    ds_cleanup(dbe);
+    bfpath_free(bfp);
+    dbe = NULL;
+}
+
+static unsigned long datastore_write(void)
+{
+    static u_int32_t pass = 0;
+    uint i;
+
+    timer_start();
+
+    dsh = ds_open(dbe, bfp, DS_WRITE);
+    if (dsh == NULL || ds_txn_begin(dsh) != DST_OK) {
+	fprintf(stderr, "%s: cannot open %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+
+    pass += 1;
+    for (i = 0; i < VOCABULARY; i += 1) {
+	dsv_t val;
+	val.spamcount = pass + i % 7;
+	val.goodcount = pass + i % 5;
+	val.date = 20240101;
+	if (ds_write(dsh, vocab[i], &val) != 0) {
+	    fprintf(stderr, "%s: cannot write %s\n", progname, bfp->filepath);
+	    exit(EX_ERROR);
+	}
+    }
+
+    if (ds_txn_commit(dsh) != DST_OK) {
+	fprintf(stderr, "%s: cannot commit %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+    ds_close(dsh);
+    dsh = NULL;
+
+    timer_stop();
+
+    return VOCABULARY;
+}
+
+/** fill the wordlist outside of the timed runs */
+static void fill_wordlist(void)
+{
+    (void) datastore_write();
+    timed_ns = 0;
+    timed_allocs = 0;
+}
+
+static bool open_wordlist(dbmode_t mode)
+{
+    dsh = ds_open(dbe, bfp, mode);
+    if (dsh == NULL) {
+	fprintf(stderr, "%s: cannot open %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+
+    if ((mode & DS_IMAGE) && ((dsh_t *) dsh)->img == NULL) {
+	fprintf(stderr, "%s: no image of %s\n", progname, bfp->filepath);
+	ds_close(dsh);
+	dsh = NULL;
+	datastore_teardown();
+	return false;
+    }
+
+    return true;
+}
+
+static bool read_setup(void)
+{
+    datastore_setup();
+    fill_wordlist();
+    return open_wordlist(DS_READ);
+}
+
+/** split the stream into messages, sorted as lookup_words() passes
+ * their tokens */
+static void sort_stream(void)
+{
+    uint i, j;
+
+
+    sorted = (const word_t **) xcalloc(STREAM, sizeof(word_t *));
+    sorted_start = (uint *) xcalloc(STREAM / MSG_TOKENS + 1, sizeof(uint));
+    sorted_chunks = 0;
+
+    for (i = j = 0; i < STREAM; i += MSG_TOKENS) {
+	uint first = j, k, n;
+	for (k = i; k < i + MSG_TOKENS; k += 1)
+	    sorted[j++] = (k % 4 == 3) ? absent[stream[k]] : vocab[stream[k]];
+	qsort(sorted + first, j - first, sizeof(word_t *), cmp_words);
+	for (k = n = first + 1; k < j; k += 1)
+	    if (word_cmp(sorted[k], sorted[n - 1]) != 0)
+		sorted[n++] = sorted[k];
+	j = n;
+	sorted_start[sorted_chunks++] = first;
+    }
+    sorted_start[sorted_chunks] = j;
+}
+
+static bool read_many_setup(void)
+{
+    if (!read_setup())
+	return false;
+
+    sort_stream();
+    return true;
+}
+
+static bool image_setup(void)
+{
+    datastore_setup();
+    fill_wordlist();
+
+    if (img_compile(dbe, bfp) != EX_OK) {
+	fprintf(stderr, "%s: cannot compile %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+
+    return open_wordlist((dbmode_t)(DS_READ | DS_IMAGE));
+}
+
+/** with a filter, a fourth of the lookups skip the datastore */
+static bool bloom_setup(void)
+{
+    datastore_setup();
+    fill_wordlist();
+
+    if (bloom_build(dbe, bfp) != EX_OK) {
+	fprintf(stderr, "%s: cannot build the filter of %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+
+    return open_wordlist(DS_READ);
+}
+
+static bool bloom_many_setup(void)
+{
+    if (!bloom_setup())
+	return false;
+
+    sort_stream();
+    return true;
+}
+
+static void read_teardown(void)
+{
+    ds_close(dsh);
+    dsh = NULL;
+    datastore_teardown();
+
+    xfree(sorted);
+    xfree(sorted_start);
+    sorted = NULL;
+    sorted_start = NULL;
+}
+
+/** \return the number of lookups, three of four hit */
+static void bloom_teardown(void)
+{
+    char *path = mxcat(bfp->filepath, BLOOM_EXT, NULL);
+
+    unlink(path);
+    xfree(path);
+    read_teardown();
+}
+
+static unsigned long datastore_read(void)
+{
+    uint i;
+
+    timer_start();
+
+    if (ds_txn_begin(dsh) != DST_OK) {
+	fprintf(stderr, "%s: cannot read %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+
+    for (i = 0; i < STREAM; i += 1) {
+	dsv_t val;
+	(void) ds_read(dsh, (i % 4 == 3) ? absent[stream[i]] : vocab[stream[i]], &val);
+    }
+
+    (void) ds_txn_commit(dsh);
+
+    timer_stop();
+
+    return STREAM;
+}
+
+static unsigned long datastore_read_many(void)
+{
+    static dsv_t vals[MSG_TOKENS];
+    static int rets[MSG_TOKENS];
+    unsigned long count = 0;
+    uint c;
+
+    timer_start();
+
+    if (ds_txn_begin(dsh) != DST_OK) {
+	fprintf(stderr, "%s: cannot read %s\n", progname, bfp->filepath);
+	exit(EX_ERROR);
+    }
+
+    for (c = 0; c < sorted_chunks; c += 1) {
+	uint n = sorted_start[c + 1] - sorted_start[c];
+	(void) ds_read_many(dsh, n, sorted + sorted_start[c], vals, rets);
+	count += n;
+    }
+
+    (void) ds_txn_commit(dsh);
+
+    timer_stop();
+
+    return count;
+}
+
+/* Scoring */
+
+/** collect the corpus messages into wordhashes with synthetic counts */
+static bool messages_setup(void)
+{
+    uint size = 0;
+
+    if (!corpus_setup())
+	return false;
+
+    bogoreader_init(2, (const char * const *) corpus);
+    while ((*reader_more)()) {
+	wordhash_t *wh = wordhash_new();
+	hashnode_t *node;
+
+	collect_words(wh);
+	wordhash_sort(wh);
+
+	for (node = (hashnode_t *) wordhash_first(wh); node != NULL;
+	     node = (hashnode_t *) wordhash_next(wh)) {
+	    wordprop_t *wp = (wordprop_t *) node->data;
+	    uint32_t h = word_hash(node->key);
+	    wp->cnts.good = h % 50;
+	    wp->cnts.bad = (h >> 8) % 50;
+	    wp->cnts.msgs_good = 1000;
+	    wp->cnts.msgs_bad = 1000;
+	}
+
+	if (msgs_count == size) {
+	    size = size ? size * 2 : 64;
+	    msgs = (wordhash_t **) xrealloc(msgs, size * sizeof(wordhash_t *));
+	}
+	msgs[msgs_count++] = wh;
+	msgarena_reset();
+    }
+    bogoreader_fini();
+
+    robs = ROBS;
+    robx = ROBX;
+    min_dev = MIN_DEV;
+    spam_cutoff = SPAM_CUTOFF;
+
+    return msgs_count != 0;
+}
+
+static void messages_teardown(void)
+{
+    uint i;
+
+    for (i = 0; i < msgs_count; i += 1)
+	wordhash_free(msgs[i]);
+    xfree(msgs);
+    msgs = NULL;
+    msgs_count = 0;
+
+    corpus_teardown();
+}
+
+static unsigned long score_run(void)
+{
+    uint i;
+
+    timer_start();
+    for (i = 0; i < msgs_count; i += 1)
+	(void) msg_compute_spamicity(msgs[i]);
+    timer_stop();
+
+    return msgs_count;
+}
+
+/* Decoding */
+
+static void coded_new(void)
+{
+    coded = (char **) xcalloc(CODED_LINES, sizeof(char *));
+    coded_buf = (char *) xmalloc(256);
+}
+
+static void coded_teardown(void)
+{
+    uint i;
+
+    for (i = 0; i < CODED_LINES; i += 1)
+	xfree(coded[i]);
+    xfree(coded);
+    xfree(coded_buf);
+    coded = NULL;
+}
+
+static bool base64_setup(void)
+{
+    static const char b64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint i, j;
+
+    coded_new();
+    rand_state = 3;
+    for (i = 0; i < CODED_LINES; i += 1) {
+	char line[80];
+	for (j = 0; j < 76; j += 1)
+	    line[j] = b64[rand_next() & 63];
+	line[j++] = '\n';
+	line[j] = '\0';
+	coded[i] = xstrdup(line);
+    }
+
+    return true;
+}
+
+static bool qp_setup(void)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    uint i;
+
+    vocab_init();
+    coded_new();
+    rand_state = 4;
+    for (i = 0; i < CODED_LINES; i += 1) {
+	char line[128];
+	size_t n = 0;
+	while (n < 70) {
+	    if (rand_next() % 8 == 0) {
+		uint c = 0x80 + rand_next() % 0x80;
+		line[n++] = '=';
+		line[n++] = hex[c >> 4];
+		line[n++] = hex[c & 15];
+	    }
+	    else {
+		const word_t *w = vocab[rand_zipf(VOCABULARY)];
+		size_t l = min(w->leng, 8);
+		memcpy(line + n, w->u.text, l);
+		n += l;
+		line[n++] = ' ';
+	    }
+	}
+	/* soft line break on most lines */
+	if (i % 4 != 3)
+	    line[n++] = '=';
+	line[n++] = '\n';
+	line[n] = '\0';
+	coded[i] = xstrdup(line);
+    }
+
+    return true;
+}
+
+static unsigned long decode_run(bool is_qp)
+{
+    unsigned long count = 0;
+    uint i;
+
+    timer_start();
+    for (i = 0; i < CODED_LINES; i += 1) {
+	word_t w;
+	w.leng = strlen(coded[i]);
+	w.u.text = (byte *) coded_buf;
+	memcpy(coded_buf, coded[i], w.leng + 1);
+	count += w.leng;
+	if (is_qp)
+	    (void) qp_decode(&w, RFC2045);
+	else
+	    (void) base64_decode(&w);
+    }
+    timer_stop();
+
+    return count;
+}
+
+static unsigned long base64_run(void)
+{
+    return decode_run(false);
+}
+
+static unsigned long qp_run(void)
+{
+    return decode_run(true);
+}
+
+/* Passthrough */
+
+/** append the lines of mbox \a path, noting where each message starts */
+static void load_lines(const char *path)
+{
+    static uint size = 0;
+    static uint msize = 0;
+    FILE *fp = fopen(path, "r");
+    char buf[4096];
+
+    if (fp == NULL) {
+	fprintf(stderr, "%s: cannot open %s: %s\n", progname, path, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	if (strncmp(buf, "From ", 5) == 0 || lines_count == 0) {
+	    /* one more for the end of the last message */
+	    if (lines_msgs + 2 > msize) {
+		msize = msize ? msize * 2 : 64;
+		line_start = (uint *) xrealloc(line_start, msize * sizeof(uint));
+	    }
+	    line_start[lines_msgs++] = lines_count;
+	}
+	if (lines_count == size) {
+	    size = size ? size * 2 : 4096;
+	    lines = (line_t *) xrealloc(lines, size * sizeof(line_t));
+	}
+	lines[lines_count].leng = strlen(buf);
+	lines[lines_count].text = xstrdup(buf);
+	lines_count += 1;
+    }
+    line_start[lines_msgs] = lines_count;
+
+    fclose(fp);
+}
+
+static bool passthrough_bench_setup(void)
+{
+    wordhash_t *wh;
+
+    if (!corpus_setup())
+	return false;
+
+    load_lines(corpus[0]);
+    load_lines(corpus[1]);
+
+    fpo_save = fpo;
+    fpo = fopen("/dev/null", "w");
+    if (fpo == NULL) {
+	fprintf(stderr, "%s: cannot open /dev/null\n", progname);
+	exit(EX_ERROR);
+    }
+    passthrough = true;
+
+    /* the header needs a score */
+    robs = ROBS;
+    robx = ROBX;
+    min_dev = MIN_DEV;
+    spam_cutoff = SPAM_CUTOFF;
+    rstats_init();
+    wh = wordhash_new();
+    (void) msg_compute_spamicity(wh);
+    wordhash_free(wh);
+
+    return lines_msgs != 0;
+}
+
+static void passthrough_bench_teardown(void)
+{
+    uint i;
+
+    rstats_cleanup();
+    passthrough = false;
+    fclose(fpo);
+    fpo = fpo_save;
+
+    for (i = 0; i < lines_count; i += 1)
+	xfree(lines[i].text);
+    xfree(lines);
+    xfree(line_start);
+    lines = NULL;
+    line_start = NULL;
+    lines_count = lines_msgs = 0;
+
+    corpus_teardown();
+}
+
+static unsigned long passthrough_run(void)
+{
+    uint m, i;
+
+    timer_start();
+    for (m = 0; m < lines_msgs; m += 1) {
+	textblock_init();
+	for (i = line_start[m]; i < line_start[m + 1]; i += 1)
+	    textblock_add((const byte *) lines[i].text, lines[i].leng);
+	write_message(RC_HAM);
+	textblock_free();
+	msgarena_reset();
+    }
+    timer_stop();
+
+    return lines_msgs;
+}
+
+/* Driver */
+
+static const bench_t benchmarks[] = {
+    { "lexer.corpus",	     "token",   corpus_setup,   lexer_corpus,      corpus_teardown },
+    { "lexer.synthetic",     "token",   synth_setup,    lexer_synthetic,   synth_teardown },
+    { "wordhash.insert",     "token",   vocab_setup,    wordhash_insert_run, NULL },
+    { "wordhash.sort",	     "token",   vocab_setup,    wordhash_sort_run, NULL },
+    { "datastore.write",     "token",   datastore_setup, datastore_write,  datastore_teardown },
+    { "datastore.read",	     "token",   read_setup,     datastore_read,    read_teardown },
+    { "datastore.read_many", "token",   read_many_setup, datastore_read_many, read_teardown },
+    { "image.read",	     "token",   image_setup,    datastore_read,    read_teardown },
+    { "bloom.read",	     "token",   bloom_setup,    datastore_read,    bloom_teardown },
+    { "bloom.read_many",     "token",   bloom_many_setup, datastore_read_many, bloom_teardown },
+    { "score.spamicity",     "message", messages_setup, score_run,         messages_teardown },
+    { "decode.base64",	     "byte",    base64_setup,   base64_run,        coded_teardown },
+    { "decode.qp",	     "byte",    qp_setup,       qp_run,            coded_teardown },
+    { "passthrough",	     "message", passthrough_bench_setup, passthrough_run, passthrough_bench_teardown },
+};
+
+static void json_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s += 1) {
+	if (*s == '"' || *s == '\\')
+	    printf("\\%c", *s);
+	else if (iscntrl((unsigned char) *s))
+	    printf("\\u%04x", (unsigned char) *s);
+	else
+	    putchar(*s);
+    }
+    putchar('"');
+}
+
+static bool run_bench(const bench_t *b, bool first)
+{
+    unsigned long ops = 0, count;
+
+    if (b->setup != NULL && !(*b->setup)())
+	return false;
+
+    /* warm up the caches */
+    (void) (*b->run)();
+
+    timed_ns = 0;
+    timed_allocs = 0;
+    do {
+	count = (*b->run)();
+	ops += count;
+    } while (count != 0 && timed_ns < min_time * 1e9);
+
+    if (b->teardown != NULL)
+	(*b->teardown)();
+
+    printf("%s\n    {\"name\": ", first ? "" : ",");
+    json_string(b->name);
+    printf(", \"unit\": ");
+    json_string(b->unit);
+    printf(", \"ops\": %lu, \"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, \"allocs_per_op\": %.4f}",
+	   ops,
+	   ops ? timed_ns / ops : 0.0,
+	   timed_ns > 0 ? ops * 1e9 / timed_ns : 0.0,
+	   ops ? (double) timed_allocs / ops : 0.0);
+    fflush(stdout);
+
+    return true;
+}
+
+static bool selected(const char *name, int argc, char **argv)
+{
+    int i;
+
+    if (argc == 0)
+	return true;
+
+    for (i = 0; i < argc; i += 1)
+	if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+	    return true;
+
+    return false;
+}
+
+static void remove_tempdir(void)
+{
+    DIR *dir = opendir(tempdir);
+    struct dirent *ent;
+
+    if (dir != NULL) {
+	while ((ent = readdir(dir)) != NULL) {
+	    char *path;
+	    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+		continue;
+	    path = mxcat(tempdir, DIRSEP_S, ent->d_name, NULL);
+	    unlink(path);
+	    xfree(path);
+	}
+	closedir(dir);
+    }
+
+    rmdir(tempdir);
+    xfree(tempdir);
+}
+
+static void help(void)
+{
+    fprintf(stdout,
+	    "Usage: %s [ -d dir ] [ -t secs ] [ -X flags ] [ name ... ]\n"
+	    "\t-d dir\t- read the test corpus from dir, default %s.\n"
+	    "\t-t secs\t- run each benchmark for at least secs seconds, default %.1f.\n"
+	    "\t-X flags\t- set test flags, e.g. F to tokenize plain text by flex alone.\n"
+	    "\t-l\t- list the benchmarks.\n"
+	    "\t-h\t- print this help message.\n"
+	    "\tname\t- run the benchmarks whose names start with name.\n",
+	    progname, inputs, min_time);
+}
+
+int main(int argc, char **argv)
+{
+    const char *tmp = getenv("TMPDIR");
+    const char *env = getenv("BOGOTEST");
+    bool first = true;
+    size_t i;
+    int option;
+
+    if (env != NULL)
+	set_bogotest(env);
+
+    while ((option = getopt(argc, argv, "d:t:X:lh")) != -1) {
+	switch (option) {
+	case 'd':
+	    inputs = optarg;
+	    break;
+	case 't':
+	    min_time = atof(optarg);
+	    break;
+	case 'X':
+	    set_bogotest(optarg);
+	    break;
+	case 'l':
+	    for (i = 0; i < COUNTOF(benchmarks); i += 1)
+		printf("%-20s %s\n", benchmarks[i].name, benchmarks[i].unit);
+	    exit(EX_OK);
+	case 'h':
+	    help();
+	    exit(EX_OK);
+	default:
+	    help();
+	    exit(EX_ERROR);
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    tempdir = mxcat(tmp != NULL && *tmp != '\0' ? tmp : "/tmp", DIRSEP_S, "bogobench.XXXXXX", NULL);
+    if (mkdtemp(tempdir) == NULL) {
+	fprintf(stderr, "%s: cannot create %s: %s\n", progname, tempdir, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    encoding = E_DEFAULT;
+    mbox_mode = true;
+    bulk_mode = B_CMDLINE;
+    fpo = stdout;
+
+    printf("{\n  \"program\": \"%s\",\n  \"version\": ", progname);
+    json_string(version);
+    printf(",\n  \"datastore\": ");
+    json_string(ds_version_str());
+    printf(",\n  \"min_time\": %.3f,\n  \"benchmarks\": [", min_time);
+
+    for (i = 0; i < COUNTOF(benchmarks); i += 1) {
+	if (selected(benchmarks[i].name, argc, argv) &&
+	    run_bench(&benchmarks[i], first))
+	    first = false;
+    }
+
+    printf("\n  ]\n}\n");
+
+    vocab_free();
+    token_cleanup();
+    mime_cleanup();
+    remove_tempdir();
+
+    return EX_OK;
+}
+
+/* End */
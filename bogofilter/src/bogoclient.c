@@ -0,0 +1,228 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bogoclient.c -- drop-in replacement for bogofilter that hands the
+		   message to a running bogofilterd.
+
+   Supports the per-message options listed in BFD_FLAGS (bogofilterd.h).
+   For any other option, or when no daemon is listening, bogoclient
+   runs bogofilter itself with the unchanged command line.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bogofilterd.h"
+#include "mxcat.h"
+#include "paths.h"
+#include "xmalloc.h"
+#include "xstrdup.h"
+
+#ifndef	BINDIR
+#define	BINDIR	"/usr/local/bin"
+#endif
+
+const char *progname = "bogoclient";
+
+/* Function Definitions */
+
+/** run the real bogofilter with our command line, does not return */
+static void fallback(char **argv)
+{
+    const char *path = BINDIR DIRSEP_S "bogofilter";
+
+    execv(path, argv);
+    fprintf(stderr, "%s: cannot execute %s: %s\n",
+	    progname, path, strerror(errno));
+    exit(EX_ERROR);
+}
+
+/** collect the option letters of argv into \a flags, returns false
+ * if an argument isn't a per-message option bogofilterd handles */
+static bool get_flags(int argc, char **argv, char *flags, size_t size)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 1; i < argc; i += 1) {
+	const char *a = argv[i];
+	if (a[0] != '-' || a[1] == '\0' || a[1] == '-')
+	    return false;
+	for (a += 1; *a != '\0'; a += 1) {
+	    if (strchr(BFD_FLAGS, *a) == NULL || len + 1 >= size)
+		return false;
+	    flags[len++] = *a;
+	}
+    }
+
+    if (len == 0)
+	flags[len++] = '-';
+    flags[len] = '\0';
+
+    return true;
+}
+
+static char *get_socket_path(void)
+{
+    const char *env = getenv(BFD_SOCKET_ENV);
+    char *dir, *path;
+
+    if (env != NULL && *env != '\0')
+	return xstrdup(env);
+
+    dir = get_directory(PR_ENV_BOGO);
+    if (dir == NULL)
+	dir = get_directory(PR_ENV_HOME);
+    if (dir == NULL)
+	return NULL;
+
+    path = mxcat(dir, DIRSEP_S, BFD_SOCKET_NAME, NULL);
+    xfree(dir);
+    return path;
+}
+
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path))
+	return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+	return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+	ssize_t w = write(fd, buf, len);
+	if (w < 0 && errno == EINTR)
+	    continue;
+	if (w <= 0)
+	    return false;
+	buf += w;
+	len -= w;
+    }
+    return true;
+}
+
+/** send request line and message, returns false on error */
+static bool send_message(int fd, const char *flags)
+{
+    char buf[BUFSIZ];
+    ssize_t n;
+
+    n = snprintf(buf, sizeof(buf), "%s %s\n", BFD_PROTOCOL, flags);
+    if (!write_all(fd, buf, n))
+	return false;
+
+    for (;;) {
+	n = read(STDIN_FILENO, buf, sizeof(buf));
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return false;
+	if (n == 0)
+	    break;
+	if (!write_all(fd, buf, n))
+	    return false;
+    }
+
+    return shutdown(fd, SHUT_WR) == 0;
+}
+
+/** read response header and copy output to stdout, returns exit code */
+static ex_t get_response(int fd)
+{
+    char buf[BUFSIZ];
+    size_t len = 0;
+    int code;
+    long size;
+
+    /* response header, byte by byte */
+    for (;;) {
+	ssize_t r = read(fd, buf + len, 1);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0 || len + 1 >= BFD_MAX_HEADER)
+	    return EX_ERROR;
+	if (buf[len] == '\n')
+	    break;
+	len += 1;
+    }
+    buf[len] = '\0';
+
+    if (sscanf(buf, "%d %ld", &code, &size) != 2 || size < 0)
+	return EX_ERROR;
+
+    while (size > 0) {
+	ssize_t r = read(fd, buf, sizeof(buf) < (size_t)size ? sizeof(buf) : (size_t)size);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0 || !write_all(STDOUT_FILENO, buf, r))
+	    return EX_ERROR;
+	size -= r;
+    }
+
+    return (ex_t) code;
+}
+
+int main(int argc, char **argv) /*@globals errno,stderr,stdout@*/
+{
+    char flags[BFD_MAX_HEADER - sizeof(BFD_PROTOCOL) - 1];
+    char *path;
+    int fd;
+    ex_t exitcode;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!get_flags(argc, argv, flags, sizeof(flags)))
+	fallback(argv);
+
+    path = get_socket_path();
+    fd = connect_socket(path);
+    xfree(path);
+
+    if (fd < 0)
+	fallback(argv);
+
+    if (!send_message(fd, flags)) {
+	fprintf(stderr, "%s: cannot send message: %s\n",
+		progname, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    exitcode = get_response(fd);
+    if (exitcode == EX_ERROR)
+	fprintf(stderr, "%s: request failed, see bogofilterd's log.\n",
+		progname);
+
+    close(fd);
+
+    exit(exitcode);
+}
+
+/* End */
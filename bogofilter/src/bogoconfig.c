@@ -55,6 +55,7 @@ Note: bogolexer also uses configfile.c.
 #include "maint.h"
 #include "paths.h"
 #include "score.h"
+#include "timing.h"
 #include "wordlists.h"
 #include "wordlists_base.h"
 #include "xatox.h"
@@ -110,6 +111,7 @@ static struct option longopts_bogofilter[] = {
     { "fixed-terse-format",		N, 0, 'T' },
     { "report-unsure",			N, 0, 'U' },
     { "classify-stdin",			N, 0, 'b' },
+    { "jobs",				R, 0, 'j' },
     { "bogofilter-dir",			R, 0, 'd' },
     { "nonspam-exits-zero",		N, 0, 'e' },
     { "use-syslog",			N, 0, 'l' },
@@ -142,6 +144,9 @@ static struct option longopts_bogofilter[] = {
     { "terse-format",			R, 0, O_TERSE_FORMAT },
     { "thresh-update",			R, 0, O_THRESH_UPDATE },
     { "timestamp",			R, 0, O_TIMESTAMP },
+    { "timing",				R, 0, O_TIMING },
+    { "token-cache-size",		R, 0, O_TOKEN_CACHE_SIZE },
+    { "update-journal",			R, 0, O_UPDATE_JOURNAL },
     { "unsure-subject-tag",		R, 0, O_UNSURE_SUBJECT_TAG },
     { "wordlist",			R, 0, O_WORDLIST },
     /* end of list */
@@ -268,6 +273,15 @@ static ex_t validate_args(void)
 		      outfname);
     }
     
+    if (bulk_jobs > 1 && (run_register || (run_type & RUN_UPDATE) ||
+			  bulk_mode == B_NORMAL))
+    {
+	(void)fprintf(stderr,
+		      "Error:  Option '-j' requires '-b' or '-B' and may not be used with '-u', '-s', '-n', '-S', or '-N'.\n"
+	    );
+	return EX_ERROR;
+    }
+
     if (run_register && (run_classify || Rtable))
     {
 	(void)fprintf(stderr,
@@ -292,6 +306,7 @@ static const char *help_text[] = {
     "  -M, --classify-mbox       - set mailbox mode.  Classify multiple messages in an mbox formatted file.\n",
     "  -b, --classify-stdin      - set streaming bulk mode. Process multiple messages (files or directories) read from STDIN.\n",
     "  -B, --classify-files=list - set bulk mode. Process multiple messages (files or directories) named on the command line.\n",
+    "  -j, --jobs=count          - in bulk mode, classify with count worker processes.\n",
     "  -R, --dataframe           - print an R data frame.\n",
     "registration options:\n",
     "  -s, --register-spam       - register message(s) as spam.\n",
@@ -360,6 +375,8 @@ static const char *help_text[] = {
     "  --terse-format                    short form\n",
     "  --thresh-update                   no update if near 0 or 1\n",
     "  --timestamp                       enable/disable token timestamps\n",
+    "  --timing                          stage times and counters to stderr, syslog or a file\n",
+    "  --token-cache-size                tokens cached per wordlist, 0 = off\n",
     "  --token-count                     fixed token count for scoring\n",
     "  --token-count-min                 min token count for scoring\n",
     "  --token-count-max                 max token count for scoring\n",
@@ -367,6 +384,7 @@ static const char *help_text[] = {
     "  --unicode                         enable/disable unicode based wordlist\n",
 #endif
     "  --unsure-subject-tag              like spam-subject-tag\n",
+    "  --update-journal                  register to journal, see bogoutil --apply-journal\n",
     "  --user-config-file                configuration file\n",
     "  --wordlist                        specify wordlist parameters\n",
     "\n",
@@ -408,7 +426,7 @@ static void print_version(void)
 		  progtype, version, ds_version_str(), PACKAGE);
 }
 
-#define	OPTIONS	":-:bBc:Cd:DehHI:k:lL:m:MnNo:O:pPqQRsStTuUvVx:X:y:"
+#define	OPTIONS	":-:bBc:Cd:DehHI:j:k:lL:m:MnNo:O:pPqQRsStTuUvVx:X:y:"
 
 /** These functions process command line arguments.
  **
@@ -507,6 +525,17 @@ int process_arg(int option, const char *name, const char *val, priority_t preced
 	bulk_mode = B_CMDLINE;
 	break;
 
+    case 'j':
+    {
+	int j;
+	if (!xatoi(&j, val) || j < 1) {
+	    fprintf(stderr, "Invalid job count '%s'.\n", val);
+	    exit(EX_ERROR);
+	}
+	bulk_jobs = (uint) j;
+	break;
+    }
+
     case 'c':
     case O_CONFIG_FILE:
 	if (pass == PASS_1_CLI) {
@@ -736,10 +765,13 @@ int process_arg(int option, const char *name, const char *val, priority_t preced
     case O_TERSE_FORMAT:		terse_format = get_string(name, val);			break;
     case O_THRESH_UPDATE:		get_double(name, val, &thresh_update);			break;
     case O_TIMESTAMP:			timestamp_tokens = get_bool(name, val);			break;
+    case O_TIMING:			timing_set(val);					break;
+    case O_TOKEN_CACHE_SIZE:		token_cache_size = atoi(val);				break;
     case O_TOKEN_COUNT_FIX:             token_count_fix = atoi(val);                            break;
     case O_TOKEN_COUNT_MIN:             token_count_min = atoi(val);                            break;
     case O_TOKEN_COUNT_MAX:             token_count_max = atoi(val);                            break;
     case O_UNSURE_SUBJECT_TAG:		unsure_subject_tag = get_string(name, val);		break;
+    case O_UPDATE_JOURNAL:		update_journal = get_bool(name, val);			break;
     case O_UNICODE:			encoding = get_bool(name, val) ? E_UNICODE : E_RAW;	break;
     case O_WORDLIST:			configure_wordlist(val);				break;
 
@@ -811,6 +843,10 @@ rc_t query_config(void)
     Q2 fprintf(stdout, "%-18s = %s\n", "user-config-file", NB(user_config_file));
     Q2 fprintf(stdout, "\n");
 
+    Q2 fprintf(stdout, "%-18s = %u\n", "jobs",                  bulk_jobs);
+    Q2 fprintf(stdout, "%-18s = %s\n", "update-journal",        YN(update_journal));
+    Q2 fprintf(stdout, "%-18s = %u\n", "token-cache-size",      token_cache_size);
+    Q2 fprintf(stdout, "%-18s = %s\n", "timing",                timing_get());
     Q2 fprintf(stdout, "%-18s = %s\n", "bogofilter-dir",        bogohome);
     Q2 display_wordlists(word_lists, "%-18s   ");
     Q2 fprintf(stdout, "\n");
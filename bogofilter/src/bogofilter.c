@@ -35,10 +35,14 @@ THEORY:
 #include "bogoreader.h"
 #include "collect.h"
 #include "format.h"
+#include "jobs.h"
+#include "msgarena.h"
 #include "passthrough.h"
 #include "register.h"
 #include "rstats.h"
 #include "score.h"
+#include "timing.h"
+#include "wordlists.h"
 
 /*
 **	case B_NORMAL:		
@@ -77,6 +81,7 @@ rc_t bogofilter(int argc, char **argv)
     bool write_msg    = passthrough || Rtable;
     bool classify_msg = write_msg || ((run_type & (RUN_NORMAL | RUN_UPDATE))) != 0;
 
+    bool first_msg = true;
     wordhash_t *words;
 
     score_initialize();			/* initialize constants */
@@ -87,13 +92,20 @@ rc_t bogofilter(int argc, char **argv)
     words = register_aft ? wordhash_new() : NULL;
 
     bogoreader_init(argc, (const char * const *) argv);
+    timing_init();
 
     while ((*reader_more)()) {
-	wordhash_t *w = wordhash_new();
+	wordhash_t *w = wordhash_new_msg();
+
+	/* each message gets a fresh view of the wordlists */
+	if (!first_msg)
+	    renew_wordlists();
+	first_msg = false;
 
 	rstats_init();
 	passthrough_setup();
 
+	TIMING_PHASE(PH_LEX);
 	collect_words(w);
 	wordhash_sort(w);
 	msgcount += 1;
@@ -105,18 +117,23 @@ rc_t bogofilter(int argc, char **argv)
         
 	if (register_opt && DEBUG_REGISTER(1))
 	    fprintf(dbgout, "Message #%ld\n", (long) msgcount);
-	if (register_bef)
+	if (register_bef) {
+	    TIMING_PHASE(PH_REGISTER);
 	    register_words(run_type, w, 1);
+	}
 	if (register_aft)
 	    wordhash_add(words, w, &wordprop_init);
 
 	if (classify_msg || write_msg) {
 	    double spamicity;
+	    TIMING_PHASE(PH_LOOKUP);
 	    lookup_words(w);			/* This reads the database */
+	    TIMING_PHASE(PH_SCORE);
 	    spamicity = msg_compute_spamicity(w);
 	    status = msg_status();
 	    if (run_type & RUN_UPDATE)		/* Note: don't register if RC_UNSURE */
 	    {
+		TIMING_PHASE(PH_REGISTER);
 		if (status == RC_SPAM && spamicity <= 1.0 - thresh_update)
 		    register_words(REG_SPAM, w, msgcount);
 		if (status == RC_HAM && spamicity >= thresh_update)
@@ -129,16 +146,20 @@ rc_t bogofilter(int argc, char **argv)
 		    fprintf(fpo, "%s ", filename); 
 	    }
 
+	    TIMING_PHASE(PH_OUTPUT);
 	    write_message(status);		/* passthrough */
 	    if (logflag && !register_opt) {
 		write_log_message(status);
 		msgcount = 0;
 	    }
 	}
+	jobs_message_done(status);	/* -j worker */
+	timing_message_done();
 	wordhash_free(w);
 
 	passthrough_cleanup();
 	rstats_cleanup();
+	msgarena_reset();
 
 	if (DEBUG_MEMORY(2))
 	    MEMDISPLAY;
@@ -149,10 +170,14 @@ rc_t bogofilter(int argc, char **argv)
 
     bogoreader_fini();
 
+    if (verbose >= 2 && (bulk_mode != B_NORMAL || mbox_mode))
+	print_token_cache_stats(dbgout);
+
     if (DEBUG_MEMORY(1))
 	MEMDISPLAY;
 
     if (register_aft && ((run_type & RUN_UPDATE) == 0)) {
+	TIMING_PHASE(PH_REGISTER);
 	wordhash_sort(words);
 	register_words(run_type, words, msgcount);
     }
@@ -162,6 +187,8 @@ rc_t bogofilter(int argc, char **argv)
     if (logflag && register_opt)
 	write_log_message(status);
 
+    timing_fini();
+
     wordhash_free(words);
 
     if (DEBUG_MEMORY(1))
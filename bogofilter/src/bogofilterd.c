@@ -0,0 +1,507 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bogofilterd.c -- classification daemon, serves bogofilter requests
+		    over a local (Unix domain) socket.
+
+   The wordlists are opened once at startup and stay open.  Each
+   connection carries one message and a small set of per-message
+   options (see bogofilterd.h) and is run through the same code path
+   as a single bogofilter invocation, i.e. bogofilter().  Requests
+   are served one after another; every request runs in its own
+   transaction, so other bogofilter/bogoutil processes can use the
+   wordlists between requests.  The message is read in full, within
+   BFD_TIMEOUT, before the wordlists are touched, so a stalled client
+   holds up neither the other clients nor the wordlists for long.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "bogoconfig.h"
+#include "bogofilter.h"
+#include "bogofilterd.h"
+#include "datastore.h"
+#include "mime.h"
+#include "mxcat.h"
+#include "paths.h"
+#include "sighandler.h"
+#include "token.h"
+#include "wordlists.h"
+#include "xmalloc.h"
+#include "xstrdup.h"
+
+const char *progname = "bogofilterd";
+
+/* option values given at startup, restored before each request */
+
+static run_t base_run_type;
+static bool  base_passthrough;
+static bool  base_nonspam_exits_zero;
+static bool  base_terse;
+static bool  base_mbox_mode;
+static int   base_verbose;
+
+static char *socket_path = NULL;
+
+static volatile sig_atomic_t fStop = false;
+
+/* Function Definitions */
+
+static void daemon_sigdie(int sig)
+{
+    (void) sig;		/* suppress compiler warning */
+    fStop = true;
+}
+
+/* unlike signal_setup(), don't restart accept() so we notice fStop,
+ * and don't set fDie, which would abort the current request */
+static void daemon_signal_setup(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_sigdie;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static void save_options(void)
+{
+    base_run_type = run_type;
+    base_passthrough = passthrough;
+    base_nonspam_exits_zero = nonspam_exits_zero;
+    base_terse = terse;
+    base_mbox_mode = mbox_mode;
+    base_verbose = verbose;
+}
+
+static void restore_options(void)
+{
+    run_type = base_run_type;
+    passthrough = base_passthrough;
+    nonspam_exits_zero = base_nonspam_exits_zero;
+    terse = base_terse;
+    mbox_mode = base_mbox_mode;
+    verbose = base_verbose;
+    msg_register[0] = '\0';
+}
+
+/** apply the option letters of a request, returns false for bad
+ * or conflicting options */
+static bool apply_flags(const char *flags)
+{
+    run_t reg = (run_t)(REG_SPAM | REG_GOOD | UNREG_SPAM | UNREG_GOOD);
+    const char *f;
+
+    if (strcmp(flags, "-") == 0)
+	return true;
+
+    for (f = flags; *f != '\0'; f += 1) {
+	switch (*f) {
+	case 'e': nonspam_exits_zero = true;	break;
+	case 'p': passthrough = true;		break;
+	case 't': terse = true;			break;
+	case 'v': verbose += 1;			break;
+	case 'u': run_type = (run_t)(run_type | RUN_UPDATE);	break;
+	case 's': run_type = (run_t)((run_type & ~RUN_NORMAL) | REG_SPAM);	break;
+	case 'n': run_type = (run_t)((run_type & ~RUN_NORMAL) | REG_GOOD);	break;
+	case 'S': run_type = (run_t)((run_type & ~RUN_NORMAL) | UNREG_SPAM);	break;
+	case 'N': run_type = (run_t)((run_type & ~RUN_NORMAL) | UNREG_GOOD);	break;
+	default:
+	    return false;
+	}
+    }
+
+    /* same restrictions as bogofilter's check_run_type() */
+    switch (run_type & reg) {
+    case 0:
+    case REG_SPAM:
+    case REG_GOOD:
+    case UNREG_SPAM:
+    case UNREG_GOOD:
+    case REG_SPAM | UNREG_GOOD:
+    case REG_GOOD | UNREG_SPAM:
+	return true;
+    default:
+	return false;
+    }
+}
+
+/** make reads and writes on a client's socket time out */
+static void set_timeouts(int fd)
+{
+    struct timeval tv;
+
+    tv.tv_sec = BFD_TIMEOUT;
+    tv.tv_usec = 0;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0)
+	fprintf(stderr, "%s: cannot set socket timeouts: %s\n",
+		progname, strerror(errno));
+}
+
+/** read from a client, failing with ETIMEDOUT once a read has timed
+ * out or \a deadline has passed */
+static ssize_t read_client(int fd, void *buf, size_t size, time_t deadline)
+{
+    for (;;) {
+	ssize_t r;
+
+	if (time(NULL) >= deadline) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+	r = read(fd, buf, size);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    errno = ETIMEDOUT;
+	return r;
+    }
+}
+
+/** read the request line byte by byte, so that the message that
+ * follows it is left unread on the socket */
+static bool read_request(int fd, char *buf, size_t size, time_t deadline)
+{
+    size_t len = 0;
+    size_t plen = strlen(BFD_PROTOCOL);
+
+    while (len < size - 1) {
+	ssize_t r = read_client(fd, buf + len, 1, deadline);
+	if (r <= 0)
+	    return false;
+	if (buf[len] == '\n') {
+	    buf[len] = '\0';
+	    return len > plen + 1
+		&& memcmp(buf, BFD_PROTOCOL, plen) == 0
+		&& buf[plen] == ' ';
+	}
+	len += 1;
+    }
+
+    return false;
+}
+
+/** copy the message to a temporary file, \return it rewound or NULL */
+static FILE *read_message(int fd, time_t deadline)
+{
+    char buf[BUFSIZ];
+    ssize_t r;
+    FILE *fp = tmpfile();
+
+    if (fp == NULL)
+	return NULL;
+
+    while ((r = read_client(fd, buf, sizeof(buf), deadline)) > 0) {
+	if (fwrite(buf, 1, r, fp) != (size_t) r) {
+	    r = -1;
+	    break;
+	}
+    }
+
+    if (r < 0 || fflush(fp) != 0) {
+	int e = errno;
+	fclose(fp);
+	errno = e;
+	return NULL;
+    }
+
+    rewind(fp);
+    return fp;
+}
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+	ssize_t w = write(fd, buf, len);
+	if (w < 0 && errno == EINTR)
+	    continue;
+	if (w <= 0)
+	    return false;
+	buf += w;
+	len -= w;
+    }
+    return true;
+}
+
+/** send the response header and the buffered output */
+static void send_response(int fd, ex_t exitcode, FILE *out)
+{
+    char buf[BUFSIZ];
+    long len = 0;
+    size_t n;
+
+    if (out != NULL) {
+	fflush(out);
+	len = ftell(out);
+	rewind(out);
+    }
+
+    n = snprintf(buf, sizeof(buf), "%d %ld\n", (int)exitcode, len);
+    if (!write_all(fd, buf, n))
+	return;
+
+    if (out == NULL)
+	return;
+
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0) {
+	if (!write_all(fd, buf, n))
+	    return;
+    }
+}
+
+static ex_t status_to_exitcode(rc_t status)
+{
+    ex_t exitcode;
+
+    switch (status) {
+    case RC_SPAM:	exitcode = EX_SPAM;	break;
+    case RC_HAM:	exitcode = EX_HAM;	break;
+    case RC_UNSURE:	exitcode = EX_UNSURE;	break;
+    case RC_OK:		exitcode = EX_OK;	break;
+    default:
+	fprintf(dbgout, "Unexpected status code - %d\n", (int)status);
+	return EX_ERROR;
+    }
+
+    if (nonspam_exits_zero)
+	exitcode = EX_OK;
+
+    return exitcode;
+}
+
+/** serve one connection: read request and message, classify and/or
+ * register, send back the exit code and bogofilter's output */
+static void serve(int fd)
+{
+    char request[BFD_MAX_HEADER];
+    const char *flags;
+    rc_t status;
+    time_t deadline = time(NULL) + 2 * BFD_TIMEOUT;
+
+    restore_options();
+    set_timeouts(fd);
+
+    errno = 0;
+    if (!read_request(fd, request, sizeof(request), deadline)) {
+	if (errno == ETIMEDOUT)
+	    fprintf(stderr, "%s: client timed out.\n", progname);
+	else
+	    fprintf(stderr, "%s: malformed request.\n", progname);
+	send_response(fd, EX_ERROR, NULL);
+	return;
+    }
+
+    flags = request + strlen(BFD_PROTOCOL) + 1;
+    if (!apply_flags(flags)) {
+	fprintf(stderr, "%s: invalid options '%s'.\n", progname, flags);
+	send_response(fd, EX_ERROR, NULL);
+	return;
+    }
+
+    fpin = read_message(fd, deadline);
+    if (fpin == NULL) {
+	fprintf(stderr, "%s: cannot read message: %s\n",
+		progname, strerror(errno));
+	send_response(fd, EX_ERROR, NULL);
+	return;
+    }
+
+    fpo = tmpfile();
+    if (fpo == NULL) {
+	fprintf(stderr, "%s: cannot set up request: %s\n",
+		progname, strerror(errno));
+	fclose(fpin);
+	fpin = NULL;
+	send_response(fd, EX_ERROR, NULL);
+	return;
+    }
+
+    /* the token caches are kept unless the wordlists have changed
+     * since the last request */
+    resume_wordlists();
+
+    status = bogofilter(0, NULL);	/* closes fpin */
+
+    suspend_wordlists();
+
+    send_response(fd, status_to_exitcode(status), fpo);
+
+    fclose(fpo);
+    fpo = NULL;
+    fpin = NULL;
+}
+
+/** remove the socket at \a path, \return false if something else is
+ * there */
+static bool unlink_socket(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0)
+	return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode))
+	return false;
+    return unlink(path) == 0 || errno == ENOENT;
+}
+
+/** \return true if a daemon is listening at \a addr */
+static bool socket_in_use(const struct sockaddr_un *addr)
+{
+    bool used;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+	return false;
+    used = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+    close(fd);
+    return used;
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: socket path too long: %s\n", progname, path);
+	exit(EX_ERROR);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+	fprintf(stderr, "%s: cannot create socket: %s\n",
+		progname, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* a socket nobody listens on is stale, anything else is left alone */
+    if (socket_in_use(&addr)) {
+	fprintf(stderr, "%s: %s is in use.\n", progname, path);
+	exit(EX_ERROR);
+    }
+    if (!unlink_socket(path)) {
+	fprintf(stderr, "%s: %s exists and is not a socket.\n",
+		progname, path);
+	exit(EX_ERROR);
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	listen(fd, SOMAXCONN) != 0) {
+	fprintf(stderr, "%s: cannot listen on %s: %s\n",
+		progname, path, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv) /*@globals errno,stderr,stdout@*/
+{
+    int sock;
+    const char *env;
+
+    signal_setup();		/* setup to catch signals */
+    daemon_signal_setup();
+    atexit(bf_exit);
+
+    fBogofilter = true;
+
+    dbgout = stderr;
+
+    progtype = build_progtype(progname, DB_TYPE);
+
+#if	defined(ENABLE_TOKYOCABINET_DATASTORE) || defined(ENABLE_QDBM_DATASTORE)
+    /* these lock the database file as long as it is open, which would
+     * shut out everybody else */
+    fprintf(stderr, "%s: not supported with %s, which keeps the wordlists locked.\n",
+	    progname, DB_TYPE);
+    exit(EX_ERROR);
+#endif
+
+    process_parameters(argc, argv, true);
+
+    if (bulk_mode != B_NORMAL || query || optind < argc) {
+	fprintf(stderr, "%s: bulk mode, -Q and file arguments are not supported.\n",
+		progname);
+	exit(EX_ERROR);
+    }
+
+    save_options();
+
+    /* the socket comes first: failing with the wordlists open would
+     * leave them in a transaction */
+    env = getenv(BFD_SOCKET_ENV);
+    socket_path = (env != NULL && *env != '\0')
+	? xstrdup(env)
+	: mxcat(bogohome, DIRSEP_S, BFD_SOCKET_NAME, NULL);
+
+    sock = open_socket(socket_path);
+
+    /* open all wordlists, writable so that requests can register
+     * unless registrations go to the journal */
+    open_wordlists(update_journal ? DS_READ : DS_WRITE);
+
+    if (encoding == E_UNKNOWN)
+	encoding = E_DEFAULT;
+
+    /* don't hold locks while idle */
+    suspend_wordlists();
+
+    if (verbose)
+	fprintf(dbgout, "%s: listening on %s\n", progname, socket_path);
+
+    while (!fStop) {
+	int fd = accept(sock, NULL, NULL);
+	if (fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    fprintf(stderr, "%s: accept failed: %s\n",
+		    progname, strerror(errno));
+	    break;
+	}
+	serve(fd);
+	close(fd);
+    }
+
+    close(sock);
+    (void) unlink_socket(socket_path);
+    xfree(socket_path);
+
+    /* transactions have been committed, nothing to abort */
+    resume_wordlists();
+    close_wordlists(true);
+
+    /* cleanup storage */
+    token_cleanup();
+    mime_cleanup();
+    free_wordlists();
+
+    xfree(progtype);
+
+    exit(EX_OK);
+}
+
+/* End */
@@ -0,0 +1,35 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bogofilterd.h -- constants shared by bogofilterd and bogoclient
+
+******************************************************************************/
+
+#ifndef	BOGOFILTERD_H
+#define	BOGOFILTERD_H
+
+/*
+ * Protocol (one request per connection):
+ *
+ * client -> daemon:	"BOGOFILTERD/1 <flags>\n", then the raw message,
+ *			then the client shuts down its sending side.
+ *			<flags> are the bogofilter option letters in
+ *			BFD_FLAGS, or "-" for none.  A client that
+ *			sends nothing for BFD_TIMEOUT seconds, or takes
+ *			twice as long for all of it, is dropped.
+ *
+ * daemon -> client:	"<exit code> <length>\n", then <length> bytes
+ *			of output, i.e. what bogofilter would have
+ *			written to stdout.
+ */
+
+#define	BFD_PROTOCOL	"BOGOFILTERD/1"
+#define	BFD_FLAGS	"enNpsStuv"	/* per-request options */
+#define	BFD_SOCKET_ENV	"BOGOFILTERD_SOCKET"
+#define	BFD_SOCKET_NAME	"bogofilterd.sock"
+#define	BFD_MAX_HEADER	64		/* max length of a request line */
+#define	BFD_TIMEOUT	30		/* seconds a client may stall */
+
+#endif	/* BOGOFILTERD_H */
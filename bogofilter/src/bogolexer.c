@@ -25,6 +25,7 @@ AUTHOR:
 #include "lexer.h"
 #include "longoptions.h"
 #include "mime.h"
+#include "msgarena.h"
 #include "textblock.h"
 #include "token.h"
 #include "format.h"
@@ -298,8 +299,6 @@ int main(int argc, char **argv)
     if (encoding == E_UNKNOWN)
 	encoding = E_DEFAULT;
 
-    textblock_init();
-
     if (!passthrough)
     {
 	if (quiet)
@@ -312,6 +311,7 @@ int main(int argc, char **argv)
 
     while ((*reader_more)()) {
 	word_t token;
+	textblock_init();
 	lexer_init();
 
 	while ((t = get_token( &token )) != NONE)
@@ -323,6 +323,11 @@ int main(int argc, char **argv)
 	    else if (!quiet)
 		fprintf(fpo, "get_token: %d \"%s\"\n", (int)t, token.u.text);
 	}
+
+	/* the message's text blocks and the lexer's copies are in
+	 * the arena */
+	textblock_free();
+	msgarena_reset();
     }
 
     if ( !passthrough )
@@ -331,7 +336,6 @@ int main(int argc, char **argv)
     /* cleanup storage */
     token_cleanup();
     mime_cleanup();
-    textblock_free();
 
     MEMDISPLAY;
 
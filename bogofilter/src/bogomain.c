@@ -29,6 +29,7 @@ CONTRIBUTORS:
 #include "bogomain.h"
 #include "bogofilter.h"
 #include "datastore.h"
+#include "jobs.h"
 #include "mime.h"
 #include "passthrough.h"
 #include "paths.h"
@@ -58,13 +59,19 @@ ex_t bogomain(int argc, char **argv) /*@globals errno,stderr,stdout@*/
 	openlog("bogofilter", LOG_PID, LOG_MAIL);
 #endif
 
-    /* open all wordlists */
-    open_wordlists((run_type == RUN_NORMAL) ? DS_READ : DS_WRITE);
+    if (bulk_jobs > 1 && !query) {
+	/* the workers open the wordlists */
+	status = jobs_run(argc - optind, argv + optind);
+    } else {
+	/* open all wordlists, registrations to the journal need no
+	 * write access */
+	open_wordlists((run_type == RUN_NORMAL || update_journal) ? DS_READ : DS_WRITE);
 
-    if (encoding == E_UNKNOWN)
-	encoding = E_DEFAULT;
+	if (encoding == E_UNKNOWN)
+	    encoding = E_DEFAULT;
 
-    status = bogofilter(argc - optind, argv + optind);
+	status = bogofilter(argc - optind, argv + optind);
+    }
 
     switch (status) {
     case RC_SPAM:	exitcode = EX_SPAM;	break;
@@ -27,7 +27,9 @@ AUTHORS: (C) Copyright 2003-2005 by
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "bogoreader.h"
 #include "error.h"
@@ -55,6 +57,28 @@ static bool firstline = true;		/* for mailbox /^From / match */
 
 static bool    have_message = false;
 
+/* Regular input files of at least MAP_MIN_SIZE bytes are mapped and
+ * split into lines with memchr() instead of being read through stdio
+ * one character at a time.  fpin stays open, but is not read.
+ *
+ * Reading a mapped file that has been truncated raises SIGBUS.  So
+ * only files opened read-only are mapped, and only while a read lock
+ * (fcntl) keeps out the writers that lock mailboxes, such as delivery
+ * agents and mail readers.  If one of them holds a lock, the file is
+ * read through stdio. */
+
+#define	MAP_MIN_SIZE	65536
+
+static byte   *map_base = NULL;
+static size_t  map_size = 0;
+static size_t  map_pos  = 0;
+static const byte *map_line = NULL;	/* last line, if taken from the map */
+static int     map_fd   = -1;		/* locked while mapped */
+
+static uint stride_offset = 0;		/* for bogoreader_set_stride() */
+static uint stride_count  = 1;
+static uint msg_index;
+
 /* Lexer-Reader Interface */
 
 reader_more_t *reader_more;
@@ -105,6 +129,7 @@ static sep_2_box_t sep_2_box[] = {
 
 static uint        seplen = 0;
 static const char *separator = NULL;
+static mbox_t      box_type = MBOX;
 
 static void dir_init(const char *name);
 static void dir_fini(void);
@@ -131,12 +156,14 @@ static reader_line_t *get_reader_line(FILE *fp) {
     c = fgetc(fp);
     ungetc(c, fp);
 
+    box_type = MBOX;
     for (i = 0; i < COUNTOF(sep_2_box); i += 1) {
 	sep_2_box_t *s = sep_2_box + i;
         if (s->sep[0] == c) {
             fcn = s->fcn;
 	    seplen = s->len;
 	    separator = s->sep;
+	    box_type = s->type;
 	    break;
 	}
     }
@@ -147,6 +174,136 @@ static reader_line_t *get_reader_line(FILE *fp) {
     return fcn;
 }
 
+/* set (F_RDLCK) or drop (F_UNLCK) the lock on all of \a fd, without
+ * waiting, \return 0 for success */
+static int lock_input(int fd, short type)
+{
+    struct flock lock;
+
+    lock.l_type = type;
+    lock.l_whence = (short)SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    return fcntl(fd, F_SETLK, &lock);
+}
+
+/* called before fpin is closed, so map_fd is still the mapped file */
+static void map_release(void)
+{
+    if (map_base != NULL)
+	munmap((void *)map_base, map_size);
+    if (map_fd >= 0)
+	(void)lock_input(map_fd, F_UNLCK);
+    map_base = NULL;
+    map_size = map_pos = 0;
+    map_line = NULL;
+    map_fd = -1;
+}
+
+/* map fpin from its current position on, if it is a large enough
+ * regular file; otherwise it's read through stdio */
+static void map_input(void)
+{
+    struct stat st;
+    long pos;
+    void *base;
+    int fd, flags;
+
+    map_release();
+
+    /* msgcounts.c reads msg-count files through stdio */
+    if (fpin == NULL || box_type == MC)
+	return;
+
+    fd = fileno(fpin);
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (flags & O_ACCMODE) != O_RDONLY)
+	return;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+	st.st_size < MAP_MIN_SIZE || (off_t)(size_t)st.st_size != st.st_size)
+	return;
+
+    pos = ftell(fpin);
+    if (pos < 0 || pos > st.st_size)
+	return;
+
+    /* somebody who locked the file may be about to truncate it */
+    if (lock_input(fd, F_RDLCK) != 0) {
+	if (DEBUG_READER(0))
+	    fprintf(dbgout, "%s:%d - not mapping locked input\n", __FILE__, __LINE__);
+	return;
+    }
+
+    /* it may have been truncated before we got the lock */
+    if (fstat(fd, &st) != 0 || st.st_size < MAP_MIN_SIZE || pos > st.st_size) {
+	(void)lock_input(fd, F_UNLCK);
+	return;
+    }
+
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+	(void)lock_input(fd, F_UNLCK);
+	return;
+    }
+
+#ifdef	MADV_SEQUENTIAL
+    (void)madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    map_base = (byte *)base;
+    map_size = (size_t)st.st_size;
+    map_pos  = (size_t)pos;
+    map_fd   = fd;
+
+    if (DEBUG_READER(0))
+	fprintf(dbgout, "%s:%d - mapped %lu bytes\n", __FILE__, __LINE__,
+		(unsigned long)map_size);
+}
+
+/* like buff_fgetsln(buff, fpin, maxlen), but takes the line from the
+ * mapped file if there is one */
+static int reader_fgetsln(buff_t *buff, uint maxlen)
+{
+    uint readpos = buff->t.leng;
+    const byte *start, *nl;
+    size_t len;
+
+    map_line = NULL;
+
+    if (map_base == NULL)
+	return buff_fgetsln(buff, fpin, maxlen);
+
+    if (map_pos >= map_size)
+	return EOF;
+
+    len = min(buff->size - readpos, maxlen);
+    if (len == 0) {
+	fprintf(stderr, "Invalid buffer size, exiting.\n");
+	abort();
+    }
+    len = min(len, map_size - map_pos);
+
+    start = map_base + map_pos;
+    nl = (const byte *)memchr(start, '\n', len);
+    if (nl != NULL)
+	len = nl - start + 1;
+
+    memcpy(buff->t.u.text + readpos, start, len);
+    map_pos += len;
+
+    /* the last line isn't handed out, callers may peek past its end */
+    if (map_pos < map_size)
+	map_line = start;
+
+    buff->read = readpos;
+    buff->t.leng += len;
+
+    return (int)len;
+}
+
+#define reader_fgetsl(buff) reader_fgetsln(buff, UINT_MAX)
+
 /* Checks if name is a directory.
  * Returns IS_DIR for directory, IS_FILE for other type, IS_ERR for error
  */
@@ -232,6 +389,33 @@ static bool reader__next_mail(void)
     }
 }
 
+/* read and discard the rest of the current message */
+static void skip_message(void)
+{
+    static buff_t *buff = NULL;
+
+    if (buff == NULL)
+	buff = buff_new((byte *)xmalloc(BUFSIZ+D), 0, BUFSIZ);
+
+    do {
+	buff->t.leng = buff->read = 0;
+    } while ((*reader_getline)(buff) != EOF);
+
+    bogoreader_close_ifeof();
+}
+
+/* like reader__next_mail, but only returns every stride_count'th message,
+ * beginning at stride_offset, and skips the others */
+static bool reader__next_mail_strided(void)
+{
+    while (reader__next_mail()) {
+	if (msg_index++ % stride_count == stride_offset)
+	    return true;
+	skip_message();
+    }
+    return false;
+}
+
 /* open mailstore (Maildir, mbox file or file with a single mail) and set
  * _getline and _next_mail pointers dependent on the mailstore's type.
  *
@@ -258,6 +442,7 @@ static bool open_mailstore(const char *name)
 	    msg_count_file = false;
 	    reader_getline = get_reader_line(fpin);
 	    mailstore_next_mail = mbox_mode ? mailbox_next_mail : mail_next_mail;
+	    map_input();
 	    return true;
 	}
     case IS_DIR:
@@ -301,6 +486,8 @@ static bool stdin_next_mailstore(void)
 
     mailstore_next_mail = mbox_mode ? mailbox_next_mail : mail_next_mail;
     mailstore_first = false;
+    if (val)
+	map_input();
     return val;
 }
 
@@ -423,6 +610,9 @@ static bool dir_next_mail(void)
 	if (0 == fstat(fileno(fpin), &st) && !S_ISREG(st.st_mode))
 	    continue;
 
+	box_type = MBOX;
+	map_input();
+
 	if (DEBUG_READER(0))
 	    fprintf(dbgout, "%s:%d - reading %s (%p)\n", __FILE__, __LINE__,
 		    filename, (void *)fpin);
@@ -447,10 +637,11 @@ static int mailbox_getline(buff_t *buff)
 	buff_add(buff, saved);
 	word_free(saved);
 	saved = NULL;
+	map_line = NULL;
 	return count;
     }
 
-    count = buff_fgetsl(buff, fpin);
+    count = reader_fgetsl(buff);
     have_message = false;
 
     /* XXX FIXME: do we need to unescape the >From, >>From, >>>From, ... lines
@@ -494,17 +685,18 @@ static int rmail_getline(buff_t *buff)
 	buff_add(buff, saved);
 	word_free(saved);
 	saved = NULL;
+	map_line = NULL;
 	return count;
     }
 
     if (bytesleft) {
-	count = buff_fgetsln(buff, fpin, bytesleft);
+	count = reader_fgetsln(buff, bytesleft);
 	if (count > 0)
 	    bytesleft -= count;
 	return count;
     }
 
-    count = buff_fgetsl(buff, fpin);
+    count = reader_fgetsl(buff);
     have_message = false;
 
     if (count >= (int) seplen && memcmp(separator, buf, seplen) == 0)
@@ -546,10 +738,11 @@ static int ant_getline(buff_t *buff)
 	buff_add(buff, saved);
 	word_free(saved);
 	saved = NULL;
+	map_line = NULL;
 	return count;
     }
 
-    count = buff_fgetsl(buff, fpin);
+    count = reader_fgetsl(buff);
     have_message = false;
 
     if (dot_found && count >= (int) seplen && memcmp(separator, buf, seplen) == 0)
@@ -578,7 +771,7 @@ static int ant_getline(buff_t *buff)
 /* reads a file as a single mail ( no ^From detection ). */
 static int simple_getline(buff_t *buff)
 {
-    int count = buff_fgetsl(buff, fpin);
+    int count = reader_fgetsl(buff);
 
     if (buff->t.leng < buff->size)	/* for easier debugging - removable */
 	Z(buff->t.u.text[buff->t.leng]);/* for easier debugging - removable */
@@ -621,7 +814,10 @@ static const char *get_filename(void)
 void bogoreader_init(int _argc, const char * const *_argv)
 {
     mailstore_first = mail_first = true;
-    reader_more = reader__next_mail;
+    firstline = true;			/* bogofilterd reads many inputs */
+    have_message = false;
+    msg_index = 0;
+    reader_more = (stride_count > 1) ? reader__next_mail_strided : reader__next_mail;
     fini = dummy_fini;
     switch (bulk_mode) {
     case B_NORMAL:		/* read mail (mbox) from stdin */
@@ -647,6 +843,14 @@ void bogoreader_init(int _argc, const char * const *_argv)
     reader_filename = get_filename;
 }
 
+/* select every count'th message, starting with message number offset
+ * (counting from 0), for the next bogoreader_init(), exported */
+void bogoreader_set_stride(uint offset, uint count)
+{
+    stride_offset = offset;
+    stride_count  = count;
+}
+
 /* For bogoconfig to distinguish '-I file' from '-I dir' */
 /* global reader initialization, exported */
 void bogoreader_name(const char *name)
@@ -670,12 +874,18 @@ void bogoreader_name(const char *name)
     }
 }
 
+/* where the last line is in the mapped input, exported. */
+const byte *reader_mapped_line(void)
+{
+    return map_line;
+}
+
 /* cleanup after reading a message, exported. */
 /* Only called if the passthrough code says it is ok to close the file. */
 
 void bogoreader_close_ifeof(void)
 {
-    if (fpin && feof(fpin))
+    if (fpin && (map_base != NULL ? map_pos >= map_size : feof(fpin)))
        bogoreader_close();
 }
 
@@ -688,6 +898,7 @@ void bogoreader_fini(void)
 
 static void bogoreader_close(void)
 {
+    map_release();
     if (fpin && fpin != stdin)
 	fclose(fpin);
     fpin = NULL;
@@ -17,6 +17,7 @@ extern void bogoreader_init(int argc, const char * const *argv);
 extern void bogoreader_close_ifeof(void);
 extern void bogoreader_fini(void);
 void bogoreader_name(const char *name);
+extern void bogoreader_set_stride(uint offset, uint count);
 
 /* Lexer-Reader Interface */
 
@@ -32,4 +33,9 @@ extern reader_line_t *reader_getline;
 extern reader_more_t *reader_more;
 extern reader_file_t *reader_filename;
 
+/** \return the address of the line reader_getline() returned last in
+ * the memory mapped input file, NULL if the line was not taken from
+ * there; it stays valid until bogoreader_close_ifeof() closes the file */
+extern const byte *reader_mapped_line(void);
+
 #endif
@@ -47,8 +47,11 @@ AUTHORS:
 #include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "bogotune.h"
 
@@ -60,12 +63,14 @@ AUTHORS:
 #include "longoptions.h"
 #include "msgcounts.h"
 #include "mime.h"
+#include "msgarena.h"
 #include "mxcat.h"
 #include "paths.h"
 #include "robx.h"
 #include "score.h"
 #include "token.h"
 #include "tunelist.h"
+#include "tunescore.h"
 #include "wordhash.h"
 #include "wordlists.h"
 #include "xmalloc.h"
@@ -153,6 +158,7 @@ static uint message_count;
 static wordhash_t *train;
 static tunelist_t *ns_and_sp;
 static tunelist_t *ns_msglists, *sp_msglists;
+static tunescore_t *ns_tunescore, *sp_tunescore;	/* NULL if not usable */
 
 static flhead_t *spam_files, *ham_files;
 
@@ -178,6 +184,11 @@ static double user_robx = 0.0;		/* from option '-r value' */
 static uint   coerced_target = 0;	/* user supplied with '-T value' */
 
 static uint   ncnt, nsum;		/* neighbor count and sum - for gfn() averaging */
+static uint   tune_jobs = 1;		/* from option '-j count' */
+
+static uint   scan_jobs;		/* worker processes of the current scan */
+static pid_t *scan_pids;
+static FILE **scan_in;
 
 #undef	TEST
 
@@ -383,8 +394,9 @@ static void score_ns(double *results)
 	mlhead_t *list = ns_msglists->u.sets[i];
 	mlitem_t *item;
 	for (item = list->head; item != NULL; item = item->next) {
-	    wordhash_t *wh = item->wh;
-	    double score = msg_compute_spamicity(wh);
+	    double score = (ns_tunescore != NULL)
+		? tunescore_spamicity(ns_tunescore, count)
+		: msg_compute_spamicity(item->wh);
 	    results[count++] = score;
 	    if ( -verbose == SCORE_DETAIL ||
 		(-verbose >= SCORE_DETAIL && EPS < score && score < 1 - EPS))
@@ -433,8 +445,9 @@ static void score_sp(double *results)
 	mlhead_t *list = sp_msglists->u.sets[i];
 	mlitem_t *item;
 	for (item = list->head; item != NULL; item = item->next) {
-	    wordhash_t *wh = item->wh;
-	    double score = msg_compute_spamicity(wh);
+	    double score = (sp_tunescore != NULL)
+		? tunescore_spamicity(sp_tunescore, count)
+		: msg_compute_spamicity(item->wh);
 	    results[count++] = score;
 	    if ( -verbose == SCORE_DETAIL ||
 		(-verbose >= SCORE_DETAIL && EPS < score && score < 1 - EPS))
@@ -787,6 +800,8 @@ static uint read_mailbox(const char *arg, mlhead_t *msgs)
 	
 	if (whc != whp)
 	    wordhash_free(whc);
+
+	msgarena_reset();	/* the lexer's scratch copies */
     }
 
     print_final_count();
@@ -926,6 +941,7 @@ static void help(void)
 		  "\t  -D      - don't read a wordlist file.\n"
 		  "\t  -d path - specify directory for wordlists.\n"
 		  "\t  -E      - disable ESF (effective size factor) tuning.\n"
+		  "\t  -j num  - score the parameter grid with num processes.\n"
 		  "\t  -M file - rewrite input file in message count format.\n"
 		  "\t  -r num  - specify robx value\n");
     (void)fprintf(stderr,
@@ -962,7 +978,7 @@ static int process_arglist(int argc, char **argv)
     _wildcard (&argc, &argv);	/* expand wildcards (*.*) */
 #endif
 
-#define	OPTIONS	":-:c:Cd:DeEM:n:qr:s:tT:vVx:"
+#define	OPTIONS	":-:c:Cd:DeEj:M:n:qr:s:tT:vVx:"
 
     while (1)
     {
@@ -1049,6 +1065,14 @@ int process_arg(int option, const char *name, const char *val, priority_t preced
 	esf_flag ^= true;
 	break;
 
+    case 'j':
+	tune_jobs = atoi(val);
+	if (tune_jobs < 1) {
+	    fprintf(stderr, "Invalid job count '%s'.\n", val);
+	    exit(EX_ERROR);
+	}
+	break;
+
     case 'M':
 	bogolex_file = val;
 	break;
@@ -1148,7 +1172,7 @@ static double get_robx(void)
     else if (ds_flag == DS_DSK)	{
 	printf("Calculating initial x value...\n");
 	verbose = -verbose;		/* disable bogofilter debug output */
-	rx = compute_robinson_x();
+	rx = compute_robinson_x(false);
 	verbose = -verbose;		/* enable bogofilter debug output */
     }
     else
@@ -1432,6 +1456,11 @@ static void bogotune_free(void)
     filelist_free(ham_files);
     filelist_free(spam_files);
 
+    if (ns_tunescore != NULL)
+	tunescore_free(ns_tunescore);
+    if (sp_tunescore != NULL)
+	tunescore_free(sp_tunescore);
+
     tunelist_free(ns_msglists);
     tunelist_free(sp_msglists);
     tunelist_free(ns_and_sp);
@@ -1500,6 +1529,192 @@ static bool check_msg_counts(void)
     return ok;
 }
 
+/* Parameter Grid
+**
+** Cell i of a scan is the parameter set with index i in the order of
+** nested loops over rsval, mdval, rxval, spexp and nsexp (as in gfn()).
+** With '-j', the cells are scored by worker processes, cell i by
+** worker i % scan_jobs.  Scoring keeps its state in globals, so
+** processes are used rather than threads; the message lists are shared
+** with the workers copy-on-write.  Each worker sends its result_t's
+** through a pipe and the parent reads them in cell order, so the
+** output is that of a serial scan.
+*/
+
+/** set the scoring parameters of cell \a idx and record them in \a r */
+static void set_parms(uint idx, result_t *r)
+{
+    uint i = idx;
+
+    r->nsi = i % nsexp->cnt; i /= nsexp->cnt;
+    r->spi = i % spexp->cnt; i /= spexp->cnt;
+    r->rxi = i % rxval->cnt; i /= rxval->cnt;
+    r->mdi = i % mdval->cnt; i /= mdval->cnt;
+    r->rsi = i;
+
+    robs = rsval->data[r->rsi];
+    min_dev = mdval->data[r->mdi];
+    robx = rxval->data[r->rxi];
+    spex = spexp->data[r->spi];
+    sp_esf = ESF_SEL(sp_esf, pow(0.75, spex));
+    nsex = nsexp->data[r->nsi];
+    ns_esf = ESF_SEL(ns_esf, pow(0.75, nsex));
+
+    r->idx = idx + 1;
+    r->rs = robs;
+    r->rx = robx;
+    r->md = min_dev;
+    r->sp_exp = spex;
+    r->ns_exp = nsex;
+}
+
+/** score all messages with the current parameters, set spam_cutoff and
+ * save cutoff, fp and fn in \a r */
+static void score_parms(result_t *r)
+{
+    uint fp;
+
+    spam_cutoff = 0.01;
+    score_ns(ns_scores);	/* scores in descending order */
+
+    /* Determine spam_cutoff and false_pos */
+    for (fp = target; fp < ns_cnt; fp += 1) {
+	spam_cutoff = ns_scores[fp-1];
+	if (spam_cutoff < 0.999999)
+	    break;
+	if (coerced_target != 0)
+	    break;
+    }
+    if (ns_cnt < fp)
+	fprintf(stderr,
+		"Too few false positives to determine a valid cutoff\n");
+
+    score_sp(sp_scores);	/* scores in ascending order */
+
+    r->co = spam_cutoff;
+    r->fp = fp;
+    r->fn = get_fn_count(sp_cnt, sp_scores);
+}
+
+static void scan_worker(uint offset, uint count, int fd)
+{
+    FILE *fp = fdopen(fd, "w");
+    uint i;
+
+    if (fp == NULL) {
+	fprintf(stderr, "Cannot set up worker: %s\n", strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    for (i = offset; i < count; i += scan_jobs) {
+	result_t r;
+	set_parms(i, &r);
+	score_parms(&r);
+	if (fwrite(&r, sizeof(r), 1, fp) != 1)
+	    exit(EX_ERROR);
+    }
+
+    exit(fclose(fp) == 0 ? EX_OK : EX_ERROR);
+}
+
+/** start the workers for the first \a count cells of the grid, if '-j'
+ * was given.  Score output (-vvvvv) and test mode need the scores in
+ * this process, so they are always serial. */
+static void scan_start(uint count)
+{
+    uint i;
+
+    scan_jobs = min(tune_jobs, count);
+    if (verbose >= SCORE_DETAIL)
+	scan_jobs = 1;
+#ifdef	TEST
+    if (test)
+	scan_jobs = 1;
+#endif
+    if (scan_jobs <= 1) {
+	scan_jobs = 0;
+	return;
+    }
+
+    scan_pids = (pid_t *) xcalloc(scan_jobs, sizeof(pid_t));
+    scan_in = (FILE **) xcalloc(scan_jobs, sizeof(FILE *));
+
+    fflush(NULL);	/* don't let the workers inherit buffered output */
+
+    for (i = 0; i < scan_jobs; i += 1) {
+	int fds[2];
+
+	if (pipe(fds) != 0 || (scan_pids[i] = fork()) < 0) {
+	    fprintf(stderr, "Cannot start worker: %s\n", strerror(errno));
+	    exit(EX_ERROR);
+	}
+
+	if (scan_pids[i] == 0) {
+	    uint j;
+	    for (j = 0; j < i; j += 1)
+		fclose(scan_in[j]);
+	    close(fds[0]);
+	    scan_worker(i, count, fds[1]);	/* does not return */
+	}
+
+	close(fds[1]);
+	scan_in[i] = fdopen(fds[0], "r");
+	if (scan_in[i] == NULL) {
+	    fprintf(stderr, "Cannot read from worker: %s\n", strerror(errno));
+	    exit(EX_ERROR);
+	}
+    }
+}
+
+/** score cell \a idx, whose parameters are already in \a r, or fetch
+ * its result from the worker */
+static void scan_result(uint idx, result_t *r)
+{
+    result_t w;
+
+    if (scan_jobs == 0) {
+	score_parms(r);
+	return;
+    }
+
+    if (fread(&w, sizeof(w), 1, scan_in[idx % scan_jobs]) != 1) {
+	fprintf(stderr, "Worker process failed.\n");
+	exit(EX_ERROR);
+    }
+
+    r->co = w.co;
+    r->fp = w.fp;
+    r->fn = w.fn;
+    spam_cutoff = w.co;
+}
+
+static void scan_finish(void)
+{
+    uint i;
+    bool failed = false;
+
+    if (scan_jobs == 0)
+	return;
+
+    for (i = 0; i < scan_jobs; i += 1) {
+	int ws;
+	fclose(scan_in[i]);
+	if (waitpid(scan_pids[i], &ws, 0) != scan_pids[i] ||
+	    !WIFEXITED(ws) || WEXITSTATUS(ws) != EX_OK)
+	    failed = true;
+    }
+
+    xfree(scan_in);
+    xfree(scan_pids);
+    scan_in = NULL;
+    scan_pids = NULL;
+
+    if (failed) {
+	fprintf(stderr, "Worker process failed.\n");
+	exit(EX_ERROR);
+    }
+}
+
 static void show_elapsed_time(int beg, int end, uint cnt, double val,
 			      const char *lbl1, const char *lbl2)
 {
@@ -1554,6 +1769,9 @@ static rc_t bogotune(void)
     create_countlists(ns_msglists);
     create_countlists(sp_msglists);
 
+    ns_tunescore = tunescore_new(ns_msglists);
+    sp_tunescore = tunescore_new(sp_msglists);
+
     if (verbose >= TIME && time(NULL) - end > 2) {
 	end = time(NULL);
 	show_elapsed_time(beg, end, ns_cnt + sp_cnt, (double)cnt/(end-beg), "messages", "msg/sec");
@@ -1637,8 +1855,7 @@ static rc_t bogotune(void)
     train = NULL;
 
     for (scan=0; scan <= 1 && !skip; scan ++) {
-	uint r_count;
-	uint rsi, rxi, mdi, spi, nsi;
+	uint r_count, n;
 	result_t *results, *r, *sorted;
 
 	printf("Performing %s scan:\n", scan==0 ? "coarse" : "fine");
@@ -1684,95 +1901,48 @@ static rc_t bogotune(void)
 		   "rs", "md", "rx", "spesf", "nsesf", "cutoff", "fp", "fn");
 	}
 
-	cnt = 0;
+	n = r_count;
+	if (fMakeCheck && n > cMakeCheck)
+	    n = cMakeCheck;
+
+	scan_start(n);
+
 	beg = time(NULL);
-	for (rsi = 0; rsi < rsval->cnt; rsi++) {
-	  robs = rsval->data[rsi];
-	  for (mdi = 0; mdi < mdval->cnt; mdi++) {
-	    min_dev = mdval->data[mdi];
-	    for (rxi = 0; rxi < rxval->cnt; rxi++) {
-	      robx = rxval->data[rxi];
-	      for (spi = 0; spi < spexp->cnt; spi++) {
-		spex = spexp->data[spi];
-		sp_esf = ESF_SEL(sp_esf, pow(0.75, spex));
-		for (nsi = 0; nsi < nsexp->cnt; nsi++) {
-		    uint fp, fn;
-		    nsex = nsexp->data[nsi];
-		    ns_esf = ESF_SEL(ns_esf, pow(0.75, nsex));
-
-		    /* save parms */
-		    r = &results[cnt++];
-		    r->idx = cnt;
-		    r->rsi = rsi; r->rs = robs;
-		    r->rxi = rxi; r->rx = robx;
-		    r->mdi = mdi; r->md = min_dev;
-		    r->spi = spi; r->sp_exp = spex;
-		    r->nsi = nsi; r->ns_exp = nsex;
-
-		    if (verbose >= SUMMARY) {
-			if (verbose >= SUMMARY+1)
-			    printf("%3u ", cnt);
-			if (verbose >= SUMMARY+2)
-			    printf(" %u %u %u %u %u  ",
-				rsi, mdi, rxi, spi, nsi);
-			printf("%6.4f %5.3f %5.3f %8.6f %8.6f",
-			    robs, min_dev, robx, sp_esf, ns_esf);
-			fflush(stdout);
-		    }
-
-		    spam_cutoff = 0.01;
-		    score_ns(ns_scores);	/* scores in descending order */
-
-		    /* Determine spam_cutoff and false_pos */
-		    for (fp = target; fp < ns_cnt; fp += 1) {
-			spam_cutoff = ns_scores[fp-1];
-			if (spam_cutoff < 0.999999)
-			    break;
-			if (coerced_target != 0)
-			    break;
-		    }
-		    if (ns_cnt < fp)
-			fprintf(stderr,
-				"Too few false positives to determine a valid cutoff\n");
-
-		    score_sp(sp_scores);	/* scores in ascending order */
-		    fn = get_fn_count(sp_cnt, sp_scores);
-
-		    /* save results */
-		    r->co = spam_cutoff;
-		    r->fp = fp;
-		    r->fn = fn;
-
-		    if (verbose < SUMMARY)
-			progress(cnt, r_count);
-		    else {
-			printf(" %8.6f %2u %3u\n", spam_cutoff, fp, fn);
-			fflush(stdout);
-		    }
+	for (cnt = 0; cnt < n; ) {
+	    r = &results[cnt];
+	    set_parms(cnt++, r);
+
+	    if (verbose >= SUMMARY) {
+		if (verbose >= SUMMARY+1)
+		    printf("%3u ", cnt);
+		if (verbose >= SUMMARY+2)
+		    printf(" %u %u %u %u %u  ",
+			r->rsi, r->mdi, r->rxi, r->spi, r->nsi);
+		printf("%6.4f %5.3f %5.3f %8.6f %8.6f",
+		    robs, min_dev, robx, sp_esf, ns_esf);
+		fflush(stdout);
+	    }
+
+	    scan_result(cnt-1, r);
+
+	    if (verbose < SUMMARY)
+		progress(cnt, r_count);
+	    else {
+		printf(" %8.6f %2u %3u\n", r->co, r->fp, r->fn);
+		fflush(stdout);
+	    }
 
 #ifdef	TEST
-		    if (test && spam_cutoff < 0.501) {
-			printf("co: %0.16f\n", spam_cutoff);
-			print_ns_scores(0, fp, 2);
-			print_sp_scores(fn-10, fn, 10);
-		    }
-#endif
-		    if (fMakeCheck && cnt >= cMakeCheck)
-			break;
-		}
-		if (fMakeCheck && cnt >= cMakeCheck)
-		    break;
-	      }
-	      if (fMakeCheck && cnt >= cMakeCheck)
-		  break;
+	    if (test && spam_cutoff < 0.501) {
+		printf("co: %0.16f\n", spam_cutoff);
+		print_ns_scores(0, r->fp, 2);
+		print_sp_scores(r->fn-10, r->fn, 10);
 	    }
-	    if (fMakeCheck && cnt >= cMakeCheck)
-		break;
-	  }
-	  fflush(stdout);
-	  if (fMakeCheck && cnt >= cMakeCheck)
-	      break;
+#endif
 	}
+	fflush(stdout);
+
+	scan_finish();
 
 	if (verbose >= TIME) {
 	    end = time(NULL);
@@ -23,13 +23,18 @@ AUTHORS:
 
 #include "bogoconfig.h"
 #include "bogofilter.h"
+#include "bindump.h"
 #include "bogohist.h"
 #include "bool.h"
 #include "buff.h"
+#include "bulkload.h"
 #include "configfile.h"
 #include "datastore.h"
+#include "datastore_bloom.h"
+#include "datastore_img.h"
 #include "datastore_db.h"
 #include "error.h"
+#include "journal.h"
 #include "longoptions.h"
 #include "maint.h"
 #include "msgcounts.h"
@@ -52,6 +57,7 @@ static int token_count = 0;
 
 static bool maintain = false;
 static bool onlyprint = false;
+static bool dump_binary = false;
 
 /* Function Definitions */
 
@@ -85,6 +91,9 @@ static ex_t ds_dump_hook(word_t *key, dsv_t *data,
     if (replace_nonascii_characters)
 	do_replace_nonascii_characters(key->u.text, key->leng);
 
+    if (dump_binary)
+	return bindump_write(fpo, key, data) ? EX_ERROR : EX_OK;
+
     fprintf(fpo, "%.*s %lu %lu",
 	    CLAMP_INT_MAX(key->leng), key->u.text,
 	    (unsigned long)data->spamcount,
@@ -93,8 +102,9 @@ static ex_t ds_dump_hook(word_t *key, dsv_t *data,
 	fprintf(fpo, " %lu", (unsigned long)data->date);
     fprintf(fpo, "\n");
 
-    fflush(stdout); /* solicit ferror flag if output is shorter than buffer */
-    return ferror(stdout) ? EX_ERROR : EX_OK;
+    /* a write error sets the flag when the buffer is flushed, see
+     * dump_wordlist() for the last one */
+    return ferror(fpo) ? EX_ERROR : EX_OK;
 }
 
 static ex_t dump_wordlist(bfpath *bfp)
@@ -104,10 +114,16 @@ static ex_t dump_wordlist(bfpath *bfp)
 
     token_count = 0;
 
+    if (dump_binary)
+	bindump_header(fpo);
+
     dbe = ds_init(bfp);
     rc = ds_oper(dbe, bfp, DS_READ, ds_dump_hook, NULL);
     ds_cleanup(dbe);
 
+    if (fflush(fpo) != 0 || ferror(fpo))
+	rc = EX_ERROR;
+
     if (rc != EX_OK)
 	fprintf(stderr, "error dumping tokens!\n");
     else
@@ -117,6 +133,42 @@ static ex_t dump_wordlist(bfpath *bfp)
     return rc;
 }
 
+static ex_t compile_wordlist(bfpath *bfp)
+{
+    ex_t rc;
+    void *dbe;
+
+    dbe = ds_init(bfp);
+    rc = img_compile(dbe, bfp);
+    ds_cleanup(dbe);
+
+    return rc;
+}
+
+static ex_t bloom_wordlist(bfpath *bfp)
+{
+    ex_t rc;
+    void *dbe;
+
+    dbe = ds_init(bfp);
+    rc = bloom_build(dbe, bfp);
+    ds_cleanup(dbe);
+
+    return rc;
+}
+
+static ex_t apply_journal(bfpath *bfp)
+{
+    ex_t rc;
+    void *dbe;
+
+    dbe = ds_init(bfp);
+    rc = journal_apply(dbe, bfp);
+    ds_cleanup(dbe);
+
+    return rc;
+}
+
 #define BUFSIZE 512
 const char POSIX_space[] = " \f\n\r\t\v";
 
@@ -152,6 +204,69 @@ static bool is_count(const char *in)
     return false;
 }
 
+typedef struct {
+    void *dsh;
+    bool  created;	/* nothing to add to */
+    int   rv;
+} load_t;
+
+/* writes one sorted, added up token for load_wordlist() */
+static int load_hook(const word_t *token, const dsv_t *in, void *userdata)
+{
+    load_t *ld = (load_t *) userdata;
+    dsv_t data;
+
+    memset(&data, 0, sizeof(data));
+
+    if (!ld->created) {
+	switch (ds_read(ld->dsh, token, &data)) {
+	    case 0:
+	    case 1:
+		break;
+	    default:
+		ld->rv = 1;
+	}
+    }
+
+    /* Slower, but allows multiple lists to be concatenated */
+    set_date(in->date);
+    data.spamcount += in->spamcount;
+    data.goodcount += in->goodcount;
+    if (ds_write(ld->dsh, token, &data)) ld->rv = 1;
+
+    return ld->rv;
+}
+
+/* checks one input token and passes it on to the sort; the wordlist
+ * version is kept in \a wl_version */
+static bool load_token(bulkload_t *bl, byte *buf, size_t len,
+		       dsv_t *data, YYYYMMDD today_save,
+		       dsv_t *wl_version)
+{
+    word_t token;
+
+    if (data->date == 0)			/* date as YYYYMMDD */
+	data->date = today_save;
+
+    if (replace_nonascii_characters)
+	do_replace_nonascii_characters(buf, len);
+
+    token.u.text = buf;
+    token.leng = (uint) len;
+
+    if (strcmp((const char *)buf, WORDLIST_VERSION) == 0) {
+	*wl_version = *data;
+	return false;
+    }
+
+    if (!is_count((const char *)buf)
+	|| (maintain && discard_token(&token, data)))
+	return false;
+
+    bulkload_add(bl, &token, data);
+    return true;
+}
+
 static int load_wordlist(bfpath *bfp)
 {
     void *dsh;
@@ -161,8 +276,18 @@ static int load_wordlist(bfpath *bfp)
     size_t len;
     int load_count = 0;
     unsigned long line = 0;
-    unsigned long count[IX_SIZE], date;
+    dsv_t val;
     YYYYMMDD today_save = today;
+    bool binary;
+    bindump_rec_t rec;
+    bulkload_t *bl;
+    load_t ld;
+    dsv_t wl_version;
+    /* binary records with longer keys are skipped unread: tokens are
+     * cut at max_multi_token_len, which includes the prefix, and
+     * without a limit the keys a text dump can hold are loaded */
+    u_int32_t max_key = (max_token_len != 0)
+	? max(max_token_len, max_multi_token_len) : BUFSIZE;
 
     void *dbe = ds_init(bfp);
 
@@ -172,13 +297,37 @@ static int load_wordlist(bfpath *bfp)
 	ds_open_failure(bfp, dbe);
 
     memset(buf, '\0', BUFSIZE);
+    memset(&rec, 0, sizeof(rec));
+    memset(&wl_version, 0, sizeof(wl_version));
 
     if (DST_OK != ds_txn_begin(dsh))
 	exit(EX_ERROR);
 
+    binary = bindump_detect(fpin);
+    bl = bulkload_new(false);
+
+    /* the input is sorted before it's written, see bulkload.c */
     for (;;) {
-	dsv_t data;
-	word_t *token;
+	if (binary) {
+	    int r = bindump_read(fpin, &rec, max_key);
+	    if (r <= 0) {
+		if (r < 0) {
+		    fprintf(stderr, "%s: truncated binary dump.\n", progname);
+		    rv = 1;
+		}
+		break;
+	    }
+
+	    if (max_token_len != 0 &&
+		rec.key.leng > max_token_len)
+		continue;		/* too long - discard */
+
+	    if (load_token(bl, rec.key.u.text, rec.key.leng,
+			   &rec.val, today_save, &wl_version))
+		load_count += 1;
+	    continue;
+	}
+
 	if (fgets((char *)buf, BUFSIZE, fpin) == NULL) {
 	    if (ferror(fpin)) {
 		perror(progname);
@@ -202,17 +351,17 @@ static int load_wordlist(bfpath *bfp)
 	    len > max_token_len)
 	    continue;		/* too long - discard */
 
-	spamcount = (uint) atoi((const char *)p);
-	if ((int) spamcount < 0)
-	    spamcount = 0;
+	val.spamcount = (uint) atoi((const char *)p);
+	if ((int) val.spamcount < 0)
+	    val.spamcount = 0;
 	p = spanword(p);
 
-	goodcount = (uint) atoi((const char *)p);
-	if ((int) goodcount < 0)
-	    goodcount = 0;
+	val.goodcount = (uint) atoi((const char *)p);
+	if ((int) val.goodcount < 0)
+	    val.goodcount = 0;
 	p = spanword(p);
 
-	date = (uint) atoi((const char *)p);
+	val.date = (uint) atoi((const char *)p);
 	p = spanword(p);
 
 	if (*p != '\0') {
@@ -224,36 +373,30 @@ static int load_wordlist(bfpath *bfp)
 	    break;
 	}
 
-	if (date == 0)				/* date as YYYYMMDD */
-	    date = today_save;
-
-	if (replace_nonascii_characters)
-	    do_replace_nonascii_characters(buf, len);
- 
- 	token = word_new(buf, len);
-	data.goodcount = goodcount;
-	data.spamcount = spamcount;
-	data.date = date;
-
-	if (is_count((const char *)buf)
-		&& !(maintain && discard_token(token, &data))) {
+	if (load_token(bl, buf, len, &val, today_save, &wl_version))
 	    load_count += 1;
-	    /* Slower, but allows multiple lists to be concatenated */
-	    set_date(date);
-	    switch (ds_read(dsh, token, &data)) {
-		case 0:
-		case 1:
-		    break;
-		default:
-		    rv = 1;
-	    }
-	    data.spamcount += spamcount;
-	    data.goodcount += goodcount;
-	    if (ds_write(dsh, token, &data)) rv = 1;
-	}
-	word_free(token);
     }
 
+    bindump_rec_free(&rec);
+
+    ld.dsh = dsh;
+    ld.created = ds_created(dsh);
+    ld.rv = 0;
+
+    /* a new wordlist gets the version of the dump, which decides how
+     * its values are written; without one, they get the old encoding */
+    if (rv == 0 && ld.created && wl_version.spamcount != 0 &&
+	ds_set_wordlist_version(dsh, &wl_version) != 0)
+	rv = 1;
+
+    if (rv == 0 && bulkload_finish(bl, load_hook, &ld) != 0)
+	rv = 1;
+    bulkload_free(bl);
+
+    /* the loaded counts aren't in the robx statistics */
+    if (rv == 0 && robx_stats_delete(dsh) != 0)
+	rv = 1;
+
     if (rv) {
 	fprintf(stderr, "read or write error, aborting.\n");
 	ds_txn_abort(dsh);
@@ -420,7 +563,7 @@ static ex_t get_robx(bfpath *bfp)
     int ret = 0;
 
     init_wordlist("word", bfp->filepath, 0, WL_REGULAR);
-    rx = compute_robinson_x();
+    rx = compute_robinson_x(!onlyprint);
     if (rx < 0)
 	return EX_ERROR;
 
@@ -455,6 +598,77 @@ static ex_t get_robx(bfpath *bfp)
     return ret ? EX_ERROR : EX_OK;
 }
 
+/* recomputes the robx statistics at their base counts and compares */
+static ex_t verify_robx(bfpath *bfp)
+{
+    void *dbe, *dsh;
+    robx_stats_t stored, scan;
+    dsv_t msgcnts;
+    double rx_stored, rx_scan;
+    ex_t ec = EX_OK;
+
+    dbe = ds_init(bfp);
+    dsh = ds_open(dbe, bfp, DS_READ);
+    if (dsh == NULL)
+	/* print error, cleanup, and exit */
+	ds_open_failure(bfp, dbe);
+
+    if (DST_OK != ds_txn_begin(dsh)) {
+	ds_close(dsh);
+	ds_cleanup(dbe);
+	fprintf(stderr, "Cannot begin transaction.\n");
+	return EX_ERROR;
+    }
+
+    switch (robx_stats_read(dsh, &stored)) {
+    case 0:
+	scan = stored;
+	if (robx_stats_scan(dsh, &scan) != 0) {
+	    fprintf(stderr, "%s: cannot read wordlist.\n", bfp->filepath);
+	    ec = EX_ERROR;
+	    break;
+	}
+
+	if (!robx_stats_value(&stored, stored.base[IX_SPAM], stored.base[IX_GOOD], &rx_stored))
+	    rx_stored = 0.0;
+	if (!robx_stats_value(&scan, scan.base[IX_SPAM], scan.base[IX_GOOD], &rx_scan))
+	    rx_scan = 0.0;
+
+	printf("base:    %lu spam, %lu good messages\n",
+	       (unsigned long)stored.base[IX_SPAM], (unsigned long)stored.base[IX_GOOD]);
+	printf("stored:  %lu tokens, robx %f\n", (unsigned long)stored.count, rx_stored);
+	printf("scanned: %lu tokens, robx %f\n", (unsigned long)scan.count, rx_scan);
+
+	if (stored.count != scan.count || stored.sum != scan.sum ||
+	    stored.slope != scan.slope) {
+	    printf("robx statistics have drifted, run %s -R to renew them.\n", progname);
+	    ec = EX_ERROR;
+	}
+	else if (ds_get_msgcounts(dsh, &msgcnts) == 0 &&
+		 !robx_stats_value(&stored, msgcnts.spamcount, msgcnts.goodcount, &rx_stored))
+	    printf("robx statistics are correct, but the message counts have moved on;\n"
+		   "run %s -R to renew them.\n", progname);
+	else
+	    printf("robx statistics are correct.\n");
+	break;
+    case 1:
+	printf("%s: no robx statistics, %s -R takes them.\n", bfp->filepath, progname);
+	break;
+    default:
+	fprintf(stderr, "%s: cannot read robx statistics.\n", bfp->filepath);
+	ec = EX_ERROR;
+    }
+
+    if (DST_OK != ds_txn_commit(dsh)) {
+	fprintf(stderr, "Cannot commit transaction.\n");
+	ec = EX_ERROR;
+    }
+    ds_close(dsh);
+    ds_cleanup(dbe);
+
+    return ec;
+}
+
 static void print_version(void)
 {
     (void)fprintf(stdout,
@@ -476,7 +690,9 @@ static void usage(FILE *fp)
     fprintf(fp, "Usage: %s {-h|-V}\n", progname);
     fprintf(fp, "   or: %s [OPTIONS] {-d|-l|-u|-m|-w|-p|--db-verify} file%s\n",
 	    progname, DB_EXT);
-    fprintf(fp, "   or: %s [OPTIONS] {-H|-r|-R} file\n", progname);
+    fprintf(fp, "   or: %s [OPTIONS] {-H|-r|-R|--verify-robx} file\n", progname);
+    fprintf(fp, "   or: %s [OPTIONS] {--compile|--bloom|--apply-journal} file%s\n",
+	    progname, DB_EXT);
 #if defined (ENABLE_DB_DATASTORE) || defined (ENABLE_SQLITE_DATASTORE)
     fprintf(fp, "   or: %s [OPTIONS] {--db-print-leafpage-count} file%s\n",
 	    progname, DB_EXT);
@@ -513,8 +729,12 @@ static const char *help_text[] = {
     "  -V, --version               - print version information and exit.\n",
     "\n",
     "  -d, --dump=file             - dump data from file to stdout.\n",
+    "      --binary                - dump in binary format, -l reads both.\n",
     "  -l, --load=file             - load data from stdin into file.\n",
     "  -u, --upgrade=file          - upgrade wordlist version.\n",
+    "      --compile=file          - write read-only image file.img for bogofilter.\n",
+    "      --bloom=file            - write filter file.bloom of the tokens in file.\n",
+    "      --apply-journal=file    - merge registrations from file.jnl into file.\n",
     "\n",
 
     "info options:\n",
@@ -526,6 +746,7 @@ static const char *help_text[] = {
     "                                - use with -vv to exclude pure spam/ham.\n",
     "  -r file                     - compute Robinson's X for the specified file.\n",
     "  -R file                     - compute Robinson's X and save it in wordlist.\n",
+    "      --verify-robx=file      - check the stored robx statistics against the tokens.\n",
     "\n",
 
     "database maintenance, the \"-m file\" option is required in this group:\n",
@@ -535,6 +756,11 @@ static const char *help_text[] = {
     "  -c cnt                      - exclude tokens with lower counts.\n",
     "  -s l,h                      - exclude tokens with lengths between 'l' and 'h'\n"
     "                                (low and high).\n",
+    "      --compact               - write the result to a new file and rename it\n"
+    "                                over the wordlist (also with -u).\n",
+    "      --hash-keys=yes/names/no - key wordlists created by -l or --compact by\n"
+    "                                64 bit token fingerprints (names: keep the\n"
+    "                                token texts in a side table; no: by text).\n",
 #ifndef	DISABLE_UNICODE
     "  --unicode=yes/no            - convert wordlist to/from unicode\n",
 #endif
@@ -581,6 +807,12 @@ static struct option longopts_bogoutil[] = {
     LONGOPTIONS_LEX_UTIL
 
     /* bogoutil specific options */
+    { "binary",				N, 0, O_BINARY },
+    { "bloom",				R, 0, O_BLOOM },
+    { "compact",			N, 0, O_COMPACT },
+    { "compile",			R, 0, O_COMPILE },
+    { "hash-keys",			R, 0, O_HASH_KEYS },
+    { "apply-journal",			R, 0, O_APPLY_JOURNAL },
     { "db-prune",                       R, 0, O_DB_PRUNE },
     { "db-checkpoint",                  R, 0, O_DB_CHECKPOINT },
     { "db-list-logfiles",               R, 0, O_DB_LIST_LOGFILES },
@@ -590,6 +822,7 @@ static struct option longopts_bogoutil[] = {
     { "db-recover-harder",              R, 0, O_DB_RECOVER_HARDER },
     { "db-remove-environment",		R, 0, O_DB_REMOVE_ENVIRONMENT },
     { "db-verify",                      R, 0, O_DB_VERIFY },
+    { "verify-robx",			R, 0, O_VERIFY_ROBX },
 
     /* end of list */
     { NULL,				0, 0, 0 }
@@ -822,12 +1055,51 @@ int process_arg(int option, const char *name, const char *val, priority_t preced
 	dbgout = stdout;
 	break;
 
+    case O_BINARY:
+	dump_binary = true;
+	break;
+
+    case O_COMPACT:
+	compact_maintenance = true;
+	break;
+
+    case O_HASH_KEYS:
+	if (strcmp(val, "names") == 0)
+	    key_hash = KH_NAMES;
+	else
+	    key_hash = str_to_bool(val) ? KH_HASHED : KH_NONE;
+	break;
+
+    case O_COMPILE:
+	flag = M_COMPILE;
+	count += 1;
+	ds_file = val;
+	break;
+
+    case O_BLOOM:
+	flag = M_BLOOM;
+	count += 1;
+	ds_file = val;
+	break;
+
+    case O_APPLY_JOURNAL:
+	flag = M_APPLY_JOURNAL;
+	count += 1;
+	ds_file = val;
+	break;
+
     case O_DB_VERIFY:
 	flag = M_VERIFY;
 	count += 1;
 	ds_file = val;
 	break;
 
+    case O_VERIFY_ROBX:
+	flag = M_VERIFY_ROBX;
+	count += 1;
+	ds_file = val;
+	break;
+
     case O_UNICODE:
 	encoding = str_to_bool(val) ? E_UNICODE : E_RAW;
 	break;
@@ -867,9 +1139,13 @@ static bfpath_mode get_mode(cmd_t cmd)
 	mode = BFP_MAY_CREATE;
 	break;
     case M_DUMP:
+    case M_COMPILE:
+    case M_BLOOM:
+    case M_APPLY_JOURNAL:
     case M_HIST:
     case M_MAINTAIN:
     case M_ROBX:
+    case M_VERIFY_ROBX:
     case M_VERIFY:
     case M_WORD:
     case M_CHECKPOINT:	/* database transaction/integrity operations */
@@ -998,6 +1274,15 @@ int main(int argc, char *argv[])
 	case M_DUMP:
 	    rc = dump_wordlist(bfp);
 	    break;
+	case M_COMPILE:
+	    rc = compile_wordlist(bfp);
+	    break;
+	case M_BLOOM:
+	    rc = bloom_wordlist(bfp);
+	    break;
+	case M_APPLY_JOURNAL:
+	    rc = apply_journal(bfp);
+	    break;
 	case M_LOAD:
 	    rc = load_wordlist(bfp) ? EX_ERROR : EX_OK;
 	    break;
@@ -1016,6 +1301,9 @@ int main(int argc, char *argv[])
 	case M_ROBX:
 	    rc = get_robx(bfp);
 	    break;
+	case M_VERIFY_ROBX:
+	    rc = verify_robx(bfp);
+	    break;
 	case M_NONE:
 	default:
 	    /* should have been handled above */
@@ -0,0 +1,315 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bulkload.c -- sorting tokens for bogoutil's load and maintenance
+
+   "bogoutil -l" used to read and write the wordlist once per input
+   line, in input order.  Now the input is sorted by token first and
+   the counts of repeated tokens are added up, so each token is
+   written once and the database sees its keys in ascending order,
+   which B-tree backends handle best.
+
+   Tokens are collected in memory up to BULK_MEM bytes, sorted and, if
+   there is more input, written to a temporary file as a sorted run in
+   the record format of bindump.c.  bulkload_finish() merges the runs.
+   Equal tokens of one run are combined when the run is sorted; those
+   of different runs while merging, and as the runs are in input
+   order, the date of the token's last input line is kept - or, for
+   maintenance, the newest date.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bindump.h"
+#include "bulkload.h"
+#include "xmalloc.h"
+
+#define	BULK_MEM	(64 * 1024 * 1024)	/* bytes per sort run */
+#define	POOL_SIZE	(1024 * 1024)		/* bytes per key pool */
+
+typedef struct {
+    word_t	key;
+    dsv_t	val;
+    uint	seq;		/* input order */
+} entry_t;
+
+typedef struct pool_s pool_t;
+struct pool_s {
+    pool_t	*next;
+    size_t	 used;
+    size_t	 size;
+    byte	 data[1];
+};
+
+typedef struct {
+    FILE	  *fp;
+    bindump_rec_t  rec;
+} sortrun_t;
+
+struct bulkload_s {
+    entry_t	*entry;
+    uint	 count;
+    uint	 size;
+    pool_t	*pools;
+    size_t	 mem;
+    sortrun_t	*run;
+    uint	 runs;
+    uint	 max_leng;	/* of the keys added */
+    bool	 newest;	/* keep the newest date, not the last one */
+};
+
+/* Function Definitions */
+
+bulkload_t *bulkload_new(bool newest_date)
+{
+    bulkload_t *bl = (bulkload_t *) xcalloc(1, sizeof(bulkload_t));
+    bl->newest = newest_date;
+    return bl;
+}
+
+/** add the counts of a later record of the same token */
+static void combine(const bulkload_t *bl, dsv_t *val, const dsv_t *next)
+{
+    val->spamcount += next->spamcount;
+    val->goodcount += next->goodcount;
+    val->date = bl->newest ? max(val->date, next->date) : next->date;
+}
+
+static byte *pool_copy(bulkload_t *bl, const byte *text, uint leng)
+{
+    pool_t *p = bl->pools;
+    byte *t;
+
+    if (p == NULL || p->size - p->used < leng + D) {
+	size_t size = max(POOL_SIZE, leng + D);
+	p = (pool_t *) xmalloc(sizeof(pool_t) + size);
+	p->next = bl->pools;
+	p->used = 0;
+	p->size = size;
+	bl->pools = p;
+	bl->mem += size;
+    }
+
+    t = p->data + p->used;
+    memcpy(t, text, leng);
+    Z(t[leng]);
+    p->used += leng + D;
+
+    return t;
+}
+
+static void pools_free(bulkload_t *bl)
+{
+    pool_t *p, *next;
+
+    for (p = bl->pools; p != NULL; p = next) {
+	next = p->next;
+	xfree(p);
+    }
+    bl->pools = NULL;
+    bl->mem = 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const entry_t *e1 = (const entry_t *) a;
+    const entry_t *e2 = (const entry_t *) b;
+    int c = word_cmp(&e1->key, &e2->key);
+
+    if (c != 0)
+	return c;
+    return (e1->seq > e2->seq) - (e1->seq < e2->seq);
+}
+
+/** sort the entries in memory and combine equal tokens */
+static void sort_entries(bulkload_t *bl)
+{
+    uint i, n = 0;
+
+    qsort(bl->entry, bl->count, sizeof(entry_t), entry_cmp);
+
+    for (i = 0; i < bl->count; i += 1) {
+	entry_t *e = &bl->entry[i];
+	if (n > 0 && word_cmp(&bl->entry[n-1].key, &e->key) == 0)
+	    combine(bl, &bl->entry[n-1].val, &e->val);
+	else
+	    bl->entry[n++] = *e;
+    }
+
+    bl->count = n;
+}
+
+/** write the entries as a sorted run and start over */
+static void spill_run(bulkload_t *bl)
+{
+    FILE *fp = tmpfile();
+    uint i;
+
+    if (fp == NULL) {
+	fprintf(stderr, "%s: cannot create temporary file: %s\n",
+		progname, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    sort_entries(bl);
+
+    for (i = 0; i < bl->count; i += 1)
+	if (bindump_write(fp, &bl->entry[i].key, &bl->entry[i].val) != 0)
+	    break;
+
+    if (i < bl->count || fflush(fp) != 0 || fseek(fp, 0L, SEEK_SET) != 0) {
+	fprintf(stderr, "%s: cannot write temporary file: %s\n",
+		progname, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    bl->run = (sortrun_t *) xrealloc(bl->run, (bl->runs + 1) * sizeof(sortrun_t));
+    memset(&bl->run[bl->runs], 0, sizeof(sortrun_t));
+    bl->run[bl->runs++].fp = fp;
+
+    bl->count = 0;
+    pools_free(bl);
+}
+
+void bulkload_add(bulkload_t *bl, const word_t *token, const dsv_t *val)
+{
+    entry_t *e;
+
+    if (bl->mem >= BULK_MEM)
+	spill_run(bl);
+
+    if (bl->count == bl->size) {
+	bl->size = bl->size ? bl->size * 2 : 65536;
+	bl->entry = (entry_t *) xrealloc(bl->entry, bl->size * sizeof(entry_t));
+    }
+
+    e = &bl->entry[bl->count];
+    bl->max_leng = max(bl->max_leng, token->leng);
+    e->key.leng = token->leng;
+    e->key.u.text = pool_copy(bl, token->u.text, token->leng);
+    e->val = *val;
+    e->seq = bl->count++;
+    bl->mem += sizeof(entry_t);
+}
+
+/* merge heap of run indices, ordered by current token, then run */
+
+static bool run_less(bulkload_t *bl, uint a, uint b)
+{
+    int c = word_cmp(&bl->run[a].rec.key, &bl->run[b].rec.key);
+    return c < 0 || (c == 0 && a < b);
+}
+
+static void heap_down(bulkload_t *bl, uint *heap, uint n, uint i)
+{
+    for (;;) {
+	uint l = 2 * i + 1, m = i, t;
+	if (l < n && run_less(bl, heap[l], heap[m]))
+	    m = l;
+	if (l + 1 < n && run_less(bl, heap[l + 1], heap[m]))
+	    m = l + 1;
+	if (m == i)
+	    break;
+	t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+	i = m;
+    }
+}
+
+static int merge_runs(bulkload_t *bl, bulkload_hook_t *hook, void *userdata)
+{
+    uint *heap = (uint *) xcalloc(bl->runs, sizeof(uint));
+    uint i, n = 0;
+    bindump_rec_t cur;
+    bool have = false;
+    int rc = 0;
+
+    memset(&cur, 0, sizeof(cur));
+
+    for (i = 0; i < bl->runs; i += 1) {
+	int r = bindump_read(bl->run[i].fp, &bl->run[i].rec, bl->max_leng);
+	if (r < 0)
+	    rc = -1;
+	if (r > 0)
+	    heap[n++] = i;
+    }
+    for (i = n / 2; i-- > 0; )
+	heap_down(bl, heap, n, i);
+
+    while (rc == 0 && n > 0) {
+	sortrun_t *run = &bl->run[heap[0]];
+	int r;
+
+	if (have && word_cmp(&cur.key, &run->rec.key) == 0)
+	    combine(bl, &cur.val, &run->rec.val);
+	else {
+	    if (have)
+		rc = (*hook)(&cur.key, &cur.val, userdata);
+	    if (run->rec.key.leng + D > cur.size) {
+		cur.size = run->rec.key.leng + D;
+		cur.key.u.text = (byte *) xrealloc(cur.key.u.text, cur.size);
+	    }
+	    memcpy(cur.key.u.text, run->rec.key.u.text, run->rec.key.leng);
+	    cur.key.leng = run->rec.key.leng;
+	    cur.val = run->rec.val;
+	    have = true;
+	}
+
+	r = bindump_read(run->fp, &run->rec, bl->max_leng);
+	if (r < 0)
+	    rc = -1;
+	if (r <= 0)
+	    heap[0] = heap[--n];
+	heap_down(bl, heap, n, 0);
+    }
+
+    if (rc == 0 && have)
+	rc = (*hook)(&cur.key, &cur.val, userdata);
+
+    bindump_rec_free(&cur);
+    xfree(heap);
+
+    return rc;
+}
+
+int bulkload_finish(bulkload_t *bl, bulkload_hook_t *hook, void *userdata)
+{
+    int rc = 0;
+    uint i;
+
+    if (bl->runs == 0) {
+	/* everything fit into memory */
+	sort_entries(bl);
+	for (i = 0; rc == 0 && i < bl->count; i += 1)
+	    rc = (*hook)(&bl->entry[i].key, &bl->entry[i].val, userdata);
+    }
+    else {
+	if (bl->count > 0)
+	    spill_run(bl);
+	rc = merge_runs(bl, hook, userdata);
+    }
+
+    return rc;
+}
+
+void bulkload_free(bulkload_t *bl)
+{
+    uint i;
+
+    for (i = 0; i < bl->runs; i += 1) {
+	fclose(bl->run[i].fp);
+	bindump_rec_free(&bl->run[i].rec);
+    }
+    xfree(bl->run);
+    xfree(bl->entry);
+    pools_free(bl);
+    xfree(bl);
+}
+
+/* End */
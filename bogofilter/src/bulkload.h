@@ -0,0 +1,38 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bulkload.h -- sorting tokens for bogoutil's load and maintenance
+
+******************************************************************************/
+
+#ifndef	BULKLOAD_H
+#define	BULKLOAD_H
+
+#include "datastore.h"
+#include "word.h"
+
+typedef struct bulkload_s bulkload_t;
+
+/** Callback of bulkload_finish(). \return 0 to go on, else to stop */
+typedef int bulkload_hook_t(const word_t *token, const dsv_t *val,
+			    void *userdata);
+
+/** \a newest_date: combined tokens get the newest of their dates
+ * instead of the date of their last bulkload_add() call */
+extern bulkload_t *bulkload_new(bool newest_date);
+
+/** Add one token with its counts and date; exits if a sort run cannot
+ * be written. */
+extern void bulkload_add(bulkload_t *bl, const word_t *token, const dsv_t *val);
+
+/** Call \a hook once per distinct token, in word_cmp() order, with the
+ * counts of all its bulkload_add() calls added up and the date of the
+ * last (or newest) one.  \return the first non-zero value the hook returned, or -1
+ * if a sort run could not be read, else 0 */
+extern int bulkload_finish(bulkload_t *bl, bulkload_hook_t *hook, void *userdata);
+
+extern void bulkload_free(/*@only@*/ bulkload_t *bl);
+
+#endif	/* BULKLOAD_H */
@@ -10,6 +10,7 @@
 #include "charset.h"
 #include "mime.h"
 #include "wordhash.h"
+#include "timing.h"
 #include "token.h"
 
 #include "collect.h"
@@ -50,6 +51,8 @@ void collect_words(wordhash_t *wh)
 	if (cls == NONE)
 	    break;
 
+	TIMING_COUNT(TC_TOKENS, 1);
+
 	if (cls == BOGO_LEX_LINE)
 	{
 	    char *beg = (char *)token.u.text+1;	/* skip leading quote mark */
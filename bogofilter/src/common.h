@@ -71,7 +71,8 @@ typedef enum sh_e { IX_SPAM = 0, 	/* index for SPAM */
 
 typedef unsigned char byte;
 
-enum dbmode_e { DS_READ = 1, DS_WRITE = 2, DS_LOAD = 8 };
+enum dbmode_e { DS_READ = 1, DS_WRITE = 2, DS_LOAD = 8,
+	       DS_IMAGE = 16 };	/* DS_READ may use a compiled image */
 typedef enum dbmode_e dbmode_t;
 
 #define BIT(n)	(1 << n)
@@ -170,17 +171,18 @@ extern void bf_exit(void);
 
 typedef enum e_wordlist_version {
     ORIGINAL_VERSION = 0,
-    IP_PREFIX = 20040500	/* when IP prefixes were added */
+    IP_PREFIX = 20040500,	/* when IP prefixes were added */
+    PACKED_VALUES = 20261000	/* when values got the compact encoding */
 } t_wordlist_version;
 
-#define	CURRENT_VERSION	IP_PREFIX
+#define	CURRENT_VERSION	PACKED_VALUES
 
 /* for bogoutil.c and datastore_db_trans.c */
 
 typedef enum { M_NONE, M_DUMP, M_LOAD, M_WORD, M_MAINTAIN, M_ROBX, M_HIST,
     M_LIST_LOGFILES, M_LEAFPAGES,
     M_RECOVER, M_CRECOVER, M_PURGELOGS, M_VERIFY, M_REMOVEENV, M_CHECKPOINT,
-    M_PAGESIZE }
+    M_PAGESIZE, M_COMPILE, M_APPLY_JOURNAL, M_VERIFY_ROBX, M_BLOOM }
     cmd_t;
 
 #endif
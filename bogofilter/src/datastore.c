@@ -15,6 +15,7 @@ David Relson <relson@osagesoftware.com>  2003
 #include "common.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -22,11 +23,14 @@ David Relson <relson@osagesoftware.com>  2003
 #include "datastore.h"
 #include "datastore_db.h"
 #include "datastore_db_private.h"
+#include "datastore_bloom.h"
+#include "datastore_img.h"
 
 #include "error.h"
 #include "maint.h"
 #include "rand_sleep.h"
 #include "swap.h"
+#include "timing.h"
 #include "word.h"
 #include "xmalloc.h"
 
@@ -34,6 +38,15 @@ David Relson <relson@osagesoftware.com>  2003
 
 YYYYMMDD today;			/* date as YYYYMMDD */
 
+e_key_hash key_hash = KH_DEFAULT;	/* key storage of new wordlists */
+
+static word_t  *msg_count_tok;
+static word_t  *wordlist_version_tok;
+static word_t  *wordlist_encoding_tok;
+static word_t  *key_hash_tok;
+static word_t  *generation_tok;
+static word_t  *journal_tok;
+
 /* OO function list */
 
 static dsm_t dsm_dummies = {
@@ -61,7 +74,9 @@ static dsm_t dsm_dummies = {
     NULL,	/* dsm_remove           */
     NULL,	/* dsm_verify           */
     NULL,	/* dsm_list_logfiles    */
-    NULL	/* dsm_leafpages        */
+    NULL,	/* dsm_leafpages        */
+    NULL,	/* dsm_prepare_replace  */
+    NULL	/* dsm_replace          */
 };
 
 /* Function definitions */
@@ -94,11 +109,162 @@ void set_today(void)
     today = time_to_date(0);
 }
 
+/* Compact value encoding, written to wordlists of version
+ * PACKED_VALUES and newer:
+ *
+ *	spam count, good count [, date]
+ *
+ * as unsigned varints of 7 bits per byte, low bits first, so they
+ * don't depend on the byte order.  The date is given as day number,
+ * counted from DATE_BASE as day 1, or as DATE_RAW plus its YYYYMMDD
+ * value if it isn't a valid date from DATE_BASE on.
+ *
+ * Values in the fixed encoding always have a multiple of 4 bytes, so
+ * a compact value of such a length gets a trailing zero byte.  Each
+ * value is decoded according to its length, and a wordlist may hold
+ * both kinds.  The fixed encoding is written where it is not longer.
+ */
+
+#define	DATE_BASE	20000101
+#define	DATE_RAW	(1UL << 22)	/* after day number of 9999-12-31 */
+
+/** \return the day number of \a date counted from 0000-03-01, or -1
+ * if it isn't a valid date */
+static long date_to_days(YYYYMMDD date)
+{
+    static const int mdays[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    long y = date / 10000, m = date / 100 % 100, d = date % 100;
+
+    if (m < 1 || m > 12 || d < 1 || d > mdays[m - 1])
+	return -1;
+    if (m == 2 && d == 29 && !(y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)))
+	return -1;
+
+    /* the year begins in March, leap days come last */
+    if (m <= 2) {
+	y -= 1;
+	m += 12;
+    }
+    return 365 * y + y / 4 - y / 100 + y / 400 + (153 * (m - 3) + 2) / 5 + d - 1;
+}
+
+/** \return the date of day number \a n counted from 0000-03-01 */
+static YYYYMMDD days_to_date(long n)
+{
+    long era = n / 146097, doe = n % 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    long y = era * 400 + yoe;
+    long m = mp < 10 ? mp + 3 : mp - 9;
+    long d = doy - (153 * mp + 2) / 5 + 1;
+
+    if (m <= 2)
+	y += 1;
+    return (YYYYMMDD) (y * 10000 + m * 100 + d);
+}
+
+/** store the code for \a date in \a code, \return false if there is
+ * none */
+static bool date_code(YYYYMMDD date, u_int32_t *code)
+{
+    long days = (date >= DATE_BASE && date <= 99991231) ? date_to_days(date) : -1;
+
+    if (days >= 0)
+	*code = (u_int32_t) (days - date_to_days(DATE_BASE) + 1);
+    else if (date <= 0xffffffffUL - DATE_RAW)
+	*code = (u_int32_t) (DATE_RAW + date);
+    else
+	return false;
+    return true;
+}
+
+static YYYYMMDD code_date(u_int32_t code)
+{
+    if (code == 0)
+	return 0;
+    if (code >= DATE_RAW)
+	return code - DATE_RAW;
+    return days_to_date(date_to_days(DATE_BASE) + code - 1);
+}
+
+static byte *put_varint(byte *p, u_int32_t v)
+{
+    while (v >= 0x80) {
+	*p++ = (byte) (v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (byte) v;
+    return p;
+}
+
+/** read the varint at \a p into \a v, 0 if it runs past \a end,
+ * \return the position after it */
+static const byte *get_varint(const byte *p, const byte *end, u_int32_t *v)
+{
+    u_int32_t r = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 35; shift += 7) {
+	byte b = *p++;
+	r |= (u_int32_t) (b & 0x7f) << shift;
+	if ((b & 0x80) == 0) {
+	    *v = r;
+	    return p;
+	}
+    }
+    *v = 0;
+    return end;
+}
+
+/** encode \a in_data compactly into \a buf, \return its length, or 0
+ * if it wouldn't be shorter than \a size */
+static u_int32_t pack_value(const dsv_t *in_data, bool dated, byte *buf, u_int32_t size)
+{
+    byte tmp[16];
+    byte *p = tmp;
+    u_int32_t code, n;
+
+    p = put_varint(p, in_data->spamcount);
+    p = put_varint(p, in_data->goodcount);
+    if (dated) {
+	if (!date_code(in_data->date, &code))
+	    return 0;
+	p = put_varint(p, code);
+    }
+
+    n = p - tmp;
+    if (n % sizeof(uint32_t) == 0)
+	tmp[n++] = 0;
+    if (n >= size)
+	return 0;
+
+    memcpy(buf, tmp, n);
+    return n;
+}
+
+static void unpack_value(const dbv_t *ex_data, dsv_t *in_data)
+{
+    const byte *p = (const byte *)ex_data->data;
+    const byte *end = p + ex_data->leng;
+    u_int32_t code;
+
+    p = get_varint(p, end, &in_data->spamcount);
+    p = get_varint(p, end, &in_data->goodcount);
+    (void) get_varint(p, end, &code);
+    in_data->date = code_date(code);
+}
+
 static void convert_external_to_internal(dsh_t *dsh, dbv_t *ex_data, dsv_t *in_data)
 {
     size_t i = 0;
     uint32_t *cv = (uint32_t *)ex_data->data;
 
+    if (ex_data->leng % sizeof(uint32_t) != 0) {
+	unpack_value(ex_data, in_data);
+	return;
+    }
+
     in_data->spamcount = !dsh->is_swapped ? cv[i++] : swap_32bit(cv[i++]);
 
     if (ex_data->leng <= i * sizeof(uint32_t))
@@ -118,6 +284,14 @@ static void convert_internal_to_external(dsh_t *dsh, dsv_t *in_data, dbv_t *ex_d
 {
     size_t i = 0;
     uint32_t *cv = (uint32_t *)ex_data->data;
+    bool dated = timestamp_tokens && in_data->date != 0;
+
+    if (dsh->packed) {
+	ex_data->leng = pack_value(in_data, dated, (byte *)ex_data->data,
+				   (dated ? 3 : 2) * sizeof(cv[0]));
+	if (ex_data->leng != 0)
+	    return;
+    }
 
     /* Writing requires extra magic since the counts may need to be
     ** separated for output to different wordlists.
@@ -126,7 +300,7 @@ static void convert_internal_to_external(dsh_t *dsh, dsv_t *in_data, dbv_t *ex_d
     cv[i++] = !dsh->is_swapped ? in_data->spamcount : swap_32bit(in_data->spamcount);
     cv[i++] = !dsh->is_swapped ? in_data->goodcount : swap_32bit(in_data->goodcount);
 
-    if (timestamp_tokens && in_data->date != 0)
+    if (dated)
 	cv[i++] = !dsh->is_swapped ? in_data->date : swap_32bit(in_data->date);
 
     ex_data->leng = i * sizeof(cv[0]);
@@ -134,11 +308,127 @@ static void convert_internal_to_external(dsh_t *dsh, dsv_t *in_data, dbv_t *ex_d
     return;
 }
 
+/* Hashed keys (KH_HASHED, KH_NAMES):
+ *
+ * The key of a token is its 64 bit FNV-1a hash, as 8 big endian bytes,
+ * so that the keys sort like the numbers.  The special tokens, which
+ * start with '.', keep their text as key, and fingerprints that would
+ * start with '.' get its top bit flipped.  ds_foreach() hands the
+ * fingerprints out as "#" and 16 hex digits, which every function
+ * takes back as the fingerprint itself; lexer tokens never start
+ * with '#'.
+ *
+ * With KH_NAMES, the token text is also written under '\0' and the
+ * fingerprint, and ds_foreach() hands out that text instead.
+ *
+ * The .KEY_HASH token holds the e_key_hash of the wordlist, it is
+ * kept out of ds_foreach() since it describes the keys, not the
+ * tokens.  So are .GENERATION, see ds_txn_commit(), and .JOURNAL,
+ * see journal_apply().
+ */
+
+#define	FP_LEN		8		/* bytes of a fingerprint */
+#define	FP_TEXT_LEN	(1 + 2 * FP_LEN)	/* '#' and hex digits */
+#define	MAX_NAME_LEN	1024		/* longer token texts aren't kept */
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static void fingerprint(const byte *text, uint32_t leng, byte *fp)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t i;
+
+    for (i = 0; i < leng; i += 1) {
+	h ^= text[i];
+	h *= 0x100000001b3ULL;
+    }
+    for (i = FP_LEN; i-- > 0; h >>= 8)
+	fp[i] = (byte) h;
+    if (fp[0] == '.')
+	fp[0] ^= 0x80;
+}
+
+static int hexval(byte c)
+{
+    const char *p = c != '\0' ? strchr(hexdigits, c) : NULL;
+    return p != NULL ? p - hexdigits : -1;
+}
+
+/** \return true if \a word spells a fingerprint, which is stored in
+ * \a fp */
+static bool parse_fingerprint(const word_t *word, byte *fp)
+{
+    uint32_t i;
+
+    if (word->leng != FP_TEXT_LEN || word->u.text[0] != '#')
+	return false;
+    for (i = 0; i < FP_LEN; i += 1) {
+	int hi = hexval(word->u.text[1 + 2 * i]);
+	int lo = hexval(word->u.text[2 + 2 * i]);
+	if (hi < 0 || lo < 0)
+	    return false;
+	fp[i] = (byte) (hi << 4 | lo);
+    }
+    return fp[0] != '.';
+}
+
+/** look up the key storage of an existing wordlist */
+static void check_key_hash(dsh_t *dsh)
+{
+    dsv_t val;
+
+    dsh->key_hash_known = true;
+    dsh->key_hash = KH_NONE;
+    if (key_hash_tok != NULL && ds_read(dsh, key_hash_tok, &val) == 0)
+	dsh->key_hash = (e_key_hash) val.count[0];
+}
+
+/** set \a key to the key of \a word, a fingerprint is put in \a fp.
+ * \return true if the fingerprint was taken of the token text */
+static bool make_key(dsh_t *dsh, const word_t *word, dbv_t *key, byte *fp)
+{
+    if (!dsh->key_hash_known)
+	check_key_hash(dsh);
+
+    key->data = word->u.text;
+    key->leng = word->leng;
+
+    if (dsh->key_hash == KH_NONE || (word->leng != 0 && word->u.text[0] == '.'))
+	return false;
+
+    key->data = fp;
+    key->leng = FP_LEN;
+
+    if (parse_fingerprint(word, fp))
+	return false;
+
+    fingerprint(word->u.text, word->leng, fp);
+    return true;
+}
+
+/** set \a key to the entry of \a fp in the name table */
+static void make_name_key(const byte *fp, dbv_t *key, byte *buf)
+{
+    buf[0] = '\0';
+    memcpy(buf + 1, fp, FP_LEN);
+    key->data = buf;
+    key->leng = FP_LEN + 1;
+}
+
 dsh_t *dsh_init(void *dbh)		/* database handle from db_open() */
 {
     dsh_t *val = (dsh_t *)xmalloc(sizeof(*val));
     val->dbh = dbh;
     val->is_swapped = db_is_swapped(dbh);
+    val->packed = false;
+    val->packed_known = false;
+    val->key_hash = KH_NONE;
+    val->key_hash_known = false;
+    val->img = NULL;
+    val->bfp = NULL;
+    val->dbe = NULL;
+    val->bloom = NULL;
+    val->dirty = false;
     return val;
 }
 
@@ -154,12 +444,47 @@ void *ds_open(void *dbe, bfpath *bfp, dbmode_t open_mode)
     dsh_t *dsh;
     void *v;
 
-    v = db_open(dbe, bfp, open_mode); /* FIXME */
+    v = db_open(dbe, bfp, (dbmode_t)(open_mode & ~DS_IMAGE)); /* FIXME */
 
     if (!v)
 	return NULL;
 
     dsh = dsh_init(v);
+    dsh->bloom = bloom_open(bfp, (open_mode & DS_WRITE) != 0);
+
+    /* an image is used if it was compiled from the wordlist as it is,
+     * see ds_txn_begin() */
+    if ((open_mode & DS_IMAGE) && !db_created(v)) {
+	dsh->bfp = bfp;
+	dsh->dbe = dbe;
+	if (DST_OK == ds_txn_begin(dsh))
+	    (void) ds_txn_commit(dsh);
+	if (dsh->img != NULL)
+	    return dsh;
+    }
+
+    /* new wordlists get the current value encoding; loaded ones get
+     * that of the version they are given, see ds_set_wordlist_version() */
+    if (db_created(v)) {
+	dsh->packed = !(open_mode & DS_LOAD);
+	dsh->packed_known = !(open_mode & DS_LOAD);
+	dsh->key_hash_known = true;
+    }
+
+    if (db_created(v) && (key_hash == KH_HASHED || key_hash == KH_NAMES)) {
+	dsv_t val;
+
+	val.count[0] = key_hash;
+	val.count[1] = 0;
+	val.date = today;
+
+	if (DST_OK != ds_txn_begin(dsh))
+	    exit(EX_ERROR);
+	ds_write(dsh, key_hash_tok, &val);
+	dsh->key_hash = key_hash;
+	if (DST_OK != ds_txn_commit(dsh))
+	    exit(EX_ERROR);
+    }
 
     if (db_created(v) && ! (open_mode & DS_LOAD)) {
 	if (DST_OK != ds_txn_begin(dsh))
@@ -178,17 +503,29 @@ void *ds_open(void *dbe, bfpath *bfp, dbmode_t open_mode)
     return dsh;
 }
 
+bool ds_created(void *vhandle)
+{
+    dsh_t *dsh = (dsh_t *)vhandle;
+    return dsh->img == NULL && db_created(dsh->dbh);
+}
+
 void ds_close(/*@only@*/ void *vhandle)
 {
     dsh_t *dsh = (dsh_t *)vhandle;
-    db_close(dsh->dbh);
+    if (dsh->img != NULL)
+	img_close(dsh->img);
+    else
+	db_close(dsh->dbh);
+    if (dsh->bloom != NULL)
+	bloom_close(dsh->bloom);
     xfree(dsh);
 }
 
 void ds_flush(void *vhandle)
 {
     dsh_t *dsh = (dsh_t *)vhandle;
-    db_flush(dsh->dbh);
+    if (dsh->img == NULL)
+	db_flush(dsh->dbh);
 }
 
 int ds_read(void *vhandle, const word_t *word, /*@out@*/ dsv_t *val)
@@ -198,15 +535,29 @@ int ds_read(void *vhandle, const word_t *word, /*@out@*/ dsv_t *val)
     dbv_t ex_key;
     dbv_t ex_data;
     uint32_t cv[3];
+    byte fp[FP_LEN];
+
+    TIMING_COUNT(TC_DS_GETS, 1);
+
+    if (dsh->img != NULL)
+	return img_read(dsh->img, word, val);
 
     struct_init(ex_key);
     struct_init(ex_data);
 
-    ex_key.data = word->u.text;
-    ex_key.leng = word->leng;
+    (void) make_key(dsh, word, &ex_key, fp);
 
     memset(val, 0, sizeof(*val));
 
+    if (!bloom_check(dsh->bloom, &ex_key)) {
+	TIMING_COUNT(TC_DS_SKIPPED, 1);
+	if (DEBUG_DATABASE(3)) {
+	    fprintf(dbgout, "ds_read: [%.*s] not in filter\n",
+		    CLAMP_INT_MAX(word->leng), (char *) word->u.text);
+	}
+	return 1;
+    }
+
     /* init ex_data inside loop since first db_get_value()
     ** call can change it and cause the second call to fail.
     */
@@ -235,6 +586,7 @@ int ds_read(void *vhandle, const word_t *word, /*@out@*/ dsv_t *val)
 	return 1;
 
     case DS_ABORT_RETRY:
+	TIMING_COUNT(TC_DS_RETRIES, 1);
 	if (DEBUG_DATABASE(1)) {
 	    print_error(__FILE__, __LINE__, "ds_read('%.*s') was aborted to recover from a deadlock.",
 		    CLAMP_INT_MAX(word->leng), (char *) word->u.text);
@@ -251,6 +603,169 @@ int ds_read(void *vhandle, const word_t *word, /*@out@*/ dsv_t *val)
     return ret;
 }
 
+static const dbv_t *sort_keys;	/* keys for compare_index() */
+
+static int compare_index(const void *pv1, const void *pv2)
+{
+    const dbv_t *k1 = &sort_keys[*(const uint *)pv1];
+    const dbv_t *k2 = &sort_keys[*(const uint *)pv2];
+    return dbv_cmp(k1, k2->data, k2->leng);
+}
+
+/** db_get_dbvalues() for keys in any order */
+static int get_dbvalues_unsorted(dsh_t *dsh, uint count, dbv_t *keys,
+				 dbv_t *vals, int *rets)
+{
+    uint *order = (uint *)xcalloc(count, sizeof(uint));
+    dbv_t *skeys = (dbv_t *)xcalloc(count, sizeof(dbv_t));
+    dbv_t *svals = (dbv_t *)xcalloc(count, sizeof(dbv_t));
+    int *srets = (int *)xcalloc(count, sizeof(int));
+    uint i;
+    int ret;
+
+    for (i = 0; i < count; i += 1)
+	order[i] = i;
+    sort_keys = keys;
+    qsort(order, count, sizeof(uint), compare_index);
+    sort_keys = NULL;
+
+    for (i = 0; i < count; i += 1) {
+	skeys[i] = keys[order[i]];
+	svals[i] = vals[order[i]];
+    }
+
+    ret = db_get_dbvalues(dsh->dbh, count, skeys, svals, srets);
+
+    for (i = 0; i < count; i += 1) {
+	vals[order[i]].leng = svals[i].leng;
+	rets[order[i]] = srets[i];
+    }
+
+    xfree(srets);
+    xfree(svals);
+    xfree(skeys);
+    xfree(order);
+
+    return ret;
+}
+
+int ds_read_many(void *vhandle, uint count, const word_t **words,
+		 /*@out@*/ dsv_t *vals, /*@out@*/ int *rets)
+{
+    int ret = 0;
+    uint i, n;
+    dsh_t *dsh = (dsh_t *)vhandle;
+    dbv_t *ex_keys, *ex_data;
+    uint32_t *cv;
+    byte *fps;
+    uint *which;
+    int *found;
+
+    TIMING_COUNT(TC_DS_GETS, count);
+
+    if (dsh->img != NULL) {
+	for (i = 0; i < count; i += 1)
+	    rets[i] = img_read(dsh->img, words[i], &vals[i]);
+	return 0;
+    }
+
+    ex_keys = (dbv_t *)xcalloc(count, sizeof(dbv_t));
+    ex_data = (dbv_t *)xcalloc(count, sizeof(dbv_t));
+    cv = (uint32_t *)xcalloc(count, 3 * sizeof(uint32_t));
+    fps = (byte *)xcalloc(count, FP_LEN);
+    which = (uint *)xcalloc(count, sizeof(uint));
+    found = (int *)xcalloc(count, sizeof(int));
+
+    /* only the keys the filter may hold are read, which[] maps them
+     * back to words[] */
+    for (i = n = 0; i < count; i += 1) {
+	(void) make_key(dsh, words[i], &ex_keys[n], fps + FP_LEN * n);
+	rets[i] = DS_NOTFOUND;
+	if (!bloom_check(dsh->bloom, &ex_keys[n])) {
+	    TIMING_COUNT(TC_DS_SKIPPED, 1);
+	    continue;
+	}
+	ex_data[n].data = cv + 3 * n;
+	ex_data[n].leng = 3 * sizeof(uint32_t);
+	which[n++] = i;
+    }
+
+    memset(vals, 0, count * sizeof(*vals));
+
+    /* fingerprints don't sort like the words */
+    if (n != 0 && dsh->key_hash == KH_NONE)
+	ret = db_get_dbvalues(dsh->dbh, n, ex_keys, ex_data, found);
+    else if (n != 0)
+	ret = get_dbvalues_unsorted(dsh, n, ex_keys, ex_data, found);
+
+    switch (ret) {
+    case 0:
+	for (i = 0; i < n; i += 1) {
+	    if (found[i] == DS_NOTFOUND)
+		continue;
+	    rets[which[i]] = 0;
+	    convert_external_to_internal(dsh, &ex_data[i], &vals[which[i]]);
+	}
+	for (i = 0; i < count; i += 1) {
+	    const word_t *word = words[i];
+	    if (rets[i] == DS_NOTFOUND) {
+		rets[i] = 1;
+		if (DEBUG_DATABASE(3))
+		    fprintf(dbgout, "ds_read: [%.*s] not found\n",
+			    CLAMP_INT_MAX(word->leng), (char *) word->u.text);
+		continue;
+	    }
+	    if (DEBUG_DATABASE(3))
+		fprintf(dbgout, "ds_read: [%.*s] -- %lu,%lu\n",
+			CLAMP_INT_MAX(word->leng), (const char *)word->u.text,
+			(unsigned long)vals[i].spamcount,
+			(unsigned long)vals[i].goodcount);
+	}
+	break;
+
+    case DS_ABORT_RETRY:
+	TIMING_COUNT(TC_DS_RETRIES, 1);
+	if (DEBUG_DATABASE(1))
+	    print_error(__FILE__, __LINE__, "ds_read_many() was aborted to recover from a deadlock.");
+	break;
+
+    default:
+	print_error(__FILE__, __LINE__, "ds_read_many(), err: %d, %s",
+		    ret, db_str_err(ret));
+	exit(EX_ERROR);
+    }
+
+    xfree(found);
+    xfree(which);
+    xfree(fps);
+    xfree(cv);
+    xfree(ex_data);
+    xfree(ex_keys);
+
+    return ret;
+}
+
+int dbv_cmp(const dbv_t *key, const void *data, u_int32_t leng)
+{
+    u_int32_t l = min(key->leng, leng);
+    int r = memcmp(key->data, data, l);
+    if (r) return r;
+    if (key->leng > leng) return 1;
+    if (key->leng < leng) return -1;
+    return 0;
+}
+
+/** look up the value encoding of an existing wordlist */
+static void check_packed(dsh_t *dsh)
+{
+    dsv_t val;
+
+    dsh->packed_known = true;
+    dsh->packed = wordlist_version_tok != NULL &&
+	ds_read(dsh, wordlist_version_tok, &val) == 0 &&
+	val.count[0] >= PACKED_VALUES;
+}
+
 int ds_write(void *vhandle, const word_t *word, dsv_t *val)
 {
     int ret = 0;
@@ -258,12 +773,18 @@ int ds_write(void *vhandle, const word_t *word, dsv_t *val)
     dbv_t ex_key;
     dbv_t ex_data;
     uint32_t cv[3];
+    byte fp[FP_LEN];
+    bool named;
+
+    assert(dsh->img == NULL);	/* images are read-only */
+
+    if (!dsh->packed_known)
+	check_packed(dsh);
 
     struct_init(ex_key);
     struct_init(ex_data);
 
-    ex_key.data = word->u.text;
-    ex_key.leng = word->leng;
+    named = make_key(dsh, word, &ex_key, fp);
 
     ex_data.data = cv;
     ex_data.leng = sizeof(cv);
@@ -275,6 +796,25 @@ int ds_write(void *vhandle, const word_t *word, dsv_t *val)
 
     ret = db_set_dbvalue(dsh->dbh, &ex_key, &ex_data);
 
+    if (ret == 0) {
+	bloom_add(dsh->bloom, &ex_key);
+	dsh->dirty = true;
+    }
+
+    if (ret == 0 && named && dsh->key_hash == KH_NAMES && word->leng <= MAX_NAME_LEN) {
+	byte buf[FP_LEN + 1];
+	dbv_t name;
+
+	make_name_key(fp, &ex_key, buf);
+	name.data = word->u.text;
+	name.leng = word->leng;
+	ret = db_set_dbvalue(dsh->dbh, &ex_key, &name);
+    }
+
+    TIMING_COUNT(TC_DS_PUTS, 1);
+    if (ret == DS_ABORT_RETRY)
+	TIMING_COUNT(TC_DS_RETRIES, 1);
+
     if (DEBUG_DATABASE(3)) {
 	fprintf(dbgout, "ds_write: [%.*s] -- %lu,%lu,%lu\n",
 		CLAMP_INT_MAX(word->leng), (const char *)word->u.text,
@@ -291,46 +831,240 @@ int ds_delete(void *vhandle, const word_t *word)
     dsh_t *dsh = (dsh_t *)vhandle;
     int ret;
     dbv_t ex_key;
+    byte fp[FP_LEN];
+
+    assert(dsh->img == NULL);	/* images are read-only */
 
     struct_init(ex_key);
-    ex_key.data = word->u.text;
-    ex_key.leng = word->leng;
+    (void) make_key(dsh, word, &ex_key, fp);
 
     ret = db_delete(dsh->dbh, &ex_key);
 
+    if (ret == 0)
+	dsh->dirty = true;
+
+    if (ret == 0 && ex_key.data == fp && dsh->key_hash == KH_NAMES) {
+	byte buf[FP_LEN + 1];
+
+	make_name_key(fp, &ex_key, buf);
+	ret = db_delete(dsh->dbh, &ex_key);
+	if (ret == DS_NOTFOUND)
+	    ret = 0;
+    }
+
     return ret;		/* 0 if ok */
 }
 
+/** Read the current generation of the wordlist of \a dsh, which
+ * uses an image, by opening it for a moment.  \return true if read. */
+static bool peek_generation(dsh_t *dsh, dsv_t *gen)
+{
+    void *v = db_open(dsh->dbe, dsh->bfp, DS_READ);
+    dsh_t *tmp;
+    bool ok = false;
+
+    if (v == NULL)
+	return false;
+
+    tmp = dsh_init(v);
+    tmp->bloom = bloom_open(dsh->bfp, false);
+    if (DST_OK == ds_txn_begin(tmp)) {
+	int r = ds_get_generation(tmp, gen);
+	ok = (r == 0 || r == 1);
+	if (DST_OK != ds_txn_commit(tmp))
+	    ok = false;
+    }
+    ds_close(tmp);
+
+    return ok;
+}
+
+/** The image of \a dsh is not of the wordlist's generation \a gen:
+ * take the one that is, or else the wordlist. */
+static void replace_image(dsh_t *dsh, const dsv_t *gen)
+{
+    img_close(dsh->img);
+    dsh->img = img_open(dsh->bfp, gen);
+    if (dsh->img != NULL)
+	return;
+
+    dsh->dbh = db_open(dsh->dbe, dsh->bfp, DS_READ);
+    if (dsh->dbh == NULL) {
+	fprintf(stderr, "Can't open file '%s'\n", dsh->bfp->filepath);
+	exit(EX_ERROR);
+    }
+    dsh->is_swapped = db_is_swapped(dsh->dbh);
+    dsh->bloom = bloom_open(dsh->bfp, false);
+}
+
+/** \a dsh reads the wordlist within a transaction: if the image of its
+ * generation has been compiled since, end the transaction and take
+ * the image. */
+static void take_image(dsh_t *dsh)
+{
+    dsv_t gen;
+    img_t *img;
+    int r = ds_get_generation(dsh, &gen);
+
+    if (r != 0 && r != 1)
+	return;
+
+    img = img_open(dsh->bfp, &gen);
+    if (img == NULL)
+	return;
+
+    if (dsm->dsm_commit != NULL)
+	(void) dsm->dsm_commit(dsh->dbh);
+    db_close(dsh->dbh);
+    bloom_close(dsh->bloom);
+    dsh->dbh = NULL;
+    dsh->bloom = NULL;
+    dsh->img = img;
+}
+
+/* A handle opened with DS_IMAGE lives as long as the program, e.g. in
+ * bogofilterd or a long run of -b, while the wordlist is trained and
+ * the image compiled anew.  So each transaction looks up the current
+ * generation, and moves from a stale image to the wordlist or to the
+ * new image, and from the wordlist to the image once it is compiled.
+ */
+
 int ds_txn_begin(void *vhandle) {
     dsh_t *dsh = (dsh_t *)vhandle;
-    if (dsm->dsm_begin == NULL)
-	return 0;
-    else
-	return dsm->dsm_begin(dsh->dbh);
+    int ret = 0;
+
+    if (dsh->img != NULL) {
+	dsv_t gen;
+
+	if (!peek_generation(dsh, &gen) || img_current(dsh->img, &gen))
+	    return 0;
+	replace_image(dsh, &gen);
+	if (dsh->img != NULL)
+	    return 0;
+    }
+
+    if (dsm->dsm_begin != NULL)
+	ret = dsm->dsm_begin(dsh->dbh);
+
+    /* the filter may have been rebuilt while we waited for the lock,
+     * and must hold the keys of the generation we see */
+    if (ret == 0 && bloom_refresh(dsh->bloom)) {
+	dsv_t gen;
+	int r = ds_get_generation(dsh, &gen);
+	if (r == 0 || r == 1)
+	    bloom_validate(dsh->bloom, &gen);
+    }
+
+    if (ret == 0 && dsh->bfp != NULL)
+	take_image(dsh);
+
+    return ret;
 }
 
 int ds_txn_abort(void *vhandle) {
     dsh_t *dsh = (dsh_t *)vhandle;
-    if (dsm->dsm_abort == NULL)
+    dsh->dirty = false;
+    if (dsh->img != NULL || dsm->dsm_abort == NULL)
 	return 0;
     else
 	return dsm->dsm_abort(dsh->dbh);
 }
 
+bool ds_txn_dirty(void *vhandle) {
+    dsh_t *dsh = (dsh_t *)vhandle;
+    return dsh->dirty;
+}
+
+/* The .GENERATION token changes with every transaction that writes to
+ * the wordlist: count[0] counts these transactions, count[1] is picked
+ * at random when the token is written first, so that a wordlist made
+ * anew doesn't repeat the numbers of the one it replaces.  Images and
+ * Bloom filters record the generation they were made from, and are
+ * only used as long as it is the wordlist's.
+ */
+
+static int bump_generation(dsh_t *dsh, dsv_t *val)
+{
+    int ret;
+
+    ret = ds_read(dsh, generation_tok, val);
+    if (ret != 0 && ret != 1)
+	return ret;
+
+    if (ret == 1) {
+	val->count[0] = 0;
+	val->count[1] = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+    }
+    val->count[0] += 1;
+
+    return ds_write(dsh, generation_tok, val);
+}
+
 int ds_txn_commit(void *vhandle) {
     dsh_t *dsh = (dsh_t *)vhandle;
-    if (dsm->dsm_commit == NULL)
-	return 0;
+    bool wrote = dsh->dirty;
+    dsv_t gen;
+    int ret;
+
+    if (wrote) {
+	ret = bump_generation(dsh, &gen);
+	dsh->dirty = false;
+	if (ret != 0) {
+	    ds_txn_abort(dsh);
+	    return (ret == DS_ABORT_RETRY) ? DST_TEMPFAIL : DST_FAILURE;
+	}
+    }
+
+    if (dsh->img != NULL || dsm->dsm_commit == NULL)
+	ret = 0;
     else
-	return dsm->dsm_commit(dsh->dbh);
+	ret = dsm->dsm_commit(dsh->dbh);
+
+    /* only now may the filter claim to hold the new generation */
+    if (ret == 0 && wrote)
+	bloom_commit(dsh->bloom, &gen);
+
+    return ret;
 }
 
 typedef struct {
     ds_foreach_t *hook;
     dsh_t	 *dsh;
     void         *data;
+    byte	  name[MAX_NAME_LEN + 1];	/* token text of a fingerprint */
 } ds_userdata_t;
 
+/** set \a word to the name of the fingerprint \a key, if the name
+ * table has it, or to its "#" and hex digits */
+static void fingerprint_word(ds_userdata_t *ds_data, const dbv_t *key, word_t *word)
+{
+    const byte *fp = (const byte *)key->data;
+    byte buf[FP_LEN + 1];
+    dbv_t name_key, name;
+    uint32_t i;
+
+    word->u.text = ds_data->name;
+
+    if (ds_data->dsh->key_hash == KH_NAMES) {
+	make_name_key(fp, &name_key, buf);
+	name.data = ds_data->name;
+	name.leng = MAX_NAME_LEN;
+	if (db_get_dbvalue(ds_data->dsh->dbh, &name_key, &name) == 0) {
+	    word->leng = name.leng;
+	    ds_data->name[name.leng] = '\0';
+	    return;
+	}
+    }
+
+    ds_data->name[0] = '#';
+    for (i = 0; i < FP_LEN; i += 1) {
+	ds_data->name[1 + 2 * i] = hexdigits[fp[i] >> 4];
+	ds_data->name[2 + 2 * i] = hexdigits[fp[i] & 15];
+    }
+    ds_data->name[FP_TEXT_LEN] = '\0';
+    word->leng = FP_TEXT_LEN;
+}
+
 static ex_t ds_hook(dbv_t *ex_key,
 		    dbv_t *ex_data,
 		    void *userdata)
@@ -344,6 +1078,19 @@ static ex_t ds_hook(dbv_t *ex_key,
     w_key.u.text = (byte *)ex_key->data;
     w_key.leng = ex_key->leng;
 
+    if (dbv_cmp(ex_key, key_hash_tok->u.text, key_hash_tok->leng) == 0 ||
+	dbv_cmp(ex_key, generation_tok->u.text, generation_tok->leng) == 0 ||
+	dbv_cmp(ex_key, journal_tok->u.text, journal_tok->leng) == 0)
+	return EX_OK;
+
+    if (dsh->key_hash != KH_NONE && ex_key->leng != 0) {
+	byte first = ((byte *)ex_key->data)[0];
+	if (ex_key->leng == FP_LEN + 1 && first == '\0')
+	    return EX_OK;	/* name table */
+	if (ex_key->leng == FP_LEN && first != '.')
+	    fingerprint_word(ds_data, ex_key, &w_key);
+    }
+
     memset(&in_data, 0, sizeof(in_data));
     convert_external_to_internal(dsh, ex_data, &in_data);
 
@@ -361,6 +1108,12 @@ ex_t ds_foreach(void *vhandle, ds_foreach_t *hook, void *userdata)
     ds_data.dsh  = dsh;
     ds_data.data = userdata;
 
+    if (dsh->img != NULL)
+	return img_foreach(dsh->img, hook, userdata);
+
+    if (!dsh->key_hash_known)
+	check_key_hash(dsh);
+
     ret = db_foreach(dsh->dbh, ds_hook, &ds_data);
 
     return ret;
@@ -396,10 +1149,6 @@ ex_t ds_oper(void *env, bfpath *bfp, dbmode_t open_mode,
     return ret;
 }
 
-static word_t  *msg_count_tok;
-static word_t  *wordlist_version_tok;
-static word_t  *wordlist_encoding_tok;
-
 void *ds_init(bfpath *bfp)
 {
     void *dbe;
@@ -421,6 +1170,18 @@ void *ds_init(bfpath *bfp)
 	wordlist_encoding_tok = word_news(WORDLIST_ENCODING);
     }
 
+    if (key_hash_tok == NULL) {
+	key_hash_tok = word_news(WORDLIST_KEY_HASH);
+    }
+
+    if (generation_tok == NULL) {
+	generation_tok = word_news(WORDLIST_GENERATION);
+    }
+
+    if (journal_tok == NULL) {
+	journal_tok = word_news(WORDLIST_JOURNAL);
+    }
+
     return dbe;
 }
 
@@ -431,8 +1192,14 @@ void ds_cleanup(void *dbe)
 	dsm->dsm_cleanup((dbe_t *)dbe);
     xfree(msg_count_tok);
     xfree(wordlist_version_tok);
+    xfree(key_hash_tok);
+    xfree(generation_tok);
+    xfree(journal_tok);
     msg_count_tok = NULL;
     wordlist_version_tok = NULL;
+    key_hash_tok = NULL;
+    generation_tok = NULL;
+    journal_tok = NULL;
 }
 
 /*
@@ -460,6 +1227,8 @@ int  ds_set_msgcounts(void *vhandle, dsv_t *val)
 void *ds_get_dbenv(void *vhandle)
 {
     dsh_t *dsh = (dsh_t *)vhandle;
+    if (dsh->img != NULL)
+	return NULL;
     return db_get_env(dsh->dbh);
 }
 
@@ -488,6 +1257,40 @@ int ds_set_wordlist_encoding(void *vhandle, int enc)
     return ds_write(dsh, wordlist_encoding_tok, &val);
 }
 
+e_key_hash ds_get_key_hash(void *vhandle)
+{
+    dsh_t *dsh = (dsh_t *)vhandle;
+
+    if (dsh->img != NULL)
+	return KH_NONE;
+    if (!dsh->key_hash_known)
+	check_key_hash(dsh);
+    return dsh->key_hash;
+}
+
+int ds_get_generation(void *vhandle, dsv_t *val)
+{
+    dsh_t *dsh = (dsh_t *)vhandle;
+    int ret = ds_read(dsh, generation_tok, val);
+
+    if (ret != 0)
+	memset(val, 0, sizeof(*val));
+
+    return ret;
+}
+
+int ds_get_journal(void *vhandle, dsv_t *val)
+{
+    dsh_t *dsh = (dsh_t *)vhandle;
+    return ds_read(dsh, journal_tok, val);
+}
+
+int ds_set_journal(void *vhandle, dsv_t *val)
+{
+    dsh_t *dsh = (dsh_t *)vhandle;
+    return ds_write(dsh, journal_tok, val);
+}
+
 /*
   Get the wordlist version associated with database.
 */
@@ -515,6 +1318,10 @@ int ds_set_wordlist_version(void *vhandle, dsv_t *val)
 
     val->date = today;
 
+    /* the version decides how values are written */
+    dsh->packed = val->count[0] >= PACKED_VALUES;
+    dsh->packed_known = true;
+
     return ds_write(dsh, wordlist_version_tok, val);
 }
 
@@ -547,6 +1354,36 @@ ex_t ds_checkpoint(bfpath *bfp)
 	return dsm->dsm_checkpoint(bfp);
 }
 
+ex_t ds_prepare_replace(void *vhandle, bfpath *copy)
+{
+    dsh_t *dsh = (dsh_t *)vhandle;
+
+    if (dsm->dsm_prepare_replace == NULL)
+	return EX_OK;
+    else
+	return dsm->dsm_prepare_replace(dsh->dbh, copy);
+}
+
+ex_t ds_replace(void *vhandle, bfpath *copy, bfpath *bfp)
+{
+    dsh_t *dsh = (dsh_t *)vhandle;
+    struct stat st;
+
+    if (dsm->dsm_replace != NULL)
+	return dsm->dsm_replace(dsh->dbh, copy);
+
+    /* same permissions as the old wordlist */
+    if (stat(bfp->filepath, &st) == 0)
+	(void) chmod(copy->filepath, st.st_mode & 07777);
+    if (rename(copy->filepath, bfp->filepath) != 0) {
+	fprintf(stderr, "Cannot rename %s to %s: %s\n",
+		copy->filepath, bfp->filepath, strerror(errno));
+	return EX_ERROR;
+    }
+
+    return EX_OK;
+}
+
 ex_t ds_purgelogs(bfpath *bfp)
 {
     if (dsm->dsm_purgelogs == NULL)
@@ -38,6 +38,21 @@ extern YYYYMMDD today;		/* date as YYYYMMDD */
  */
 #define MSG_COUNT ".MSG_COUNT"
 
+/** How the keys of a wordlist are stored: as the token text, or as a
+ * 64 bit fingerprint of it, with or without a table that maps the
+ * fingerprints back to the token texts for dumps. */
+typedef enum {
+    KH_DEFAULT = -1,	/**< --hash-keys not given, never stored */
+    KH_NONE = 0,
+    KH_HASHED = 1,
+    KH_NAMES = 2
+} e_key_hash;
+
+/** key storage of the wordlists that are created, bogoutil --hash-keys;
+ * with KH_DEFAULT, that of the wordlist they are copied from, else
+ * KH_NONE */
+extern e_key_hash key_hash;
+
 /** Datastore handle type
 ** - used to communicate between datastore layer and database layer
 ** - known to program layer as a void*
@@ -47,6 +62,24 @@ typedef struct {
     void   *dbh;
     /** tracks endianness */
     bool is_swapped;
+    /** values are written in the compact encoding (PACKED_VALUES) */
+    bool packed;
+    /** packed is set, else it is looked up at the first write */
+    bool packed_known;
+    /** storage of the keys */
+    e_key_hash key_hash;
+    /** key_hash is set, else it is looked up at the first access */
+    bool key_hash_known;
+    /** compiled image (datastore_img.c), used instead of dbh if set */
+    struct img_s *img;
+    /** the wordlist, if opened with DS_IMAGE: each transaction looks
+     * for the image of its current generation */
+    bfpath *bfp;
+    void *dbe;
+    /** Bloom filter of the keys (datastore_bloom.c), NULL with images */
+    struct bloom_s *bloom;
+    /** the current transaction has changed the wordlist */
+    bool dirty;
 } dsh_t;
 
 /** Datastore value type, used to communicate between program layer and
@@ -81,6 +114,11 @@ typedef struct {
     u_int32_t leng;
 } dbv_t;
 
+/** compare \a key with the \a leng bytes at \a data the way all
+ * backends order their keys: bytewise with memcmp(), a key sorts
+ * before any longer key it is a prefix of. */
+extern int dbv_cmp(const dbv_t *key, const void *data, u_int32_t leng);
+
 #ifndef	ENABLE_DB_DATASTORE	/* if not Berkeley DB */
 typedef	void DB;
 typedef	void DB_ENV;
@@ -114,6 +152,7 @@ typedef u_int32_t dsm_u_pp	(bfpath *bfp);
 typedef DB_ENV *dsm_pnv_pp	(bfpath *bfp);
 typedef DB_ENV *dsm_pnv_pbe	(dbe_t *env);
 typedef ex_t	dsm_x_ppsi	(bfpath *bfp, int argc, char **argv);
+typedef ex_t	dsm_x_pvp	(void *vhandle, bfpath *bfp);
 
 /** Datastore methods type, used by datastore/database layers to switch
  * implementations after detection of database type. */
@@ -143,6 +182,8 @@ typedef struct {
     dsm_x_pp	 *dsm_verify;
     dsm_x_ppsi	 *dsm_list_logfiles;
     dsm_u_pp	 *dsm_leafpages;
+    dsm_x_pvp	 *dsm_prepare_replace;
+    dsm_x_pvp	 *dsm_replace;
 } dsm_t;
 
 extern dsm_t *dsm;
@@ -180,6 +221,10 @@ extern void *ds_open(void *dbe,		/**< parent environment */
 		     bfpath *bfp,	/**< path to database file */
 		     dbmode_t open_mode	/**< open mode, DS_READ or DS_WRITE */);
 
+/** \return true if ds_open() created the database, i.e. it is empty
+ * but for the special tokens */
+extern bool ds_created(void *vhandle);
+
 /** Close file and clean up. */
 extern void  ds_close(/*@only@*/ void *vhandle);
 
@@ -205,6 +250,16 @@ void dsh_free(void *vhandle);
  */
 extern int  ds_read  (void *vhandle, const word_t *word, /*@out@*/ dsv_t *val);
 
+/** Retrieve the values of \a count words at once.  The words must be
+ * sorted with word_cmp() so that the backend can resolve them in a
+ * single sweep through the database (with hashed keys, they are
+ * sorted again by key).  rets[i] is set as ds_read()'s
+ * return value for words[i] would be.
+ * \return 0 for success, DS_ABORT_RETRY if the transaction was aborted
+ */
+extern int  ds_read_many(void *vhandle, uint count, const word_t **words,
+			 /*@out@*/ dsv_t *vals, /*@out@*/ int *rets);
+
 /** Retrieve the value associated with a given word in a list. 
  * \return zero if the word does not exist in the database. Implementation
  */
@@ -278,6 +333,10 @@ extern int ds_txn_commit(void *vhandle);
  */
 extern int ds_txn_abort(void *vhandle);
 
+/** \return true if the current transaction wrote to the data store,
+ * i.e. its commit will change the wordlist's generation. */
+extern bool ds_txn_dirty(void *vhandle);
+
 /** Successful return from ds_txn_* operation. */
 #define DST_OK (0)
 /** Temporary failure return from ds_txn_* operation, the application
@@ -290,7 +349,8 @@ extern int ds_txn_abort(void *vhandle);
 /** Get the database version */
 extern int ds_get_wordlist_version(void *vhandle, dsv_t *val);
 
-/** set the database version */
+/** set the database version, which also decides how values are
+ * written from then on (PACKED_VALUES) */
 extern int ds_set_wordlist_version(void *vhandle, dsv_t *val);
 
 /** Get the database encoding */
@@ -299,6 +359,21 @@ extern int ds_get_wordlist_encoding(void *vhandle, dsv_t *val);
 /** set the database encoding */
 extern int ds_set_wordlist_encoding(void *vhandle, int enc);
 
+/** \return how the keys of the wordlist are stored */
+extern e_key_hash ds_get_key_hash(void *vhandle);
+
+/** Get the generation of the wordlist, which changes with every
+ * transaction that writes to it; all zero if it was never written
+ * since it got one. */
+extern int ds_get_generation(void *vhandle, dsv_t *val);
+
+/** Get the stamp of the last registration journal merged into the
+ * wordlist, see journal_apply(). */
+extern int ds_get_journal(void *vhandle, dsv_t *val);
+
+/** Record the stamp of a journal, in the transaction that merges it. */
+extern int ds_set_journal(void *vhandle, dsv_t *val);
+
 /** Get the current process ID. */
 extern unsigned long ds_handle_pid(void *vhandle);
 
@@ -334,6 +409,18 @@ extern ex_t ds_purgelogs(bfpath *bfp);
 /** Run checkpoint once */
 extern ex_t ds_checkpoint(bfpath *bfp);
 
+/** Get the wordlist open as \a vhandle ready to be replaced by the
+ * wordlist file \a copy, which is yet to be written.  This must come
+ * before the transaction that ds_replace() is called in, \return
+ * EX_OK or EX_ERROR. */
+extern ex_t ds_prepare_replace(void *vhandle, bfpath *copy);
+
+/** Replace the wordlist \a bfp, open as \a vhandle within a
+ * transaction, with the wordlist file \a copy, \return EX_OK or
+ * EX_ERROR.  The file is renamed over the wordlist, unless the
+ * backend has to do it otherwise. */
+extern ex_t ds_replace(void *vhandle, bfpath *copy, bfpath *bfp);
+
 /** datastore backends must provide this initializing function */
 extern void dsm_init(bfpath *bfp);
 
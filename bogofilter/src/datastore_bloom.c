@@ -0,0 +1,461 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   datastore_bloom.c -- Bloom filters of the keys of a wordlist
+
+   "bogoutil --bloom" writes a Bloom filter of all keys of a wordlist
+   into a file next to it (wordlist.db.bloom).  Most tokens of a
+   message are not in the wordlist; ds_read() and ds_read_many() ask
+   the filter first and skip the datastore for keys it certainly
+   doesn't hold.  ds_write() adds its keys to the filter, and
+   "bogoutil -m" writes it anew, without the deleted tokens.
+
+   The filter is mapped and updated in place, under the lock of the
+   wordlist.  Its header records the generation of the wordlist (see
+   ds_get_generation()) whose keys it holds, and the filter is only
+   used in transactions that start from that generation.  A writer
+   adds its keys before committing and advances the filter's
+   generation after the commit succeeded, provided the filter was
+   current before; so a writer that can't map the filter, or fails
+   half way, leaves it unused until it is written anew.  A new filter
+   is written to a temporary file and renamed into place while the
+   wordlist is locked; handles map it anew at the start of their next
+   transaction.
+
+   Layout, all numbers in host byte order:
+
+	bloom_header_t	header
+	byte		bits[1 << shift / 8]
+
+   Each key sets the bits (h1 + i * h2) mod 2^shift for i below
+   hashes, h1 and h2 being the halves of a 64 bit hash of the key.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "datastore.h"
+#include "datastore_bloom.h"
+#include "datastore_db.h"
+#include "error.h"
+#include "mxcat.h"
+#include "xmalloc.h"
+
+#define	BLOOM_MAGIC	"BFBLOOM1"
+#define	BLOOM_ENDIAN	0x01020304
+#define	BLOOM_HASHES	7		/* bits set per key */
+#define	BLOOM_KEY_BITS	10		/* bits per key, about 1% false hits */
+#define	BLOOM_MIN_SHIFT	15		/* 4 kB */
+#define	BLOOM_MAX_SHIFT	31		/* 256 MB */
+
+typedef struct {
+    char	magic[8];
+    uint32_t	endian;
+    uint32_t	shift;		/* the filter has 1 << shift bits */
+    uint32_t	hashes;		/* bits set per key */
+    uint32_t	capacity;	/* keys it was sized for */
+    uint32_t	count;		/* keys added, about */
+    uint32_t	generation[2];	/* of the wordlist, see ds_get_generation() */
+} bloom_header_t;
+
+struct bloom_s {
+    char		*path;		/* of the filter */
+    bool		 writable;
+    bool		 current;	/* holds the keys of the transaction's generation */
+    bool		 seen;		/* the filter file existed at the last look */
+    dev_t		 dev;		/* and was this file */
+    ino_t		 ino;
+    void		*map;		/* NULL if there is no usable filter */
+    size_t		 size;
+    bloom_header_t	*hdr;
+    byte		*bits;
+    uint32_t		 mask;
+};
+
+/* Function Definitions */
+
+/** 64 bit FNV-1a hash of \a key, with the final mix of MurmurHash3 so
+ * that both halves are usable */
+static uint64_t bloom_hash(const dbv_t *key)
+{
+    const byte *p = (const byte *) key->data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    u_int32_t i;
+
+    for (i = 0; i < key->leng; i += 1) {
+	h ^= p[i];
+	h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static bool test_bits(const byte *bits, uint32_t mask, uint32_t hashes, uint64_t h)
+{
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    uint32_t i;
+
+    for (i = 0; i < hashes; i += 1) {
+	uint32_t bit = (h1 + i * h2) & mask;
+	if ((bits[bit >> 3] & (1 << (bit & 7))) == 0)
+	    return false;
+    }
+
+    return true;
+}
+
+/** \return true if a bit was not set yet */
+static bool set_bits(byte *bits, uint32_t mask, uint32_t hashes, uint64_t h)
+{
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    uint32_t i;
+    bool added = false;
+
+    for (i = 0; i < hashes; i += 1) {
+	uint32_t bit = (h1 + i * h2) & mask;
+	byte b = (byte) (1 << (bit & 7));
+	if ((bits[bit >> 3] & b) == 0) {
+	    bits[bit >> 3] |= b;
+	    added = true;
+	}
+    }
+
+    return added;
+}
+
+static void unmap_filter(bloom_t *bloom)
+{
+    if (bloom->map != NULL)
+	munmap(bloom->map, bloom->size);
+    bloom->map = NULL;
+    bloom->current = false;
+    bloom->hdr = NULL;
+    bloom->bits = NULL;
+}
+
+static void map_filter(bloom_t *bloom)
+{
+    struct stat fst;
+    const bloom_header_t *hdr;
+    void *map;
+    int fd;
+
+    fd = open(bloom->path, bloom->writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+	bloom->seen = stat(bloom->path, &fst) == 0;
+	if (bloom->seen) {
+	    bloom->dev = fst.st_dev;
+	    bloom->ino = fst.st_ino;
+	    if (DEBUG_DATABASE(1))
+		fprintf(dbgout, "ignoring filter %s: %s\n", bloom->path, strerror(errno));
+	}
+	return;
+    }
+
+    bloom->seen = fstat(fd, &fst) == 0;
+    if (!bloom->seen) {
+	close(fd);
+	return;
+    }
+    bloom->dev = fst.st_dev;
+    bloom->ino = fst.st_ino;
+
+    if ((size_t) fst.st_size < sizeof(bloom_header_t)) {
+	if (DEBUG_DATABASE(1))
+	    fprintf(dbgout, "ignoring filter %s, bad format.\n", bloom->path);
+	close(fd);
+	return;
+    }
+
+    map = mmap(NULL, (size_t) fst.st_size,
+	       bloom->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+	       MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+	print_error(__FILE__, __LINE__, "cannot map %s: %s", bloom->path, strerror(errno));
+	return;
+    }
+
+    hdr = (const bloom_header_t *) map;
+
+    if (memcmp(hdr->magic, BLOOM_MAGIC, sizeof(hdr->magic)) != 0 ||
+	hdr->endian != BLOOM_ENDIAN ||
+	hdr->hashes == 0 || hdr->hashes > 32 ||
+	hdr->shift < BLOOM_MIN_SHIFT || hdr->shift > BLOOM_MAX_SHIFT ||
+	sizeof(bloom_header_t) + ((size_t) 1 << hdr->shift) / 8 != (size_t) fst.st_size) {
+	if (DEBUG_DATABASE(1))
+	    fprintf(dbgout, "ignoring filter %s, bad format or byte order.\n", bloom->path);
+	munmap(map, (size_t) fst.st_size);
+	return;
+    }
+
+    bloom->map = map;
+    bloom->size = (size_t) fst.st_size;
+    bloom->hdr = (bloom_header_t *) map;
+    bloom->bits = (byte *) (bloom->hdr + 1);
+    bloom->mask = (uint32_t) (((uint64_t) 1 << hdr->shift) - 1);
+}
+
+bloom_t *bloom_open(bfpath *bfp, bool writable)
+{
+    bloom_t *bloom = (bloom_t *) xcalloc(1, sizeof(*bloom));
+
+    bloom->path = mxcat(bfp->filepath, BLOOM_EXT, NULL);
+    bloom->writable = writable;
+
+    map_filter(bloom);
+
+    return bloom;
+}
+
+bool bloom_refresh(bloom_t *bloom)
+{
+    struct stat st;
+    bool exists = stat(bloom->path, &st) == 0;
+
+    bloom->current = false;
+
+    if (exists != bloom->seen ||
+	(exists && (st.st_dev != bloom->dev || st.st_ino != bloom->ino))) {
+	unmap_filter(bloom);
+	map_filter(bloom);
+    }
+
+    return bloom->map != NULL;
+}
+
+void bloom_validate(bloom_t *bloom, const dsv_t *gen)
+{
+    if (bloom->map == NULL)
+	return;
+
+    bloom->current = bloom->hdr->generation[0] == gen->count[0] &&
+		     bloom->hdr->generation[1] == gen->count[1];
+
+    if (DEBUG_DATABASE(1)) {
+	if (bloom->current)
+	    fprintf(dbgout, "using filter %s, %lu keys.\n", bloom->path,
+		    (unsigned long) bloom->hdr->count);
+	else
+	    fprintf(dbgout, "ignoring filter %s, the wordlist has changed.\n",
+		    bloom->path);
+    }
+}
+
+void bloom_commit(bloom_t *bloom, const dsv_t *gen)
+{
+    bloom_header_t *hdr = bloom->hdr;
+
+    if (bloom->map == NULL || !bloom->writable)
+	return;
+
+    /* the filter holds the keys of the previous generation, and
+     * bloom_add() put the keys of this one in */
+    if (gen->count[0] != 0 &&
+	hdr->generation[0] == gen->count[0] - 1 &&
+	hdr->generation[1] == gen->count[1])
+	hdr->generation[0] = gen->count[0];
+}
+
+void bloom_close(bloom_t *bloom)
+{
+    if (bloom->map != NULL && bloom->writable &&
+	bloom->hdr->count > bloom->hdr->capacity && DEBUG_DATABASE(1))
+	fprintf(dbgout, "filter %s is full, rebuild it.\n", bloom->path);
+
+    unmap_filter(bloom);
+    xfree(bloom->path);
+    xfree(bloom);
+}
+
+bool bloom_check(const bloom_t *bloom, const dbv_t *key)
+{
+    if (!bloom->current)
+	return true;
+
+    return test_bits(bloom->bits, bloom->mask, bloom->hdr->hashes, bloom_hash(key));
+}
+
+void bloom_add(bloom_t *bloom, const dbv_t *key)
+{
+    if (bloom->map == NULL || !bloom->writable)
+	return;
+
+    if (set_bits(bloom->bits, bloom->mask, bloom->hdr->hashes, bloom_hash(key)))
+	bloom->hdr->count += 1;
+}
+
+bool bloom_exists(bfpath *bfp)
+{
+    char *path = mxcat(bfp->filepath, BLOOM_EXT, NULL);
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+
+    xfree(path);
+
+    return exists;
+}
+
+/* building */
+
+typedef struct {
+    uint64_t	*hashes;
+    uint32_t	 count;
+    uint32_t	 size;
+} collect_t;
+
+static ex_t collect_hook(dbv_t *token, dbv_t *data, void *userdata)
+{
+    collect_t *c = (collect_t *) userdata;
+
+    (void) data;
+
+    if (fDie)
+	exit(EX_ERROR);
+
+    if (c->count == c->size) {
+	c->size = c->size ? c->size * 2 : 4096;
+	c->hashes = (uint64_t *) xrealloc(c->hashes, c->size * sizeof(uint64_t));
+    }
+
+    c->hashes[c->count++] = bloom_hash(token);
+
+    return EX_OK;
+}
+
+static bool write_filter(FILE *fp, const bloom_header_t *hdr, const byte *bits)
+{
+    if (fwrite(hdr, sizeof(*hdr), 1, fp) != 1 ||
+	fwrite(bits, 1, ((size_t) 1 << hdr->shift) / 8, fp) != ((size_t) 1 << hdr->shift) / 8)
+	return false;
+
+    return fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+/** write a filter of the keys in \a c, which are those of generation
+ * \a gen of the wordlist, to the filter file of \a bfp */
+static ex_t replace_filter(bfpath *bfp, const collect_t *c, const dsv_t *gen)
+{
+    bloom_header_t hdr;
+    uint64_t capacity = max((uint64_t) c->count * 2, (uint64_t) 1 << (BLOOM_MIN_SHIFT - 3));
+    uint32_t mask, i;
+    byte *bits;
+    char *path, *temp;
+    FILE *fp = NULL;
+    struct stat st;
+    bool ok = false;
+    ex_t ret = EX_OK;
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BLOOM_MAGIC, sizeof(hdr.magic));
+    hdr.endian = BLOOM_ENDIAN;
+    hdr.hashes = BLOOM_HASHES;
+    hdr.capacity = (uint32_t) min(capacity, (uint64_t) UINT32_MAX);
+    hdr.count = c->count;
+    hdr.generation[0] = gen->count[0];
+    hdr.generation[1] = gen->count[1];
+
+    for (hdr.shift = BLOOM_MIN_SHIFT; hdr.shift < BLOOM_MAX_SHIFT; hdr.shift += 1)
+	if (((uint64_t) 1 << hdr.shift) >= capacity * BLOOM_KEY_BITS)
+	    break;
+
+    mask = (uint32_t) (((uint64_t) 1 << hdr.shift) - 1);
+    bits = (byte *) xcalloc(((size_t) 1 << hdr.shift) / 8, 1);
+    for (i = 0; i < c->count; i += 1)
+	(void) set_bits(bits, mask, hdr.hashes, c->hashes[i]);
+
+    path = mxcat(bfp->filepath, BLOOM_EXT, NULL);
+    temp = mxcat(path, ".XXXXXX", NULL);
+
+    fd = mkstemp(temp);
+    if (fd >= 0) {
+	/* readable and writable by whoever may use the wordlist */
+	if (stat(bfp->filepath, &st) == 0)
+	    (void) fchmod(fd, st.st_mode & 0666);
+	fp = fdopen(fd, "wb");
+	if (fp == NULL)
+	    close(fd);
+    }
+
+    if (fp != NULL) {
+	ok = write_filter(fp, &hdr, bits);
+	if (fclose(fp) != 0)
+	    ok = false;
+    }
+
+    if (!ok || rename(temp, path) != 0) {
+	fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+	if (fd >= 0)
+	    unlink(temp);
+	ret = EX_ERROR;
+    }
+    else if (verbose)
+	fprintf(dbgout, "%lu keys in filter %s, %lu kB\n",
+		(unsigned long) c->count, path,
+		(unsigned long) (((size_t) 1 << hdr.shift) / 8 / 1024));
+
+    xfree(temp);
+    xfree(path);
+    xfree(bits);
+
+    return ret;
+}
+
+ex_t bloom_build(void *dbe, bfpath *bfp)
+{
+    collect_t c;
+    dsh_t *dsh;
+    dsv_t gen;
+    ex_t ret;
+
+    memset(&c, 0, sizeof(c));
+
+    /* Registrations wait for the lock and then update the new filter,
+     * so the lock is held until it is in place. */
+    dsh = (dsh_t *) ds_open(dbe, bfp, DS_WRITE);
+    if (dsh == NULL) {
+	fprintf(stderr, "Can't open file '%s'\n", bfp->filepath);
+	return EX_ERROR;
+    }
+
+    ret = EX_ERROR;
+    if (DST_OK == ds_txn_begin(dsh)) {
+	/* all keys, including the special tokens and key tables */
+	ret = db_foreach(dsh->dbh, collect_hook, &c);
+	if (ret == EX_OK && ds_get_generation(dsh, &gen) == DS_ABORT_RETRY)
+	    ret = EX_ERROR;
+	if (ret != EX_OK)
+	    fprintf(stderr, "error reading %s\n", bfp->filepath);
+	else
+	    ret = replace_filter(bfp, &c, &gen);
+	if (ds_txn_commit(dsh) != DST_OK)
+	    ret = EX_ERROR;
+    }
+    ds_close(dsh);
+
+    xfree(c.hashes);
+
+    return ret;
+}
+
+/* End */
@@ -0,0 +1,59 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   datastore_bloom.h -- Bloom filters of the keys of a wordlist
+
+******************************************************************************/
+
+#ifndef	DATASTORE_BLOOM_H
+#define	DATASTORE_BLOOM_H
+
+#include "datastore.h"
+
+/** File name suffix of a wordlist's Bloom filter. */
+#define	BLOOM_EXT	".bloom"
+
+/** Handle of the filter of an open wordlist. */
+typedef struct bloom_s bloom_t;
+
+/** Map the filter of the wordlist at \a bfp, for reading or, if
+ * \a writable, for updating as well.  Filters written on a host with
+ * another byte order are ignored; without a filter, the handle answers
+ * every key with "maybe". */
+extern bloom_t *bloom_open(bfpath *bfp, bool writable);
+
+/** Map the filter anew if its file was replaced or created since it was
+ * mapped, and stop using it until bloom_validate().  Call this with the
+ * wordlist locked, i.e. at the start of each transaction.  \return
+ * true if there is a filter to validate. */
+extern bool bloom_refresh(bloom_t *bloom);
+
+/** Use the filter in this transaction if it holds the keys of
+ * generation \a gen of the wordlist. */
+extern void bloom_validate(bloom_t *bloom, const dsv_t *gen);
+
+/** Record that a transaction that added its keys committed generation
+ * \a gen of the wordlist. */
+extern void bloom_commit(bloom_t *bloom, const dsv_t *gen);
+
+/** Unmap the filter and free the handle. */
+extern void bloom_close(/*@only@*/ bloom_t *bloom);
+
+/** \return false if \a key is certainly not in the wordlist, true if
+ * it may be. */
+extern bool bloom_check(const bloom_t *bloom, const dbv_t *key);
+
+/** Add \a key, which is written to the wordlist, to the filter. */
+extern void bloom_add(bloom_t *bloom, const dbv_t *key);
+
+/** \return true if the wordlist at \a bfp has a filter file, usable
+ * or not. */
+extern bool bloom_exists(bfpath *bfp);
+
+/** Write a filter of all keys of the wordlist at \a bfp, recording its
+ * generation, and atomically replace the previous one. */
+extern ex_t bloom_build(void *dbe, bfpath *bfp);
+
+#endif	/* DATASTORE_BLOOM_H */
@@ -830,6 +830,118 @@ int db_get_dbvalue(void *vhandle, const dbv_t *token, /*@out@*/ dbv_t *val)
 }
 
 
+int db_get_dbvalues(void *vhandle, uint count, const dbv_t *tokens,
+		    /*@out@*/ dbv_t *vals, /*@out@*/ int *rets)
+{
+    int ret = 0;
+    int rmw_flag;
+    uint i;
+    bool positioned = false;	/* cursor is on db_key, which is >= all previous tokens */
+    DBT db_key;
+    DBT db_data;
+
+    dbh_t *handle = (dbh_t *)vhandle;
+    DB *dbp = handle->dbp;
+    DBC *dbcp;
+
+    assert(handle);
+    assert(handle->magic == MAGIC_DBH);
+    assert((eTransaction == T_DISABLED) == (handle->txn == NULL));
+
+    if ((ret = dbp->cursor(dbp, handle->txn, &dbcp, 0))) {
+	print_error(__FILE__, __LINE__, "(db) DB->cursor(%s), err: %d, %s",
+		    handle->path, ret, db_strerror(ret));
+	dsm->dsm_abort(handle);
+	exit(EX_ERROR);
+    }
+
+    DBT_init(db_key);
+    DBT_init(db_data);
+
+    /* DB_RMW can avoid deadlocks */
+    rmw_flag = dsm->dsm_get_rmw_flag(handle->open_mode);
+
+    for (i = 0; i < count; i += 1) {
+	int cmp = 1;
+
+	if (positioned)
+	    cmp = dbv_cmp(&tokens[i], db_key.data, db_key.size);
+
+	/* only move the cursor if the token is past its key */
+	if (cmp > 0) {
+	    DBT_init(db_key);
+	    DBT_init(db_data);
+	    db_key.data = tokens[i].data;
+	    db_key.size = tokens[i].leng;
+
+#if DB_AT_LEAST(4,6)
+	    ret = dbcp->get(dbcp, &db_key, &db_data, DB_SET_RANGE | rmw_flag);
+#else
+	    ret = dbcp->c_get(dbcp, &db_key, &db_data, DB_SET_RANGE | rmw_flag);
+#endif
+
+	    if (DEBUG_DATABASE(3))
+		fprintf(dbgout, "DBC->get(%.*s, DB_SET_RANGE): %s\n",
+			CLAMP_INT_MAX(tokens[i].leng), (char *) tokens[i].data,
+			db_strerror(ret));
+
+	    if (ret == DB_NOTFOUND) {
+		/* beyond the last key */
+		for (; i < count; i += 1)
+		    rets[i] = DS_NOTFOUND;
+		ret = 0;
+		break;
+	    }
+	    if (ret != 0)
+		break;
+
+	    positioned = true;
+	    cmp = dbv_cmp(&tokens[i], db_key.data, db_key.size);
+	}
+
+	if (cmp < 0) {
+	    rets[i] = DS_NOTFOUND;
+	    continue;
+	}
+
+	if (vals[i].leng < db_data.size) {
+	    print_error(__FILE__, __LINE__,
+			"(db) db_get_dbvalues( '%.*s' ), size error %lu: %lu",
+			CLAMP_INT_MAX(tokens[i].leng),
+			(char *)tokens[i].data, (unsigned long)vals[i].leng,
+			(unsigned long)db_data.size);
+	    exit(EX_ERROR);
+	}
+
+	vals[i].leng = db_data.size;		/* read count */
+	memcpy(vals[i].data, db_data.data, db_data.size);
+	rets[i] = 0;
+    }
+
+#if DB_AT_LEAST(4,6)
+    dbcp->close(dbcp);
+#else
+    dbcp->c_close(dbcp);
+#endif
+
+    switch (ret) {
+    case 0:
+	break;
+    case DB_LOCK_DEADLOCK:
+	dsm->dsm_abort(handle);
+	ret = DS_ABORT_RETRY;
+	break;
+    default:
+	print_error(__FILE__, __LINE__, "(db) DBC->get(TXN=%lu,  '%.*s' ), err: %d, %s",
+		    (unsigned long)handle->txn, CLAMP_INT_MAX(tokens[i].leng),
+		    (char *) tokens[i].data, ret, db_strerror(ret));
+	dsm->dsm_abort(handle);
+	exit(EX_ERROR);
+    }
+
+    return ret;
+}
+
 int db_set_dbvalue(void *vhandle, const dbv_t *token, const dbv_t *val)
 {
     int ret;
@@ -61,6 +61,19 @@ int db_get_dbvalue(
 				 */
 );
 
+/** Retrieve the values of \a count keys, which must be sorted with
+ * dbv_cmp(), in one pass over the database.  Like db_get_dbvalue(),
+ * vals[i] must be pre-allocated.  rets[i] is set to 0 or DS_NOTFOUND.
+ * \return 0 for success, DS_ABORT_RETRY if the transaction was aborted
+ */
+int db_get_dbvalues(
+	void *vhandle,		/**< database handle */
+	uint count,		/**< number of keys */
+	const dbv_t *tokens,	/**< sorted keys to look for */
+	/*@out@*/ dbv_t *vals,	/**< output, pre-allocated as above */
+	/*@out@*/ int *rets	/**< output, status of each key */
+);
+
 /** Delete the key */
 int db_delete(void *handle, const dbv_t *data);
 
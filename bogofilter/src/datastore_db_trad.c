@@ -72,7 +72,9 @@ dsm_t dsm_traditional = {
     NULL,		/* dsm_remove           */
     &db_verify,		/* dsm_verify           */
     NULL,		/* dsm_list_logfiles    */
-    &db_leafpages	/* dsm_leafpages        */
+    &db_leafpages,	/* dsm_leafpages        */
+    NULL,		/* dsm_prepare_replace  */
+    NULL		/* dsm_replace          */
 };
 
 DB_ENV *bft_get_env_dbe	(dbe_t *env)
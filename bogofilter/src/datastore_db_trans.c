@@ -94,7 +94,8 @@ dsm_t dsm_transactional = {
     &dbx_remove,
     &db_verify,
     &dbx_list_logfiles,
-    &db_leafpages
+    &db_leafpages,
+    NULL
 };
 
 /* non-OO static function prototypes */
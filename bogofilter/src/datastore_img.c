@@ -0,0 +1,447 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   datastore_img.c -- compiled, read-only wordlist images
+
+   "bogoutil --compile" writes all tokens of a wordlist into an
+   immutable file next to it (wordlist.db.img).  bogofilter maps that
+   file instead of opening the wordlist when it only needs to read,
+   i.e. for classification without -u.  Lookups need no locks,
+   transactions or copies, and all bogofilter processes share the
+   same pages.
+
+   The image is written to a temporary file and renamed into place,
+   so readers see either the old or the new image.  It records the
+   generation of the wordlist it was compiled from, and is ignored
+   once the wordlist was written to, so it should be recompiled after
+   each training run.  Each transaction checks the generation anew, so
+   that long-running readers move on to the wordlist, or to the image
+   compiled next.
+
+   Layout, all numbers in host byte order:
+
+	img_header_t	header
+	img_rec_t	records[count]		sorted by key
+	uint32_t	fences[nfences]		key prefix of every
+						FENCE_STEP'th record
+	byte		keys[keysize]		key text
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "datastore.h"
+#include "datastore_img.h"
+#include "error.h"
+#include "mxcat.h"
+#include "xmalloc.h"
+
+#define	IMG_MAGIC	"BFIMAGE1"
+#define	IMG_ENDIAN	0x01020304
+#define	FENCE_STEP	64
+
+typedef struct {
+    char	magic[8];
+    uint32_t	endian;
+    uint32_t	count;		/* number of records */
+    uint32_t	nfences;	/* number of fences */
+    uint32_t	keysize;	/* bytes of key text */
+    uint32_t	generation[2];	/* of the wordlist, see ds_get_generation() */
+} img_header_t;
+
+typedef struct {
+    uint32_t	key;		/* offset of the key text */
+    uint32_t	leng;		/* length of the key text */
+    uint32_t	count[IX_SIZE];
+    uint32_t	date;
+} img_rec_t;
+
+struct img_s {
+    char		*path;
+    void		*map;
+    size_t		 size;
+    const img_header_t	*hdr;
+    const img_rec_t	*recs;
+    const uint32_t	*fences;
+    const byte		*keys;
+};
+
+/* Function Definitions */
+
+/** first four bytes of a key as a number, so that comparing prefixes
+ * never contradicts comparing keys */
+static uint32_t key_prefix(const byte *key, uint32_t leng)
+{
+    uint32_t p = 0;
+    uint32_t i;
+
+    for (i = 0; i < 4; i += 1)
+	p = (p << 8) | (i < leng ? key[i] : 0);
+
+    return p;
+}
+
+/** \return the key text of \a rec.  Only the records a lookup visits
+ * are checked, rather than all of them when the image is opened. */
+static const byte *rec_key(const img_t *img, const img_rec_t *rec)
+{
+    uint32_t keysize = img->hdr->keysize;
+
+    if (rec->key > keysize || rec->leng > keysize - rec->key) {
+	print_error(__FILE__, __LINE__, "%s is corrupt, run bogoutil --compile again.",
+		    img->path);
+	exit(EX_ERROR);
+    }
+
+    return img->keys + rec->key;
+}
+
+static int rec_cmp(const img_t *img, const word_t *word, const img_rec_t *rec)
+{
+    uint32_t l = min(word->leng, rec->leng);
+    int r = memcmp(word->u.text, rec_key(img, rec), l);
+    if (r) return r;
+    if (word->leng > rec->leng) return 1;
+    if (word->leng < rec->leng) return -1;
+    return 0;
+}
+
+img_t *img_open(bfpath *bfp, const dsv_t *gen)
+{
+    char *path = mxcat(bfp->filepath, IMG_EXT, NULL);
+    struct stat ist;
+    img_t *img;
+    void *map;
+    img_header_t hdr;
+    uint64_t need;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	xfree(path);
+	return NULL;
+    }
+
+    /* the header tells whether the image is of any use before
+     * anything is mapped; after a training run, it is not */
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr) ||
+	memcmp(hdr.magic, IMG_MAGIC, sizeof(hdr.magic)) != 0 ||
+	hdr.endian != IMG_ENDIAN) {
+	if (DEBUG_DATABASE(1))
+	    fprintf(dbgout, "ignoring image %s, bad format or byte order.\n", path);
+	close(fd);
+	xfree(path);
+	return NULL;
+    }
+
+    if (hdr.generation[0] != gen->count[0] ||
+	hdr.generation[1] != gen->count[1]) {
+	if (DEBUG_DATABASE(1))
+	    fprintf(dbgout, "ignoring image %s, the wordlist has changed.\n", path);
+	close(fd);
+	xfree(path);
+	return NULL;
+    }
+
+    need = sizeof(img_header_t)
+	+ (uint64_t) hdr.count * sizeof(img_rec_t)
+	+ (uint64_t) hdr.nfences * sizeof(uint32_t)
+	+ hdr.keysize;
+
+    if (fstat(fd, &ist) != 0 ||
+	hdr.nfences != (hdr.count + FENCE_STEP - 1) / FENCE_STEP ||
+	need != (uint64_t) ist.st_size) {
+	if (DEBUG_DATABASE(1))
+	    fprintf(dbgout, "ignoring image %s, bad format or byte order.\n", path);
+	close(fd);
+	xfree(path);
+	return NULL;
+    }
+
+    map = mmap(NULL, (size_t) ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+	print_error(__FILE__, __LINE__, "cannot map %s: %s", path, strerror(errno));
+	xfree(path);
+	return NULL;
+    }
+
+    if (DEBUG_DATABASE(1))
+	fprintf(dbgout, "using image %s, %lu tokens.\n", path,
+		(unsigned long) hdr.count);
+
+    img = (img_t *) xmalloc(sizeof(*img));
+    img->path = path;
+    img->map = map;
+    img->size = (size_t) ist.st_size;
+    img->hdr = (const img_header_t *) map;
+    img->recs = (const img_rec_t *) (img->hdr + 1);
+    img->fences = (const uint32_t *) (img->recs + hdr.count);
+    img->keys = (const byte *) (img->fences + hdr.nfences);
+
+    return img;
+}
+
+bool img_current(const img_t *img, const dsv_t *gen)
+{
+    return img->hdr->generation[0] == gen->count[0] &&
+	img->hdr->generation[1] == gen->count[1];
+}
+
+void img_close(img_t *img)
+{
+    munmap(img->map, img->size);
+    xfree(img->path);
+    xfree(img);
+}
+
+int img_read(img_t *img, const word_t *word, /*@out@*/ dsv_t *val)
+{
+    uint32_t p = key_prefix(word->u.text, word->leng);
+    uint32_t nfences = img->hdr->nfences;
+    uint32_t lo, hi, mid;
+
+    memset(val, 0, sizeof(*val));
+
+    /* The fences narrow the search down to the blocks from the last
+     * one starting below the prefix up to the first one starting
+     * above it, mostly a single block. */
+    for (lo = 0, hi = nfences; lo < hi; ) {
+	mid = lo + (hi - lo) / 2;
+	if (img->fences[mid] < p) lo = mid + 1; else hi = mid;
+    }
+    lo = (lo > 0) ? lo - 1 : 0;
+
+    for (mid = lo, hi = nfences; mid < hi; ) {
+	uint32_t m = mid + (hi - mid) / 2;
+	if (img->fences[m] <= p) mid = m + 1; else hi = m;
+    }
+
+    lo *= FENCE_STEP;
+    hi = min(img->hdr->count, hi * FENCE_STEP);
+
+    while (lo < hi) {
+	const img_rec_t *rec;
+	int r;
+
+	mid = lo + (hi - lo) / 2;
+	rec = &img->recs[mid];
+	r = rec_cmp(img, word, rec);
+	if (r == 0) {
+	    val->spamcount = rec->count[IX_SPAM];
+	    val->goodcount = rec->count[IX_GOOD];
+	    val->date = rec->date;
+	    return 0;
+	}
+	if (r > 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return 1;
+}
+
+ex_t img_foreach(img_t *img, ds_foreach_t *hook, void *userdata)
+{
+    uint32_t i;
+
+    for (i = 0; i < img->hdr->count; i += 1) {
+	const img_rec_t *rec = &img->recs[i];
+	word_t key;
+	dsv_t val;
+	ex_t ret;
+
+	key.u.ctext = (const char *) rec_key(img, rec);
+	key.leng = rec->leng;
+	val.spamcount = rec->count[IX_SPAM];
+	val.goodcount = rec->count[IX_GOOD];
+	val.date = rec->date;
+
+	ret = (*hook)(&key, &val, userdata);
+	if (ret != EX_OK)
+	    return ret;
+    }
+
+    return EX_OK;
+}
+
+/* compiling */
+
+typedef struct {
+    img_rec_t	*recs;
+    uint32_t	 count;
+    uint32_t	 size;
+    byte	*keys;
+    uint32_t	 keysize;
+    uint32_t	 keyalloc;
+    dsv_t	 gen;
+} builder_t;
+
+static const byte *sort_keys;	/* key text for compare_rec() */
+
+static int compare_rec(const void *pv1, const void *pv2)
+{
+    const img_rec_t *r1 = (const img_rec_t *) pv1;
+    const img_rec_t *r2 = (const img_rec_t *) pv2;
+    uint32_t l = min(r1->leng, r2->leng);
+    int r = memcmp(sort_keys + r1->key, sort_keys + r2->key, l);
+    if (r) return r;
+    if (r1->leng > r2->leng) return 1;
+    if (r1->leng < r2->leng) return -1;
+    return 0;
+}
+
+static ex_t compile_hook(word_t *key, dsv_t *data, void *userdata)
+{
+    builder_t *b = (builder_t *) userdata;
+    img_rec_t *rec;
+
+    if (fDie)
+	exit(EX_ERROR);
+
+    if (b->count == b->size) {
+	b->size = b->size ? b->size * 2 : 4096;
+	b->recs = (img_rec_t *) xrealloc(b->recs, b->size * sizeof(img_rec_t));
+    }
+
+    while (b->keysize + key->leng > b->keyalloc) {
+	b->keyalloc = b->keyalloc ? b->keyalloc * 2 : 65536;
+	b->keys = (byte *) xrealloc(b->keys, b->keyalloc);
+    }
+
+    rec = &b->recs[b->count++];
+    rec->key = b->keysize;
+    rec->leng = key->leng;
+    rec->count[IX_SPAM] = data->spamcount;
+    rec->count[IX_GOOD] = data->goodcount;
+    rec->date = data->date;
+
+    memcpy(b->keys + b->keysize, key->u.text, key->leng);
+    b->keysize += key->leng;
+
+    return EX_OK;
+}
+
+static bool write_image(FILE *fp, builder_t *b)
+{
+    img_header_t hdr;
+    uint32_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMG_MAGIC, sizeof(hdr.magic));
+    hdr.endian = IMG_ENDIAN;
+    hdr.count = b->count;
+    hdr.nfences = (b->count + FENCE_STEP - 1) / FENCE_STEP;
+    hdr.keysize = b->keysize;
+    hdr.generation[0] = b->gen.count[0];
+    hdr.generation[1] = b->gen.count[1];
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	fwrite(b->recs, sizeof(img_rec_t), b->count, fp) != b->count)
+	return false;
+
+    for (i = 0; i < b->count; i += FENCE_STEP) {
+	const img_rec_t *rec = &b->recs[i];
+	uint32_t p = key_prefix(b->keys + rec->key, rec->leng);
+	if (fwrite(&p, sizeof(p), 1, fp) != 1)
+	    return false;
+    }
+
+    if (fwrite(b->keys, 1, b->keysize, fp) != b->keysize)
+	return false;
+
+    return fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+ex_t img_compile(void *dbe, bfpath *bfp)
+{
+    builder_t b;
+    void *dsh;
+    char *path, *temp;
+    FILE *fp = NULL;
+    struct stat st;
+    bool ok = false;
+    ex_t ret;
+    int fd;
+
+    memset(&b, 0, sizeof(b));
+
+    dsh = ds_open(dbe, bfp, DS_READ);
+    if (dsh == NULL) {
+	fprintf(stderr, "Can't open file '%s'\n", bfp->filepath);
+	return EX_ERROR;
+    }
+
+    ret = EX_ERROR;
+    if (DST_OK == ds_txn_begin(dsh)) {
+	/* lookups in the image go by token text */
+	if (ds_get_key_hash(dsh) != KH_NONE)
+	    fprintf(stderr, "%s: hashed keys, not compiling.\n", bfp->filepath);
+	else {
+	    ds_get_generation(dsh, &b.gen);
+	    ret = ds_foreach(dsh, compile_hook, &b);
+	}
+	if (ds_txn_commit(dsh) != DST_OK)
+	    ret = EX_ERROR;
+    }
+    ds_close(dsh);
+
+    if (ret != EX_OK) {
+	fprintf(stderr, "error reading %s\n", bfp->filepath);
+	return ret;
+    }
+
+    sort_keys = b.keys;
+    qsort(b.recs, b.count, sizeof(img_rec_t), compare_rec);
+    sort_keys = NULL;
+
+    path = mxcat(bfp->filepath, IMG_EXT, NULL);
+    temp = mxcat(path, ".XXXXXX", NULL);
+
+    fd = mkstemp(temp);
+    if (fd >= 0) {
+	/* readable by whoever may read the wordlist */
+	if (stat(bfp->filepath, &st) == 0)
+	    (void) fchmod(fd, st.st_mode & 0666);
+	fp = fdopen(fd, "wb");
+	if (fp == NULL)
+	    close(fd);
+    }
+
+    if (fp != NULL) {
+	ok = write_image(fp, &b);
+	if (fclose(fp) != 0)
+	    ok = false;
+    }
+
+    if (!ok || rename(temp, path) != 0) {
+	fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+	if (fd >= 0)
+	    unlink(temp);
+	ret = EX_ERROR;
+    }
+    else if (verbose)
+	fprintf(dbgout, "%lu tokens compiled into %s\n",
+		(unsigned long) b.count, path);
+
+    xfree(temp);
+    xfree(path);
+    xfree(b.keys);
+    xfree(b.recs);
+
+    return ret;
+}
+
+/* End */
@@ -0,0 +1,44 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   datastore_img.h -- compiled, read-only wordlist images
+
+******************************************************************************/
+
+#ifndef	DATASTORE_IMG_H
+#define	DATASTORE_IMG_H
+
+#include "datastore.h"
+
+/** File name suffix of a wordlist's compiled image. */
+#define	IMG_EXT		".img"
+
+/** Handle of an open image. */
+typedef struct img_s img_t;
+
+/** Map the image for the wordlist at \a bfp, if there is one that was
+ * compiled from generation \a gen of the wordlist (see
+ * ds_get_generation()) on a host with the same byte order.
+ * \return NULL if there is no usable image. */
+extern img_t *img_open(bfpath *bfp, const dsv_t *gen);
+
+/** \return true if \a img was compiled from generation \a gen of the
+ * wordlist. */
+extern bool img_current(const img_t *img, const dsv_t *gen);
+
+/** Unmap the image and free the handle. */
+extern void img_close(/*@only@*/ img_t *img);
+
+/** Look up \a word.  \return 0 if found, 1 if not, just like ds_read(). */
+extern int img_read(img_t *img, const word_t *word, /*@out@*/ dsv_t *val);
+
+/** Call \a hook for every token of the image in key order. */
+extern ex_t img_foreach(img_t *img, ds_foreach_t *hook, void *userdata);
+
+/** Write an image of the wordlist at \a bfp and atomically replace the
+ * previous one. */
+extern ex_t img_compile(void *dbe, bfpath *bfp);
+
+#endif	/* DATASTORE_IMG_H */
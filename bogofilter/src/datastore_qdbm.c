@@ -193,6 +193,65 @@ int db_get_dbvalue(void *vhandle, const dbv_t *token, /*@out@*/ dbv_t *val)
 }
 
 
+int db_get_dbvalues(void *vhandle, uint count, const dbv_t *tokens,
+		    /*@out@*/ dbv_t *vals, /*@out@*/ int *rets)
+{
+    dbh_t *handle = vhandle;
+    VILLA *dbp = handle->dbp;
+
+    bool positioned = false;	/* cursor is on key, which is >= all previous tokens */
+    const void *key = NULL;
+    int ksiz = 0;
+    uint i;
+
+    for (i = 0; i < count; i += 1) {
+	const void *data;
+	int siz, cmp = 1;
+
+	if (positioned)
+	    cmp = dbv_cmp(&tokens[i], key, ksiz);
+
+	/* only move the cursor if the token is past its key */
+	if (cmp > 0) {
+	    if (!vlcurjump(dbp, tokens[i].data, tokens[i].leng, VL_JFORWARD) ||
+		(key = vlcurkeycache(dbp, &ksiz)) == NULL) {
+		if (dpecode != DP_ENOITEM) {
+		    print_error(__FILE__, __LINE__, "(qdbm) vlcurjump err: %d, %s",
+				dpecode, dperrmsg(dpecode));
+		    exit(EX_ERROR);
+		}
+		/* beyond the last key */
+		for (; i < count; i += 1)
+		    rets[i] = DS_NOTFOUND;
+		break;
+	    }
+	    positioned = true;
+	    cmp = dbv_cmp(&tokens[i], key, ksiz);
+	}
+
+	if (cmp < 0) {
+	    rets[i] = DS_NOTFOUND;
+	    continue;
+	}
+
+	data = vlcurvalcache(dbp, &siz);
+	if (data == NULL || vals[i].leng < (unsigned)siz) {
+	    print_error(__FILE__, __LINE__,
+			"(qdbm) db_get_dbvalues( '%.*s' ), size error %lu: %lu",
+			CLAMP_INT_MAX(tokens[i].leng),
+			(char *)tokens[i].data, (unsigned long)vals[i].leng,
+			(unsigned long)siz);
+	    exit(EX_ERROR);
+	}
+
+	vals[i].leng = siz;		/* read count */
+	memcpy(vals[i].data, data, siz);
+	rets[i] = 0;
+    }
+
+    return 0;
+}
+
 /*
    Re-organize database according to some heuristics
 */
@@ -5,6 +5,7 @@
  *
  * This file handles a static table named "bogofilter" in a SQLite3
  * database. The table has two "BLOB"-typed columns, key and value.
+ * Databases are written in WAL journal mode.
  *
  * GNU GENERAL PUBLIC LICENSE v2
  */
@@ -17,6 +18,7 @@
 #include "datastore_db.h"
 
 #include "error.h"
+#include "maint.h"
 #include "rand_sleep.h"
 #include "xmalloc.h"
 #include "xstrdup.h"
@@ -27,10 +29,13 @@ struct dbhsqlite_t {
     char *name;	   /**< database file name */
     sqlite3 *db;   /**< pointer to SQLite3 handle */
     sqlite3_stmt *select; /**< prepared SELECT statement for DB retrieval */
-    sqlite3_stmt *insert; /**< prepared INSERT OR REPLACE for DB update */
+    sqlite3_stmt *insert; /**< prepared INSERT ... ON CONFLICT for DB update */
     sqlite3_stmt *delete; /**< prepared DELETE statement */
+    sqlite3_stmt *select_many; /**< prepared SELECT ... IN for batches */
+    bool readonly; /**< opened with DS_READ, transactions are deferred */
     bool created;  /**< gets set by db_open if it created the database new */
     bool swapped;  /**< if endian swapped on disk vs. current host */
+    bool attached; /**< the copy that replaces it is attached */
 };
 
 /** Convenience shortcut to avoid typing "struct dbh_t" */
@@ -38,6 +43,9 @@ typedef struct dbhsqlite_t dbh_t;
 
 static const char *ENDIAN32 = ".ENDIAN32";
 
+/** Number of keys db_get_dbvalues() looks up with one SELECT. */
+#define BATCH	64
+
 void db_flush(void *unused) { (void)unused; }
 
 static int sql_txn_begin(void *vhandle);
@@ -45,32 +53,35 @@ static int sql_txn_abort(void *vhandle);
 static int sql_txn_commit(void *vhandle);
 static u_int32_t sql_pagesize(bfpath *bfp);
 static ex_t sql_verify(bfpath *bfp);
+static ex_t sql_prepare_replace(void *vhandle, bfpath *copy);
+static ex_t sql_replace(void *vhandle, bfpath *copy);
+
+/** Version of the table layout, kept in the database's user_version.
+ * Version 0 databases have a rowid table with a key index and an
+ * additional (key,value) index. */
+#define SCHEMA_VERSION	2
 
 /** The layout of the bogofilter table, formatted as SQL statement.
  *
- * The additional index, although making writes a bit slower, speeds up
- * queries noticably as it improves locality of referenced data and
- * reduces complexity of the retrieval of the value column.
+ * Without a rowid, the table is a single B-tree ordered by key that
+ * holds the value next to it, so lookups need no index and each write
+ * updates one tree instead of three.
  */
 #define LAYOUT \
 	"CREATE TABLE bogofilter (" \
 	"   key   BLOB PRIMARY KEY," \
-	"   value BLOB);" \
-	"CREATE INDEX bfidx ON bogofilter(key,value);"
-/*
- * another experimental layout is as follows,
- * but does not appear to make a lot of difference
- * performance-wise (evaluation in other environments
- * is required though):
- *
-#define LAYOUT \
-    "CREATE TABLE bogofilter (key BLOB, value BLOB); " \
-    "CREATE INDEX bfidx ON bogofilter(key,value);" \
-    "CREATE TRIGGER bfuniquekey BEFORE INSERT ON bogofilter " \
-    " FOR EACH ROW WHEN EXISTS(SELECT key FROM bogofilter WHERE (key=NEW.key) LIMIT 1) " \
-    " BEGIN UPDATE bogofilter SET value=NEW.value WHERE (key=NEW.key); SELECT RAISE(IGNORE); END;"
-#endif
- */
+	"   value BLOB) WITHOUT ROWID;" \
+	"PRAGMA user_version=2;"
+
+/** Copies a version 0 table into the current layout, in key order. */
+#define UPGRADE \
+	"CREATE TABLE bogofilter_new (" \
+	"   key   BLOB PRIMARY KEY," \
+	"   value BLOB) WITHOUT ROWID;" \
+	"INSERT INTO bogofilter_new SELECT key, value FROM bogofilter ORDER BY key;" \
+	"DROP TABLE bogofilter;" \
+	"ALTER TABLE bogofilter_new RENAME TO bogofilter;" \
+	"PRAGMA user_version=2;"
 
 dsm_t dsm_sqlite = {
     /* public -- used in datastore.c */
@@ -98,7 +109,9 @@ dsm_t dsm_sqlite = {
     NULL,	/* dsm_remove           */
     &sql_verify,/* dsm_verify           */
     NULL,	/* dsm_list_logfiles    */
-    NULL	/* dsm_leafpages        */
+    NULL,	/* dsm_leafpages        */
+    &sql_prepare_replace,/* dsm_prepare_replace */
+    &sql_replace/* dsm_replace          */
 };
 
 dsm_t *dsm = &dsm_sqlite;
@@ -107,6 +120,20 @@ dsm_t *dsm = &dsm_sqlite;
 #define BEGIN \
 	"BEGIN TRANSACTION;"
 
+/** The command to begin a transaction of a writer.  It takes the
+ * write lock up front, waiting for it in the busy handler, so that a
+ * deferred transaction cannot fail with SQLITE_BUSY when it first
+ * writes.  In WAL mode, readers are not held up by it. */
+#define BEGIN_WRITE \
+	"BEGIN IMMEDIATE TRANSACTION;"
+
+/** The command to begin a writer's transaction while a copy is
+ * attached.  BEGIN IMMEDIATE would take the write lock of the copy
+ * as well, which keeps the copy from being written; the empty DELETE
+ * takes that of the main database alone. */
+#define BEGIN_WRITE_MAIN \
+	"BEGIN TRANSACTION; DELETE FROM main.bogofilter WHERE 0;"
+
 /* real functions */
 /** Initialize database handle and return it.
  * \returns non-NULL, as it exits with EX_ERROR in case of trouble. */
@@ -245,6 +272,39 @@ static int db_loop(sqlite3 *db,	/**< SQLite3 database handle */
     return found ? 0 : DS_NOTFOUND;
 }
 
+/** Callback for PRAGMA user_version, stores it in \a ptr. */
+static int version_cb(void *ptr, int argc, char **argv, char **dummy) {
+    int *iptr = ptr;
+
+    (void)dummy;
+
+    if (argc != 1 || argv[0] == NULL)
+	return -1;
+    *iptr = atoi(argv[0]);
+    return 0;
+}
+
+/** Rewrites a table with an older layout for \a dbh in the current one.
+ * Must be called inside a transaction.
+ * \returns the number of the layout found, or -1 on error. */
+static int sql_upgrade(dbh_t *dbh) {
+    int layout = 0;
+
+    if (sqlite3_exec(dbh->db, "PRAGMA user_version;", version_cb, &layout, NULL) != SQLITE_OK) {
+	print_error(__FILE__, __LINE__, "Can't read schema version of %s: %s\n",
+		dbh->name, sqlite3_errmsg(dbh->db));
+	return -1;
+    }
+
+    if (layout < SCHEMA_VERSION && upgrade_wordlist_version) {
+	fprintf(dbgout, "Upgrading SQLite table of %s.\n", dbh->name);
+	if (sqlexec(dbh->db, UPGRADE))
+	    return -1;
+    }
+
+    return layout;
+}
+
 /** This busy handler just sleeps a while and retries */
 static int busyhandler(void *dummy, int count)
 {
@@ -254,26 +314,17 @@ static int busyhandler(void *dummy, int count)
     return 1;
 }
 
-static void check_sqlite_version(void)
+/** The library may be older than the header configure checked: the
+ * upserts and WITHOUT ROWID tables need 3.24.0.
+ * \return true if the library will do */
+static bool check_sqlite_version(void)
 {
-    const unsigned int wmaj = 3, wmin = 6, wpl = 12;	/* desired version of sqlite3 library */
-    unsigned int vmaj, vmin, vpl;			/* actual version of sqlite3 library */
-    static int complained;
-    const char *v;
+    if (sqlite3_libversion_number() >= 3024000)
+	return true;
 
-    if (complained)
-	return;
-    complained = 1;
-    v = sqlite3_libversion();
-    sscanf(v, "%u.%u.%u", &vmaj, &vmin, &vpl);
-    if (vmaj > wmaj) return;
-    if (vmaj == wmaj && vmin > wmin) return;
-    if (vmaj == wmaj && vmin == wmin && vpl >= wpl) return;
-    if (!getenv("BF_USE_OLD_SQLITE"))
-	fprintf(stderr,
-		"\n"
-		"WARNING: please update sqlite to %d.%d.%d or newer.\n"
-		"\n", wmaj, wmin, wpl);
+    print_error(__FILE__, __LINE__, "SQLite %s is too old, 3.24.0 or newer is required.",
+		sqlite3_libversion());
+    return false;
 }
 
 void *db_open(void *dummyenv, bfpath *bfp, dbmode_t mode)
@@ -284,7 +335,8 @@ void *db_open(void *dummyenv, bfpath *bfp, dbmode_t mode)
 
     (void)dummyenv;
 
-    check_sqlite_version();
+    if (!check_sqlite_version())
+	return NULL;
 
     dbh = dbh_init(bfp);
 
@@ -314,13 +366,26 @@ void *db_open(void *dummyenv, bfpath *bfp, dbmode_t mode)
 	goto barf;
     }
 
+    dbh->readonly = mode == DS_READ;
+
     /* check/set endianness marker and create table if needed */
     if (mode != DS_READ) {
-	/* using IMMEDIATE or DEFERRED here locks up in t.lock3
-	 * or t.bulkmode
-	 * using EXCLUSIVE locks up in t.lock3 on MAC OSX
+	int layout = SCHEMA_VERSION;
+
+	/* readers then work on a snapshot and never block the writer;
+	 * the mode is kept in the file */
+	if (sqlexec(dbh->db, "PRAGMA journal_mode=WAL;")) goto barf;
+	/* in WAL mode, this is safe against corruption, a crash may
+	 * merely lose the last transactions */
+	if (sqlexec(dbh->db, "PRAGMA synchronous=NORMAL;")) goto barf;
+
+	/* This may create the table, so it takes the write lock up
+	 * front like any writer.  In WAL mode, this passes t.lock3 and
+	 * t.bulkmode; with the rollback journal, IMMEDIATE and DEFERRED
+	 * used to lock up there.  EXCLUSIVE locked up in t.lock3 on
+	 * Mac OS X.
 	 */
-	if (sqlexec(dbh->db, BEGIN)) goto barf;
+	if (sqlexec(dbh->db, BEGIN_WRITE)) goto barf;
 	/*
 	 * trick: the sqlite_master table (see SQLite FAQ) is read-only
 	 * and lists all tables, indexes etc. so we use it to check if
@@ -335,6 +400,8 @@ void *db_open(void *dummyenv, bfpath *bfp, dbmode_t mode)
 		NULL, NULL);
 	switch (rc) {
 	    case 0:
+		layout = sql_upgrade(dbh);
+		if (layout < 0) goto barf;
 		if (sqlexec(dbh->db, "COMMIT;")) goto barf;
 		break;
 	    case DS_NOTFOUND:
@@ -360,6 +427,11 @@ void *db_open(void *dummyenv, bfpath *bfp, dbmode_t mode)
 	    default:
 		goto barf;
 	}
+
+	/* give the space of the old table back */
+	if (layout < SCHEMA_VERSION && upgrade_wordlist_version &&
+		sqlexec(dbh->db, "VACUUM;"))
+	    goto barf;
     }
 
     /*
@@ -429,6 +501,7 @@ barf2:
 void db_close(void *handle) {
     int rc;
     dbh_t *dbh = handle;
+    if (dbh->select_many) sqlite3_finalize(dbh->select_many);
     if (dbh->delete) sqlite3_finalize(dbh->delete);
     if (dbh->insert) sqlite3_finalize(dbh->insert);
     if (dbh->select) sqlite3_finalize(dbh->select);
@@ -451,7 +524,9 @@ const char *db_version_str(void) {
 
 static int sql_txn_begin(void *vhandle) {
     dbh_t *dbh = vhandle;
-    return sqlexec(dbh->db,  BEGIN );
+    if (dbh->readonly)
+	return sqlexec(dbh->db, BEGIN);
+    return sqlexec(dbh->db, dbh->attached ? BEGIN_WRITE_MAIN : BEGIN_WRITE);
 }
 
 static int sql_txn_abort(void *vhandle) {
@@ -521,8 +596,11 @@ int db_delete(void *vhandle, const dbv_t *key) {
 int db_set_dbvalue(void *vhandle, const dbv_t *key, const dbv_t *val) {
     dbh_t *dbh = vhandle;
 
+    /* unlike INSERT OR REPLACE, this updates an existing row in place
+     * rather than deleting it and inserting a new one */
     if (!dbh->insert)
-	dbh->insert = sqlprep(dbh, "INSERT OR REPLACE INTO bogofilter VALUES(?,?);", true);
+	dbh->insert = sqlprep(dbh, "INSERT INTO bogofilter VALUES(?,?) "
+		"ON CONFLICT(key) DO UPDATE SET value=excluded.value;", true);
 
     sqlite3_bind_blob(dbh->insert, 1, key->data, key->leng, SQLITE_STATIC);
     sqlite3_bind_blob(dbh->insert, 2, val->data, val->leng, SQLITE_STATIC);
@@ -536,6 +614,84 @@ int db_get_dbvalue(void *vhandle, const dbv_t* token, /*@out@*/ dbv_t *val) {
     return sql_fastpath(dbh, "db_get_dbvalue", dbh->select, val, DS_NOTFOUND);
 }
 
+/** Prepare the statement that retrieves up to BATCH keys in key order. */
+static sqlite3_stmt *prep_select_many(dbh_t *dbh) {
+    const char *head = "SELECT key, value FROM bogofilter WHERE key IN (";
+    const char *tail = ") ORDER BY key;";
+    char *cmd = xmalloc(strlen(head) + 2 * BATCH + strlen(tail));
+    char *p = cmd;
+    sqlite3_stmt *stmt;
+    int i;
+
+    p += sprintf(p, "%s", head);
+    for (i = 0; i < BATCH; i++)
+	p += sprintf(p, i ? ",?" : "?");
+    strcpy(p, tail);
+
+    stmt = sqlprep(dbh, cmd, true);
+    xfree(cmd);
+    return stmt;
+}
+
+int db_get_dbvalues(void *vhandle, uint count, const dbv_t *tokens,
+		    /*@out@*/ dbv_t *vals, /*@out@*/ int *rets) {
+    dbh_t *dbh = vhandle;
+    sqlite3_stmt *stmt;
+    uint base, i;
+
+    if (!dbh->select_many)
+	dbh->select_many = prep_select_many(dbh);
+    stmt = dbh->select_many;
+
+    for (i = 0; i < count; i++)
+	rets[i] = DS_NOTFOUND;
+
+    /* The rows come back sorted like the keys, so they are matched up
+     * by merging.  Unused parameters stay NULL and match nothing. */
+    for (base = 0; base < count; base += BATCH) {
+	uint n = min(BATCH, count - base);
+	uint j = base;
+	int rc;
+
+	sqlite3_clear_bindings(stmt);
+	for (i = 0; i < n; i++)
+	    sqlite3_bind_blob(stmt, i + 1, tokens[base + i].data,
+			      tokens[base + i].leng, SQLITE_STATIC);
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+	    const void *key = sqlite3_column_blob(stmt, 0);
+	    int ksiz = sqlite3_column_bytes(stmt, 0);
+
+	    while (j < base + n && dbv_cmp(&tokens[j], key, ksiz) < 0)
+		j++;
+	    for (; j < base + n && dbv_cmp(&tokens[j], key, ksiz) == 0; j++) {
+		dbv_t *val = &vals[j];
+		int len = min(INT_MAX, val->leng);
+		val->leng = min(len, sqlite3_column_bytes(stmt, 1));
+		memcpy(val->data, sqlite3_column_blob(stmt, 1), val->leng);
+		rets[j] = 0;
+	    }
+	}
+
+	sqlite3_reset(stmt);
+
+	switch (rc) {
+	    case SQLITE_DONE:
+		break;
+	    case SQLITE_BUSY:
+		sql_txn_abort(dbh);
+		return DS_ABORT_RETRY;
+	    default:
+		print_error(__FILE__, __LINE__,
+			"db_get_dbvalues: error executing statement on %s: %s (%d)\n",
+			dbh->name, sqlite3_errmsg(dbh->db), rc);
+		return rc;
+	}
+    }
+
+    return 0;
+}
+
 ex_t db_foreach(void *vhandle, db_foreach_t hook, void *userdata) {
     dbh_t *dbh = vhandle;
     const char *cmd = "SELECT key, value FROM bogofilter;";
@@ -648,3 +804,72 @@ static ex_t sql_verify(bfpath *bfp)
     }
     return faulty ? EX_ERROR : EX_OK;
 }
+
+/** Attaches the database file \a copy, which is yet to be written, to
+ * the database \a vhandle as "compact".  ATTACH does not work within a
+ * transaction, so this comes before the transaction that sql_replace()
+ * copies the rows in; thus the write lock is held from reading the
+ * wordlist until its contents are replaced, and no update of another
+ * process is lost in between.
+ */
+static ex_t sql_prepare_replace(void *vhandle, bfpath *copy)
+{
+    dbh_t *dbh = vhandle;
+    char *cmd;
+    int rc;
+
+    cmd = sqlite3_mprintf("ATTACH DATABASE %Q AS compact;", copy->filepath);
+    rc = sqlexec(dbh->db, cmd);
+    sqlite3_free(cmd);
+
+    if (rc != 0)
+	return EX_ERROR;
+
+    dbh->attached = true;
+    return EX_OK;
+}
+
+/** Replaces the contents of the database \a vhandle with those of the
+ * database file \a copy, which sql_prepare_replace() has attached.
+ * The copy must not be renamed over it: other processes find the -wal
+ * and -shm files of the database by its name, and would apply those of
+ * the old file to the new one.  So the rows are copied over within the
+ * caller's transaction, which is committed so that VACUUM can give the
+ * space back, and begun anew at the end.
+ */
+static ex_t sql_replace(void *vhandle, bfpath *copy)
+{
+    dbh_t *dbh = vhandle;
+    bool ok;
+
+    (void)copy;
+
+    if (!dbh->attached)
+	return EX_ERROR;
+
+    ok = sqlexec(dbh->db, "SAVEPOINT replace;") == 0;
+    if (ok) {
+	if (sqlexec(dbh->db, "DELETE FROM main.bogofilter;") == 0 &&
+	    sqlexec(dbh->db, "INSERT INTO main.bogofilter "
+		    "SELECT key, value FROM compact.bogofilter;") == 0)
+	    (void) sqlexec(dbh->db, "RELEASE replace;");
+	else {
+	    (void) sqlexec(dbh->db, "ROLLBACK TO replace; RELEASE replace;");
+	    ok = false;
+	}
+    }
+    if (!ok)
+	return EX_ERROR;
+
+    if (sqlexec(dbh->db, "COMMIT;") != 0)
+	return EX_ERROR;
+    (void) sqlexec(dbh->db, "DETACH DATABASE compact;");
+    dbh->attached = false;
+
+    ok = sqlexec(dbh->db, "VACUUM;") == 0;
+
+    if (sqlexec(dbh->db, BEGIN_WRITE) != 0)
+	ok = false;
+
+    return ok ? EX_OK : EX_ERROR;
+}
@@ -96,7 +96,9 @@ static dsm_t dsm_tc = {
     NULL,	/* dsm_remove           */
     NULL,	/* dsm_verify           */
     NULL,	/* dsm_list_logfiles    */
-    NULL	/* dsm_leafpages        */
+    NULL,	/* dsm_leafpages        */
+    NULL,	/* dsm_prepare_replace  */
+    NULL	/* dsm_replace          */
 };
 
 dsm_t *dsm = &dsm_tc;
@@ -258,6 +260,70 @@ int db_get_dbvalue(void *vhandle, const dbv_t *token, /*@out@*/ dbv_t *val)
 }
 
 
+int db_get_dbvalues(void *vhandle, uint count, const dbv_t *tokens,
+		    /*@out@*/ dbv_t *vals, /*@out@*/ int *rets)
+{
+    dbh_t *handle = vhandle;
+    TCBDB *dbp = handle->dbp;
+    BDBCUR *cursor;
+
+    bool positioned = false;	/* cursor is on key, which is >= all previous tokens */
+    const void *key = NULL;
+    int ksiz = 0;
+    uint i;
+
+    cursor = tcbdbcurnew(dbp);
+
+    for (i = 0; i < count; i += 1) {
+	const void *data;
+	int siz, cmp = 1;
+
+	if (positioned)
+	    cmp = dbv_cmp(&tokens[i], key, ksiz);
+
+	/* only move the cursor if the token is past its key */
+	if (cmp > 0) {
+	    if (!tcbdbcurjump(cursor, tokens[i].data, tokens[i].leng) ||
+		(key = tcbdbcurkey3(cursor, &ksiz)) == NULL) {
+		if (tcbdbecode(dbp) != TCENOREC) {
+		    print_error(__FILE__, __LINE__, "(tc) tcbdbcurjump err: %d, %s",
+				tcbdbecode(dbp), tcbdberrmsg(tcbdbecode(dbp)));
+		    exit(EX_ERROR);
+		}
+		/* beyond the last key */
+		for (; i < count; i += 1)
+		    rets[i] = DS_NOTFOUND;
+		break;
+	    }
+	    positioned = true;
+	    cmp = dbv_cmp(&tokens[i], key, ksiz);
+	}
+
+	if (cmp < 0) {
+	    rets[i] = DS_NOTFOUND;
+	    continue;
+	}
+
+	data = tcbdbcurval3(cursor, &siz);
+	if (data == NULL || vals[i].leng < (unsigned)siz) {
+	    print_error(__FILE__, __LINE__,
+			"(tc) db_get_dbvalues( '%.*s' ), size error %lu: %lu",
+			CLAMP_INT_MAX(tokens[i].leng),
+			(char *)tokens[i].data, (unsigned long)vals[i].leng,
+			(unsigned long)siz);
+	    exit(EX_ERROR);
+	}
+
+	vals[i].leng = siz;		/* read count */
+	memcpy(vals[i].data, data, siz);
+	rets[i] = 0;
+    }
+
+    tcbdbcurdel(cursor);
+
+    return 0;
+}
+
 /*
    Re-organize database according to some heuristics
 */
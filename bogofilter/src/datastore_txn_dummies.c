@@ -46,7 +46,9 @@ dsm_t dsm_dummies = {
     NULL,	/* dsm_remove           */
     NULL,	/* dsm_verify           */
     NULL,	/* dsm_list_logfiles    */
-    NULL	/* dsm_leafpages        */
+    NULL,	/* dsm_leafpages        */
+    NULL,	/* dsm_prepare_replace  */
+    NULL	/* dsm_replace          */
 };
 
 dsm_t *dsm = &dsm_dummies;
@@ -26,6 +26,7 @@ bulk_t	bulk_mode = B_NORMAL;		/* '-b, -B' */
 bool	suppress_config_file;		/* '-C' */
 bool	nonspam_exits_zero;		/* '-e' */
 FILE	*fpin = NULL;			/* '-I' */
+uint	bulk_jobs = 1;			/* '-j' */
 bool	logflag;			/* '-l' */
 bool	mbox_mode;			/* '-M' */
 bool	replace_nonascii_characters;	/* '-n' */
@@ -54,6 +55,7 @@ uint	token_count_min = 0;
 uint	token_count_max = 0;
 
 const char	*update_dir;
+bool	update_journal = false;	/* registrations go to the journal */
 /*@observer@*/
 const char	*stats_prefix;
 
@@ -82,6 +84,7 @@ double	ns_esf = NS_ESF;
 /* other */
 FILE	*fpo;
 uint	db_cachesize = DB_CACHESIZE;	/* in MB */
+uint	token_cache_size = TOKEN_CACHE_SIZE;	/* tokens per wordlist */
 bool	msg_count_file = false;
 char	*progtype = NULL;
 bool	unsure_stats = false;		/* true if print stats for unsures */
@@ -26,6 +26,7 @@ extern	bool	suppress_config_file;	/* '-C' */
 extern	bool	nonspam_exits_zero;	/* '-e' */
 extern	bool	fisher;			/* '-f' */
 extern	FILE	*fpin;			/* '-I' */
+extern	uint	bulk_jobs;		/* '-j' */
 extern	bool	logflag;		/* '-l' */
 
 extern	uint	min_token_len;
@@ -61,6 +62,7 @@ extern	bool	stats_in_header;
 extern	bool	header_line_markup;	/* -Ph,-PH */
 
 extern	const char	*update_dir;
+extern	bool		update_journal;
 extern	const char	*progname;
 extern	      char	*progtype;
 /*@observer@*/
@@ -107,6 +109,9 @@ extern	double ns_esf;
 #define	DB_CACHESIZE	4	/* in MB */
 extern	uint	db_cachesize;
 
+#define	TOKEN_CACHE_SIZE 65536	/* tokens per wordlist */
+extern	uint	token_cache_size;
+
 /* other */
 
 extern FILE  *fpo;
@@ -120,6 +125,12 @@ extern	uint	wordlist_version;
 #define	WORDLIST_ENCODING	".ENCODING"
 extern	e_enc	encoding;
 
+#define	WORDLIST_KEY_HASH	".KEY_HASH"
+
+#define	WORDLIST_GENERATION	".GENERATION"
+
+#define	WORDLIST_JOURNAL	".JOURNAL"
+
 #ifndef HAVE_SIG_ATOMIC_T
 typedef volatile int sig_atomic_t;
 #endif
@@ -0,0 +1,221 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   jobs.c -- classify bulk input (-b, -B) with several worker processes
+
+   The lexer and the scoring code keep their state in static variables,
+   so the work is split across processes rather than threads.  Every
+   worker reads the whole input, classifies every bulk_jobs'th message
+   (see bogoreader_set_stride()) and skips the others.  The output of
+   each message is sent to the parent through a pipe, framed as
+
+	"<status> <length>\n" <length bytes of output>
+
+   and the parent reads the workers round-robin, so the output appears
+   in input order, exactly as without -j.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bogofilter.h"
+#include "bogoreader.h"
+#include "fgetsl.h"
+#include "jobs.h"
+#include "wordlists.h"
+#include "xmalloc.h"
+#include "xstrdup.h"
+
+static FILE *job_out = NULL;	/* worker: pipe to the parent */
+
+/* Function Definitions */
+
+void jobs_message_done(rc_t status)
+{
+    char buf[BUFSIZ];
+    long len;
+    size_t n;
+
+    if (job_out == NULL)
+	return;
+
+    fflush(fpo);
+    len = ftell(fpo);
+    rewind(fpo);
+
+    fprintf(job_out, "%d %ld\n", (int) status, len);
+    while ((n = fread(buf, 1, sizeof(buf), fpo)) > 0)
+	fwrite(buf, 1, n, job_out);
+
+    if (fflush(job_out) || ferror(fpo)) {
+	fprintf(stderr, "%s: cannot pass on output: %s\n",
+		progname, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    rewind(fpo);
+    if (ftruncate(fileno(fpo), 0) != 0) {
+	fprintf(stderr, "%s: cannot truncate output buffer: %s\n",
+		progname, strerror(errno));
+	exit(EX_ERROR);
+    }
+}
+
+static void worker(uint offset, int fd, int argc, char **argv)
+{
+    job_out = fdopen(fd, "w");
+    fpo = tmpfile();
+    if (job_out == NULL || fpo == NULL) {
+	fprintf(stderr, "%s: cannot set up worker: %s\n",
+		progname, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    bogoreader_set_stride(offset, bulk_jobs);
+
+    open_wordlists(DS_READ);
+
+    if (encoding == E_UNKNOWN)
+	encoding = E_DEFAULT;
+
+    (void) bogofilter(argc, argv);
+
+    if (fclose(job_out) != 0)
+	exit(EX_ERROR);
+    job_out = NULL;
+
+    close_wordlists(true);
+
+    exit(EX_OK);
+}
+
+/** read the file names for '-b' from stdin, so that all workers see
+ * the same list */
+static int read_names(char ***names)
+{
+    char buff[PATH_LEN+1];
+    int count = 0, size = 0;
+    int len;
+
+    *names = NULL;
+
+    while ((len = fgetsl(buff, sizeof(buff), stdin)) > 0) {
+	if (buff[len-1] == '\n')
+	    buff[len-1] = '\0';
+	if (count == size) {
+	    size = size ? size * 2 : 64;
+	    *names = (char **) xrealloc(*names, size * sizeof(char *));
+	}
+	(*names)[count++] = xstrdup(buff);
+    }
+
+    return count;
+}
+
+/** copy one message's output from worker to fpo, returns false at end
+ * of input */
+static bool copy_message(FILE *fp, rc_t *status)
+{
+    char buf[BUFSIZ];
+    int st;
+    long len;
+
+    if (fgets(buf, sizeof(buf), fp) == NULL ||
+	sscanf(buf, "%d %ld", &st, &len) != 2)
+	return false;
+
+    while (len > 0) {
+	size_t n = fread(buf, 1, (size_t) len < sizeof(buf) ? (size_t) len : sizeof(buf), fp);
+	if (n == 0)
+	    return false;
+	fwrite(buf, 1, n, fpo);
+	len -= n;
+    }
+
+    *status = (rc_t) st;
+    return true;
+}
+
+rc_t jobs_run(int argc, char **argv)
+{
+    uint i, n = bulk_jobs;
+    pid_t *pids = (pid_t *) xcalloc(n, sizeof(pid_t));
+    FILE **in = (FILE **) xcalloc(n, sizeof(FILE *));
+    char **names = NULL;
+    rc_t status = RC_OK;
+    bool failed = false;
+
+    if (bulk_mode == B_STDIN) {
+	argc = read_names(&names);
+	argv = names;
+	bulk_mode = B_CMDLINE;
+    }
+
+    fflush(NULL);	/* don't let the workers inherit buffered output */
+
+    for (i = 0; i < n; i += 1) {
+	int fds[2];
+
+	if (pipe(fds) != 0 || (pids[i] = fork()) < 0) {
+	    fprintf(stderr, "%s: cannot start worker: %s\n",
+		    progname, strerror(errno));
+	    exit(EX_ERROR);
+	}
+
+	if (pids[i] == 0) {
+	    uint j;
+	    for (j = 0; j < i; j += 1)
+		fclose(in[j]);
+	    close(fds[0]);
+	    worker(i, fds[1], argc, argv);	/* does not return */
+	}
+
+	close(fds[1]);
+	in[i] = fdopen(fds[0], "r");
+	if (in[i] == NULL) {
+	    fprintf(stderr, "%s: cannot read from worker: %s\n",
+		    progname, strerror(errno));
+	    exit(EX_ERROR);
+	}
+    }
+
+    /* message k comes from worker k % n */
+    for (i = 0; copy_message(in[i], &status); i = (i + 1) % n)
+	continue;
+
+    for (i = 0; i < n; i += 1)
+	fclose(in[i]);
+
+    for (i = 0; i < n; i += 1) {
+	int ws;
+	if (waitpid(pids[i], &ws, 0) != pids[i] ||
+	    !WIFEXITED(ws) || WEXITSTATUS(ws) != EX_OK)
+	    failed = true;
+    }
+
+    if (names != NULL) {
+	for (i = 0; i < (uint) argc; i += 1)
+	    xfree(names[i]);
+	xfree(names);
+    }
+    xfree(in);
+    xfree(pids);
+
+    if (failed) {
+	fprintf(stderr, "%s: worker process failed.\n", progname);
+	exit(EX_ERROR);
+    }
+
+    return status;
+}
+
+/* End */
@@ -0,0 +1,22 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   jobs.h -- prototypes and definitions for jobs.c
+
+******************************************************************************/
+
+#ifndef	JOBS_H
+#define	JOBS_H
+
+/** classify the messages of a bulk run (-b, -B) with bulk_jobs worker
+ * processes, writes their output in input order and returns the last
+ * message's status */
+extern rc_t jobs_run(int argc, char **argv);
+
+/** in a worker, pass the output of the current message on to the
+ * parent; no-op otherwise */
+extern void jobs_message_done(rc_t status);
+
+#endif	/* JOBS_H */
@@ -0,0 +1,577 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   journal.c -- deferred registration journal
+
+   With update_journal set, bogofilter does not write registrations
+   (-s, -n, -S, -N, -u) to the wordlist.  It appends them to a journal
+   next to it (wordlist.db.jnl) instead and opens the wordlist read-only,
+   so classification never waits for a write lock.  "bogoutil
+   --apply-journal" later combines the registrations per token and
+   merges them into the wordlist in one sorted pass.  Counts that are
+   taken from stop at zero after each record, as they do after each
+   message when registering directly, and tokens get the date of their
+   last registration.
+
+   Each registration is one record, written with a single write() to
+   the file opened with O_APPEND, so concurrent writers don't mix their
+   records:
+
+	J <incr> <decr> <messages> <tokens> <date>\n
+	<freq> <length> <token>\n		(repeated <tokens> times)
+
+   <incr> is 's' or 'n', <decr> is 'S' or 'N', '-' stands for none.
+
+   Writers hold a shared fcntl() lock on the journal while appending.
+   bogoutil renames the journal before reading it and then waits for an
+   exclusive lock, so a record is either complete in the renamed file
+   or goes to a fresh journal: a writer that finds the file renamed
+   after getting its lock opens the journal again.
+
+   Before merging, bogoutil appends a stamp to the renamed journal,
+
+	I <time> <pid>\n
+
+   and the transaction that merges it stores the stamp in the wordlist
+   (.JOURNAL).  The journal is removed after the commit; if bogoutil
+   stops before that, the next run applies it first - unless the
+   wordlist has its stamp, i.e. it was merged already.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "maint.h"
+#include "mxcat.h"
+#include "rand_sleep.h"
+#include "robx.h"
+#include "xmalloc.h"
+
+#define	JNL_WORK	".apply"	/* suffix while being applied */
+#define	JNL_LOCK	".lock"		/* serializes bogoutil runs */
+#define	JNL_BATCH	1024		/* tokens per ds_read_many() */
+#define	JNL_MAX_TOKEN	65536		/* longer tokens are bogus */
+
+/** The change of a count by a sequence of records: it becomes
+ * max(floor, count + add), see add_change(). */
+typedef struct {
+    long floor[IX_SIZE];
+    long add[IX_SIZE];
+    YYYYMMDD date;		/* of the last record, 0 if it had none */
+} delta_t;
+
+/** the contents of a journal */
+typedef struct {
+    wordhash_t *h;		/* delta_t per token */
+    delta_t msgs;		/* of the message counts */
+    bool stamped;
+    u_int32_t stamp[2];
+} journal_t;
+
+/* Function Definitions */
+
+static bool lock_journal(int fd, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+
+    while (fcntl(fd, F_SETLKW, &fl) != 0) {
+	if (errno != EINTR)
+	    return false;
+    }
+
+    return true;
+}
+
+/** open the journal for appending, with a shared lock held */
+static int open_journal(const char *path)
+{
+    for (;;) {
+	struct stat fst, pst;
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+
+	if (fd < 0 || !lock_journal(fd, F_RDLCK)) {
+	    fprintf(stderr, "Cannot open journal %s: %s\n", path, strerror(errno));
+	    exit(EX_ERROR);
+	}
+
+	/* bogoutil may have taken this file over meanwhile */
+	if (fstat(fd, &fst) == 0 && stat(path, &pst) == 0 &&
+	    fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino)
+	    return fd;
+
+	close(fd);
+    }
+}
+
+static char count_letter(sh_t ix, bool reg)
+{
+    switch (ix) {
+    case IX_SPAM:	return reg ? 's' : 'S';
+    case IX_GOOD:	return reg ? 'n' : 'N';
+    default:		return '-';
+    }
+}
+
+void journal_register(wordlist_t *list, sh_t incr, sh_t decr,
+		      wordhash_t *h, u_int32_t msgcount)
+{
+    char *path = mxcat(list->bfp->filepath, JNL_EXT, NULL);
+    hashnode_t *node;
+    char *buf;
+    size_t len, size = 64;
+    ssize_t w;
+    uint count = 0;
+    int fd;
+
+    for (node = (hashnode_t *)wordhash_first(h); node != NULL; node = (hashnode_t *)wordhash_next(h)) {
+	size += node->key->leng + 32;
+	count += 1;
+    }
+
+    buf = (char *)xmalloc(size);
+    len = snprintf(buf, size, "J %c %c %lu %u %lu\n",
+		   count_letter(incr, true), count_letter(decr, false),
+		   (unsigned long)msgcount, count, (unsigned long)today);
+
+    for (node = (hashnode_t *)wordhash_first(h); node != NULL; node = (hashnode_t *)wordhash_next(h)) {
+	wordprop_t *wordprop = (wordprop_t *)node->data;
+	len += snprintf(buf + len, size - len, "%d %lu ",
+			wordprop->freq, (unsigned long)node->key->leng);
+	memcpy(buf + len, node->key->u.text, node->key->leng);
+	len += node->key->leng;
+	buf[len++] = '\n';
+    }
+
+    fd = open_journal(path);
+
+    do
+	w = write(fd, buf, len);
+    while (w < 0 && errno == EINTR);
+
+    if (w != (ssize_t)len || close(fd) != 0) {
+	fprintf(stderr, "Cannot write journal %s: %s\n", path, strerror(errno));
+	exit(EX_ERROR);
+    }
+
+    if (DEBUG_REGISTER(1))
+	fprintf(dbgout, "journal %s - %u tokens, %lu messages\n",
+		path, count, (unsigned long)msgcount);
+
+    xfree(buf);
+    xfree(path);
+}
+
+/* applying */
+
+static sh_t count_index(int c, bool reg)
+{
+    switch (c) {
+    case 's': return reg ? IX_SPAM : IX_SIZE;
+    case 'n': return reg ? IX_GOOD : IX_SIZE;
+    case 'S': return reg ? IX_SIZE : IX_SPAM;
+    case 'N': return reg ? IX_SIZE : IX_GOOD;
+    case '-': return IX_UNDF;
+    default:  return IX_SIZE;			/* invalid */
+    }
+}
+
+/** change \a d by a record that adds \a freq to count \a ix or, unless
+ * \a reg, takes it away, stopping at zero */
+static void add_change(delta_t *d, sh_t ix, long freq, bool reg, YYYYMMDD date)
+{
+    /* max(f, c + a) + freq = max(f + freq, c + a + freq), and
+     * max(0, max(f, c + a) - freq) = max(max(0, f - freq), c + a - freq) */
+    if (reg) {
+	d->floor[ix] += freq;
+	d->add[ix] += freq;
+    }
+    else {
+	d->floor[ix] = max(0, d->floor[ix] - freq);
+	d->add[ix] -= freq;
+    }
+    d->date = date;
+}
+
+static u_int32_t apply_change(u_int32_t count, const delta_t *d, sh_t ix)
+{
+    long sum = (long)count + d->add[ix];
+    return (u_int32_t)max(sum, d->floor[ix]);
+}
+
+/** read one record or stamp into \a jnl, returns 1 for a complete
+ * record, 2 for a stamp, 0 for damaged data and EOF at the end */
+static int read_record(FILE *fp, journal_t *jnl)
+{
+    char line[256];
+    char r, u;
+    unsigned long msgcount, count, date = 0, i;
+    word_t **words;
+    long *freqs;
+    int ret = 1;
+    sh_t incr, decr;
+
+    if (fgets(line, sizeof(line), fp) == NULL)
+	return EOF;
+
+    if (line[0] == 'I') {
+	unsigned long t, p;
+	if (sscanf(line, "I %lu %lu", &t, &p) != 2 || strchr(line, '\n') == NULL)
+	    return 0;
+	jnl->stamp[0] = (u_int32_t)t;
+	jnl->stamp[1] = (u_int32_t)p;
+	jnl->stamped = true;
+	return 2;
+    }
+
+    /* records without a date are merged with today's */
+    if (sscanf(line, "J %c %c %lu %lu %lu", &r, &u, &msgcount, &count, &date) < 4 ||
+	(incr = count_index(r, true)) == IX_SIZE ||
+	(decr = count_index(u, false)) == IX_SIZE)
+	return 0;
+
+    words = (word_t **)xcalloc(count ? count : 1, sizeof(word_t *));
+    freqs = (long *)xcalloc(count ? count : 1, sizeof(long));
+
+    for (i = 0; i < count; i += 1) {
+	unsigned long leng;
+	byte *text;
+
+	if (fscanf(fp, "%ld %lu", &freqs[i], &leng) != 2 ||
+	    leng > JNL_MAX_TOKEN || getc(fp) != ' ') {
+	    ret = 0;
+	    break;
+	}
+
+	text = (byte *)xmalloc(leng + 1);
+	if (fread(text, 1, leng, fp) != leng || getc(fp) != '\n') {
+	    xfree(text);
+	    ret = 0;
+	    break;
+	}
+	words[i] = word_new(text, (uint)leng);
+	xfree(text);
+    }
+
+    if (ret == 0) {
+	/* skip the rest of the line, resume at the next record */
+	int c;
+	while ((c = getc(fp)) != EOF && c != '\n')
+	    continue;
+    }
+    else {
+	/* only complete records count, in the order they were written */
+	for (i = 0; i < count; i += 1) {
+	    delta_t *d = (delta_t *)wordhash_insert(jnl->h, words[i], sizeof(delta_t), NULL);
+	    if (incr != IX_UNDF)
+		add_change(d, incr, freqs[i], true, (YYYYMMDD)date);
+	    if (decr != IX_UNDF)
+		add_change(d, decr, freqs[i], false, (YYYYMMDD)date);
+	}
+	if (incr != IX_UNDF)
+	    add_change(&jnl->msgs, incr, (long)msgcount, true, (YYYYMMDD)date);
+	if (decr != IX_UNDF)
+	    add_change(&jnl->msgs, decr, (long)msgcount, false, (YYYYMMDD)date);
+    }
+
+    for (i = 0; i < count; i += 1)
+	if (words[i] != NULL)
+	    word_free(words[i]);
+    xfree(words);
+    xfree(freqs);
+
+    return ret;
+}
+
+/** date the next writes like the last record of \a d */
+static void set_change_date(const delta_t *d, YYYYMMDD today_save)
+{
+    set_date((d->date != 0) ? d->date : today_save);
+}
+
+static int write_batch(void *dsh, uint n, const word_t **words, delta_t **deltas,
+		       robx_stats_t *stats, YYYYMMDD today_save)
+{
+    dsv_t vals[JNL_BATCH], old;
+    int rets[JNL_BATCH];
+    uint i;
+    int r;
+
+    r = ds_read_many(dsh, n, words, vals, rets);
+    if (r != 0)
+	return r;
+
+    for (i = 0; i < n; i += 1) {
+	old = vals[i];
+	vals[i].spamcount = apply_change(vals[i].spamcount, deltas[i], IX_SPAM);
+	vals[i].goodcount = apply_change(vals[i].goodcount, deltas[i], IX_GOOD);
+	set_change_date(deltas[i], today_save);
+	r = ds_write(dsh, words[i], &vals[i]);
+	set_date(today_save);
+	if (r != 0)
+	    return r;
+	if (stats != NULL)
+	    robx_stats_change(stats, &old, &vals[i]);
+    }
+
+    return 0;
+}
+
+/** merge the sorted deltas of \a jnl in batches and record its stamp,
+ * returns 0, DS_ABORT_RETRY or another nonzero value for errors */
+static int write_deltas(void *dsh, journal_t *jnl, YYYYMMDD today_save)
+{
+    const word_t *words[JNL_BATCH];
+    delta_t *deltas[JNL_BATCH];
+    hashnode_t *node;
+    dsv_t val;
+    robx_stats_t robx_stats, *stats = NULL;
+    uint n = 0;
+    int r;
+
+    r = robx_stats_read(dsh, &robx_stats);
+    if (r == 0)
+	stats = &robx_stats;
+    else if (r != 1)
+	return r;
+
+    for (node = (hashnode_t *)wordhash_first(jnl->h); node != NULL; node = (hashnode_t *)wordhash_next(jnl->h)) {
+	words[n] = node->key;
+	deltas[n] = (delta_t *)node->data;
+	if (++n == JNL_BATCH) {
+	    r = write_batch(dsh, n, words, deltas, stats, today_save);
+	    if (r != 0)
+		return r;
+	    n = 0;
+	}
+    }
+
+    if (n != 0) {
+	r = write_batch(dsh, n, words, deltas, stats, today_save);
+	if (r != 0)
+	    return r;
+    }
+
+    if (stats != NULL) {
+	r = robx_stats_write(dsh, stats);
+	if (r != 0)
+	    return r;
+    }
+
+    r = ds_get_msgcounts(dsh, &val);
+    if (r != 0 && r != 1)
+	return r;
+
+    val.spamcount = apply_change(val.spamcount, &jnl->msgs, IX_SPAM);
+    val.goodcount = apply_change(val.goodcount, &jnl->msgs, IX_GOOD);
+
+    set_change_date(&jnl->msgs, today_save);
+    r = ds_set_msgcounts(dsh, &val);
+    set_date(today_save);
+    if (r != 0)
+	return r;
+
+    memset(&val, 0, sizeof(val));
+    val.count[0] = jnl->stamp[0];
+    val.count[1] = jnl->stamp[1];
+
+    return ds_set_journal(dsh, &val);
+}
+
+/** append a stamp to the journal, unless it has one */
+static bool stamp_journal(FILE *fp, journal_t *jnl)
+{
+    const char *nl = "";
+
+    if (jnl->stamped)
+	return true;
+
+    /* after a damaged last line */
+    if (fseek(fp, -1L, SEEK_END) == 0 && getc(fp) != '\n')
+	nl = "\n";
+
+    jnl->stamp[0] = (u_int32_t)time(NULL);
+    jnl->stamp[1] = (u_int32_t)getpid();
+    jnl->stamped = true;
+
+    return fseek(fp, 0L, SEEK_END) == 0 &&
+	fprintf(fp, "%sI %lu %lu\n", nl,
+		(unsigned long)jnl->stamp[0], (unsigned long)jnl->stamp[1]) > 0 &&
+	fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+static ex_t apply_file(void *dbe, bfpath *bfp, const char *work)
+{
+    journal_t jnl;
+    unsigned long records = 0, damaged = 0;
+    int retrycount = 60;
+    bool skipping = false;
+    bool merged = false;
+    YYYYMMDD today_save = today;
+    void *dsh;
+    dsv_t val;
+    FILE *fp;
+    int fd, r;
+    ex_t ret = EX_OK;
+
+    fd = open(work, O_RDWR);
+    /* wait for writers that opened the journal before it was renamed */
+    if (fd < 0 || !lock_journal(fd, F_WRLCK) || (fp = fdopen(fd, "r+")) == NULL) {
+	fprintf(stderr, "Cannot read journal %s: %s\n", work, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return EX_ERROR;
+    }
+
+    memset(&jnl, 0, sizeof(jnl));
+    jnl.h = wordhash_init(WH_NORMAL, 0);
+
+    while ((r = read_record(fp, &jnl)) != EOF) {
+	if (r != 0)
+	    skipping = false;
+	if (r == 1)
+	    records += 1;
+	else if (r == 0 && !skipping) {
+	    damaged += 1;
+	    skipping = true;
+	}
+    }
+
+    if (ferror(fp) || !stamp_journal(fp, &jnl)) {
+	fprintf(stderr, "Cannot read journal %s: %s\n", work, strerror(errno));
+	fclose(fp);
+	wordhash_free(jnl.h);
+	return EX_ERROR;
+    }
+    fclose(fp);
+
+    if (damaged)
+	fprintf(stderr, "%s: skipped %lu damaged part%s of %s\n",
+		progname, damaged, (damaged == 1) ? "" : "s", work);
+
+    wordhash_sort(jnl.h);
+
+    dsh = ds_open(dbe, bfp, DS_WRITE);
+    if (dsh == NULL) {
+	fprintf(stderr, "Cannot open wordlist %s\n", bfp->filepath);
+	wordhash_free(jnl.h);
+	return EX_ERROR;
+    }
+
+    for (;;) {
+	if (retrycount-- == 0) {
+	    fprintf(stderr, "retry count exceeded, giving up.\n");
+	    ret = EX_ERROR;
+	    break;
+	}
+
+	if (ds_txn_begin(dsh) != DST_OK) {
+	    rand_sleep(1000, 1000000);
+	    continue;
+	}
+
+	/* a run that stopped before removing the journal merged it */
+	r = ds_get_journal(dsh, &val);
+	if (r == 0 && val.count[0] == jnl.stamp[0] && val.count[1] == jnl.stamp[1]) {
+	    (void) ds_txn_abort(dsh);
+	    merged = true;
+	    break;
+	}
+
+	if (r == 0 || r == 1)
+	    r = write_deltas(dsh, &jnl, today_save);
+	if (r == DS_ABORT_RETRY) {
+	    rand_sleep(4 * 1000, 1000 * 1000);
+	    continue;
+	}
+	if (r != 0) {
+	    fprintf(stderr, "cannot write to data base.\n");
+	    ds_txn_abort(dsh);
+	    ret = EX_ERROR;
+	    break;
+	}
+
+	r = ds_txn_commit(dsh);
+	if (r == DST_TEMPFAIL)
+	    continue;
+	if (r != DST_OK) {
+	    fprintf(stderr, "commit failed\n");
+	    ret = EX_ERROR;
+	}
+	break;
+    }
+
+    ds_close(dsh);
+
+    if (ret == EX_OK) {
+	unlink(work);
+	if (verbose && merged)
+	    fprintf(dbgout, "%s was applied already\n", work);
+	else if (verbose)
+	    fprintf(dbgout, "%lu registrations, %lu tokens applied from %s\n",
+		    records, (unsigned long)jnl.h->count, work);
+    }
+
+    wordhash_free(jnl.h);
+
+    return ret;
+}
+
+ex_t journal_apply(void *dbe, bfpath *bfp)
+{
+    char *path = mxcat(bfp->filepath, JNL_EXT, NULL);
+    char *work = mxcat(path, JNL_WORK, NULL);
+    char *lock = mxcat(path, JNL_LOCK, NULL);
+    struct stat st;
+    ex_t ret = EX_OK;
+    int fd;
+
+    /* one bogoutil at a time, or two could apply the same file */
+    fd = open(lock, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || !lock_journal(fd, F_WRLCK)) {
+	fprintf(stderr, "Cannot lock %s: %s\n", lock, strerror(errno));
+	ret = EX_ERROR;
+    }
+
+    /* left over by a run that did not finish */
+    if (ret == EX_OK && stat(work, &st) == 0)
+	ret = apply_file(dbe, bfp, work);
+
+    if (ret == EX_OK) {
+	if (rename(path, work) == 0)
+	    ret = apply_file(dbe, bfp, work);
+	else if (errno != ENOENT) {
+	    fprintf(stderr, "Cannot rename %s: %s\n", path, strerror(errno));
+	    ret = EX_ERROR;
+	}
+	else if (verbose)
+	    fprintf(dbgout, "no journal %s\n", path);
+    }
+
+    if (fd >= 0)
+	close(fd);
+
+    xfree(lock);
+    xfree(work);
+    xfree(path);
+
+    return ret;
+}
+
+/* End */
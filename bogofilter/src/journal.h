@@ -0,0 +1,31 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   journal.h -- deferred registration journal
+
+******************************************************************************/
+
+#ifndef	JOURNAL_H
+#define	JOURNAL_H
+
+#include "datastore.h"
+#include "wordhash.h"
+#include "wordlists.h"
+
+/** File name suffix of a wordlist's registration journal. */
+#define	JNL_EXT		".jnl"
+
+/** Append one registration - the tokens of \a h with their frequencies,
+ * added to count \a incr and/or taken from count \a decr (IX_UNDF for
+ * none), and \a msgcount messages - to the journal of \a list.  Exits
+ * on error, like register_words(). */
+extern void journal_register(wordlist_t *list, sh_t incr, sh_t decr,
+			     wordhash_t *h, u_int32_t msgcount);
+
+/** Merge the journal of the wordlist at \a bfp into the wordlist and
+ * remove it. */
+extern ex_t journal_apply(void *dbe, bfpath *bfp);
+
+#endif	/* JOURNAL_H */
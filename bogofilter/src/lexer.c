@@ -27,6 +27,7 @@
 #include "msgcounts.h"
 #include "qp.h"
 #include "textblock.h"
+#include "timing.h"
 #include "token.h"
 #include "word.h"
 #include "xmalloc.h"
@@ -41,9 +42,10 @@ lexer_t *lexer = NULL;
 
 /* Local Variables */
 
+/* lexer_text.c tokenizes plain text, flex everything else */
 static lexer_t v3_lexer = {
-    yylex,
-    lexer_v3_get_token
+    lexer_text_yylex,
+    lexer_text_get_token
 };
 
 lexer_t msg_count_lexer = {
@@ -51,6 +53,12 @@ lexer_t msg_count_lexer = {
     msg_count_get_token
 };
 
+/* what yyinput() drops of its input, see there */
+typedef enum { SKIP_NONE, SKIP_WORD, SKIP_LINE } skip_t;
+
+static skip_t skipping = SKIP_NONE;
+static skip_t broken = SKIP_NONE;	/* ... and did for the current match */
+
 /* Function Prototypes */
 
 static int yy_get_new_line(buff_t *buff);
@@ -61,9 +69,11 @@ static int skip_folded_line(buff_t *buff);
 
 void lexer_init(void)
 {
+    skipping = broken = SKIP_NONE;
     mime_reset();
     token_init();
     lexer_v3_init(NULL);
+    lexer_text_init();
     init_charset_table(charset_default);
 }
 
@@ -77,33 +87,15 @@ static void lexer_display_buffer(buff_t *buff)
 	fputc('\n', dbgout);
 }
 
-/**
- * Check for lines wholly composed of printable characters as they can
- * cause a scanner abort "input buffer overflow, can't enlarge buffer
- * because scanner uses REJECT"
- *
- * \bug this function must go, we need to fix the lexer
- */
-static bool long_token(byte *buf, uint count)
-{
-    uint i;
-    for (i=0; i < count; i += 1) {
-	byte c = buf[i];
-	/* 10/23/05 - fix SIGSEGV with msg.1023.6479.txt
-	** evidently caused by 09/07/05 patch for 0.96.2
-	*/
-	if (c == '\0')
-	    break;
-	if ((iscntrl(c) || isspace(c) || ispunct(c)) && (c != '_'))
-	    return false;
-    }
-    return true;
-}
-
 static int yy_get_new_line(buff_t *buff)
 {
-    int count = (*reader_getline)(buff);
-    const byte *buf = buff->t.u.text;
+    int count;
+    const byte *buf;
+
+    TIMING_PHASE(PH_READ);
+    count = (*reader_getline)(buff);
+    TIMING_PHASE(PH_LEX);
+    buf = buff->t.u.text;
 
     static size_t hdrlen = 0;
     if (hdrlen==0)
@@ -167,10 +159,12 @@ static int get_decoded_line(buff_t *buff)
 
 	/* UTF-8 uses up to six octets per character.  Make input buffer
 	 * sufficiently small that the UTF-8 text can fit in the output
-	 * buffer */
-	if (tempbuff->size < buff->size / 6) {
+	 * buffer, which is never larger than one chunk */
+	uint size = min(buff->size, LEXER_CHUNK_LEN) / 6;
+
+	if (tempbuff->size < size) {
 	    xfree(tempbuff->t.u.text);
-	    tempbuff->size = buff->size / 6;
+	    tempbuff->size = size;
 	    tempbuff->t.u.text = (byte *) xmalloc(tempbuff->size+D);
 	}
 
@@ -193,10 +187,16 @@ static int get_decoded_line(buff_t *buff)
     /* Save the text on a linked list of lines.
      * Note that we store fixed-length blocks here, not lines.
      * One very long physical line could break up into more
-     * than one of these. */
+     * than one of these.  Lines of a memory mapped input file are
+     * not copied, the list just points to them. */
 
-    if (passthrough && count > 0)
-	textblock_add(linebuff->t.u.text+linebuff->read, (size_t) count);
+    if (passthrough && count > 0) {
+	const byte *mapped = reader_mapped_line();
+	if (mapped != NULL)
+	    textblock_add_ref(mapped, (size_t) count);
+	else
+	    textblock_add(linebuff->t.u.text+linebuff->read, (size_t) count);
+    }
 
     if ( !msg_header && 
 	 !msg_state->mime_dont_decode &&
@@ -298,48 +298,75 @@ void yyinit(void)
 	lexer = &v3_lexer;
 }
 
-int yyinput(byte *buf, size_t used, size_t size)
+/* Input is read and decoded in chunks of at most LEXER_CHUNK_LEN bytes,
+ * however long its lines are.  Flex keeps the text of the match it is
+ * in the middle of, and enlarges its buffer for as long as the match
+ * goes on - a line of letters megabytes long, an HTML tag that isn't
+ * closed.  Such a match never makes a token bogofilter keeps, so once
+ * it has grown to MAX_MATCH_LEN, the input that would continue it is
+ * dropped up to the next blank, newline, '<' or '>' (SKIP_WORD), which
+ * ends runs of letters and HTML tags where they would have ended.  If
+ * the match still goes on past twice that, a '>' is put in and the
+ * rest of the line is dropped (SKIP_LINE), again for every line.  No
+ * newline is ever put in, so the text after a match that was broken up
+ * is not taken for the start of a line.
+ */
+
+/** drop the bytes at the start of \a buf that continue the match being
+ * skipped.  \return the number of bytes left */
+static int skip_match(byte *buf, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i += 1) {
+	byte c = buf[i];
+	if (c == '\n')
+	    break;
+	if (skipping == SKIP_WORD && (isspace(c) || c == '<' || c == '>'))
+	    break;
+    }
+
+    if (i < count)
+	skipping = SKIP_NONE;
+
+    memmove(buf, buf + i, count - i);
+    return count - i;
+}
+
+int yyinput(byte *buf, size_t held, size_t size)
 /* input getter for the scanner */
 {
-    int cnt;
-    int count = 0;
+    int count;
+    uint brk = 0;
     buff_t buff;
 
-    buff_init(&buff, buf, 0, (uint) size);
+    /* a line lexer_text.c has read, but left to flex */
+    if ((count = lexer_text_pending(buf, size)) >= 0)
+	return count;
 
-    /* After reading a line of text, check if it has special characters.
-     * If not, trim some, but leave enough to match a max length token.
-     * Then read more text.  This will ensure that a really long sequence
-     * of alphanumerics, which bogofilter will ignore anyway, doesn't crash
-     * the flex lexer.
-     */
+    size = min(size, LEXER_CHUNK_LEN);
 
-    while ((cnt = get_decoded_line(&buff)) != 0) {
+    if (held < MAX_MATCH_LEN)
+	broken = SKIP_NONE;
+    else if (held >= 2 * MAX_MATCH_LEN && skipping != SKIP_LINE && size > 1)
+	brk = 1;
 
-	count += cnt;
-
-	/* Note: some malformed messages can cause xfgetsl() to report
-	** "Invalid buffer size, exiting."  ** and then abort.  This
-	** can happen when the parser is in html mode and there's a
-	** leading '<' but no closing '>'.
-	**
-	** The "fix" is to check for a nearly full lexer buffer and
-	** discard most of it.
-	*/
+    if (brk != 0 || (held >= MAX_MATCH_LEN && broken == SKIP_NONE)) {
+	broken = skipping = (brk != 0) ? SKIP_LINE : SKIP_WORD;
+	if (DEBUG_LEXER(1))
+	    fprintf(dbgout, "*** match of %lu bytes broken up\n", (unsigned long) held);
+    }
 
-	/* if not nearly full */
-	if (used < 1000 || used < size * 10)
-	    break;
+    do {
+	buff_init(&buff, buf + brk, 0, (uint) (size - brk));
+	count = get_decoded_line(&buff);
+    } while (count > 0 && skipping != SKIP_NONE &&
+	     (count = skip_match(buf + brk, count)) == 0);
 
-	if (count >= MAX_TOKEN_LEN * 2 && 
-	    long_token(buff.t.u.text, (uint) count)) {
-	    uint start = buff.t.leng - count;
-	    uint length = count - max_token_len;
-	    buff_shift(&buff, start, length);
-	    count = buff.t.leng;
-	}
-	else
-	    break;
+    if (brk != 0) {
+	/* ends the match, whatever the rule */
+	buf[0] = '>';
+	count = (count > 0) ? count + 1 : 1;
     }
 
     if (msg_state &&
@@ -364,7 +391,7 @@ int yyinput(byte *buf, size_t used, size_t size)
     }
 
     if (DEBUG_LEXER(2))
-	fprintf(dbgout, "*** yyinput(\"%-.*s\", %lu, %lu) = %d\n", count, buf, (unsigned long)used, (unsigned long)size, count);
+	fprintf(dbgout, "*** yyinput(\"%-.*s\", %lu, %lu) = %d\n", count, buf, (unsigned long)held, (unsigned long)size, count);
 
     return (count == EOF ? 0 : count);
 }
@@ -467,6 +494,7 @@ word_t *text_decode(word_t *w)
 		len = qp_decode(w, RFC2047);	/* decode quoted-printable */
 	    break;
 	}
+	TIMING_COUNT(TC_DECODED, len);
 
 	/* move decoded word to where the encoded used to be */
 	if (encoding == E_RAW) {
@@ -19,6 +19,12 @@ extern	bool	block_on_subnets;
 
 #define YY_NULL 0
 
+/* yyinput() reads at most LEXER_CHUNK_LEN bytes at a time, and drops
+ * the input that would make a flex match longer than MAX_MATCH_LEN, so
+ * the scanner's buffer stays small however long a message's lines are */
+#define LEXER_CHUNK_LEN	8192
+#define MAX_MATCH_LEN	65536
+
 /* lexer interface */
 typedef enum {
     NONE,
@@ -57,6 +63,14 @@ extern lexer_t	msg_count_lexer;
 extern token_t	yylex(void);
 extern void	lexer_v3_init(FILE *fp);
 extern long	lexer_v3_get_token(byte **output);
+extern size_t	lexer_v3_text_line(void);
+extern void	lexer_v3_count_line(void);
+
+/* in lexer_text.c */
+extern token_t	lexer_text_yylex(void);
+extern long	lexer_text_get_token(byte **output);
+extern void	lexer_text_init(void);
+extern int	lexer_text_pending(byte *buf, size_t size);
 
 /* in lexer_v?.c */
 extern char yy_get_state(void);
@@ -65,7 +79,7 @@ extern void yy_set_state_initial(void);
 /* in lexer.c */
 extern void 	lexer_init(void);
 extern void	yyinit(void);
-extern int	yyinput(byte *buf, size_t used, size_t size);
+extern int	yyinput(byte *buf, size_t held, size_t size);
 
 extern int	buff_fill(buff_t *buff, size_t used, size_t need);
 
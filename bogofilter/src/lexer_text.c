@@ -0,0 +1,348 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   lexer_text.c -- table-driven tokenizer for plain text bodies
+
+   Most of a message is plain body text, for which only a few rules of
+   lexer_v3.l apply: TOKEN, IPADDR, [IPADDR], MONEY, and the rules that
+   skip a character or end a line.  When the flex scanner is in the
+   TEXT state at the start of a line with nothing buffered, the next
+   line is read here and split up with 256 entry character class
+   tables, yielding the same tokens as those rules.
+
+   Lines that other rules may match - MIME boundaries and PGP
+   signature delimiters starting with "--", the HTML DOCTYPE, and
+   lines without a newline, whose last token may continue in the next
+   read - are handed back: yyinput() passes them on to flex, which
+   reads them as if nothing had happened.  So do headers, HTML and
+   every other state.
+
+   BOGOTEST=F (or -X F) leaves everything to flex, for comparison.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <string.h>
+
+#include "lexer.h"
+#include "token.h"
+#include "xmalloc.h"
+
+/* character classes, as in lexer_v3.l; the scanner is generated
+ * with the C locale's classes, so bytes above 127 belong to none of
+ * [:blank:], [:cntrl:], [:digit:] and [:punct:] */
+#define	C_FRONT	0x01	/* FRONT_CHAR: may start a token */
+#define	C_MID	0x02	/* MID_CHAR: may be inside one */
+#define	C_BACK	0x04	/* BACK_CHAR: may end one */
+#define	C_DIGIT	0x08
+#define	C_START	0x10	/* starts a match: FRONT_CHAR, digit, '[', '$', '\n' */
+
+static byte ctab[256];
+
+static const char doctype[] = "<!DOCTYPE HTML PUBLIC ";
+
+/* the line read ahead of flex */
+static byte  *line;
+static size_t line_size;
+static size_t len;		/* bytes in line */
+static size_t pos;		/* scanning position */
+static bool   active;		/* line is being tokenized here */
+
+/* line or end of input handed back to flex by yyinput() */
+static size_t pending;		/* bytes not yet passed on */
+static bool   pending_eof;
+
+/* the last token, NUL terminated like yytext; the byte it covers is
+ * put back before scanning on */
+static byte  *tok;
+static size_t tok_len;
+static byte   hold;
+static bool   holding;
+
+static bool   from_flex;	/* the last token came from yylex() */
+
+/* Function Definitions */
+
+static void init_tables(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c += 1) {
+	byte cl = 0;
+	bool blank = c == ' ' || c == '\t';
+	bool cntrl = c < 32 || c == 127;
+	bool digit = c >= '0' && c <= '9';
+	bool punct = c > 32 && c < 127 && !digit &&
+	    !(c >= 'A' && c <= 'Z') && !(c >= 'a' && c <= 'z');
+
+	if (!blank && !cntrl && !digit && !punct)
+	    cl |= C_FRONT | C_START;
+	if (!blank && !cntrl && (!punct || strchr("!'-._`~", c) != NULL))
+	    cl |= C_MID;
+	if ((cl & C_MID) && (!punct || c == '!'))
+	    cl |= C_BACK;
+	if (digit)
+	    cl |= C_DIGIT | C_START;
+	if (c == '[' || c == '$' || c == '\n')
+	    cl |= C_START;
+	ctab[c] = cl;
+    }
+}
+
+void lexer_text_init(void)
+{
+    if (ctab['a'] == 0)
+	init_tables();
+
+    active = false;
+    pending = 0;
+    pending_eof = false;
+    holding = false;
+    from_flex = true;
+}
+
+/** \return true if the \a n digits at \a s are a valid UINT8 */
+static bool uint8_ok(const byte *s, size_t n)
+{
+    if (n < 3)
+	return true;
+    return s[0] < '2' || (s[0] == '2' && (s[1] < '5' || (s[1] == '5' && s[2] <= '5')));
+}
+
+/** \return the length of an IPADDR at \a s, which must end just
+ * before \a close if that isn't NUL, or 0 */
+static size_t ipaddr_len(const byte *s, const byte *end, byte close)
+{
+    const byte *t = s;
+    int i;
+
+    for (i = 0; i < 4; i += 1) {
+	size_t n = 0;
+
+	/* more than three digits never make an octet */
+	while (t + n < end && n < 4 && (ctab[t[n]] & C_DIGIT))
+	    n += 1;
+	if (n == 0)
+	    return 0;
+
+	if (i < 3 || close != '\0') {
+	    /* the whole run, followed by '.' or the closing bracket */
+	    byte next = (i < 3) ? '.' : close;
+	    if (n > 3 || !uint8_ok(t, n) || t + n >= end || t[n] != next)
+		return 0;
+	    t += n + (i < 3);
+	}
+	else {
+	    /* the longest valid prefix */
+	    if (n > 3)
+		n = 3;
+	    if (!uint8_ok(t, n))
+		n = 2;
+	    t += n;
+	}
+    }
+
+    return t - s;
+}
+
+/** \return the length of a MONEY token at \a s, or 0 */
+static size_t money_len(const byte *s, const byte *end)
+{
+    const byte *t = s + 1;
+
+    if (t >= end || !(ctab[*t] & C_DIGIT))
+	return 0;
+    while (t < end && (ctab[*t] & C_DIGIT))
+	t += 1;
+    if (t + 1 < end && *t == '.' && (ctab[t[1]] & C_DIGIT)) {
+	t += 1;
+	while (t < end && (ctab[*t] & C_DIGIT))
+	    t += 1;
+    }
+
+    return t - s;
+}
+
+static token_t set_token(size_t start, size_t leng, token_t cls)
+{
+    tok = line + start;
+    tok_len = leng;
+    pos = start + leng;
+    hold = line[pos];
+    holding = true;
+    line[pos] = '\0';
+    return cls;
+}
+
+/** find the next token of the line, NONE at its end */
+static token_t scan(void)
+{
+    const byte *end = line + len;
+
+    if (holding) {
+	line[pos] = hold;
+	holding = false;
+    }
+
+    while (pos < len) {
+	const byte *s;
+	size_t n;
+
+	/* skip the run of characters no rule starts with */
+	while (pos < len && !(ctab[line[pos]] & C_START))
+	    pos += 1;
+	if (pos >= len)
+	    break;
+
+	s = line + pos;
+
+	if (*s == '\n') {
+	    /* the rule for '\n'; decoded text may have more than one */
+	    pos += 1;
+	    lexer_v3_count_line();
+	    clr_tag();
+	    continue;
+	}
+
+	if (ctab[*s] & C_FRONT) {
+	    /* TOKEN: up to the last BACK_CHAR in the run of MID_CHARs */
+	    const byte *t, *last = s;
+	    for (t = s + 1; t < end && (ctab[*t] & C_MID); t += 1)
+		if (ctab[*t] & C_BACK)
+		    last = t;
+	    return set_token(pos, last - s + 1, TOKEN);
+	}
+
+	if (ctab[*s] & C_DIGIT) {
+	    if ((n = ipaddr_len(s, end, '\0')) != 0)
+		return set_token(pos, n, IPADDR);
+	}
+	else if (*s == '[') {
+	    if ((n = ipaddr_len(s + 1, end, ']')) != 0)
+		return set_token(pos, n + 2, MESSAGE_ADDR);
+	}
+	else if (*s == '$') {
+	    if ((n = money_len(s, end)) != 0)
+		return set_token(pos, n, MONEY);
+	}
+
+	/* no match, ignore the character */
+	pos += 1;
+    }
+
+    return NONE;
+}
+
+/** \return true if a rule that is not handled here may match \a buf */
+static bool needs_flex(const byte *buf, size_t n)
+{
+    const byte *p, *end = buf + n;
+    size_t dl = sizeof(doctype) - 1;
+
+    if (n == 0 || buf[n - 1] != '\n')
+	return true;
+
+    /* decoded text may have more than one line */
+    for (p = buf; p < end; p += 1) {
+	if (end - p >= 2 && p[0] == '-' && p[1] == '-')
+	    return true;
+	p = (const byte *) memchr(p, '\n', end - p);
+    }
+
+    for (p = buf; (p = (const byte *) memchr(p, '<', end - p)) != NULL; p += 1)
+	if ((size_t)(end - p) > dl && strncasecmp((const char *)p, doctype, dl) == 0)
+	    return true;
+
+    return false;
+}
+
+/** read the next line for flex, keep it if flex isn't needed for it */
+static void read_line(size_t size)
+{
+    int n;
+
+    if (line_size < size + 1) {
+	xfree(line);
+	line_size = size + 1;
+	line = (byte *) xmalloc(line_size);
+    }
+
+    n = yyinput(line, 0, size);
+    if (n <= 0) {
+	pending_eof = true;
+	return;
+    }
+
+    len = (size_t) n;
+    line[len] = '\0';
+
+    /* a MIME boundary read with the line may have ended the text */
+    if (yy_get_state() != 't' || needs_flex(line, len)) {
+	pending = len;
+	return;
+    }
+
+    pos = 0;
+    holding = false;
+    active = true;
+}
+
+int lexer_text_pending(byte *buf, size_t size)
+{
+    size_t n;
+
+    if (pending == 0) {
+	if (!pending_eof)
+	    return -1;
+	pending_eof = false;
+	return 0;
+    }
+
+    n = min(pending, size);
+    memcpy(buf, line + len - pending, n);
+    pending -= n;
+
+    return (int) n;
+}
+
+token_t lexer_text_yylex(void)
+{
+    for (;;) {
+	size_t size;
+
+	if (active) {
+	    token_t cls = scan();
+	    if (cls != NONE) {
+		from_flex = false;
+		return cls;
+	    }
+	    active = false;
+	}
+
+	if (pending != 0 || pending_eof || BOGOTEST('F'))
+	    break;
+
+	size = lexer_v3_text_line();
+	if (size == 0)
+	    break;
+
+	read_line(size);
+	if (!active)
+	    break;
+    }
+
+    from_flex = true;
+    return yylex();
+}
+
+long lexer_text_get_token(byte **output)
+{
+    if (from_flex)
+	return lexer_v3_get_token(output);
+
+    *output = tok;
+    return (long) tok_len;
+}
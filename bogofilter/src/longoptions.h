@@ -26,7 +26,13 @@ enum field_e {
 
 typedef enum longopts_e {
     O_BLOCK_ON_SUBNETS = 1000,
+    O_BINARY,
+    O_BLOOM,
     O_CHARSET_DEFAULT,
+    O_COMPACT,
+    O_COMPILE,
+    O_HASH_KEYS,
+    O_APPLY_JOURNAL,
     O_CONFIG_FILE,
     O_DB_CHECKPOINT,
     O_DB_LIST_LOGFILES,
@@ -65,13 +71,17 @@ typedef enum longopts_e {
     O_TERSE,
     O_TERSE_FORMAT,
     O_THRESH_UPDATE,
+    O_TOKEN_CACHE_SIZE,
     O_TOKEN_COUNT_FIX,
     O_TOKEN_COUNT_MIN,
     O_TOKEN_COUNT_MAX,
     O_TIMESTAMP,
+    O_TIMING,
     O_UNICODE,
     O_UNSURE_SUBJECT_TAG,
+    O_UPDATE_JOURNAL,
     O_USER_CONFIG_FILE,
+    O_VERIFY_ROBX,
     O_WORDLIST
 } longopts_t;
 
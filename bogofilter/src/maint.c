@@ -14,9 +14,12 @@ AUTHOR:
 
 #include <assert.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "buff.h"
+#include "bulkload.h"
 #include "datastore.h"
+#include "datastore_bloom.h"
 #include "error.h"
 #include "charset.h"
 #ifndef	DISABLE_UNICODE
@@ -24,6 +27,9 @@ AUTHOR:
 #include "iconvert.h"
 #endif
 #include "maint.h"
+#include "mxcat.h"
+#include "paths.h"
+#include "robx.h"
 #include "transaction.h"
 #include "wordlists.h"
 #include "xmalloc.h"
@@ -35,6 +41,7 @@ size_t	 size_min = 0;
 size_t	 size_max = 0;
 bool     timestamp_tokens = true;
 bool	 upgrade_wordlist_version = false;
+bool	 compact_maintenance = false;
 
 #ifndef	DISABLE_UNICODE
 e_enc	 old_encoding;
@@ -78,12 +85,29 @@ static bool keep_size(size_t size)
     return ok;
 }
 
-static void merge_tokens(const word_t *old_token, const word_t *new_token, dsv_t *in_val, ta_t *transaction, void *vhandle)
+/** keep the robx statistics in step with the transaction changing
+ * \a token to \a val, or deleting it if \a val is NULL */
+static void track_robx(robx_stats_t *stats, ta_t *transaction, void *vhandle,
+		       const word_t *token, const dsv_t *val)
+{
+    dsv_t cur;
+
+    if (stats == NULL || token->u.text[0] == '.')
+	return;
+
+    if (ta_read(transaction, vhandle, token, &cur) == 0)
+	robx_stats_change(stats, &cur, val);
+    else
+	robx_stats_change(stats, NULL, val);
+}
+
+static void merge_tokens(const word_t *old_token, const word_t *new_token, dsv_t *in_val, ta_t *transaction, void *vhandle, robx_stats_t *stats)
 {
     int	  ret;
     dsv_t old_tmp;
 
     /* delete original token */
+    track_robx(stats, transaction, vhandle, old_token, NULL);
     ta_delete(transaction, vhandle, old_token);
 
     /* retrieve and update nonascii token*/
@@ -95,17 +119,20 @@ static void merge_tokens(const word_t *old_token, const word_t *new_token, dsv_t
 	in_val->date       = max(old_tmp.date, in_val->date);	/* date in form YYYYMMDD */
     }
     set_date(in_val->date);	/* set timestamp */
+    track_robx(stats, transaction, vhandle, new_token, in_val);
     ta_write(transaction, vhandle, new_token, in_val);
     set_date(0);
 }
 
-static void replace_token(const word_t *old_token, const word_t *new_token, dsv_t *in_val, ta_t *transaction, void *vhandle)
+static void replace_token(const word_t *old_token, const word_t *new_token, dsv_t *in_val, ta_t *transaction, void *vhandle, robx_stats_t *stats)
 {
     /* delete original token */
+    track_robx(stats, transaction, vhandle, old_token, NULL);
     ta_delete(transaction, vhandle, old_token);	
 
     /* retrieve and update nonascii token*/
     set_date(in_val->date);	/* set timestamp */
+    track_robx(stats, transaction, vhandle, new_token, in_val);
     ta_write(transaction, vhandle, new_token, in_val);
     set_date(0);
 }
@@ -122,6 +149,8 @@ bool discard_token(word_t *token, dsv_t *in_val)
 	    return false;
 	if (strcmp((const char *)token->u.text, ROBX_W) == 0)
 	    return false;
+	if (robx_stats_token(token))
+	    return false;
 	if (strcmp((const char *)token->u.text, WORDLIST_ENCODING) == 0)
 	    return false;
     }
@@ -156,9 +185,68 @@ bool do_replace_nonascii_characters(register byte *str, register size_t len)
     return change;
 }
 
+#ifndef	DISABLE_UNICODE
+/** convert \a token from old_encoding to new_encoding into a new
+ * buffer, \return true if it changed */
+static bool convert_token(const word_t *token, word_t *new_token)
+{
+    buff_t new_buff;
+    buff_t old_buff;
+    bool change;
+
+    old_buff.read = 0;
+    old_buff.size = token->leng;
+    old_buff.t.u.text = token->u.text;
+    old_buff.t.leng = token->leng;
+
+    new_buff.read = 0;
+    new_buff.size = token->leng * 6;
+    new_buff.t.leng = 0;
+    new_buff.t.u.text = (byte *)xmalloc(new_buff.size);
+
+    iconvert(&old_buff, &new_buff);
+
+    change = old_buff.t.leng != new_buff.t.leng ||
+	memcmp(old_buff.t.u.text, new_buff.t.u.text, new_buff.t.leng) != 0;
+
+    if (change && DEBUG_ICONV(2)) {
+	fputs("***  ", dbgout); word_puts(&old_buff.t, 0, dbgout); fputs( "\n", dbgout);
+	fputs("***  ", dbgout); word_puts(&new_buff.t, 0, dbgout); fputs( "\n", dbgout);
+    }
+
+    *new_token = new_buff.t;
+    return change;
+}
+#endif
+
+/** give a "url:" token of a version 0 wordlist the "ip:" prefix,
+ * \return true (and a new buffer) if it had to be changed */
+static bool upgrade_token(const word_t *token, word_t *new_token)
+{
+    const char  *url_hdr = "url:";
+    size_t       url_len = strlen(url_hdr);
+    const char  *ip_hdr  = "ip:";
+    size_t       ip_len  = strlen(ip_hdr);
+
+    if (wordlist_version >= IP_PREFIX)
+	return false;	/* up-to-date - nothing to do */
+
+    if (token->leng <= url_len || memcmp(token->u.text, url_hdr, url_len) != 0)
+	return false;
+
+    new_token->leng = token->leng + ip_len -  url_len;
+    new_token->u.text = (byte *)xmalloc(new_token->leng + 1);
+    memcpy(new_token->u.text, ip_hdr, ip_len);
+    memcpy(new_token->u.text+ip_len, token->u.text+url_len, token->leng - url_len);
+    new_token->u.text[new_token->leng] = '\0';
+    return true;
+}
+
 struct userdata_t {
     void *vhandle;
     ta_t *transaction;
+    robx_stats_t *stats;	/* NULL if the wordlist has none */
+    bool rewrite;		/* write every token anew */
 };
 
 static ex_t maintain_hook(word_t *w_key, dsv_t *in_val,
@@ -168,17 +256,24 @@ static ex_t maintain_hook(word_t *w_key, dsv_t *in_val,
     word_t token;
     void *vhandle = ((struct userdata_t *) userdata)->vhandle;
     ta_t *transaction = ((struct userdata_t *) userdata)->transaction;
+    robx_stats_t *stats = ((struct userdata_t *) userdata)->stats;
 
     token.u.text = w_key->u.text;
     token.leng = w_key->leng;
 
+    /* in the current value encoding */
+    if (((struct userdata_t *) userdata)->rewrite)
+	ta_write(transaction, vhandle, &token, in_val);
+
     len = strlen(MSG_COUNT);
     if (len == token.leng && 
 	    strncmp((char *)token.u.text, MSG_COUNT, token.leng) == 0)
 	return EX_OK;
 
     if (discard_token(&token, in_val)) {
-	ex_t ret = ta_delete(transaction, vhandle, &token) ? EX_ERROR : EX_OK;
+	ex_t ret;
+	track_robx(stats, transaction, vhandle, &token, NULL);
+	ret = ta_delete(transaction, vhandle, &token) ? EX_ERROR : EX_OK;
 	if (DEBUG_DATABASE(0))
 	    fprintf(dbgout, "deleting '%.*s'\n", (int)min(INT_MAX, token.leng), (char *)token.u.text);
 	return ret;
@@ -192,73 +287,26 @@ static ex_t maintain_hook(word_t *w_key, dsv_t *in_val,
 	new_token.leng = token.leng;
 	new_token.u.text[new_token.leng] = '\0';
 	if (do_replace_nonascii_characters(new_token.u.text, new_token.leng))
-	    merge_tokens(&token, &new_token, in_val, transaction, vhandle);
+	    merge_tokens(&token, &new_token, in_val, transaction, vhandle, stats);
 	xfree(new_token.u.text);
     }
 
 #ifndef	DISABLE_UNICODE
     if (old_encoding != new_encoding)
     {
-	buff_t new_buff;
-	buff_t old_buff;
-
-	old_buff.read = 0;
-	old_buff.size = token.leng;
-	old_buff.t.u.text = token.u.text;
-	old_buff.t.leng = token.leng;
-
-	new_buff.read = 0;
-	new_buff.size = token.leng * 6;
-	new_buff.t.leng = 0;
-	new_buff.t.u.text = (byte *)xmalloc(new_buff.size);
-
-	iconvert(&old_buff, &new_buff);
-
-	if (old_buff.t.leng != new_buff.t.leng ||
-	    memcmp(old_buff.t.u.text, new_buff.t.u.text, new_buff.t.leng) != 0) {
-	    if (DEBUG_ICONV(2)) {
-		fputs("***  ", dbgout); word_puts(&old_buff.t, 0, dbgout); fputs( "\n", dbgout);
-		fputs("***  ", dbgout); word_puts(&new_buff.t, 0, dbgout); fputs( "\n", dbgout);
-
-	    }
-	    merge_tokens(&old_buff.t, &new_buff.t, in_val, transaction, vhandle);
-	}
-
-	xfree(new_buff.t.u.text);
+	word_t new_token;
+	if (convert_token(&token, &new_token))
+	    merge_tokens(&token, &new_token, in_val, transaction, vhandle, stats);
+	xfree(new_token.u.text);
     }
 #endif
 
     if (upgrade_wordlist_version)
     {
-	switch (wordlist_version)
-	{
-	    case IP_PREFIX:
-		{
-		    /* up-to-date - nothing to do */
-		    break;
-		}
-	    case 0:
-		{
-		    /* update to "ip:" prefix level */
-
-		    const char  *url_hdr = "url:";
-		    size_t       url_len = strlen(url_hdr);
-		    const char  *ip_hdr  = "ip:";
-		    size_t       ip_len  = strlen(ip_hdr);
-
-		    if (token.leng > url_len && memcmp(token.u.text, url_hdr, url_len) == 0)
-		    {
-			word_t new_token;
-			new_token.leng = token.leng + ip_len -  url_len;
-			new_token.u.text = (byte *)xmalloc(new_token.leng + 1);
-			memcpy(new_token.u.text, ip_hdr, ip_len);
-			memcpy(new_token.u.text+ip_len, token.u.text+url_len, token.leng - url_len);
-			new_token.u.text[new_token.leng] = '\0';
-			replace_token(&token, &new_token, in_val, transaction, vhandle);
-			xfree(new_token.u.text);
-		    }
-		    break;
-		}
+	word_t new_token;
+	if (upgrade_token(&token, &new_token)) {
+	    replace_token(&token, &new_token, in_val, transaction, vhandle, stats);
+	    xfree(new_token.u.text);
 	}
     }
 
@@ -275,35 +323,251 @@ static bool check_wordlist_version(dsh_t *dsh)
 	return false;
 }
 
+#ifndef	DISABLE_UNICODE
+static void init_encodings(void *database)
+{
+    dsv_t val;
+    int rc = ds_get_wordlist_encoding(database, &val);
+    new_encoding = encoding;
+    if (rc == 0)
+	old_encoding = (e_enc)val.spamcount;	/* found | FIXME: is the cast correct? */
+    else
+	old_encoding = E_RAW;		/* not found */
+    if (old_encoding != new_encoding) {
+	const char *from_charset = DEFAULT_OR_UNICODE(old_encoding);
+	const char *to_charset   = DEFAULT_OR_UNICODE(new_encoding);
+	init_charset_table_iconv(from_charset, to_charset);
+    }
+}
+
+static void set_encoding(void *database)
+{
+    dsv_t val;
+    word_t enco;
+
+    enco.u.text = (byte *)xstrdup(WORDLIST_ENCODING);
+    enco.leng = strlen(WORDLIST_ENCODING);
+    val.count[0] = new_encoding;
+    val.count[1] = 0;
+    val.date     = 0;
+
+    ds_write(database, &enco, &val);
+    xfree(enco.u.text);
+}
+#endif
+
+/** \return false, with a message, if the maintenance asked for needs
+ * the token texts but the wordlist keeps only their fingerprints */
+static bool check_key_hash(void *database)
+{
+    const char *opt = NULL;
+
+    if (ds_get_key_hash(database) != KH_HASHED)
+	return true;
+
+    if (size_min != 0 || size_max != 0)
+	opt = "-s";
+    else if (replace_nonascii_characters)
+	opt = "-n";
+#ifndef	DISABLE_UNICODE
+    else if (old_encoding != new_encoding)
+	opt = "--unicode";
+#endif
+    else if (compact_maintenance && key_hash != KH_DEFAULT && key_hash != KH_HASHED)
+	opt = "--hash-keys";
+
+    if (opt == NULL)
+	return true;
+
+    fprintf(stderr, "%s: %s needs the token texts, the wordlist has only "
+	    "fingerprints (--hash-keys=yes).\n", progname, opt);
+    return false;
+}
+
 static ex_t maintain_wordlist(void *database)
 {
     ta_t *transaction = ta_init();
     struct userdata_t userdata;
+    robx_stats_t stats;
     ex_t ret;
     bool done = false;
 
     userdata.vhandle = database;
     userdata.transaction = transaction;
+    userdata.stats = NULL;
+    userdata.rewrite = false;
 
     if (DST_OK == ds_txn_begin(database)) {
 #ifndef	DISABLE_UNICODE
-	dsv_t val;
-	int rc = ds_get_wordlist_encoding(database, &val);
-	new_encoding = encoding;
-	if (rc == 0)
-	    old_encoding = (e_enc)val.spamcount;	/* found | FIXME: is the cast correct? */
-	else
-	    old_encoding = E_RAW;		/* not found */
-	if (old_encoding != new_encoding) {
-	    const char *from_charset = DEFAULT_OR_UNICODE(old_encoding);
-	    const char *to_charset   = DEFAULT_OR_UNICODE(new_encoding);
-	    init_charset_table_iconv(from_charset, to_charset);
-	}
+	init_encodings(database);
 #endif
+	if (!check_key_hash(database)) {
+	    (void) ta_rollback(transaction);
+	    (void) ds_txn_abort(database);
+	    return EX_ERROR;
+	}
+	if (upgrade_wordlist_version) {
+	    done = check_wordlist_version((dsh_t *)database);
+	    if (!done)
+		fprintf(dbgout, "Upgrading wordlist.\n");
+	    else
+		fprintf(dbgout, "Wordlist has already been upgraded.\n");
+	}
+
+	/* the new version switches the value encoding, which the
+	 * tokens get by being written again */
+	if (!done && upgrade_wordlist_version)
+	{
+	    dsv_t val;
+	    val.count[0] = CURRENT_VERSION;
+	    val.count[1] = 0;
+	    ds_set_wordlist_version(database, &val);
+	    userdata.rewrite = true;
+	}
+
+	if (robx_stats_read(database, &stats) == 0)
+	    userdata.stats = &stats;
 	ret = ds_foreach(database, maintain_hook, &userdata);
     } else
 	ret = EX_ERROR;
 
+#ifndef	DISABLE_UNICODE
+    if (old_encoding != new_encoding)
+	set_encoding(database);
+#endif
+
+    if (ta_commit(transaction) != TA_OK)
+	ret = EX_ERROR;
+
+    if (userdata.stats != NULL && robx_stats_write(database, &stats) != 0)
+	ret = EX_ERROR;
+
+    if (DST_OK != ds_txn_commit(database))
+	ret = EX_ERROR;
+
+    return ret;
+}
+
+/* copy-compacting maintenance */
+
+static ex_t compact_hook(word_t *w_key, dsv_t *in_val, void *userdata)
+{
+    bulkload_t *bl = (bulkload_t *) userdata;
+    word_t token;
+    byte *text = NULL;
+
+    token.u.text = w_key->u.text;
+    token.leng = w_key->leng;
+
+    if (token.leng == strlen(MSG_COUNT) &&
+	    strncmp((char *)token.u.text, MSG_COUNT, token.leng) == 0) {
+	bulkload_add(bl, &token, in_val);
+	return EX_OK;
+    }
+
+    /* taken anew from the copy; the version is set before the copy */
+    if (robx_stats_token(&token) ||
+	(token.leng == strlen(WORDLIST_VERSION) &&
+	 strncmp((char *)token.u.text, WORDLIST_VERSION, token.leng) == 0))
+	return EX_OK;
+
+    if (discard_token(&token, in_val)) {
+	if (DEBUG_DATABASE(0))
+	    fprintf(dbgout, "deleting '%.*s'\n", (int)min(INT_MAX, token.leng), (char *)token.u.text);
+	return EX_OK;
+    }
+
+    /* the changes are applied one after the other to the token */
+
+    if (replace_nonascii_characters) {
+	text = (byte *)xmalloc(token.leng + 1);
+	memcpy(text, token.u.text, token.leng);
+	text[token.leng] = '\0';
+	token.u.text = text;
+	(void) do_replace_nonascii_characters(text, token.leng);
+    }
+
+#ifndef	DISABLE_UNICODE
+    if (old_encoding != new_encoding) {
+	word_t new_token;
+	(void) convert_token(&token, &new_token);
+	xfree(text);
+	token = new_token;
+	text = token.u.text;
+    }
+#endif
+
+    if (upgrade_wordlist_version) {
+	word_t new_token;
+	if (upgrade_token(&token, &new_token)) {
+	    xfree(text);
+	    token = new_token;
+	    text = token.u.text;
+	}
+    }
+
+    bulkload_add(bl, &token, in_val);
+    xfree(text);
+
+    return EX_OK;
+}
+
+typedef struct {
+    void *dsh;
+    robx_stats_t *stats;	/* NULL without message counts */
+} copy_t;
+
+static int copy_hook(const word_t *token, const dsv_t *val, void *userdata)
+{
+    copy_t *cp = (copy_t *) userdata;
+    dsv_t tmp = *val;
+
+    if (cp->stats != NULL && token->u.text[0] != '.')
+	robx_stats_change(cp->stats, NULL, val);
+
+    return ds_write(cp->dsh, token, &tmp);
+}
+
+/** Write the surviving tokens of \a database to a new wordlist, in key
+ * order, and rename it over \a bfp.  The source is kept open, and
+ * thus locked against writers, until the copy is in place. */
+static ex_t compact_wordlist(void *dbe, bfpath *bfp, void *database)
+{
+    bulkload_t *bl;
+    bfpath *tmp;
+    void *copy = NULL;
+    copy_t cp;
+    robx_stats_t stats;
+    dsv_t msgs;
+    char name[40], *path;
+    ex_t ret;
+    bool done = true;
+    bool began = false;
+
+    /* the new wordlist goes next to the old one */
+    snprintf(name, sizeof(name), ".compact.%lu", (unsigned long) getpid());
+    path = mxcat(bfp->filepath, name, NULL);
+    (void) unlink(path);
+    tmp = bfpath_create(path);
+    xfree(path);
+    (void) bfpath_check_mode(tmp, BFP_MAY_CREATE);
+
+    if (ds_prepare_replace(database, tmp) != EX_OK ||
+	DST_OK != ds_txn_begin(database)) {
+	bfpath_free(tmp);
+	return EX_ERROR;
+    }
+
+#ifndef	DISABLE_UNICODE
+    init_encodings(database);
+#endif
+
+    if (!check_key_hash(database)) {
+	(void) ds_txn_abort(database);
+	bfpath_free(tmp);
+	return EX_ERROR;
+    }
+
     if (upgrade_wordlist_version) {
 	done = check_wordlist_version((dsh_t *)database);
 	if (!done)
@@ -312,35 +576,93 @@ static ex_t maintain_wordlist(void *database)
 	    fprintf(dbgout, "Wordlist has already been upgraded.\n");
     }
 
-    if (!done && upgrade_wordlist_version)
-    {
+    bl = bulkload_new(true);
+    ret = ds_foreach(database, compact_hook, bl);
+
+    /* the copy stores its keys like the old wordlist, unless
+     * --hash-keys says otherwise */
+    if (key_hash == KH_DEFAULT)
+	key_hash = ds_get_key_hash(database);
+
+    if (ret == EX_OK)
+	copy = ds_open(dbe, tmp, (dbmode_t)(DS_WRITE | DS_LOAD));
+
+    if (copy != NULL && DST_OK == ds_txn_begin(copy))
+	began = true;
+    else
+	ret = EX_ERROR;
+
+    /* the copy's version decides how its values are written, so it
+     * comes first: the current one if upgrading, else the old one */
+    if (ret == EX_OK) {
 	dsv_t val;
-	val.count[0] = CURRENT_VERSION;
-	val.count[1] = 0;
-	ds_set_wordlist_version(database, &val);
+	if (!done) {
+	    val.count[0] = CURRENT_VERSION;
+	    val.count[1] = 0;
+	    if (ds_set_wordlist_version(copy, &val) != 0)
+		ret = EX_ERROR;
+	}
+	else if (ds_get_wordlist_version(database, &val) == 0 &&
+		 ds_set_wordlist_version(copy, &val) != 0)
+	    ret = EX_ERROR;
     }
 
-#ifndef	DISABLE_UNICODE
-    if (old_encoding != new_encoding) {
-	dsv_t val;
-	word_t enco;
+    if (ret == EX_OK) {
+	YYYYMMDD today_save = today;
+
+	/* the copy sees every token, so robx statistics are taken anew
+	 * at the current message counts */
+	cp.dsh = copy;
+	cp.stats = NULL;
+	if (robx_stats_read(database, &stats) == 0 &&
+	    ds_get_msgcounts(database, &msgs) == 0 &&
+	    msgs.spamcount != 0 && msgs.goodcount != 0) {
+	    robx_stats_init(&stats, msgs.spamcount, msgs.goodcount);
+	    cp.stats = &stats;
+	}
 
-	enco.u.text = (byte *)xstrdup(WORDLIST_ENCODING);
-	enco.leng = strlen(WORDLIST_ENCODING);
-	val.count[0] = new_encoding;
-	val.count[1] = 0;
-	val.date     = 0;
+	set_date(0);		/* keep the tokens' dates */
+	if (bulkload_finish(bl, copy_hook, &cp) != 0)
+	    ret = EX_ERROR;
+	set_date(today_save);
 
-	ds_write(database, &enco, &val);
-	xfree(enco.u.text);
+	if (ret == EX_OK && cp.stats != NULL &&
+	    robx_stats_write(copy, &stats) != 0)
+	    ret = EX_ERROR;
+
+	/* ds_foreach() leaves out the stamp of the last journal, which
+	 * keeps it from being merged twice */
+	if (ret == EX_OK && ds_get_journal(database, &msgs) == 0 &&
+	    ds_set_journal(copy, &msgs) != 0)
+	    ret = EX_ERROR;
     }
+
+#ifndef	DISABLE_UNICODE
+    if (ret == EX_OK && old_encoding != new_encoding)
+	set_encoding(copy);
 #endif
 
-    if (ta_commit(transaction) != TA_OK)
-	ret = EX_ERROR;
+    if (began) {
+	if (ret == EX_OK) {
+	    if (DST_OK != ds_txn_commit(copy))
+		ret = EX_ERROR;
+	}
+	else
+	    (void) ds_txn_abort(copy);
+    }
+    if (copy != NULL)
+	ds_close(copy);
 
-    if (DST_OK != ds_txn_commit(database))
-	ret = EX_ERROR;
+    if (ret == EX_OK)
+	ret = ds_replace(database, tmp, bfp);
+
+    /* unless it was renamed */
+    (void) unlink(tmp->filepath);
+
+    (void) ds_txn_commit(database);
+
+    bulkload_free(bl);
+    bfpath_free(tmp);
 
     return ret;
 }
@@ -358,9 +680,26 @@ ex_t maintain_wordlist_file(bfpath *bfp)
     if (dsh == NULL)
 	return EX_ERROR;
 
-    rc = maintain_wordlist(dsh);
+#ifdef	ENABLE_DB_DATASTORE
+    /* files of a transactional environment must not be renamed */
+    if (compact_maintenance && eTransaction == T_ENABLED) {
+	fprintf(stderr, "%s: transactional wordlist, not compacting.\n", bfp->filepath);
+	compact_maintenance = false;
+    }
+#endif
+
+    if (compact_maintenance)
+	rc = compact_wordlist(dbe, bfp, dsh);
+    else
+	rc = maintain_wordlist(dsh);
 
     ds_close(dsh);
+
+    /* drop the deleted tokens from the filter; a compacted wordlist
+     * starts a generation of its own, so the old filter is not used
+     * with it even if this fails */
+    if (rc == EX_OK && bloom_exists(bfp))
+	rc = bloom_build(dbe, bfp);
     ds_cleanup(dbe);
 
     return rc;
@@ -18,6 +18,7 @@ extern	size_t   size_min, size_max;
 extern	bool     timestamp_tokens;
 extern	bool     replace_nonascii_characters;
 extern	bool     upgrade_wordlist_version;
+extern	bool     compact_maintenance;
 
 /* Function Prototypes */
 ex_t maintain_wordlist_file(bfpath *bfp);
@@ -25,6 +25,7 @@
 #include "lexer.h"
 #include "mime.h"
 #include "qp.h"
+#include "timing.h"
 #include "uudecode.h"
 #include "xstrdup.h"
 #include "xmalloc.h"
@@ -607,6 +608,8 @@ uint mime_decode(word_t * text)
 	break;
     }
 
+    TIMING_COUNT(TC_DECODED, count);
+
     return count;
 }
 
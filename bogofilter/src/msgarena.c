@@ -0,0 +1,106 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   msgarena.c -- per-message memory arena
+
+   Much of what bogofilter allocates while it reads and scores a
+   message - the nodes and keys of the message's wordhash, the rstats
+   list, the passthrough text blocks, scratch copies in the lexer - is
+   small, numerous and dropped together when the message is done.
+   These blocks are cut from large chunks here, and msgarena_reset()
+   releases them all at once, keeping a few chunks for the next
+   message.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <string.h>
+
+#include "msgarena.h"
+#include "xmalloc.h"
+
+#define	ARENA_CHUNK	65536	/* usual chunk size */
+#define	ARENA_KEEP	4	/* chunks kept by msgarena_reset() */
+
+typedef struct chunk_s chunk_t;
+struct chunk_s {
+    chunk_t	*next;
+    size_t	 size;		/* usable bytes */
+    size_t	 used;
+};
+
+/* determine architecture's alignment boundary */
+union align_u { long l; double d; void *p; };
+struct align_s { char c; union align_u u; };
+#define	ALIGNMENT	offsetof(struct align_s, u)
+
+#define	CHUNK_HDR	((sizeof(chunk_t) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT)
+
+static chunk_t *chunks = NULL;	/* most recent first */
+static chunk_t *spare = NULL;	/* unused chunks of ARENA_CHUNK bytes */
+
+/* Function Definitions */
+
+void *msgarena_alloc(size_t size)
+{
+    chunk_t *c = chunks;
+    char *p;
+
+    /* Force alignment on architecture's natural boundary.*/
+    if ((size % ALIGNMENT) != 0)
+	size += ALIGNMENT - (size % ALIGNMENT);
+
+    if (c == NULL || c->size - c->used < size) {
+	if (spare != NULL && size <= ARENA_CHUNK) {
+	    c = spare;
+	    spare = c->next;
+	}
+	else {
+	    size_t n = max(size, ARENA_CHUNK);
+	    c = (chunk_t *) xmalloc(CHUNK_HDR + n);
+	    c->size = n;
+	}
+	c->next = chunks;
+	c->used = 0;
+	chunks = c;
+    }
+
+    p = (char *) c + CHUNK_HDR + c->used;
+    c->used += size;
+
+    return p;
+}
+
+void *msgarena_calloc(size_t size)
+{
+    void *p = msgarena_alloc(size);
+    memset(p, 0, size);
+    return p;
+}
+
+void msgarena_reset(void)
+{
+    chunk_t *c, *next;
+    uint count = 0;
+
+    for (c = spare; c != NULL; c = c->next)
+	count += 1;
+
+    for (c = chunks; c != NULL; c = next) {
+	next = c->next;
+	if (count < ARENA_KEEP && c->size == ARENA_CHUNK) {
+	    c->next = spare;
+	    spare = c;
+	    count += 1;
+	}
+	else
+	    xfree(c);
+    }
+
+    chunks = NULL;
+}
+
+/* End */
@@ -0,0 +1,28 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   msgarena.h -- per-message memory arena
+
+******************************************************************************/
+
+#ifndef	MSGARENA_H
+#define	MSGARENA_H
+
+#include <stddef.h>
+
+/** allocate \a size bytes that stay valid until the next msgarena_reset(),
+ * exit program on allocation failure */
+/*@dependent@*/ /*@out@*/ /*@notnull@*/
+void *msgarena_alloc(size_t size);
+
+/** like msgarena_alloc(), but clear the memory */
+/*@dependent@*/ /*@notnull@*/
+void *msgarena_calloc(size_t size);
+
+/** release everything allocated from the arena at once; called after
+ * each message */
+void msgarena_reset(void);
+
+#endif	/* MSGARENA_H */
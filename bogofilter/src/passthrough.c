@@ -71,18 +71,37 @@ static bool is_hb_delim(const char *line, size_t len, bool strict_body)
     return is_blank_line(line, len);
 }
 
-static int read_mem(char **out, void *in) {
+static int read_mem(const char **out, void *in) {
     textdata_t **text = (textdata_t **)in;
     if ((*text)->next) {
 	int s = (*text)->size;
-	*out = (char *)(*text)->data;
+	*out = (const char *)(*text)->data;
 	*text = (*text)->next;
 	return s;
     }
     return 0;
 }
 
-typedef int (*readfunc_t)(char **, void *);
+/* like read_mem(), but joins blocks that are adjacent in memory, such
+ * as the lines of a memory mapped input file, so the message body goes
+ * out with one write */
+static int read_mem_run(const char **out, void *in) {
+    textdata_t **text = (textdata_t **)in;
+    size_t s;
+    if ((*text)->next == NULL)
+	return 0;
+    *out = (const char *)(*text)->data;
+    s = (*text)->size;
+    *text = (*text)->next;
+    while ((*text)->next && (*text)->data == (const byte *)*out + s &&
+	   s + (*text)->size <= INT_MAX) {
+	s += (*text)->size;
+	*text = (*text)->next;
+    }
+    return (int) s;
+}
+
+typedef int (*readfunc_t)(const char **, void *);
 
 static void write_spam_info(void)
 {
@@ -104,7 +123,7 @@ static void write_spam_info(void)
 static bool write_header(rc_t status, readfunc_t rf, void *rfarg)
 {
     ssize_t rd;
-    char   *out;
+    const char *out;
 
     bool hadlf = true;
     bool seen_subj = false;
@@ -187,7 +206,7 @@ static bool write_header(rc_t status, readfunc_t rf, void *rfarg)
 static void write_body(readfunc_t rf, void *rfarg)
 {
     ssize_t rd;
-    char   *out;
+    const char *out;
 
     int hadlf = 1;
     /* If the message terminated early (without body or blank
@@ -245,7 +264,7 @@ void write_message(rc_t status)
 		(void) fprintf(fpo, "Subject: %s%s", unsure_subject_tag, eol);
 	}
 
-	write_body(rf, rfarg);
+	write_body(read_mem_run, rfarg);
 
 	if (verbose || Rtable) {
 	    if (fflush(fpo) || ferror(fpo))
@@ -339,15 +358,24 @@ void passthrough_setup(void)
 
 int passthrough_keepopen(void)
 {
-    return false;
+    /* the text blocks may point into the mapped input file */
+    return passthrough && textblock_has_refs();
 }
 
 void passthrough_cleanup(void)
 {
+    bool keepopen;
+
     if (!passthrough)
 	return;
 
+    keepopen = passthrough_keepopen();
+
     textblock_free();
+
+    /* bogofilter left this to us */
+    if (keepopen)
+	bogoreader_close_ifeof();
 }
 
 /* End */
@@ -12,6 +12,8 @@ AUTHOR:
 
 #include "common.h"
 
+#include <string.h>
+
 #include "qp.h"
 
 /* Local Variables */
@@ -56,8 +58,22 @@ uint qp_decode(word_t *word, qp_mode mode)
 
     while (s < e)
     {
-	byte ch = *s++;
+	byte ch;
 	int x, y;
+
+	if (mode == RFC2045) {
+	    /* only '=' needs decoding, move the text up to it in one go */
+	    byte *q = (byte *) memchr(s, '=', e - s);
+	    size_t n = ((q != NULL) ? q : e) - s;
+	    if (d != s)
+		memmove(d, s, n);
+	    d += n;
+	    s += n;
+	    if (s == e)
+		break;
+	}
+
+	ch = *s++;
 	switch (ch) {
 	    case '=':
 		if (mode == RFC2045) {
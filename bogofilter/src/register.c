@@ -10,9 +10,12 @@
 #include "datastore.h"
 #include "collect.h"
 #include "format.h"
+#include "journal.h"
 #include "msgcounts.h"
 #include "rand_sleep.h"
 #include "register.h"
+#include "robx.h"
+#include "tokencache.h"
 #include "wordhash.h"
 #include "wordlists.h"
 
@@ -25,7 +28,7 @@
 void register_words(run_t _run_type, wordhash_t *h, u_int32_t msgcount)
 {
     const char *r="",*u="";
-    dsv_t val;
+    dsv_t val, old;
     hashnode_t *node;
     wordprop_t *wordprop;
     run_t save_run_type = run_type;
@@ -33,6 +36,8 @@ void register_words(run_t _run_type, wordhash_t *h, u_int32_t msgcount)
 					   registration five dozen times
 					   before giving up. */
     bool first;
+    bool stats;				/* robx statistics to update */
+    robx_stats_t robx_stats;
 
     u_int32_t wordcount = h->count;	/* use number of unique tokens */
 
@@ -69,6 +74,12 @@ void register_words(run_t _run_type, wordhash_t *h, u_int32_t msgcount)
 
     run_type = (run_t)(run_type | _run_type);
 
+    if (update_journal) {
+	journal_register(list, incr, decr, h, msgcount);
+	run_type = save_run_type;
+	return;
+    }
+
     first = true;
 
 retry:
@@ -85,6 +96,21 @@ retry:
 	exit(EX_ERROR);
     }
 
+    switch (robx_stats_read(list->dsh, &robx_stats)) {
+	case 0:
+	    stats = true;
+	    break;
+	case 1:
+	    stats = false;
+	    break;
+	case DS_ABORT_RETRY:
+	    rand_sleep(4 * 1000, 1000 * 1000);
+	    goto retry;
+	default:
+	    fprintf(stderr, "cannot read robx statistics.\n");
+	    exit(EX_ERROR);
+    }
+
     for (node = (hashnode_t *)wordhash_first(h); node != NULL; node = (hashnode_t *)wordhash_next(h))
     {
 	wordprop = (wordprop_t *)node->data;
@@ -99,6 +125,7 @@ retry:
 		fprintf(stderr, "cannot read from data base.\n");
 		exit(EX_ERROR);
 	}
+	old = val;
 	if (incr != IX_UNDF) {
 	    u_int32_t *counts = val.count;
 	    counts[incr] += wordprop->freq;
@@ -112,11 +139,28 @@ retry:
 		rand_sleep(4*1000,1000*1000);
 		goto retry;
 	    case 0:
+		if (list->cache != NULL)	/* keep it up to date */
+		    tokencache_put(list->cache, node->key, &val, 0);
 		break;
 	    default:
 		fprintf(stderr, "cannot write to data base.\n");
 		exit(EX_ERROR);
 	}
+	if (stats)
+	    robx_stats_change(&robx_stats, &old, &val);
+    }
+
+    if (stats) {
+	switch (robx_stats_write(list->dsh, &robx_stats)) {
+	    case 0:
+		break;
+	    case DS_ABORT_RETRY:
+		rand_sleep(4 * 1000, 1000 * 1000);
+		goto retry;
+	    default:
+		fprintf(stderr, "cannot write robx statistics.\n");
+		exit(EX_ERROR);
+	}
     }
 
     switch (ds_get_msgcounts(list->dsh, &val)) {
@@ -5,21 +5,51 @@
 NAME:
    robx.c -- computes robx value by reading wordlist.db
 
+   A full scan of the wordlist is slow for large wordlists, so the
+   sum and count robx is the ratio of are also kept in .ROBX_* records,
+   next to .MSG_COUNT, and updated whenever a token changes: by
+   registration, journal replay and maintenance.
+
+   A token's spamicity depends on the ratio of spam to good messages,
+   which changes with every registration, so the sums are taken at the
+   message counts recorded in .ROBX_BASE, together with the sum of
+   p*(1-p), the change of p with the ratio.  Each token's share is
+   rounded to a multiple of 2^-24 so adding and taking it away again
+   cancel exactly, and bogoutil --verify-robx can compare the records
+   with a recomputation bit by bit.  While the ratio stays within
+   ROBX_STATS_DRIFT of the base one, robx is computed from the records;
+   after that, a full scan is needed and bogoutil -R takes the
+   statistics anew.
+
 AUTHOR:
    David Relson - C version
    Greg Lous - perl version
    
 ******************************************************************************/
 
-#include <errno.h>
-
 #include "common.h"
 
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
 #include "datastore.h"
 #include "rand_sleep.h"
 #include "robx.h"
 #include "wordlists.h"
 
+#define	ROBX_SCALE	16777216.0	/* 2^24 */
+#define	TWO_32		4294967296.0
+
+/* the records of the statistics */
+enum { RS_BASE, RS_COUNT, RS_SUM, RS_SLOPE, RS_SIZE };
+
+static const char *const stats_names[RS_SIZE] = {
+    ".ROBX_BASE", ".ROBX_COUNT", ".ROBX_SUM", ".ROBX_SLOPE"
+};
+
+static word_t *stats_words[RS_SIZE];
+
 /* Function Prototypes */
 
 /* Function Definitions */
@@ -31,6 +61,7 @@ typedef struct robhook_data {
     uint32_t good_cnt;
     dsh_t    *dsh;
     double   scalefactor;
+    robx_stats_t *stats;
 } rhd_t;
 
 static void robx_accum(rhd_t *rh, 
@@ -63,15 +94,185 @@ static ex_t robx_hook(word_t *key, dsv_t *data,
     struct robhook_data *rh = (struct robhook_data *)userdata;
 
     /* ignore system meta-data */
-    if (*key->u.text != '.')
+    if (*key->u.text != '.') {
 	robx_accum(rh, key, data);
+	if (rh->stats != NULL)
+	    robx_stats_change(rh->stats, NULL, data);
+    }
 
     return EX_OK;
 }
 
+static word_t *stats_word(int i)
+{
+    if (stats_words[i] == NULL)
+	stats_words[i] = word_news(stats_names[i]);
+    return stats_words[i];
+}
+
+bool robx_stats_token(const word_t *token)
+{
+    int i;
+
+    for (i = 0; i < RS_SIZE; i += 1) {
+	size_t len = strlen(stats_names[i]);
+	if (token->leng == len && memcmp(token->u.text, stats_names[i], len) == 0)
+	    return true;
+    }
+
+    return false;
+}
+
+void robx_stats_init(robx_stats_t *st, u_int32_t spam, u_int32_t good)
+{
+    st->base[IX_SPAM] = spam;
+    st->base[IX_GOOD] = good;
+    st->count = 0;
+    st->sum = 0.0;
+    st->slope = 0.0;
+}
+
+/** add (\a sign 1) or take away (\a sign -1) the share of a token */
+static void stats_add(robx_stats_t *st, const dsv_t *val, int sign)
+{
+    uint32_t goodness = val->goodcount;
+    uint32_t spamness = val->spamcount;
+    double scalefactor, prob;
+
+    if (goodness + spamness < 10)
+	return;
+
+    scalefactor = (double)st->base[IX_SPAM] / (double)st->base[IX_GOOD];
+    prob = spamness / (goodness * scalefactor + spamness);
+
+    st->count += sign;
+    st->sum   += sign * floor(prob * ROBX_SCALE + 0.5);
+    st->slope += sign * floor(prob * (1.0 - prob) * ROBX_SCALE + 0.5);
+}
+
+void robx_stats_change(robx_stats_t *st, const dsv_t *old, const dsv_t *new)
+{
+    if (old != NULL)
+	stats_add(st, old, -1);
+    if (new != NULL)
+	stats_add(st, new, 1);
+}
+
+/* the sums are kept as two 32 bit halves */
+
+static double get_sum(const dsv_t *val)
+{
+    return val->count[1] * TWO_32 + val->count[0];
+}
+
+static void set_sum(dsv_t *val, double sum)
+{
+    double hi;
+
+    if (sum < 0.0)		/* damaged, left to --verify-robx */
+	sum = 0.0;
+    hi = floor(sum / TWO_32);
+    val->count[1] = (u_int32_t) hi;
+    val->count[0] = (u_int32_t) (sum - hi * TWO_32);
+}
+
+int robx_stats_read(void *dsh, robx_stats_t *st)
+{
+    dsv_t val[RS_SIZE];
+    int i, ret;
+
+    for (i = 0; i < RS_SIZE; i += 1) {
+	ret = ds_read(dsh, stats_word(i), &val[i]);
+	if (ret != 0)
+	    return ret;
+    }
+
+    /* a spamicity needs both kinds of messages */
+    if (val[RS_BASE].spamcount == 0 || val[RS_BASE].goodcount == 0)
+	return 1;
+
+    st->base[IX_SPAM] = val[RS_BASE].spamcount;
+    st->base[IX_GOOD] = val[RS_BASE].goodcount;
+    st->count = val[RS_COUNT].count[0];
+    st->sum   = get_sum(&val[RS_SUM]);
+    st->slope = get_sum(&val[RS_SLOPE]);
+
+    return 0;
+}
+
+int robx_stats_write(void *dsh, const robx_stats_t *st)
+{
+    dsv_t val[RS_SIZE];
+    int i, ret;
+
+    memset(val, 0, sizeof(val));
+    val[RS_BASE].spamcount = st->base[IX_SPAM];
+    val[RS_BASE].goodcount = st->base[IX_GOOD];
+    val[RS_COUNT].count[0] = st->count;
+    set_sum(&val[RS_SUM], st->sum);
+    set_sum(&val[RS_SLOPE], st->slope);
+
+    for (i = 0; i < RS_SIZE; i += 1) {
+	ret = ds_write(dsh, stats_word(i), &val[i]);
+	if (ret != 0)
+	    return ret;
+    }
+
+    return 0;
+}
+
+int robx_stats_delete(void *dsh)
+{
+    dsv_t val;
+    int i, ret;
+
+    for (i = 0; i < RS_SIZE; i += 1) {
+	ret = ds_read(dsh, stats_word(i), &val);
+	if (ret == 0)
+	    ret = ds_delete(dsh, stats_word(i));
+	if (ret != 0 && ret != 1)
+	    return ret;
+    }
+
+    return 0;
+}
+
+bool robx_stats_value(const robx_stats_t *st, u_int32_t spam, u_int32_t good,
+		      double *rx)
+{
+    double drift;
+
+    if (st->count == 0 || spam == 0 || good == 0)
+	return false;
+
+    /* relative change of the ratio since the base counts */
+    drift = ((double)spam * st->base[IX_GOOD]) /
+	((double)good * st->base[IX_SPAM]) - 1.0;
+    if (fabs(drift) > ROBX_STATS_DRIFT)
+	return false;
+
+    /* dp/dk = -p*(1-p)/k */
+    *rx = (st->sum - st->slope * drift) / ROBX_SCALE / st->count;
+    return true;
+}
+
+int robx_stats_scan(void *dsh, robx_stats_t *st)
+{
+    struct robhook_data rh;
+
+    memset(&rh, 0, sizeof(rh));
+    rh.dsh = (dsh_t *)dsh;
+    rh.scalefactor = (double)st->base[IX_SPAM] / (double)st->base[IX_GOOD];
+    rh.stats = st;
+
+    robx_stats_init(st, st->base[IX_SPAM], st->base[IX_GOOD]);
+
+    return ds_foreach(dsh, robx_hook, &rh);
+}
+
 /** returns negative for failure.
  * used by bogoutil and bogotune */
-double compute_robinson_x(void)
+double compute_robinson_x(bool renew)
 {
     int ret;
     double rx;
@@ -79,8 +280,9 @@ double compute_robinson_x(void)
     wordlist_t *wordlist;
 
     struct robhook_data rh;
+    robx_stats_t stored, stats;
 
-    open_wordlists(DS_READ);
+    open_wordlists(renew ? DS_WRITE : DS_READ);
     wordlist = get_default_wordlist(word_lists);
 
     dsh = wordlist->dsh;
@@ -93,12 +295,28 @@ double compute_robinson_x(void)
     
     rh.scalefactor = (double)rh.spam_cnt/(double)rh.good_cnt;
 
+    /* served from the statistics if they are close enough */
+    if (robx_stats_read(dsh, &stored) == 0 &&
+	robx_stats_value(&stored, rh.spam_cnt, rh.good_cnt, &rx)) {
+	if (verbose > 2)
+	    printf("%s: %u, %u, base: %u, %u, cnt: %6d, .ROBX: %f\n",
+		   MSG_COUNT, rh.spam_cnt, rh.good_cnt,
+		   stored.base[IX_SPAM], stored.base[IX_GOOD],
+		   (int)stored.count, rx);
+	close_wordlists(true);
+	return rx;
+    }
+
     rh.dsh = dsh;
-    rh.sum = 0.0;
-    rh.count = 0;
+    rh.stats = renew ? &stats : NULL;
 
     do {
+	rh.sum = 0.0;
+	rh.count = 0;
+	robx_stats_init(&stats, rh.spam_cnt, rh.good_cnt);
 	ret = ds_foreach(dsh, robx_hook, &rh);
+	if (ret == 0 && renew)
+	    ret = robx_stats_write(dsh, &stats);
 	if (ret == DS_ABORT_RETRY) {
 	    rand_sleep(1000, 1000000);
 	    begin_wordlist(wordlist);
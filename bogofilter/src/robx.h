@@ -10,6 +10,59 @@ NAME:
 #ifndef	HAVE_ROBX_H
 #define	HAVE_ROBX_H
 
-double compute_robinson_x(void);
+#include "datastore.h"
+
+/** largest relative change of the spam/good message ratio since the
+ * statistics were taken for which robx is served from them */
+#define	ROBX_STATS_DRIFT	0.01
+
+/** running robx statistics, kept in .ROBX_* records next to .MSG_COUNT
+ * and updated whenever a token changes */
+typedef struct {
+    /** message counts the spamicities are taken at */
+    u_int32_t base[IX_SIZE];
+    /** number of tokens with 10 or more counts */
+    u_int32_t count;
+    /** sum of their spamicities, in units of 2^-24 */
+    double    sum;
+    /** sum of p*(1-p) over the same tokens, in units of 2^-24, for
+     * the change of the sum with the message ratio */
+    double    slope;
+} robx_stats_t;
+
+/** returns negative for failure.  With \a renew, the wordlist is
+ * opened for writing and the statistics are stored if a full scan was
+ * needed. */
+double compute_robinson_x(bool renew);
+
+/** true if \a token is one of the records of the statistics */
+bool robx_stats_token(const word_t *token);
+
+/** prepare empty statistics for message counts \a spam and \a good */
+void robx_stats_init(robx_stats_t *st, u_int32_t spam, u_int32_t good);
+
+/** update \a st for a token changing from \a old to \a new, either of
+ * which is NULL if the token didn't or doesn't exist */
+void robx_stats_change(robx_stats_t *st, const dsv_t *old, const dsv_t *new);
+
+/** read the statistics of wordlist \a dsh, returns 0 if found, 1 if
+ * there are none, and ds_read() errors */
+int  robx_stats_read(void *dsh, robx_stats_t *st);
+
+/** store the statistics, returns 0 or ds_write() errors */
+int  robx_stats_write(void *dsh, const robx_stats_t *st);
+
+/** remove the statistics, e. g. after a change that doesn't keep
+ * them up to date */
+int  robx_stats_delete(void *dsh);
+
+/** compute robx for message counts \a spam and \a good from \a st,
+ * returns false if they have drifted too far from the base counts */
+bool robx_stats_value(const robx_stats_t *st, u_int32_t spam, u_int32_t good,
+		      double *rx);
+
+/** recompute \a st at its base counts from all tokens of wordlist
+ * \a dsh, returns 0 or ds_foreach() errors */
+int  robx_stats_scan(void *dsh, robx_stats_t *st);
 
 #endif	/* HAVE_ROBX_H */
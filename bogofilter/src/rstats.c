@@ -19,11 +19,11 @@ AUTHOR:
 
 #include "bogofilter.h"
 #include "listsort.h"
+#include "msgarena.h"
 #include "msgcounts.h"
 #include "prob.h"
 #include "rstats.h"
 #include "score.h"
-#include "xmalloc.h"
 
 typedef struct rstats_s rstats_t;
 struct rstats_s {
@@ -68,22 +68,15 @@ static void rstats_print_rtable(rstats_t *rstats_head);
 void rstats_init(void)
 {
     if (stats_head == NULL) {
-	stats_head = (header_t *)xcalloc(1, sizeof(header_t));
-	stats_tail = (rstats_t *)xcalloc(1, sizeof(rstats_t));
+	stats_head = (header_t *)msgarena_calloc(sizeof(header_t));
+	stats_tail = (rstats_t *)msgarena_calloc(sizeof(rstats_t));
 	stats_head->list = stats_tail;
     }
 }
 
+/* the list is in the message arena */
 void rstats_cleanup(void)
 {
-    rstats_t *p, *q;
-
-    for (p = stats_head->list; p != NULL; p = q)
-    {
-      q = p->next;
-      xfree(p);
-    }
-    xfree(stats_head);
     stats_head = NULL;
     stats_tail = NULL;
 }
@@ -107,7 +100,7 @@ void rstats_add(const word_t *token, double prob, bool used, wordcnts_t *cnts)
     stats_tail->msgs_good = cnts->msgs_good;
     stats_tail->msgs_bad = cnts->msgs_bad;
 
-    stats_tail->next = (rstats_t *)xcalloc(1, sizeof(rstats_t));
+    stats_tail->next = (rstats_t *)msgarena_calloc(sizeof(rstats_t));
     stats_tail = stats_tail->next;
 }
 
@@ -23,8 +23,10 @@ NAME:
 #include "rand_sleep.h"
 #include "rstats.h"
 #include "score.h"
+#include "tokencache.h"
 #include "wordhash.h"
 #include "wordlists.h"
+#include "xmalloc.h"
 
 #if defined(HAVE_GSL_10) && !defined(HAVE_GSL_14)
 /* HAVE_GSL_14 implies HAVE_GSL_10
@@ -53,8 +55,6 @@ typedef struct score_s {
     double min_dev;
     double spamicity;
     u_int32_t robn;
-    double p_ln;	/* Robinson P, as a log*/
-    double q_ln;	/* Robinson Q, as a log*/
     double p_pr;	/* Robinson P */
     double q_pr;	/* Robinson Q */
 } score_t;
@@ -104,80 +104,104 @@ void msg_print_stats(FILE *fp)
 	rstats_print(unsure);
 }
 
-/** search token in all lists according to precedence, summing up the
- * counts (all lists at same precedence are used); if found, set cnts
- * accordingly. */
-static int lookup(const word_t *token, wordcnts_t *cnts)
+/** lookup_words()' state for one token */
+typedef struct lookup_s {
+    const word_t *token;
+    wordcnts_t   *cnts;
+    int		  override;	/* precedence of the lists it was found in */
+    bool	  done;		/* no further lists to search */
+} lookup_t;
+
+/** sort by key, the order of the datastore */
+static int compare_lookup_t(const void *pv1, const void *pv2)
 {
-    int override=0;
-    wordlist_t* list;
+    const lookup_t *l1 = (const lookup_t *)pv1;
+    const lookup_t *l2 = (const lookup_t *)pv2;
+    return word_cmp(l1->token, l2->token);
+}
 
-    if (fBogotune) {
-	wordprop_t *wp = (wordprop_t *)wordhash_search_memory(token);
-	if (wp) {
-	    cnts->good = wp->cnts.good;
-	    cnts->bad  = wp->cnts.bad;
-	}
-	return 0;
+/** add the counts of \a list for \a item, \a ret as from ds_read() */
+static void add_counts(wordlist_t *list, lookup_t *item, const dsv_t *val, int ret)
+{
+    wordcnts_t *cnts = item->cnts;
+
+    if (ret == 0 && list->type == WL_IGNORE) {	/* if found on ignore list */
+	cnts->good = cnts->bad = 0;
+	item->done = true;
+	return;
     }
 
-    cnts->msgs_bad = cnts->msgs_good = 0;
+    item->override = list->override;
 
-    for (list=word_lists; list != NULL; list=list->next)
-    {
-	dsv_t val;
-	int ret;
-
-	if (override > list->override)	/* if already found */
-	    break;
-
-	ret = ds_read(list->dsh, token, &val);
-
-	/* check if we have the token */
-	switch (ret) {
-	    case 0:
-		/* token found, pass on */
-		break;
-	    case 1:
-		/* token not found, clear counts */
-		val.count[IX_GOOD] = 0;
-		val.count[IX_SPAM] = 0;
-		break;
-	    case DS_ABORT_RETRY:
-		/* sleep, reinitialize and start over */
-		rand_sleep(1000,1000000);
-		begin_wordlist(list);
-		/* FALLTHROUGH */
-	    default:
-		return ret;
-	}
+    if (DEBUG_ALGORITHM(2)) {
+	fprintf(dbgout, "%6d %5u %5u %5u %5u list=%s,%c,%d ",
+		ret, (uint)val->count[IX_GOOD], (uint)val->count[IX_SPAM],
+		(uint)list->msgcount[IX_GOOD], (uint)list->msgcount[IX_SPAM],
+		list->listname, list->type, list->override);
+	word_puts(item->token, 0, dbgout);
+	fputc('\n', dbgout);
+    }
 
-	if (ret == 0 && list->type == WL_IGNORE) {	/* if found on ignore list */
-	    cnts->good = cnts->bad = 0;
-	    break;
-	}
+    cnts->good += val->count[IX_GOOD];
+    cnts->bad += val->count[IX_SPAM];
+    cnts->msgs_good += list->msgcount[IX_GOOD];
+    cnts->msgs_bad += list->msgcount[IX_SPAM];
+}
 
-	override=list->override;
+/** search the tokens in \a list and add the counts found.
+ *
+ * Together with lookup_words() this searches each token in all lists
+ * according to precedence, summing up the counts (all lists at same
+ * precedence are used); if found on an ignore list, set the counts to
+ * zero.  Tokens in the list's token cache are taken from there, all
+ * others are read with one ds_read_many() call, which needs them
+ * sorted by key, and added to the cache.
+ * \return 0 for success, DS_ABORT_RETRY to start over
+ */
+static int lookup_list(wordlist_t *list, lookup_t *items, uint count,
+		       const word_t **words, dsv_t *vals, int *rets,
+		       uint *index)
+{
+    uint i, n = 0;
+    int ret;
 
-	if (DEBUG_ALGORITHM(2)) {
-	    fprintf(dbgout, "%6d %5u %5u %5u %5u list=%s,%c,%d ",
-		    ret, (uint)val.count[IX_GOOD], (uint)val.count[IX_SPAM],
-		    (uint)list->msgcount[IX_GOOD], (uint)list->msgcount[IX_SPAM],
-		    list->listname, list->type, list->override);
-	    word_puts(token, 0, dbgout);
-	    fputc('\n', dbgout);
+    if (list->cache == NULL && token_cache_size != 0)
+	list->cache = tokencache_new(token_cache_size);
+
+    for (i = 0; i < count; i += 1) {
+	lookup_t *item = &items[i];
+	if (item->done)
+	    continue;
+	if (item->override > list->override) {	/* if already found */
+	    item->done = true;
+	    continue;
+	}
+	if (list->cache != NULL &&
+	    tokencache_get(list->cache, item->token, &vals[n], &rets[n])) {
+	    add_counts(list, item, &vals[n], rets[n]);
+	    continue;
 	}
+	index[n] = i;
+	words[n] = item->token;
+	n += 1;
+    }
+
+    if (n == 0)
+	return 0;
 
-	cnts->good += val.count[IX_GOOD];
-	cnts->bad += val.count[IX_SPAM];
-	cnts->msgs_good += list->msgcount[IX_GOOD];
-	cnts->msgs_bad += list->msgcount[IX_SPAM];
+    ret = ds_read_many(list->dsh, n, words, vals, rets);
+
+    if (ret == DS_ABORT_RETRY) {
+	/* sleep, reinitialize and start over */
+	rand_sleep(1000,1000000);
+	begin_wordlist(list);
+	return ret;
     }
 
-    if (DEBUG_ALGORITHM(1)) {
-	fprintf(dbgout, "%5u %5u ", (uint)cnts->bad, (uint)cnts->good);
-	word_puts(token, 0, dbgout);
-	fputc('\n', dbgout);
+    for (i = 0; i < n; i += 1) {
+	if (list->cache != NULL && (rets[i] == 0 || rets[i] == 1))
+	    tokencache_put(list->cache, words[i], &vals[i], rets[i]);
+	add_counts(list, &items[index[i]], &vals[i], rets[i]);
     }
 
     return 0;
@@ -188,25 +212,86 @@ static int lookup(const word_t *token, wordcnts_t *cnts)
  */
 void lookup_words(wordhash_t *wh)
 {
-    int ret;
     hashnode_t *node;
+    wordlist_t *list;
+    lookup_t *items;
+    const word_t **words;
+    dsv_t *vals;
+    int *rets;
+    uint *index;
+    uint i, count = 0;
 
     if (msg_count_file)	/* if mc file, already done */
 	return;
 
-retry:
+    if (fBogotune) {
+	for (node = (hashnode_t *)wordhash_first(wh); node != NULL; node = (hashnode_t *)wordhash_next(wh))
+	{
+	    wordcnts_t *cnts = &((wordprop_t *) node->data)->cnts;
+	    wordprop_t *wp = (wordprop_t *)wordhash_search_memory(node->key);
+	    if (wp) {
+		cnts->good = wp->cnts.good;
+		cnts->bad  = wp->cnts.bad;
+	    }
+	}
+	return;
+    }
+
     for (node = (hashnode_t *)wordhash_first(wh); node != NULL; node = (hashnode_t *)wordhash_next(wh))
+	count += 1;
+
+    if (count == 0)
+	return;
+
+    items = (lookup_t *)xcalloc(count, sizeof(lookup_t));
+    words = (const word_t **)xcalloc(count, sizeof(word_t *));
+    vals  = (dsv_t *)xcalloc(count, sizeof(dsv_t));
+    rets  = (int *)xcalloc(count, sizeof(int));
+    index = (uint *)xcalloc(count, sizeof(uint));
+
+    i = 0;
+    for (node = (hashnode_t *)wordhash_first(wh); node != NULL; node = (hashnode_t *)wordhash_next(wh))
+    {
+	items[i].token = node->key;
+	items[i].cnts  = &((wordprop_t *) node->data)->cnts;
+	i += 1;
+    }
+
+    /* visit the keys in database order */
+    qsort(items, count, sizeof(lookup_t), compare_lookup_t);
+
+retry:
+    for (i = 0; i < count; i += 1) {
+	wordcnts_t *cnts = items[i].cnts;
+	cnts->good = cnts->bad = 0;
+	cnts->msgs_good = cnts->msgs_bad = 0;
+	items[i].override = 0;
+	items[i].done = false;
+    }
+
+    for (list = word_lists; list != NULL; list = list->next)
     {
-	word_t *token     = node->key;
-	wordprop_t *props = (wordprop_t *) node->data;
-	wordcnts_t *cnts  = &props->cnts;
-	ret = lookup(token, cnts);
-	if (ret == DS_ABORT_RETRY)
+	if (lookup_list(list, items, count, words, vals, rets, index) == DS_ABORT_RETRY)
 	    /* start all over, the message counts may have changed
-	     * lookup handles reinitializing the wordlist */
+	     * lookup_list handles reinitializing the wordlist */
 	    goto retry;
     }
 
+    if (DEBUG_ALGORITHM(1)) {
+	for (i = 0; i < count; i += 1) {
+	    wordcnts_t *cnts = items[i].cnts;
+	    fprintf(dbgout, "%5u %5u ", (uint)cnts->bad, (uint)cnts->good);
+	    word_puts(items[i].token, 0, dbgout);
+	    fputc('\n', dbgout);
+	}
+    }
+
+    xfree(index);
+    xfree(rets);
+    xfree(vals);
+    xfree(words);
+    xfree(items);
+
     return;
 }
 
@@ -549,36 +634,42 @@ inline static double prbf(double x, double df)
 }
 #endif
 
-static double get_spamicity(size_t robn, FLOAT P, FLOAT Q)
+/* msg_fisher_prob() computes score.p_pr from P (or score.q_pr from Q)
+** and msg_combine_probs() combines them into S; bogotune calls them
+** on its own to cache the parts per message.
+*/
+
+double msg_fisher_prob(size_t robn, FLOAT F, double esf)
+{
+    double df = 2.0 * robn * esf;
+    double ln2 = log(2.0);				/* ln(2) */
+    double f_ln = (log(F.mant) + F.exp * ln2) * esf;	/* convert to natural log */
+
+    return prbf(-2.0 * f_ln, df);
+}
+
+double msg_combine_probs(size_t robn, double p_pr, double q_pr)
 {
     if (robn == 0)
-    {
-	score.spamicity = robx;
-    }
-    else
-    {
-	double sp_df = 2.0 * robn * sp_esf;
-	double ns_df = 2.0 * robn * ns_esf;
-	double ln2 = log(2.0);					/* ln(2) */
+	return robx;
+    if (!fBogotune && sp_esf >= 1.0 && ns_esf >= 1.0)
+	return (1.0 + q_pr - p_pr) / 2.0;
+    if (q_pr < DBL_EPSILON && p_pr < DBL_EPSILON)
+	return 0.5;
+    return q_pr / (q_pr + p_pr);
+}
 
+static double get_spamicity(size_t robn, FLOAT P, FLOAT Q)
+{
+    if (robn != 0)
+    {
 	score.robn = robn;
-
-	/* convert to natural logs */
-	score.p_ln = (log(P.mant) + P.exp * ln2) * sp_esf;	/* invlogsum */
-	score.q_ln = (log(Q.mant) + Q.exp * ln2) * ns_esf;	/* logsum */
-
-	score.p_pr = prbf(-2.0 * score.p_ln, sp_df);		/* compute P */
-	score.q_pr = prbf(-2.0 * score.q_ln, ns_df);		/* compute Q */
-  
-	if (!fBogotune && sp_esf >= 1.0 && ns_esf >= 1.0) {
-	    score.spamicity = (1.0 + score.q_pr - score.p_pr) / 2.0;
-	} else if (score.q_pr < DBL_EPSILON && score.p_pr < DBL_EPSILON) {
-	    score.spamicity = 0.5;
-	} else {
-	    score.spamicity = score.q_pr / (score.q_pr + score.p_pr);
-	}
+	score.p_pr = msg_fisher_prob(robn, P, sp_esf);		/* compute P */
+	score.q_pr = msg_fisher_prob(robn, Q, ns_esf);		/* compute Q */
     }
 
+    score.spamicity = msg_combine_probs(robn, score.p_pr, score.q_pr);
+
     return score.spamicity;
 }
 
@@ -14,6 +14,8 @@ extern	void	score_initialize(void);
 extern	void	score_cleanup(void);
 
 extern	double	msg_compute_spamicity(wordhash_t *wordhash) /*@globals errno@*/;
+extern	double	msg_fisher_prob(size_t robn, FLOAT F, double esf);
+extern	double	msg_combine_probs(size_t robn, double p_pr, double q_pr);
 extern	double	msg_spamicity(void);
 extern	rc_t	msg_status(void);
 extern	void	msg_print_stats(FILE *fp);
@@ -0,0 +1,277 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   bench_decode.c -- compare the MIME decoders with their previous,
+		     byte-at-a-time versions
+
+   Every line of the files named on the command line is decoded as
+   base64, as RFC 2045 quoted-printable and as RFC 2047 quoted-printable
+   by both versions.  The results must be identical; the time for
+   "rounds" passes over all lines is printed.  Run with "make
+   bench-decode".
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base64.h"
+#include "qp.h"
+#include "xmalloc.h"
+
+#define	ROUNDS	200
+
+typedef uint decoder_t(word_t *word);
+
+/* the reference versions */
+
+static byte ref_base64_xlate[256];
+static const byte ref_base64_invalid = 0x7F;
+
+static uint ref_base64_decode(word_t *word)
+{
+    uint count = 0;
+    uint size = word->leng;
+    byte *s = word->u.text;		/* src */
+    byte *d = word->u.text;		/* dst */
+
+    if (!base64_validate(word))
+	return size;
+
+    while (size)
+    {
+	int i;
+	int shorten = 0;
+	unsigned long v = 0;
+	while (size && (*s == '\r' || *s == '\n')) {
+	    size--;
+	    s++;
+	}
+	if (size < 4)
+	    break;
+	for (i = 0; i < 4 && (uint)i < size; i += 1) {
+	    byte c = *s++;
+	    byte t = ref_base64_xlate[c];
+	    if (t == ref_base64_invalid) {
+		shorten = 4 - i;
+		i = 4;
+		v >>= (shorten * 2);
+		if (shorten == 2) s++;
+		break;
+	    }
+	    v = v << 6 | t;
+	}
+	size -= i;
+	for (i = 2 - shorten; i >= 0; i -= 1) {
+	    byte c = (byte) v & 0xFF;
+	    d[i] = c;
+	    v = v >> 8;
+	}
+	if (shorten != 4) {
+	    d += 3 - shorten;
+	    count += 3 - shorten;
+	}
+    }
+    if (word->leng)
+	*d = (byte) '\0';
+    return count;
+}
+
+static void ref_base64_init(void)
+{
+    static const char charset[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+
+    for (i = 0; i < sizeof(charset) - 1; i += 1)
+	ref_base64_xlate[(byte) charset[i]] = (byte) i;
+    ref_base64_xlate['='] = ref_base64_invalid;
+}
+
+static int hex_to_bin(byte c) {
+    switch (c) {
+	case '0': return 0;
+	case '1': return 1;
+	case '2': return 2;
+	case '3': return 3;
+	case '4': return 4;
+	case '5': return 5;
+	case '6': return 6;
+	case '7': return 7;
+	case '8': return 8;
+	case '9': return 9;
+	case 'a': case 'A': return 10;
+	case 'b': case 'B': return 11;
+	case 'c': case 'C': return 12;
+	case 'd': case 'D': return 13;
+	case 'e': case 'E': return 14;
+	case 'f': case 'F': return 15;
+	default: return -1;
+    }
+}
+
+static int qp_eol_check(byte *s, byte *e)
+{
+    if (s + 1 <= e) {
+	/* test for LF */
+	if (s[0] == '\n')
+	{
+	    /* only LF */
+	    return 1;
+	}
+
+	if (s[0] == '\r'
+		&& s + 2 <= e && s[1] == '\n')
+	    /* CR LF */
+	    return 2;
+    }
+
+    return 0;
+}
+
+static uint ref_qp_decode(word_t *word, qp_mode mode)
+{
+    uint size = word->leng;
+    byte *s = word->u.text;	/* src */
+    byte *d = word->u.text;	/* dst */
+    byte *e = s + size;		/* end */
+
+    while (s < e)
+    {
+	byte ch = *s++;
+	int x, y;
+	switch (ch) {
+	    case '=':
+		if (mode == RFC2045) {
+		    int c = qp_eol_check(s, e);
+		    if (c != 0) {
+			/* continuation line, trailing = */
+			s += c;
+			continue;
+		    }
+		}
+		if (s + 2 <= e && 
+			(y = hex_to_bin(s[0])) >= 0 && (x = hex_to_bin(s[1])) >= 0) {
+		    /* encoded character */
+		    ch = (byte) (y << 4 | x);
+		    s += 2;
+		}
+		break;
+	    case '_':
+		if (mode == RFC2047)
+		    ch = ' ';
+		break;
+	}
+	*d++ = ch;
+    }
+    return d - word->u.text;
+}
+
+static uint ref_qp2045(word_t *w) { return ref_qp_decode(w, RFC2045); }
+static uint ref_qp2047(word_t *w) { return ref_qp_decode(w, RFC2047); }
+static uint new_qp2045(word_t *w) { return qp_decode(w, RFC2045); }
+static uint new_qp2047(word_t *w) { return qp_decode(w, RFC2047); }
+
+/* the corpus */
+
+static word_t **lines;
+static size_t nlines, maxlines;
+static size_t nbytes;
+
+static void read_lines(const char *name)
+{
+    char buf[8192];
+    FILE *fp = fopen(name, "rb");
+
+    if (fp == NULL)
+	return;
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	if (nlines == maxlines) {
+	    maxlines = maxlines ? maxlines * 2 : 1024;
+	    lines = (word_t **) xrealloc(lines, maxlines * sizeof(word_t *));
+	}
+	lines[nlines++] = word_news(buf);
+	nbytes += strlen(buf);
+    }
+
+    fclose(fp);
+}
+
+/** decode every line with both versions, compare the results and time
+ * the new one against the reference, returns false on a mismatch */
+static bool bench(const char *what, decoder_t *ref, decoder_t *dec)
+{
+    word_t *a = word_new(NULL, 8192);
+    word_t *b = word_new(NULL, 8192);
+    clock_t t0, t_ref, t_new;
+    size_t i;
+    int r;
+
+    for (i = 0; i < nlines; i += 1) {
+	uint la, lb;
+	memcpy(a->u.text, lines[i]->u.text, lines[i]->leng);
+	memcpy(b->u.text, lines[i]->u.text, lines[i]->leng);
+	a->leng = b->leng = lines[i]->leng;
+	la = (*ref)(a);
+	lb = (*dec)(b);
+	if (la != lb || memcmp(a->u.text, b->u.text, la) != 0) {
+	    fprintf(stderr, "%s: results differ for line %lu: %.*s",
+		    what, (unsigned long) i,
+		    (int) lines[i]->leng, lines[i]->u.text);
+	    return false;
+	}
+    }
+
+    t0 = clock();
+    for (r = 0; r < ROUNDS; r += 1)
+	for (i = 0; i < nlines; i += 1) {
+	    memcpy(a->u.text, lines[i]->u.text, lines[i]->leng);
+	    a->leng = lines[i]->leng;
+	    (void) (*ref)(a);
+	}
+    t_ref = clock() - t0;
+
+    t0 = clock();
+    for (r = 0; r < ROUNDS; r += 1)
+	for (i = 0; i < nlines; i += 1) {
+	    memcpy(b->u.text, lines[i]->u.text, lines[i]->leng);
+	    b->leng = lines[i]->leng;
+	    (void) (*dec)(b);
+	}
+    t_new = clock() - t0;
+
+    printf("%-8s  reference %7.3f s  new %7.3f s  speedup %5.2f\n", what,
+	   (double) t_ref / CLOCKS_PER_SEC, (double) t_new / CLOCKS_PER_SEC,
+	   t_new ? (double) t_ref / t_new : 0.0);
+
+    word_free(a);
+    word_free(b);
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool ok = true;
+    int i;
+
+    ref_base64_init();
+
+    for (i = 1; i < argc; i += 1)
+	read_lines(argv[i]);
+
+    printf("%lu lines, %lu bytes, %d rounds\n",
+	   (unsigned long) nlines, (unsigned long) nbytes, ROUNDS);
+
+    ok &= bench("base64", ref_base64_decode, base64_decode);
+    ok &= bench("qp2045", ref_qp2045, new_qp2045);
+    ok &= bench("qp2047", ref_qp2047, new_qp2047);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -5,12 +5,15 @@
 NAME:
    textblock.c -- implementation of textblock linked lists.
 
+   The blocks are allocated in the message arena and released with it.
+   Text from a memory mapped input file is referenced, not copied.
+
 ******************************************************************************/
 
 #include "common.h"
 
+#include "msgarena.h"
 #include "textblock.h"
-#include "xmalloc.h"
 
 /* Global Variables */
 
@@ -18,6 +21,8 @@ static textblock_t *textblocks = NULL;
 
 static size_t cur_mem, max_mem, tot_mem;
 
+static bool has_refs = false;
+
 /* Function Definitions */
 
 textdata_t *textblock_head(void)
@@ -27,10 +32,11 @@ textdata_t *textblock_head(void)
 
 void textblock_init(void)
 {
-    textblock_t *t = (textblock_t *) xcalloc(1, sizeof(*t));
+    textblock_t *t = (textblock_t *) msgarena_calloc(sizeof(*t));
     size_t mem = sizeof(*t)+sizeof(textdata_t);
-    t->head = (textdata_t *) xcalloc(1, sizeof(textdata_t));
+    t->head = (textdata_t *) msgarena_calloc(sizeof(textdata_t));
     t->tail = t->head;
+    has_refs = false;
     cur_mem += mem;
     tot_mem += mem;
     max_mem = max(max_mem, cur_mem);
@@ -42,35 +48,53 @@ void textblock_init(void)
     textblocks = t;
 }
 
-void textblock_add(const byte *text, size_t size)
+static void textblock_append(const byte *data, size_t size)
 {
     textblock_t *t = textblocks;
     size_t mem = size+sizeof(textdata_t);
     textdata_t *cur = t->tail;
 
     cur->size = size;
-    if (size == 0)
-	cur->data = NULL;
-    else {
-	cur->data = (byte *)xmalloc(size+D);
-	memcpy((char *)cur->data, (const char *)text, size+D);
-	Z(((char *)cur->data)[size]);	/* for easier debugging - removable */
-    }
+    cur->data = data;
     cur_mem += mem;
     tot_mem += mem;
     max_mem = max(max_mem, cur_mem);
     if (DEBUG_TEXT(2))
 	fprintf(dbgout, "%s:%d  %p %p %3lu *add* cur: %lu, max: %lu, tot: %lu\n", 
 			       __FILE__,__LINE__,
-			       (void *)cur, (void *)cur->data,
+			       (const void *)cur, (const void *)cur->data,
 			       (unsigned long)cur->size,
 			       (unsigned long)cur_mem,
 			       (unsigned long)max_mem,
 			       (unsigned long)tot_mem );
-    cur = cur->next = (textdata_t *) xcalloc(1, sizeof(textdata_t));
+    cur = cur->next = (textdata_t *) msgarena_calloc(sizeof(textdata_t));
     t->tail = cur;
 }
 
+void textblock_add(const byte *text, size_t size)
+{
+    byte *data = NULL;
+
+    if (size != 0) {
+	data = (byte *)msgarena_alloc(size+D);
+	memcpy((char *)data, (const char *)text, size+D);
+	Z(((char *)data)[size]);	/* for easier debugging - removable */
+    }
+
+    textblock_append(data, size);
+}
+
+void textblock_add_ref(const byte *text, size_t size)
+{
+    has_refs = true;
+    textblock_append(text, size);
+}
+
+bool textblock_has_refs(void)
+{
+    return textblocks != NULL && has_refs;
+}
+
 void textblock_free(void)
 {
     size_t mem;
@@ -82,13 +106,11 @@ void textblock_free(void)
 	mem = cur->size + sizeof(*cur);
 	cur_mem -= mem;
 	if (DEBUG_TEXT(2)) fprintf(dbgout, "%s:%d  %p %p %3lu *rel* cur: %lu, max: %lu, tot: %lu\n", 
-				   __FILE__,__LINE__, (void *)cur, cur->data,
+				   __FILE__,__LINE__, (const void *)cur, (const void *)cur->data,
 				   (unsigned long)cur->size,
 				   (unsigned long)cur_mem,
 				   (unsigned long)max_mem,
 				   (unsigned long)tot_mem);
-	xfree((void*)cur->data);
-	xfree((void*)cur);
     }
 
     mem = sizeof(*t->head);
@@ -99,7 +121,7 @@ void textblock_free(void)
 			       (void *)t, (void *)t->head,
 			       (unsigned long)cur_mem, (unsigned long)max_mem,
 			       (unsigned long)tot_mem);
-    xfree(t);
+    textblocks = NULL;
     cur_mem -= sizeof(t->head) + sizeof(t);
     if (DEBUG_TEXT(1)) fprintf(dbgout, "cur: %lu, max: %lu, tot: %lu\n", (unsigned long)cur_mem, (unsigned long)max_mem, (unsigned long)tot_mem );
 }
@@ -13,7 +13,7 @@ NAME:
 typedef struct textdata_s {
     struct textdata_s *next;
     size_t             size;
-    byte              *data;
+    const byte        *data;
 } textdata_t;
 
 typedef struct textblock_s {
@@ -27,4 +27,11 @@ void textblock_free(void);
 
 void textblock_add(const byte *text, size_t size);
 
+/** like textblock_add(), but keep a pointer to \a text instead of a
+ * copy; it must stay valid until textblock_free() */
+void textblock_add_ref(const byte *text, size_t size);
+
+/** \return true if any block points to memory outside the list */
+bool textblock_has_refs(void);
+
 #endif	/* HAVE_TEXTBLOCK_H */
@@ -0,0 +1,263 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   timing.c -- time spent in bogofilter's processing stages, and counters
+
+   With the timing option set, bogofilter reads a monotonic clock
+   whenever it moves from one stage of a message to the next - reading
+   input, lexing, looking up the tokens, scoring, writing the output,
+   registering - and charges the time since the last reading to the
+   stage it leaves.  After each message, and at the end, the times are
+   reported with a few counters: tokens, datastore reads, writes and
+   deadlock retries, bytes decoded and allocations.
+
+   "stderr" prints the reports for people; "syslog" and a file name get
+   one line of name=value pairs per report, for scripts.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYSLOG_H
+#include <syslog.h>
+#endif
+
+#include "timing.h"
+#include "xmalloc.h"
+#include "xstrdup.h"
+
+typedef enum { TO_NONE, TO_STDERR, TO_SYSLOG, TO_FILE } timing_output_t;
+
+/* Global Variables */
+
+bool timing_enabled = false;
+unsigned long timing_counts[TC_COUNT];
+
+/* Local Variables */
+
+static const char *const phase_names[PH_COUNT] = {
+    "read", "lex", "lookup", "score", "output", "register"
+};
+
+static const char *const counter_names[TC_COUNT] = {
+    "tokens", "ds_gets", "ds_skipped", "ds_puts", "ds_retries", "decoded"
+};
+
+static timing_output_t output = TO_NONE;
+static char *timing_file = NULL;
+static FILE *fp = NULL;
+
+static time_t base;		/* seconds subtracted from the clock */
+static double last;		/* clock at the last phase change */
+static phase_t current;
+
+static uint messages;
+static double msg_times[PH_COUNT];
+static double total_times[PH_COUNT];
+
+/* counts at the start of the message and at timing_init(); the last
+ * one is xmalloc_count */
+static unsigned long msg_start[TC_COUNT + 1];
+static unsigned long init_start[TC_COUNT + 1];
+
+/* Function Definitions */
+
+void timing_set(const char *val)
+{
+    xfree(timing_file);
+    timing_file = NULL;
+
+    if (strcasecmp(val, "no") == 0 || strcasecmp(val, "off") == 0)
+	output = TO_NONE;
+    else if (strcasecmp(val, "yes") == 0 || strcasecmp(val, "stderr") == 0)
+	output = TO_STDERR;
+    else if (strcasecmp(val, "syslog") == 0)
+	output = TO_SYSLOG;
+    else {
+	output = TO_FILE;
+	timing_file = xstrdup(val);
+    }
+
+    timing_enabled = output != TO_NONE;
+}
+
+const char *timing_get(void)
+{
+    switch (output) {
+    case TO_STDERR:	return "stderr";
+    case TO_SYSLOG:	return "syslog";
+    case TO_FILE:	return timing_file;
+    default:		return "no";
+    }
+}
+
+/** \return seconds since \a base, from a monotonic clock if there is one */
+static double timing_clock(void)
+{
+    struct timeval tv;
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+	if (base == 0)
+	    base = ts.tv_sec;
+	return (ts.tv_sec - base) + ts.tv_nsec / 1e9;
+    }
+#endif
+
+    gettimeofday(&tv, NULL);
+    if (base == 0)
+	base = tv.tv_sec;
+    return (tv.tv_sec - base) + tv.tv_usec / 1e6;
+}
+
+static void read_counts(unsigned long *counts)
+{
+    memcpy(counts, timing_counts, sizeof(timing_counts));
+    counts[TC_COUNT] = xmalloc_count;
+}
+
+void timing_init(void)
+{
+    if (!timing_enabled)
+	return;
+
+    if (output == TO_FILE && fp == NULL) {
+	fp = fopen(timing_file, "a");
+	if (fp == NULL) {
+	    fprintf(stderr, "Cannot open %s: %s\n",
+		    timing_file, strerror(errno));
+	    exit(EX_ERROR);
+	}
+    }
+
+    messages = 0;
+    memset(msg_times, 0, sizeof(msg_times));
+    memset(total_times, 0, sizeof(total_times));
+    read_counts(init_start);
+    memcpy(msg_start, init_start, sizeof(msg_start));
+
+    current = PH_READ;
+    last = timing_clock();
+}
+
+void timing_phase(phase_t p)
+{
+    double now = timing_clock();
+
+    msg_times[current] += now - last;
+    last = now;
+    current = p;
+}
+
+/** write the report for message \a number or, if \a total, for all
+ * \a number messages */
+static void report(bool total, uint number, const double *times,
+		   const unsigned long *start, const unsigned long *end)
+{
+    char line[512];
+    size_t n = 0;
+    double sum = 0.0;
+    int i;
+
+    for (i = 0; i < PH_COUNT; i += 1)
+	sum += times[i];
+
+    if (output == TO_STDERR) {
+	n += snprintf(line + n, sizeof(line) - n,
+		      total ? "timing: %u messages: %.3f ms (" : "timing: message %u: %.3f ms (",
+		      number, sum * 1e3);
+	for (i = 0; i < PH_COUNT; i += 1)
+	    n += snprintf(line + n, sizeof(line) - n, "%s%s %.3f",
+			  i ? ", " : "", phase_names[i], times[i] * 1e3);
+	n += snprintf(line + n, sizeof(line) - n, ")");
+	for (i = 0; i < TC_COUNT; i += 1)
+	    n += snprintf(line + n, sizeof(line) - n, "%s %s %lu",
+			  i ? "," : ";", counter_names[i], end[i] - start[i]);
+	n += snprintf(line + n, sizeof(line) - n, ", allocs %lu",
+		      end[TC_COUNT] - start[TC_COUNT]);
+	fprintf(stderr, "%s\n", line);
+	return;
+    }
+
+    n += snprintf(line + n, sizeof(line) - n, "timing %s=%u total_us=%.0f",
+		  total ? "messages" : "message", number, sum * 1e6);
+    for (i = 0; i < PH_COUNT; i += 1)
+	n += snprintf(line + n, sizeof(line) - n, " %s_us=%.0f",
+		      phase_names[i], times[i] * 1e6);
+    for (i = 0; i < TC_COUNT; i += 1)
+	n += snprintf(line + n, sizeof(line) - n, " %s=%lu",
+		      counter_names[i], end[i] - start[i]);
+    n += snprintf(line + n, sizeof(line) - n, " allocs=%lu",
+		  end[TC_COUNT] - start[TC_COUNT]);
+
+    if (output == TO_FILE) {
+	fprintf(fp, "pid=%ld %s\n", (long) getpid(), line);
+	fflush(fp);
+    }
+#ifdef HAVE_SYSLOG_H
+    else
+	syslog(LOG_INFO, "%s", line);
+#endif
+}
+
+void timing_message_done(void)
+{
+    unsigned long counts[TC_COUNT + 1];
+    int i;
+
+    if (!timing_enabled)
+	return;
+
+    timing_phase(current);
+    read_counts(counts);
+
+    messages += 1;
+    report(false, messages, msg_times, msg_start, counts);
+
+    for (i = 0; i < PH_COUNT; i += 1) {
+	total_times[i] += msg_times[i];
+	msg_times[i] = 0.0;
+    }
+    memcpy(msg_start, counts, sizeof(msg_start));
+
+    /* what follows is reading the next message; the report itself
+     * isn't charged to it */
+    current = PH_READ;
+    last = timing_clock();
+}
+
+void timing_fini(void)
+{
+    unsigned long counts[TC_COUNT + 1];
+    int i;
+
+    if (!timing_enabled)
+	return;
+
+    /* the time after the last message, e.g. for the final
+     * registration, is only in the totals */
+    timing_phase(current);
+    read_counts(counts);
+    for (i = 0; i < PH_COUNT; i += 1) {
+	total_times[i] += msg_times[i];
+	msg_times[i] = 0.0;
+    }
+
+    report(true, messages, total_times, init_start, counts);
+
+    if (fp != NULL) {
+	fclose(fp);
+	fp = NULL;
+    }
+}
+
+/* End */
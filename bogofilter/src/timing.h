@@ -0,0 +1,65 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   timing.h -- time spent in bogofilter's processing stages, and counters
+
+******************************************************************************/
+
+#ifndef	TIMING_H
+#define	TIMING_H
+
+/** processing stages of a message */
+typedef enum {
+    PH_READ,		/**< reading input */
+    PH_LEX,		/**< lexing and MIME decoding */
+    PH_LOOKUP,		/**< lookup_words() */
+    PH_SCORE,		/**< msg_compute_spamicity() */
+    PH_OUTPUT,		/**< write_message() */
+    PH_REGISTER,	/**< register_words() */
+    PH_COUNT
+} phase_t;
+
+/** events counted */
+typedef enum {
+    TC_TOKENS,		/**< tokens returned by the lexer */
+    TC_DS_GETS,		/**< tokens read from the datastore */
+    TC_DS_SKIPPED,	/**< of these, misses the Bloom filter answered */
+    TC_DS_PUTS,		/**< tokens written to the datastore */
+    TC_DS_RETRIES,	/**< operations aborted with DS_ABORT_RETRY */
+    TC_DECODED,		/**< bytes of base64, QP and uuencoded text decoded */
+    TC_COUNT
+} counter_t;
+
+/** set by the timing option */
+extern bool timing_enabled;
+
+/** the counts are kept whether timing is enabled or not */
+extern unsigned long timing_counts[TC_COUNT];
+
+#define	TIMING_COUNT(c, n)	(timing_counts[c] += (n))
+
+/** charge the time from now on to \a p */
+#define	TIMING_PHASE(p)		do { if (timing_enabled) timing_phase(p); } while (0)
+
+/** set the timing option: "no", "stderr" (or "yes"), "syslog", or the
+ * name of a file to append to */
+extern void timing_set(const char *val);
+
+/** \return the timing option's value */
+extern const char *timing_get(void);
+
+/** start the clock, charging the time to PH_READ */
+extern void timing_init(void);
+
+extern void timing_phase(phase_t p);
+
+/** report the times and counts of the message just done and add them
+ * to the totals */
+extern void timing_message_done(void);
+
+/** report the totals */
+extern void timing_fini(void);
+
+#endif	/* TIMING_H */
@@ -0,0 +1,210 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   tokencache.c -- recently looked up tokens of a wordlist
+
+   When bogofilter classifies many messages (-b, -B, -M), it looks up
+   the same frequent tokens - header tags, common words - for nearly
+   every message.  Each wordlist keeps the results of its recent
+   lookups here, for as long as its transaction lasts, so most of them
+   need no trip to the datastore.
+
+   The cache holds at most "size" tokens.  When it is full, a clock
+   hand sweeps over the entries, sparing those used since its last
+   pass, and the first unused one is replaced.
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <string.h>
+
+#include "tokencache.h"
+#include "wordhash.h"
+#include "xmalloc.h"
+
+typedef struct entry_s entry_t;
+struct entry_s {
+    entry_t	*next;		/* bin chain */
+    word_t	 key;
+    uint32_t	 hash;
+    dsv_t	 val;
+    int		 ret;
+    bool	 used;		/* looked up since the clock hand passed */
+};
+
+struct tokencache_s {
+    uint	  size;		/* max entries */
+    uint	  count;	/* entries in use */
+    uint	  alloc;	/* entries allocated */
+    entry_t	 *entry;
+    entry_t	**bin;
+    uint	  bins;		/* power of 2 */
+    uint	  hand;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/* Function Definitions */
+
+tokencache_t *tokencache_new(uint size)
+{
+    tokencache_t *tc = (tokencache_t *) xcalloc(1, sizeof(tokencache_t));
+    tc->size = size;
+    return tc;
+}
+
+void tokencache_clear(tokencache_t *tc)
+{
+    uint i;
+
+    for (i = 0; i < tc->count; i += 1)
+	xfree(tc->entry[i].key.u.text);
+    if (tc->bin != NULL)
+	memset(tc->bin, 0, tc->bins * sizeof(entry_t *));
+    tc->count = 0;
+    tc->hand = 0;
+}
+
+void tokencache_free(tokencache_t *tc)
+{
+    tokencache_clear(tc);
+    xfree(tc->entry);
+    xfree(tc->bin);
+    xfree(tc);
+}
+
+static entry_t **find(tokencache_t *tc, const word_t *token, uint32_t h)
+{
+    entry_t **p;
+
+    for (p = &tc->bin[h & (tc->bins - 1)]; *p != NULL; p = &(*p)->next) {
+	entry_t *e = *p;
+	if (e->hash == h && e->key.leng == token->leng &&
+	    memcmp(e->key.u.text, token->u.text, token->leng) == 0)
+	    break;
+    }
+
+    return p;
+}
+
+bool tokencache_get(tokencache_t *tc, const word_t *token,
+		    dsv_t *val, int *ret)
+{
+    entry_t *e;
+
+    if (tc->count == 0) {
+	tc->misses += 1;
+	return false;
+    }
+
+    e = *find(tc, token, word_hash(token));
+    if (e == NULL) {
+	tc->misses += 1;
+	return false;
+    }
+
+    e->used = true;
+    *val = e->val;
+    *ret = e->ret;
+    tc->hits += 1;
+
+    return true;
+}
+
+/** make room for more entries, moving them means relinking the bins */
+static void grow(tokencache_t *tc)
+{
+    uint i;
+
+    tc->alloc = tc->alloc ? min(tc->alloc * 2, tc->size) : min(1024, tc->size);
+    tc->entry = (entry_t *) xrealloc(tc->entry, tc->alloc * sizeof(entry_t));
+
+    xfree(tc->bin);
+    for (tc->bins = 1; tc->bins < tc->alloc * 2; tc->bins *= 2)
+	continue;
+    tc->bin = (entry_t **) xcalloc(tc->bins, sizeof(entry_t *));
+
+    for (i = 0; i < tc->count; i += 1) {
+	entry_t *e = &tc->entry[i];
+	entry_t **b = &tc->bin[e->hash & (tc->bins - 1)];
+	e->next = *b;
+	*b = e;
+    }
+}
+
+/** \return an entry to reuse, unlinked from its bin */
+static entry_t *evict(tokencache_t *tc)
+{
+    entry_t *e, **p;
+
+    for (;;) {
+	e = &tc->entry[tc->hand];
+	tc->hand = (tc->hand + 1) % tc->count;
+	if (!e->used)
+	    break;
+	e->used = false;
+    }
+
+    for (p = &tc->bin[e->hash & (tc->bins - 1)]; *p != e; p = &(*p)->next)
+	continue;
+    *p = e->next;
+    xfree(e->key.u.text);
+
+    return e;
+}
+
+void tokencache_put(tokencache_t *tc, const word_t *token,
+		    const dsv_t *val, int ret)
+{
+    uint32_t h = word_hash(token);
+    entry_t **p, *e;
+
+    if (tc->size == 0)
+	return;
+
+    if (tc->count > 0) {
+	e = *find(tc, token, h);
+	if (e != NULL) {
+	    e->val = *val;
+	    e->ret = ret;
+	    return;
+	}
+    }
+
+    if (tc->count < tc->size) {
+	if (tc->count == tc->alloc)
+	    grow(tc);
+	e = &tc->entry[tc->count++];
+    }
+    else
+	e = evict(tc);
+
+    e->key.leng = token->leng;
+    e->key.u.text = (byte *) xmalloc(token->leng + D);
+    memcpy(e->key.u.text, token->u.text, token->leng);
+    Z(e->key.u.text[token->leng]);
+    e->hash = h;
+    e->val = *val;
+    e->ret = ret;
+    e->used = false;
+
+    p = &tc->bin[h & (tc->bins - 1)];
+    e->next = *p;
+    *p = e;
+}
+
+void tokencache_print_stats(tokencache_t *tc, const char *name, FILE *fp)
+{
+    unsigned long total = tc->hits + tc->misses;
+
+    if (total == 0)
+	return;
+
+    fprintf(fp, "token cache %s: %lu hits, %lu misses (%.1f%%), %u tokens\n",
+	    name, tc->hits, tc->misses, 100.0 * tc->hits / total, tc->count);
+}
+
+/* End */
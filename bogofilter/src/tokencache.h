@@ -0,0 +1,39 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   tokencache.h -- recently looked up tokens of a wordlist
+
+******************************************************************************/
+
+#ifndef	TOKENCACHE_H
+#define	TOKENCACHE_H
+
+#include "datastore.h"
+#include "word.h"
+
+typedef struct tokencache_s tokencache_t;
+
+/** a cache for up to \a size tokens */
+extern tokencache_t *tokencache_new(uint size);
+
+extern void tokencache_free(/*@only@*/ tokencache_t *tc);
+
+/** forget all tokens, e.g. when a new transaction begins */
+extern void tokencache_clear(tokencache_t *tc);
+
+/** look up \a token, \return true and set \a val and \a ret (the
+ * return value of ds_read(), 0 if found, 1 if not) if it is cached */
+extern bool tokencache_get(tokencache_t *tc, const word_t *token,
+			   dsv_t *val, int *ret);
+
+/** remember the ds_read() result for \a token; when the cache is
+ * full, it replaces a token that has not been used lately */
+extern void tokencache_put(tokencache_t *tc, const word_t *token,
+			   const dsv_t *val, int ret);
+
+/** print the hit and miss counts, headed by \a name */
+extern void tokencache_print_stats(tokencache_t *tc, const char *name, FILE *fp);
+
+#endif	/* TOKENCACHE_H */
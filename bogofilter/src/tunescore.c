@@ -0,0 +1,317 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   tunescore.c -- bogotune's compact, cached message scoring
+
+   During its scans bogotune scores every test message once per
+   parameter set.  A token's probability depends only on its counts,
+   robs and robx, and the messages share most of their tokens, so the
+   distinct count tuples are kept in one table (as separate arrays)
+   and each message is a list of indices into it.  The probabilities
+   are recomputed only when robs or robx change, and each message's
+   Robinson P and Q only when min_dev changes as well.  The chi-square
+   probabilities of P and Q depend on one ESF value each; the one for
+   P is kept for the current sp_esf and the ones for Q for the last
+   few ns_esf values, so the innermost scan loops, over the ESF
+   exponents, mostly just combine cached values.
+
+   P and Q are accumulated exactly as in score.c, token by token in
+   wordhash order, so the results are bit for bit the same as those of
+   msg_compute_spamicity().
+
+******************************************************************************/
+
+#include "common.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "bogofilter.h"
+#include "prob.h"
+#include "score.h"
+#include "tunescore.h"
+#include "xmalloc.h"
+
+#define	Q_SLOTS	8		/* cached ns_esf values */
+
+struct tunescore_s {
+    /* distinct count tuples */
+    uint	 npairs;
+    uint	 size;
+    u_int32_t	*good;
+    u_int32_t	*bad;
+    u_int32_t	*msgs_good;
+    u_int32_t	*msgs_bad;
+    double	*prob;
+
+    /* messages */
+    uint	 nmsgs;
+    uint	*start;		/* tokens of message i: tok[start[i]] .. tok[start[i+1]-1] */
+    uint	*tok;		/* index of each token's counts */
+    FLOAT	*P;
+    FLOAT	*Q;
+    uint	*robn;
+    double	*p_pr;		/* chi-square probability of P, for p_esf */
+    double	*q_pr;		/* ... of Q, nmsgs per slot, for q_esf[slot] */
+
+    /* parameters of prob, P, Q and robn */
+    bool	 valid;
+    double	 robs;
+    double	 robx;
+    double	 min_dev;
+
+    /* ESF values of p_pr and q_pr */
+    bool	 p_valid;
+    double	 p_esf;
+    uint	 q_used;
+    uint	 q_next;
+    double	 q_esf[Q_SLOTS];
+};
+
+/* dedupe table for tunescore_new(), holds index+1 of a tuple */
+typedef struct {
+    uint	*bin;
+    uint	 bins;
+} pairhash_t;
+
+/* Function Definitions */
+
+static uint pair_hash(const wordcnts_t *c)
+{
+    uint h = c->good;
+    h = h * 0x9E3779B1u + c->bad;
+    h = h * 0x9E3779B1u + c->msgs_good;
+    h = h * 0x9E3779B1u + c->msgs_bad;
+    return h ^ (h >> 15);
+}
+
+static void pairs_grow(tunescore_t *ts)
+{
+    ts->size = ts->size ? ts->size * 2 : 4096;
+    ts->good = (u_int32_t *) xrealloc(ts->good, ts->size * sizeof(u_int32_t));
+    ts->bad = (u_int32_t *) xrealloc(ts->bad, ts->size * sizeof(u_int32_t));
+    ts->msgs_good = (u_int32_t *) xrealloc(ts->msgs_good, ts->size * sizeof(u_int32_t));
+    ts->msgs_bad = (u_int32_t *) xrealloc(ts->msgs_bad, ts->size * sizeof(u_int32_t));
+}
+
+static void pairhash_rehash(tunescore_t *ts, pairhash_t *ph)
+{
+    uint i;
+
+    xfree(ph->bin);
+    ph->bins = ph->bins ? ph->bins * 2 : 8192;
+    ph->bin = (uint *) xcalloc(ph->bins, sizeof(uint));
+
+    for (i = 0; i < ts->npairs; i += 1) {
+	wordcnts_t c;
+	uint b;
+	c.good = ts->good[i];
+	c.bad = ts->bad[i];
+	c.msgs_good = ts->msgs_good[i];
+	c.msgs_bad = ts->msgs_bad[i];
+	for (b = pair_hash(&c) & (ph->bins - 1); ph->bin[b] != 0; b = (b + 1) & (ph->bins - 1))
+	    continue;
+	ph->bin[b] = i + 1;
+    }
+}
+
+/** \return the index of the tuple \a c, adding it if new */
+static uint pair_index(tunescore_t *ts, pairhash_t *ph, const wordcnts_t *c)
+{
+    uint b, i;
+
+    for (b = pair_hash(c) & (ph->bins - 1); ph->bin[b] != 0; b = (b + 1) & (ph->bins - 1)) {
+	i = ph->bin[b] - 1;
+	if (ts->good[i] == c->good && ts->bad[i] == c->bad &&
+	    ts->msgs_good[i] == c->msgs_good && ts->msgs_bad[i] == c->msgs_bad)
+	    return i;
+    }
+
+    if (ts->npairs == ts->size)
+	pairs_grow(ts);
+
+    i = ts->npairs++;
+    ts->good[i] = c->good;
+    ts->bad[i] = c->bad;
+    ts->msgs_good[i] = c->msgs_good;
+    ts->msgs_bad[i] = c->msgs_bad;
+    ph->bin[b] = i + 1;
+
+    /* keep the table at most half full */
+    if (ts->npairs * 2 > ph->bins)
+	pairhash_rehash(ts, ph);
+
+    return i;
+}
+
+tunescore_t *tunescore_new(tunelist_t *list)
+{
+    tunescore_t *ts;
+    pairhash_t ph;
+    uint i, ntok = 0, n = 0;
+
+    /* the token count limits need the tokens sorted per message */
+    if (token_count_fix != 0 || token_count_min != 0 || token_count_max != 0)
+	return NULL;
+
+    for (i = 0; i < COUNTOF(list->u.sets); i += 1) {
+	mlitem_t *item;
+	for (item = list->u.sets[i]->head; item != NULL; item = item->next) {
+	    if (item->wh->type != WH_CNTS)
+		return NULL;
+	    ntok += item->wh->count;
+	    n += 1;
+	}
+    }
+
+    ts = (tunescore_t *) xcalloc(1, sizeof(tunescore_t));
+    ts->nmsgs = n;
+    ts->start = (uint *) xcalloc(n + 1, sizeof(uint));
+    ts->tok = (uint *) xcalloc(ntok, sizeof(uint));
+    ts->P = (FLOAT *) xcalloc(n, sizeof(FLOAT));
+    ts->Q = (FLOAT *) xcalloc(n, sizeof(FLOAT));
+    ts->robn = (uint *) xcalloc(n, sizeof(uint));
+    ts->p_pr = (double *) xcalloc(n, sizeof(double));
+    ts->q_pr = (double *) xcalloc((size_t) n * Q_SLOTS, sizeof(double));
+
+    memset(&ph, 0, sizeof(ph));
+    pairhash_rehash(ts, &ph);
+
+    n = ntok = 0;
+    for (i = 0; i < COUNTOF(list->u.sets); i += 1) {
+	mlitem_t *item;
+	for (item = list->u.sets[i]->head; item != NULL; item = item->next) {
+	    wordhash_t *wh = item->wh;
+	    uint j;
+	    ts->start[n++] = ntok;
+	    for (j = 0; j < wh->count; j += 1)
+		ts->tok[ntok++] = pair_index(ts, &ph, &wh->cnts[j]);
+	}
+    }
+    ts->start[n] = ntok;
+
+    xfree(ph.bin);
+
+    ts->prob = (double *) xcalloc(ts->npairs, sizeof(double));
+
+    return ts;
+}
+
+void tunescore_free(tunescore_t *ts)
+{
+    xfree(ts->good);
+    xfree(ts->bad);
+    xfree(ts->msgs_good);
+    xfree(ts->msgs_bad);
+    xfree(ts->prob);
+    xfree(ts->start);
+    xfree(ts->tok);
+    xfree(ts->P);
+    xfree(ts->Q);
+    xfree(ts->robn);
+    xfree(ts->p_pr);
+    xfree(ts->q_pr);
+    xfree(ts);
+}
+
+/** recompute what depends on robs, robx and min_dev */
+static void tunescore_update(tunescore_t *ts)
+{
+    uint i;
+
+    if (!ts->valid || ts->robs != robs || ts->robx != robx) {
+	for (i = 0; i < ts->npairs; i += 1)
+	    ts->prob[i] = calc_prob(ts->good[i], ts->bad[i],
+				    ts->msgs_good[i], ts->msgs_bad[i]);
+    }
+
+    for (i = 0; i < ts->nmsgs; i += 1) {
+	FLOAT P = {1.0, 0};
+	FLOAT Q = {1.0, 0};
+	uint count = 0;
+	uint j;
+
+	for (j = ts->start[i]; j < ts->start[i+1]; j += 1) {
+	    double prob = ts->prob[ts->tok[j]];
+	    if (fabs(prob - EVEN_ODDS) > min_dev) {
+		int e;
+
+		P.mant *= 1-prob;
+		if (P.mant < 1.0e-200) {
+		    P.mant = frexp(P.mant, &e);
+		    P.exp += e;
+		}
+
+		Q.mant *= prob;
+		if (Q.mant < 1.0e-200) {
+		    Q.mant = frexp(Q.mant, &e);
+		    Q.exp += e;
+		}
+		count += 1;
+	    }
+	}
+
+	ts->P[i] = P;
+	ts->Q[i] = Q;
+	ts->robn[i] = count;
+    }
+
+    ts->valid = true;
+    ts->robs = robs;
+    ts->robx = robx;
+    ts->min_dev = min_dev;
+
+    ts->p_valid = false;
+    ts->q_used = ts->q_next = 0;
+}
+
+/** \return the q_pr slot for the current ns_esf, filling it if needed */
+static uint q_slot(tunescore_t *ts)
+{
+    uint i, slot;
+    double *q;
+
+    for (slot = 0; slot < ts->q_used; slot += 1)
+	if (ts->q_esf[slot] == ns_esf)
+	    return slot;
+
+    slot = ts->q_next;
+    ts->q_next = (ts->q_next + 1) % Q_SLOTS;
+    if (ts->q_used < Q_SLOTS)
+	ts->q_used += 1;
+    ts->q_esf[slot] = ns_esf;
+
+    q = ts->q_pr + (size_t) slot * ts->nmsgs;
+    for (i = 0; i < ts->nmsgs; i += 1)
+	if (ts->robn[i] != 0)
+	    q[i] = msg_fisher_prob(ts->robn[i], ts->Q[i], ns_esf);
+
+    return slot;
+}
+
+double tunescore_spamicity(tunescore_t *ts, uint idx)
+{
+    uint slot;
+
+    if (!ts->valid || ts->robs != robs || ts->robx != robx ||
+	ts->min_dev != min_dev)
+	tunescore_update(ts);
+
+    if (!ts->p_valid || ts->p_esf != sp_esf) {
+	uint i;
+	for (i = 0; i < ts->nmsgs; i += 1)
+	    if (ts->robn[i] != 0)
+		ts->p_pr[i] = msg_fisher_prob(ts->robn[i], ts->P[i], sp_esf);
+	ts->p_valid = true;
+	ts->p_esf = sp_esf;
+    }
+
+    slot = q_slot(ts);
+
+    return msg_combine_probs(ts->robn[idx], ts->p_pr[idx],
+			     ts->q_pr[(size_t) slot * ts->nmsgs + idx]);
+}
+
+/* End */
@@ -0,0 +1,29 @@
+/* $Id$ */
+
+/*****************************************************************************
+
+NAME:
+   tunescore.h -- bogotune's compact, cached message scoring
+
+******************************************************************************/
+
+#ifndef TUNESCORE_H
+#define TUNESCORE_H
+
+#include "tunelist.h"
+
+typedef struct tunescore_s tunescore_t;
+
+/** Copy the token counts of the messages in the scoring sets of \a list
+ * into a compact layout.  \return NULL if the messages have to be scored
+ * with msg_compute_spamicity(), i.e. if token count limits are set. */
+extern tunescore_t *tunescore_new(tunelist_t *list);
+
+extern void tunescore_free(/*@only@*/ tunescore_t *ts);
+
+/** Spamicity of message \a idx (counting through the scoring sets in
+ * order) for the current robs, robx, min_dev and ESF values; the same
+ * value msg_compute_spamicity() returns for it. */
+extern double tunescore_spamicity(tunescore_t *ts, uint idx);
+
+#endif
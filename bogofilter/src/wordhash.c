@@ -8,10 +8,6 @@ AUTHOR:
    Gyepi Sam <gyepi@praxis-sw.com>
 
 THEORY:
-  See 'Programming Pearls' by Jon Bentley for a good treatment of word hashing.
-  The algorithm, magic number selections, and hash function are based on
-  his implementation.
-
   This module has been tuned to perform fast inserts and searches, using
   the following techniques:
 
@@ -21,6 +17,20 @@ THEORY:
 
   2. Maintains a linked list of hash nodes in insert order for fast
   traversal of hash table.
+
+  3. The table uses open addressing with linear probing.  It starts
+  small and doubles when it gets 3/4 full, so short messages don't pay
+  for a big table and long ones don't get long probe sequences.  Each
+  slot holds the token's hash and length, so most mismatches are
+  rejected without looking at the token itself.
+
+  4. The hash function follows XXH32 (Yann Collet's xxHash), which
+  mixes all bits of the key well and works on 4 bytes at a time.
+
+  5. Nodes, keys and data are cut from large chunks and freed with the
+  hash.  The chunks and the table of a message's wordhash
+  (wordhash_new_msg()) come from the message arena and are not freed
+  individually at all.
 */
 
 #include "common.h"
@@ -30,21 +40,21 @@ THEORY:
 #include <stddef.h>	/* for offsetof */
 
 #include "listsort.h"
+#include "msgarena.h"
 #include "wordhash.h"
 #include "xmalloc.h"
 
-#define NHASH 29989
-#define MULT 31
-
-/* Note:  every wordhash includes three large chunks of memory:
+/* Note:  every wordhash includes two large chunks of memory:
    20k - S_CHUNK -- 
-   32k - N_CHUNK * sizeof (hashnode_t)
-   120k - NHASH * sizeof (hashnode_t **)
+   24k - N_CHUNK * sizeof (hashnode_t)
+   and a hash table that starts at WH_BINS slots and grows as needed.
 */
 
 #define N_CHUNK 2000
 #define S_CHUNK 20000
 
+#define WH_BINS 64	/* initial table size, must be a power of 2 */
+
 #define	WH_INIT	64
 #define	WH_INCR	64
 
@@ -75,19 +85,31 @@ static void wh_trap(void) {}
 ** initialized storage.
 */
 
-wordhash_t *
-wordhash_init (wh_t type, uint count)
+/* the table of a message's wordhash comes from the message arena too */
+static wh_slot *
+alloc_bins (const wordhash_t *wh, uint bins)
+{
+    if (wh->in_arena)
+	return (wh_slot *)msgarena_calloc (bins * sizeof (wh_slot));
+    else
+	return (wh_slot *)xcalloc (bins, sizeof (wh_slot));
+}
+
+static wordhash_t *
+wordhash_create (wh_t type, uint count, bool in_arena)
 {
     wordhash_t *wh = (wordhash_t *)xcalloc (1, sizeof (wordhash_t));
 
     wh->type = type;
     wh->count = 0;
     wh->size = (type == WH_NORMAL) ? 0 : ((count == 0) ? WH_INIT : count);
+    wh->in_arena = in_arena && (type == WH_NORMAL);
 
     switch (type)
     {
     case WH_NORMAL:
-	wh->bin = (hashnode_t **)xcalloc (NHASH, sizeof (hashnode_t **));
+	wh->bins = WH_BINS;
+	wh->bin = alloc_bins (wh, wh->bins);
 	break;
     case WH_CNTS:	/* used for bogotune with msg_count files */
 	wh->cnts = (wordcnts_t *) xcalloc(wh->size, sizeof(wordcnts_t));
@@ -101,14 +123,32 @@ wordhash_init (wh_t type, uint count)
     return wh;
 }
 
+wordhash_t *
+wordhash_init (wh_t type, uint count)
+{
+    return wordhash_create(type, count, false);
+}
+
+/* bogotune with msg_count files keeps counts instead */
+static wh_t
+new_type (void)
+{
+    return (!fBogotune || !msg_count_file) ? WH_NORMAL : WH_CNTS;
+}
+
 wordhash_t *
 wordhash_new (void)
 {
-    wh_t type = (!fBogotune || !msg_count_file) ? WH_NORMAL : WH_CNTS;
-    wordhash_t *wh = wordhash_init(type, 0);
+    wordhash_t *wh = wordhash_init(new_type(), 0);
     return wh;
 }
 
+wordhash_t *
+wordhash_new_msg (void)
+{
+    return wordhash_create(new_type(), 0, true);
+}
+
 static void
 wordhash_free_alloc_nodes (wordhash_t *wh)
 {
@@ -119,6 +159,11 @@ wordhash_free_alloc_nodes (wordhash_t *wh)
     */
     wh->iter_head = wh->iter_tail = NULL;
 
+    if (wh->in_arena) {
+	wh->nodes = NULL;
+	return;
+    }
+
     for (node = wh->nodes; node; node = next)
     {
 	next = node->next;
@@ -131,14 +176,7 @@ wordhash_free_alloc_nodes (wordhash_t *wh)
 static void
 wordhash_free_hash_nodes (wordhash_t *wh)
 {
-    hashnode_t *item, *next;
-
-    for (item = wh->iter_head; item != NULL ; item = next)
-    {
-	next = item->iter_next;
-	word_free( item->key );
-	item->key = NULL;
-    }
+    /* the keys are in the string buffers */
     wh->iter_head = NULL;
 }
 
@@ -147,6 +185,11 @@ wordhash_free_strings (wordhash_t *wh)
 {
     wh_alloc_str *sp, *sq;
 
+    if (wh->in_arena) {
+	wh->strings = NULL;
+	return;
+    }
+
     for (sp = wh->strings; sp; sp = sq)
     {
 	sq = sp->next;
@@ -183,7 +226,8 @@ wordhash_free (wordhash_t *wh)
 	break;
     }
 
-    xfree (wh->bin);
+    if (!wh->in_arena)
+	xfree (wh->bin);
     xfree (wh);
 }
 
@@ -195,11 +239,16 @@ nmalloc (wordhash_t *wh) /*@modifies wh->nodes@*/
 
     if (wn == NULL || wn->avail == 0)
     {
-	wn = (wh_alloc_node *)xmalloc (sizeof (wh_alloc_node));
+	if (!wh->in_arena) {
+	    wn = (wh_alloc_node *)xmalloc (sizeof (wh_alloc_node));
+	    wn->buf = (hashnode_t *)xmalloc (N_CHUNK * sizeof (hashnode_t));
+	} else {
+	    wn = (wh_alloc_node *)msgarena_alloc (sizeof (wh_alloc_node));
+	    wn->buf = (hashnode_t *)msgarena_alloc (N_CHUNK * sizeof (hashnode_t));
+	}
 	wn->next = wh->nodes;
 	wh->nodes = wn;
 
-	wn->buf = (hashnode_t *)xmalloc (N_CHUNK * sizeof (hashnode_t));
 	wn->avail = N_CHUNK;
 	wn->used = 0;
     }
@@ -225,11 +274,16 @@ smalloc (wordhash_t *wh, size_t n) /*@modifies wh->strings@*/
    
     if (s == NULL || s->avail < n)
     {
-	s = (wh_alloc_str *)xmalloc (sizeof (wh_alloc_str));
+	if (!wh->in_arena) {
+	    s = (wh_alloc_str *)xmalloc (sizeof (wh_alloc_str));
+	    s->buf = (char *)xmalloc (S_CHUNK + n);
+	} else {
+	    s = (wh_alloc_str *)msgarena_alloc (sizeof (wh_alloc_str));
+	    s->buf = (char *)msgarena_alloc (S_CHUNK + n);
+	}
 	s->next = wh->strings;
 	wh->strings = s;
 
-	s->buf = (char *)xmalloc (S_CHUNK + n);
 	s->avail = S_CHUNK + n;
 	s->used = 0;
     }
@@ -239,14 +293,130 @@ smalloc (wordhash_t *wh, size_t n) /*@modifies wh->strings@*/
     return (t);
 }
 
-static unsigned int
+/* copy of token t in the string buffers, like word_dup() */
+static word_t *
+sdup (wordhash_t *wh, const word_t *t)
+{
+    word_t *w = (word_t *) smalloc (wh, sizeof (word_t) + t->leng + 1);
+
+    w->leng = t->leng;
+    w->u.text = (byte *) (w + 1);
+    memcpy (w->u.text, t->u.text, t->leng);
+    w->u.text[t->leng] = '\0';
+    return w;
+}
+
+#define PRIME1	2654435761U
+#define PRIME2	2246822519U
+#define PRIME3	3266489917U
+#define PRIME4	 668265263U
+#define PRIME5	 374761393U
+
+#define ROTL(x, r)	(((x) << (r)) | ((x) >> (32 - (r))))
+
+static inline uint32_t
+read32 (const byte *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));	/* byte order doesn't matter here */
+    return v;
+}
+
+/* XXH32 with seed 0; never returns 0, see wordhash_search() */
+static uint32_t
 hash (const word_t *t)
 {
-    unsigned int h = 0;
-    size_t l;
-    for (l=0; l<t->leng; l++)
-	h = MULT * h + t->u.text[l];
-    return h % NHASH;
+    const byte *p = t->u.text;
+    const byte *end = p + t->leng;
+    uint32_t h;
+
+    if (t->leng >= 16) {
+	const byte *limit = end - 16;
+	uint32_t v1 = PRIME1 + PRIME2;
+	uint32_t v2 = PRIME2;
+	uint32_t v3 = 0;
+	uint32_t v4 = 0 - PRIME1;
+
+	do {
+	    v1 += read32(p) * PRIME2; v1 = ROTL(v1, 13) * PRIME1; p += 4;
+	    v2 += read32(p) * PRIME2; v2 = ROTL(v2, 13) * PRIME1; p += 4;
+	    v3 += read32(p) * PRIME2; v3 = ROTL(v3, 13) * PRIME1; p += 4;
+	    v4 += read32(p) * PRIME2; v4 = ROTL(v4, 13) * PRIME1; p += 4;
+	} while (p <= limit);
+
+	h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+    }
+    else
+	h = PRIME5;
+
+    h += (uint32_t) t->leng;
+
+    for (; p + 4 <= end; p += 4) {
+	h += read32(p) * PRIME3;
+	h = ROTL(h, 17) * PRIME4;
+    }
+
+    for (; p < end; p += 1) {
+	h += (*p) * PRIME5;
+	h = ROTL(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 15;
+    h *= PRIME2;
+    h ^= h >> 13;
+    h *= PRIME3;
+    h ^= h >> 16;
+
+    return h ? h : 1;
+}
+
+uint32_t
+word_hash (const word_t *t)
+{
+    return hash (t);
+}
+
+/* returns the slot holding t, or the empty slot where it belongs */
+static wh_slot *
+find_slot (const wordhash_t *wh, const word_t *t, uint32_t h)
+{
+    uint mask = wh->bins - 1;
+    uint i;
+
+    for (i = h & mask; ; i = (i + 1) & mask) {
+	wh_slot *s = &wh->bin[i];
+	if (s->node == NULL)
+	    return s;
+	if (s->hash == h && s->leng == t->leng &&
+	    memcmp (t->u.text, s->node->key->u.text, t->leng) == 0)
+	    return s;
+    }
+}
+
+/* doubles the table, keeping the stored hashes */
+static void
+grow_table (wordhash_t *wh)
+{
+    wh_slot *old = wh->bin;
+    uint bins = wh->bins;
+    uint mask, i;
+
+    wh->bins = bins * 2;
+    wh->bin = alloc_bins (wh, wh->bins);
+    mask = wh->bins - 1;
+
+    for (i = 0; i < bins; i += 1) {
+	uint j;
+	if (old[i].node == NULL)
+	    continue;
+	for (j = old[i].hash & mask; wh->bin[j].node != NULL; j = (j + 1) & mask)
+	    continue;
+	wh->bin[j] = old[i];
+    }
+
+    /* an outgrown table in the arena stays there until the reset */
+    if (!wh->in_arena)
+	xfree (old);
 }
 
 static void display_node(hashnode_t *n, const char *str)
@@ -311,33 +481,37 @@ wordhash_search_memory (const word_t *t)
     return ans;
 }
 
+/* h is t's hash, or 0 to compute it */
 void *
-wordhash_search (const wordhash_t *wh, const word_t *t, unsigned int idx)
+wordhash_search (const wordhash_t *wh, const word_t *t, uint h)
 {
-    hashnode_t *hn;
+    wh_slot *s;
 
-    if (idx == 0)
-	idx = hash (t);
+    if (wh->bin == NULL)
+	return NULL;
 
-    for (hn = wh->bin[idx]; hn != NULL; hn = hn->next) {
-	word_t *key = hn->key;
-	if (key->leng == t->leng && memcmp (t->u.text, key->u.text, t->leng) == 0) {
-	    wordprop_t *p = (wordprop_t *)hn->data;
-	    return p;
-	}
-    }
-    return NULL;
+    if (h == 0)
+	h = hash (t);
+
+    s = find_slot (wh, t, h);
+    return (s->node != NULL) ? s->node->data : NULL;
 }
 
 static void *
 wordhash_standard_insert (wordhash_t *wh, word_t *t, size_t n, void (*initializer)(void *))
 {
     hashnode_t *hn;
-    unsigned int idx = hash (t);
-    void *buf = wordhash_search(wh, t, idx);
+    uint32_t h = hash (t);
+    wh_slot *s = find_slot (wh, t, h);
 
-    if (buf != NULL)
-	return buf;
+    if (s->node != NULL)
+	return s->node->data;
+
+    /* keep the load factor below 3/4 */
+    if ((wh->used + 1) * 4 > wh->bins * 3) {
+	grow_table (wh);
+	s = find_slot (wh, t, h);
+    }
 
     hn = nmalloc (wh);
     hn->data = smalloc (wh, n);
@@ -346,10 +520,12 @@ wordhash_standard_insert (wordhash_t *wh, word_t *t, size_t n, void (*initialize
     else
 	memset(hn->data, '\0', n);
 
-    hn->key = word_dup(t);
+    hn->key = sdup(wh, t);
 
-    hn->next = wh->bin[idx];
-    wh->bin[idx] = hn;
+    s->hash = h;
+    s->leng = t->leng;
+    s->node = hn;
+    wh->used += 1;
 
     if (wh->iter_head == NULL){
 	wh->iter_head = hn;
@@ -551,7 +727,6 @@ convert_wordhash_to_propslist(wordhash_t *whi, wordhash_t *db)
 		    wh_trap();
 	    }
 	    who->props[who->count].data = wp;
-	    xfree(node->key);
 	    node->key = NULL;
 	    who->count += 1;
 	}
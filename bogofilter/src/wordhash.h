@@ -8,11 +8,18 @@
 /* Hash entry. */
 typedef struct hashnode_t {
   /*@dependent@*/ struct hashnode_t *iter_next;	/* Next item added to hash. For fast traversal */
-  struct hashnode_t *next;			/* Next item in linked list of items with same hash */ 
   word_t *key;					/* word key */
   void   *data;					/* Associated data. To be used by caller. */
 } hashnode_t;
 
+/* Hash table slot, empty if node is NULL.  The hash and the key
+ * length are kept here so most mismatches don't touch the node. */
+typedef struct wh_slot {
+  uint32_t hash;
+  uint32_t leng;
+  /*@null@*/ /*@dependent@*/ hashnode_t *node;
+} wh_slot;
+
 typedef struct wh_alloc_node {
   hashnode_t *buf;
   /*@refs@*/ size_t avail;
@@ -36,11 +43,14 @@ typedef enum wh_e { WH_NORMAL,
 typedef struct wordhash_s {
   /*@null@*/  /*@dependent@*/ wh_t type;		/* normal, ordered, props, or cnts */
   /*@null@*/  /*@dependent@*/ bool freeable;
+  /*@null@*/  /*@dependent@*/ bool in_arena;		/* chunks from the message arena */
   /*@null@*/  /*@dependent@*/ uint index;		/* access index */
   /*@null@*/  /*@dependent@*/ uint count;		/* count of words */
   /*@null@*/  /*@dependent@*/ uint size;		/* size of array */
 
-  hashnode_pt *bin;
+  /*@null@*/ /*@owned@*/ wh_slot *bin;			/* open addressing table */
+  uint bins;						/* number of slots, a power of 2 */
+  uint used;						/* number of occupied slots */
   /*@null@*/ /*@owned@*/ wh_alloc_node *nodes;		/* list of node buffers */
   /*@null@*/  		 wh_alloc_str  *strings;	/* list of string buffers */
 
@@ -55,6 +65,11 @@ typedef struct wordhash_s {
 /*@only@*/ wordhash_t *wordhash_new(void);
 /*@only@*/ wordhash_t *wordhash_init(wh_t type, uint count);
 
+/* A wordhash for a single message: nodes, keys, data and the table are
+ * allocated in the message arena, so it must be freed before
+ * msgarena_reset(). */
+/*@only@*/ wordhash_t *wordhash_new_msg(void);
+
 void wordhash_free(/*@only@*/ wordhash_t *);
 size_t wordhash_count(wordhash_t * h);
 void wordhash_sort(wordhash_t * h);
@@ -63,6 +78,9 @@ void wordhash_set_counts(wordhash_t *wh, int good, int bad);
 
 void *wordhash_search (const wordhash_t *wh, const word_t *t, uint hash);
 
+/* the hash function of the wordhash, never 0 */
+uint32_t word_hash (const word_t *t);
+
 /* Given h, s, n, search for key s.
  * If found, return pointer to associated buffer.
  * Else, insert key and return pointer to allocated buffer of size n. */
@@ -14,6 +14,7 @@
 #include "mxcat.h"
 #include "paths.h"
 #include "rand_sleep.h"
+#include "tokencache.h"
 #include "wordlists.h"
 #include "xmalloc.h"
 #include "xstrdup.h"
@@ -64,7 +65,8 @@ static void *list_searchinsert(bfpath *bfp)
     return n->dbe;
 }
 
-void begin_wordlist(wordlist_t *list)
+/** begin a transaction and read the message counts and encoding */
+static void start_wordlist(wordlist_t *list)
 {
     dsv_t val;
 
@@ -98,6 +100,71 @@ void begin_wordlist(wordlist_t *list)
     }
 }
 
+void begin_wordlist(wordlist_t *list)
+{
+    /* other processes may have changed the wordlist */
+    if (list->cache != NULL)
+	tokencache_clear(list->cache);
+
+    start_wordlist(list);
+}
+
+void suspend_wordlists(void)
+{
+    wordlist_t *list;
+
+    for (list = word_lists; list != NULL; list = list->next) {
+	dsv_t gen;
+
+	if (list->dsh == NULL)
+	    continue;
+
+	/* our own writes went to the cache, and bump the generation */
+	list->gen_found = ds_get_generation(list->dsh, &gen);
+	if (ds_txn_dirty(list->dsh))
+	    gen.count[0] += 1;
+	list->generation[0] = gen.count[0];
+	list->generation[1] = gen.count[1];
+	if (ds_txn_commit(list->dsh)) {
+	    fprintf(stderr, "%s: cannot commit transaction on %s.\n",
+		    progname, list->listname);
+	    exit(EX_ERROR);
+	}
+    }
+}
+
+void resume_wordlists(void)
+{
+    wordlist_t *list;
+
+    for (list = word_lists; list != NULL; list = list->next) {
+	dsv_t after;
+	int found = list->gen_found;
+	bool same;
+
+	if (list->dsh == NULL)
+	    continue;
+
+	start_wordlist(list);
+
+	/* the cached counts stay good unless somebody else wrote; a
+	 * list nobody has written since generations were introduced
+	 * has none before and after */
+	same = (found == 0 || found == 1) &&
+	    ds_get_generation(list->dsh, &after) == found &&
+	    list->generation[0] == after.count[0] &&
+	    list->generation[1] == after.count[1];
+	if (list->cache != NULL && !same)
+	    tokencache_clear(list->cache);
+    }
+}
+
+void renew_wordlists(void)
+{
+    suspend_wordlists();
+    resume_wordlists();
+}
+
 static bool open_wordlist(wordlist_t *list, dbmode_t mode)
 {
     bool retry = false;
@@ -110,6 +177,9 @@ static bool open_wordlist(wordlist_t *list, dbmode_t mode)
     if (list->type == WL_IGNORE) 	/* open ignore list in read-only mode */
 	mode = DS_READ;
 
+    if (mode == DS_READ)		/* a compiled image will do */
+	mode = (dbmode_t)(mode | DS_IMAGE);
+
     /* FIXME: create or reuse environment from filepath */
 
     dbe = list_searchinsert(bfp);
@@ -237,6 +307,15 @@ void open_wordlists(dbmode_t mode)
     }
 }
 
+void print_token_cache_stats(FILE *fp)
+{
+    wordlist_t *list;
+
+    for (list = word_lists; list != NULL; list = list->next)
+	if (list->cache != NULL)
+	    tokencache_print_stats(list->cache, list->listname, fp);
+}
+
 /** close all open word lists */
 bool close_wordlists(bool commit /** if unset, abort */)
     /* FIXME: we really need to look at the list's environments */
@@ -257,6 +336,10 @@ bool close_wordlists(bool commit /** if unset, abort */)
 	    }
 	    ds_close(vhandle);
 	}
+	if (list->cache != NULL) {
+	    tokencache_free(list->cache);
+	    list->cache = NULL;
+	}
     }
 
     while ((i = envlisthead.lh_first)) {
@@ -28,11 +28,30 @@ bool configure_wordlist(const char *val);
  */
 void begin_wordlist(wordlist_t *list);
 
+/**
+ * end the transaction of each open wordlist and begin the next, so
+ * that a process reading many messages doesn't keep one snapshot of
+ * the wordlists, or their locks, all the time; token caches are only
+ * cleared if a wordlist was written to meanwhile
+ */
+void renew_wordlists(void);
+
+/**
+ * the two halves of renew_wordlists(), for a process that waits in
+ * between and shouldn't hold a transaction meanwhile: commit the
+ * transaction of each open wordlist, and begin the next one
+ */
+void suspend_wordlists(void);
+void resume_wordlists(void);
+
 void open_wordlists(dbmode_t mode);
 bool close_wordlists(bool commit);
 bool query_wordlists_closed(void);
 
 void set_list_active_status(bool status);
+
+/** print the hit and miss counts of the wordlists' token caches */
+void print_token_cache_stats(FILE *fp);
 void set_wordlist_directory(void);
 
 void wordlist_error(int err);
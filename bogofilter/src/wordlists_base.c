@@ -2,6 +2,7 @@
 
 #include "common.h"
 
+#include "datastore.h"
 #include "find_home.h"
 #include "mxcat.h"
 #include "paths.h"
@@ -71,6 +72,7 @@ void init_wordlist(const char* name,
     n->bfp     =bfpath_create(path);
     n->type    =type;
     n->override=override;
+    n->gen_found=DS_NOTFOUND;		/* not suspended yet */
 
     /* now enqueue according to "override" (priority) */
     list_ptr=word_lists;
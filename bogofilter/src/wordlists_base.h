@@ -29,6 +29,9 @@ struct wordlist_s
     WL_TYPE	type;			/**< datastore type */
     int		override;		/**< priority in queue */
     e_enc	encoding;		/**< encoding */
+    /*@owned@*/ struct tokencache_s *cache;	/**< recent lookups */
+    u_int32_t	generation[2];		/**< as suspend_wordlists() left it */
+    int		gen_found;		/**< ds_get_generation() result for it */
 };
 
 void wordlists_set_bogohome(void);
@@ -16,6 +16,7 @@
 void
 *xcalloc(size_t nmemb, size_t size){
    void *ptr;
+   xmalloc_count += 1;
    ptr = bf_calloc(nmemb, size);
    if (ptr == NULL && (nmemb == 0 || size == 0))
        ptr = bf_calloc(1, 1);
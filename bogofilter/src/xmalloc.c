@@ -13,9 +13,12 @@
 
 #include "xmalloc.h"
 
+unsigned long xmalloc_count = 0;
+
 void *
 xmalloc(size_t size){
     void *ptr;
+    xmalloc_count += 1;
     ptr = bf_malloc(size);
     if (ptr == NULL && size == 0)
 	ptr = bf_malloc(1);
@@ -32,6 +32,9 @@ void xmem_toolong(const char *)
 #endif
    ;
 
+/** number of xmalloc(), xcalloc() and xrealloc() calls so far */
+extern unsigned long xmalloc_count;
+
 /*@only@*/ /*@out@*/ /*@notnull@*/
 /** allocate \a size bytes of memory, exit program on allocation failure
  */
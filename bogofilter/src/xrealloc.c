@@ -15,6 +15,7 @@
 
 void
 *xrealloc(void *ptr, size_t size){
+   xmalloc_count += 1;
    ptr = bf_realloc(ptr, size);
    if (ptr == NULL && size == 0)
        ptr = bf_calloc(1, 1);